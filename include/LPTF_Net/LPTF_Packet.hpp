@@ -21,9 +21,67 @@
 #define BINARY_PART_PACKET 10
 #define LOGIN_PACKET 11
 
+// more command packet types
+
+#define STAT_MANY_COMMAND 12
+#define QUOTA_COMMAND 13
+#define SEARCH_COMMAND 14
+#define HASH_COMMAND 15
+#define DOWNLOAD_RANGES_COMMAND 16
+#define PWRITE_COMMAND 17
+#define APPEND_COMMAND 18
+#define COPY_COMMAND 19
+#define MOVE_COMMAND 20
+#define DOWNLOAD_DIR_COMMAND 21
+#define UPLOAD_DIR_COMMAND 22
+
+#define LAST_COMMAND UPLOAD_DIR_COMMAND
+
 #define ERROR_PACKET 0xFF   // a packet type should not be higher than this value
 
 
+// LIST_FILES_COMMAND reply formats
+#define LIST_FORMAT_TEXT 0      // newline separated names, directories end with a separator
+#define LIST_FORMAT_BINARY 1    // varint encoded entries with type, size, mtime and mode
+
+// binary listing entry types
+#define LIST_ENTRY_FILE 0
+#define LIST_ENTRY_DIR 1
+#define LIST_ENTRY_SYMLINK 2
+#define LIST_ENTRY_OTHER 3
+
+
+// STAT_MANY_COMMAND result status
+#define STAT_RESULT_OK 0
+#define STAT_RESULT_ERROR 1
+
+
+// file transfer options, requested after the upload/download request arguments
+// and accepted by the server in its reply (the options it doesn't know are dropped)
+#define TRANSFER_OPT_SPARSE 0x01    // holes are sent as hole parts instead of zeros
+#define TRANSFER_OPT_COMPRESS 0x02  // parts may be compressed
+#define TRANSFER_OPT_DELTA 0x04     // the receiver sends the signature of its version, blocks of it are referenced
+#define TRANSFER_OPT_DEDUP 0x08     // (uploads) the client sends its chunk list, chunks the server has are referenced
+#define TRANSFER_OPT_CHECKSUM 0x10  // parts carry a CRC32C and are sent again if corrupted, the file CRC32C follows the last part
+
+// BINARY_PART_PACKET flags (header reserved byte)
+#define PART_FLAG_HOLE 0x01         // the content is the length of a hole (uint64), not file data
+#define PART_FLAG_COMPRESSED 0x02   // the content is an LZ block (see lz_codec.hpp)
+#define PART_FLAG_BLOCK_REF 0x04    // the content is a run of blocks of the receiver's version, or of chunks the server has (varint first, varint count)
+#define PART_FLAG_CHECKSUM 0x08     // the content ends with the CRC32C of the rest (uint32)
+#define PART_FLAG_DIGEST 0x10       // the content is the CRC32C of the whole file (uint32), sent after the last part
+
+// BINARY_PART_PACKET reply status (reply content)
+#define PART_REPLY_OK 0
+#define PART_REPLY_RESEND 1         // the part was corrupted, send it again
+
+#define PART_MAX_RESENDS 3          // a part corrupted more times than this fails the transfer
+
+
+// PWRITE_COMMAND/APPEND_COMMAND records, each written at once
+#define WRITE_RECORD_MAX_BYTES (1024 * 1024)
+
+
 // command error codes
 #define ERR_CMD_FAILURE 0
 #define ERR_CMD_UNKNOWN 1
@@ -63,6 +121,9 @@ class LPTF_Packet {
 
         uint16_t size();
 
+        uint8_t flags();
+        void set_flags(uint8_t flags);
+
         const void *get_content();
         const PACKET_HEADER get_header();
 
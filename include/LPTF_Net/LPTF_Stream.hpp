@@ -0,0 +1,68 @@
+#pragma once
+
+#include <iostream>
+
+#include "LPTF_Socket.hpp"
+#include "LPTF_Packet.hpp"
+
+using namespace std;
+
+
+/*
+Streams arbitrary data as a sequence of BINARY_PART packets.
+
+Data is copied straight into the packet buffer and a packet is sent each time
+it is full (MAX_BINARY_PART_BYTES), then the writer waits for the peer reply.
+close() sends the last, shorter (possibly empty) packet that ends the stream.
+
+peersockfd is the socket to send to (server side), or -1 to write on the socket itself (client side).
+Throws a runtime_error if the peer doesn't acknowledge a packet.
+*/
+class LPTF_PartWriter {
+
+private:
+    LPTF_Socket *socket;
+    int peersockfd;
+    char buffer[MAX_BINARY_PART_BYTES];
+    uint16_t len;
+    size_t total;
+    bool closed;
+
+    void send_part();
+
+public:
+    LPTF_PartWriter(LPTF_Socket *socket, int peersockfd);
+
+    void write(const void *data, size_t datalen);
+    void write(const string &data);
+    void put(char c);
+
+    void close();
+
+    size_t bytes_written();
+};
+
+
+/*
+Reads a stream sent by a LPTF_PartWriter, acknowledging each BINARY_PART packet.
+
+peersockfd is the socket to read from (server side), or -1 to read on the socket itself (client side).
+Throws a runtime_error if an other packet is received (with the error message for an ERROR packet).
+*/
+class LPTF_PartReader {
+
+private:
+    LPTF_Socket *socket;
+    int peersockfd;
+    size_t total;
+    bool ended;
+
+public:
+    LPTF_PartReader(LPTF_Socket *socket, int peersockfd);
+
+    bool read(string &data);
+
+    bool done();
+
+    size_t bytes_read();
+};
@@ -1,19 +1,63 @@
 #pragma once
 
 #include <iostream>
+#include <vector>
 using namespace std;
 
 typedef struct {
     string filepath;
     uint32_t filesize;
+    uint8_t options;    // TRANSFER_OPT_*
 } FILE_UPLOAD_REQ_PACKET_STRUCT;
 
+typedef struct {
+    uint64_t offset;
+    uint64_t length;    // 0 up to the end of the file
+    bool from_end;      // the offset counts back from the end of the file
+} FILE_RANGE_STRUCT;
+
+typedef struct {
+    string filepath;
+    uint8_t options;    // TRANSFER_OPT_*
+    vector<FILE_RANGE_STRUCT> ranges;
+} FILE_RANGES_REQ_PACKET_STRUCT;
+
 typedef struct {
     string newname;
     string path;
 } RENAME_DIR_REQ_PACKET_STRUCT;
 
+typedef struct {
+    string source;
+    string destination;
+} COPY_REQ_PACKET_STRUCT;
+
+typedef struct {
+    string folder;
+    uint8_t options;    // TRANSFER_OPT_*
+    uint64_t total;     // size of the files of the archive
+} UPLOAD_DIR_REQ_PACKET_STRUCT;
+
 typedef struct {
     const void *data;
     uint16_t len;
 } BINARY_PART_PACKET_STRUCT;
+
+typedef struct {
+    uint64_t first;     // block index
+    uint64_t count;
+} BLOCK_REF_STRUCT;
+
+typedef struct {
+    string name;
+    uint8_t type;
+    uint64_t size;
+    uint64_t mtime;     // seconds since epoch
+    uint32_t mode;      // permission bits
+} LIST_ENTRY_STRUCT;
+
+typedef struct {
+    uint8_t status;             // STAT_RESULT_OK or STAT_RESULT_ERROR
+    LIST_ENTRY_STRUCT entry;    // entry.name is the requested path
+    string error;
+} STAT_RESULT_STRUCT;
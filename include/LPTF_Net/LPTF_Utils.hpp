@@ -15,15 +15,28 @@ LPTF_Packet build_message_packet(const string &message);
 LPTF_Packet build_command_packet(uint8_t cmd_type, const string &arg);
 LPTF_Packet build_error_packet(uint8_t errfrom, uint8_t err_code, string &errmsg);
 
-LPTF_Packet build_file_upload_request_packet(const string filepath, uint32_t filesize);
-LPTF_Packet build_file_download_request_packet(const string filepath);
+LPTF_Packet build_file_upload_request_packet(const string filepath, uint32_t filesize, uint8_t options = 0);
+LPTF_Packet build_file_download_request_packet(const string filepath, uint8_t options = 0);
+LPTF_Packet build_file_ranges_request_packet(const string filepath, uint8_t options, const vector<FILE_RANGE_STRUCT> &ranges);
 LPTF_Packet build_file_delete_request_packet(const string filepath);
-LPTF_Packet build_list_directory_request_packet(const string pathname);
+LPTF_Packet build_list_directory_request_packet(const string pathname, uint8_t format = LIST_FORMAT_TEXT);
 LPTF_Packet build_create_directory_request_packet(const string folder);
 LPTF_Packet build_remove_directory_request_packet(string folder);
 LPTF_Packet build_rename_directory_request_packet(string newname, string path);
+LPTF_Packet build_user_tree_request_packet(const string cursor);
+LPTF_Packet build_copy_request_packet(uint8_t cmd_type, const string source, const string destination);
+LPTF_Packet build_directory_download_request_packet(const string folder, uint8_t options);
+LPTF_Packet build_directory_upload_request_packet(const string folder, uint8_t options, uint64_t total);
 
 LPTF_Packet build_binary_part_packet(void *data, uint16_t datalen);
+LPTF_Packet build_hole_part_packet(uint64_t length);
+LPTF_Packet build_compressed_part_packet(void *data, uint16_t datalen);
+LPTF_Packet build_block_ref_part_packet(uint64_t first, uint64_t count);
+LPTF_Packet build_digest_part_packet(uint32_t digest);
+LPTF_Packet build_part_reply_packet(uint8_t status);
+
+void add_part_checksum(LPTF_Packet &packet);
+bool check_part_checksum(LPTF_Packet &packet);
 
 string get_message_from_message_packet(LPTF_Packet &packet);
 string get_arg_from_command_packet(LPTF_Packet &packet);
@@ -35,10 +48,35 @@ string get_error_content_from_error_packet(LPTF_Packet &packet);
 
 FILE_UPLOAD_REQ_PACKET_STRUCT get_data_from_file_upload_request_packet(LPTF_Packet &packet);
 string get_file_from_file_download_request_packet(LPTF_Packet &packet);
+uint8_t get_options_from_file_download_request_packet(LPTF_Packet &packet);
+FILE_RANGES_REQ_PACKET_STRUCT get_data_from_file_ranges_request_packet(LPTF_Packet &packet);
 string get_file_from_file_delete_request_packet(LPTF_Packet &packet);
 string get_path_from_list_directory_request_packet(LPTF_Packet &packet);
+uint8_t get_format_from_list_directory_request_packet(LPTF_Packet &packet);
 string get_path_from_create_directory_request_packet(LPTF_Packet &packet);
 string get_path_from_remove_directory_request_packet(LPTF_Packet &packet);
 RENAME_DIR_REQ_PACKET_STRUCT get_data_from_rename_directory_request_packet(LPTF_Packet &packet);
+string get_cursor_from_user_tree_request_packet(LPTF_Packet &packet);
+COPY_REQ_PACKET_STRUCT get_data_from_copy_request_packet(LPTF_Packet &packet);
+string get_path_from_directory_download_request_packet(LPTF_Packet &packet);
+uint8_t get_options_from_directory_download_request_packet(LPTF_Packet &packet);
+UPLOAD_DIR_REQ_PACKET_STRUCT get_data_from_directory_upload_request_packet(LPTF_Packet &packet);
 
 BINARY_PART_PACKET_STRUCT get_data_from_binary_part_packet(LPTF_Packet &packet);
+bool is_hole_part_packet(LPTF_Packet &packet);
+bool is_compressed_part_packet(LPTF_Packet &packet);
+bool is_block_ref_part_packet(LPTF_Packet &packet);
+BLOCK_REF_STRUCT get_block_ref_from_block_ref_part_packet(LPTF_Packet &packet);
+bool is_digest_part_packet(LPTF_Packet &packet);
+uint32_t get_digest_from_digest_part_packet(LPTF_Packet &packet);
+bool is_resend_part_reply_packet(LPTF_Packet &packet);
+uint64_t get_length_from_hole_part_packet(LPTF_Packet &packet);
+
+void append_varint(string &out, uint64_t value);
+bool read_varint(const char *&ptr, const char *end, uint64_t &value);
+
+void append_list_entry(string &out, const LIST_ENTRY_STRUCT &entry);
+bool read_list_entry(const char *&ptr, const char *end, LIST_ENTRY_STRUCT &entry);
+
+void append_stat_result(string &out, const STAT_RESULT_STRUCT &result);
+bool read_stat_result(const char *&ptr, const char *end, STAT_RESULT_STRUCT &result);
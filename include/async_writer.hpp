@@ -0,0 +1,69 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#define ASYNC_WRITER_BUFFER_BYTES 1048576   // received parts are coalesced into writes of this size
+#define ASYNC_WRITER_MAX_BUFFERS 4          // full buffers waiting for the disk before write() blocks
+
+using namespace std;
+
+
+/*
+Write-behind stage for received files.
+
+write() only copies the data into the current buffer, full buffers are handed to a writer
+thread that pwrite()s them, so the receiving thread can acknowledge the next part while
+the disk catches up. skip() leaves a hole (the file is expected to be new or empty).
+write() blocks once ASYNC_WRITER_MAX_BUFFERS buffers are waiting (backpressure).
+finish() flushes everything and fdatasync()s the file (unless the caller syncs it otherwise).
+With enable_digest(), the CRC32C of the file (holes included) is computed along the way.
+Write errors are reported by the next write() or finish() call.
+*/
+class AsyncWriter {
+
+private:
+    typedef struct {
+        uint64_t offset;
+        string data;
+    } WRITE_BUFFER;
+
+    int fd;
+    WRITE_BUFFER current;
+    uint64_t queued_bytes;
+    uint64_t skipped_bytes;
+    bool digest_enabled;
+    uint32_t digest;
+
+    thread writer;
+    mutex lock;
+    condition_variable not_full;
+    condition_variable not_empty;
+    condition_variable drained;
+    deque<WRITE_BUFFER> queue;
+    bool busy;
+    bool stop;
+    string error;
+
+    void write_loop();
+    void push_current();
+    void check_error();
+
+public:
+    AsyncWriter(int fd);
+
+    ~AsyncWriter();
+
+    void write(const void *data, size_t len);
+    void skip(uint64_t len);
+    void finish(bool sync = true);
+
+    void enable_digest();
+    uint32_t get_digest();
+
+    uint64_t bytes_written();
+    uint64_t bytes_skipped();
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <string>
+#include <vector>
+
+#define BLAKE3_OUT_BYTES 32
+#define BLAKE3_BLOCK_BYTES 64
+#define BLAKE3_CHUNK_BYTES 1024
+#define BLAKE3_PARALLEL_MIN_BYTES (1024 * 1024)     // subtrees smaller than this are not split across threads
+
+using namespace std;
+
+
+/*
+In-tree BLAKE3 (portable, same results as the reference implementation).
+
+The input is cut in 1Kb chunks, the leaves of a binary tree whose parent nodes hash the
+chaining values of their children. Used where a hash must resist collisions (content addressing).
+*/
+class Blake3 {
+
+private:
+    // state of the chunk being hashed
+    uint32_t chunk_cv[8];
+    uint64_t chunk_counter;
+    uint8_t block[BLAKE3_BLOCK_BYTES];
+    uint8_t block_len;
+    uint8_t blocks_compressed;
+
+    // chaining values of the completed subtrees, largest first
+    vector<array<uint32_t, 8>> cv_stack;
+
+    void reset_chunk(uint64_t counter);
+    void add_chunk_cv(array<uint32_t, 8> cv, uint64_t total_chunks);
+
+public:
+    Blake3();
+    explicit Blake3(uint64_t first_chunk);
+
+    void update(const void *data, size_t len);
+    void finalize(uint8_t out[BLAKE3_OUT_BYTES]);
+    array<uint32_t, 8> finalize_subtree();
+};
+
+string blake3(const void *data, size_t len);
+string blake3_parallel(const void *data, size_t len, unsigned int threads);
+string to_hex(const string &bytes);
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "LPTF_Net/LPTF_Structs.hpp"
+#include "tree_walker.hpp"
+
+#define CATALOG_COMPACT_RECORDS 65536   // log records merged into the catalog file past this count
+#define CATALOG_RECONCILE_INTERVAL_S 3600
+
+using namespace std;
+namespace fs = std::filesystem;
+
+
+// tree order: a directory is directly followed by its whole subtree (same order as walk_tree())
+struct CATALOG_PATH_LESS {
+    bool operator()(const string &a, const string &b) const;
+};
+
+
+/*
+Per-user metadata catalog: the type, size, mtime, mode and (optional) content hash
+of every path of the user root, keyed by the path relative to it.
+
+Each user has two files in meta/catalog:
+    <user>.cat  the entries sorted in tree order, memory-mapped and binary searched
+    <user>.log  the changes made since, replayed into an in-memory overlay when loaded
+The log is merged into a new .cat once it grows. Server operations update the catalog
+write-through, and a catalog that is missing or corrupt is rebuilt from the user tree
+(until then, readers fall back to the disk). Every catalog is also rebuilt hourly, to catch
+the changes made outside of the server.
+Compactions and rebuilds run on a builder thread: the new .cat is made aside and swapped in,
+with the changes logged meanwhile carried over to the new log.
+*/
+class Catalog {
+
+private:
+    typedef struct {
+        bool removed;
+        LIST_ENTRY_STRUCT entry;    // entry.name is the relative path
+        string hash;
+    } CATALOG_RECORD;
+
+    typedef struct {
+        shared_mutex lock;
+        bool loaded;                // the log is open, changes are recorded
+        bool complete;              // false until the first build from the user tree is done
+        bool building;              // queued for the builder thread
+
+        // <user>.cat mapping: header, offsets of the records, records
+        const char *base;
+        size_t base_size;
+        uint64_t base_count;
+        uint64_t base_id;           // the log only applies to the .cat with the same id
+
+        map<string, CATALOG_RECORD, CATALOG_PATH_LESS> overlay;
+        int log_fd;
+        unsigned int log_records;
+    } USER_CATALOG;
+
+    typedef struct {
+        string username;
+        bool from_disk;             // rebuild from the user tree, or only merge the log (compaction)
+    } CATALOG_BUILD;
+
+    map<string, shared_ptr<USER_CATALOG>> users;
+    mutex users_lock;
+
+    deque<CATALOG_BUILD> build_queue;
+    thread builder;
+    condition_variable builder_cv;
+    mutex builder_lock;
+    atomic<bool> stop;
+
+    shared_ptr<USER_CATALOG> get_user(const string &username);
+
+    void load(const string &username, USER_CATALOG &catalog);
+    void request_build(const string &username, USER_CATALOG &catalog, bool from_disk);
+    void build(const string &username, bool from_disk);
+    void build_loop();
+    fs::path write_base(const string &username, uint64_t id, const vector<CATALOG_RECORD> &records);
+    void swap_base(const string &username, USER_CATALOG &catalog, const fs::path &file);
+    bool map_base(const string &username, USER_CATALOG &catalog);
+    void unmap_base(USER_CATALOG &catalog);
+    void open_log(const string &username, USER_CATALOG &catalog);
+
+    bool read_base_record(const USER_CATALOG &catalog, uint64_t index, CATALOG_RECORD &record) const;
+    uint64_t base_lower_bound(const USER_CATALOG &catalog, const string &path) const;
+    bool find(const USER_CATALOG &catalog, const string &path, CATALOG_RECORD &record) const;
+    bool scan(const USER_CATALOG &catalog, const string &start, bool inclusive, const string &subtree,
+              const function<bool(const CATALOG_RECORD &)> &visit) const;
+
+    bool apply_log_record(USER_CATALOG &catalog, const char *&ptr, const char *end);
+    void erase_tree(USER_CATALOG &catalog, const string &path);
+    void update(const string &username, USER_CATALOG &catalog, const string &record);
+
+public:
+    Catalog();
+    ~Catalog();
+
+    void start_builder();
+
+    bool lookup(const string &username, const string &path, LIST_ENTRY_STRUCT &entry);
+    bool get_hash(const string &username, const string &path, string &hash);
+    bool walk(const string &username, const string &cursor, const TREE_VISITOR &visit);
+    bool get_tree_totals(const string &username, const string &path, uint64_t &files, uint64_t &bytes);
+
+    void refresh(const string &username, const string &path);
+    void set_hash(const string &username, const string &path, const string &hash);
+    void remove_tree(const string &username, const string &path);
+    void rename_tree(const string &username, const string &path, const string &newpath);
+};
+
+Catalog &get_catalog();
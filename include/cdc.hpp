@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "LPTF_Net/LPTF_Stream.hpp"
+
+#define CDC_MIN_CHUNK_BYTES (16 * 1024)
+#define CDC_AVG_CHUNK_BYTES (64 * 1024)
+#define CDC_MAX_CHUNK_BYTES (256 * 1024)
+#define CDC_MAX_LIST_BYTES (32 * 1024 * 1024)   // chunk list of a 4Gb file cut in the smallest chunks
+
+using namespace std;
+
+
+typedef struct {
+    string hash;        // BLAKE3 of the chunk
+    uint32_t length;
+} CONTENT_CHUNK;
+
+
+/*
+Content-defined chunking (FastCDC: gear rolling hash with normalized chunking).
+
+Chunk boundaries depend on the content around them only, so data inserted or removed in a
+file only changes the chunks around the edit, and identical data found in different files
+(or at different offsets) is cut in the same chunks. Both ends of a transfer cut files the
+same way, chunks are identified by a BLAKE3 hash.
+*/
+size_t cdc_chunk_length(const uint8_t *data, size_t len);
+
+vector<CONTENT_CHUNK> compute_chunks(int fd, uint64_t filesize);
+
+string serialize_chunk_list(const vector<CONTENT_CHUNK> &chunks);
+bool parse_chunk_list(const string &data, vector<CONTENT_CHUNK> &chunks);
+
+void send_chunk_list(LPTF_PartWriter &stream, const vector<CONTENT_CHUNK> &chunks);
+bool receive_chunk_list(LPTF_PartReader &stream, vector<CONTENT_CHUNK> &chunks);
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "LPTF_Net/LPTF_Packet.hpp"
+
+#define CHUNK_CACHE_DEFAULT_MAX_BYTES 268435456             // 256Mb
+#define CHUNK_CACHE_CHUNK_BYTES (8 * MAX_BINARY_PART_BYTES) // a chunk is sent as 8 full parts
+#define CHUNK_CACHE_SHARDS 16
+#define CHUNK_CACHE_SKETCH_WIDTH 4096                       // counters per row of the frequency sketch, per shard
+
+using namespace std;
+namespace fs = std::filesystem;
+
+
+// identifies a version of a file's content, cached chunks of another version are stale
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+} FILE_VERSION;
+
+bool operator==(const FILE_VERSION &a, const FILE_VERSION &b);
+
+FILE_VERSION get_file_version(const struct stat &st);
+
+
+/*
+Server-wide cache of file chunks (CHUNK_CACHE_CHUNK_BYTES each), for files downloaded over and over.
+
+The cache is split in shards (by file) with their own lock, LRU list and byte budget.
+A chunk only enters a full shard if it is requested more often than the chunk it would evict
+(TinyLFU: frequencies are estimated by a count-min sketch, halved periodically so they age),
+so one-off downloads don't flush the popular files.
+Chunks are shared with the readers, which send them without holding any lock.
+*/
+class ChunkCache {
+
+private:
+    typedef struct {
+        string file;
+        uint64_t index;
+        shared_ptr<const string> data;
+    } CHUNK_ENTRY;
+
+    typedef struct {
+        FILE_VERSION version;
+        unordered_map<uint64_t, list<CHUNK_ENTRY>::iterator> chunks;
+    } CACHED_FILE;
+
+    typedef struct {
+        mutex lock;
+        size_t used_bytes;
+
+        // most recently used chunks first
+        list<CHUNK_ENTRY> lru;
+        unordered_map<string, CACHED_FILE> files;
+
+        // count-min sketch: 4 rows of 8 bit counters
+        vector<uint8_t> sketch;
+        unsigned int sketch_additions;
+    } SHARD;
+
+    size_t shard_max_bytes;
+    SHARD shards[CHUNK_CACHE_SHARDS];
+
+    SHARD &get_shard(const string &file);
+
+    void record_access(SHARD &shard, const string &file, uint64_t index);
+    unsigned int estimate_frequency(SHARD &shard, const string &file, uint64_t index);
+
+    void evict(SHARD &shard, list<CHUNK_ENTRY>::iterator it);
+    void drop_file(SHARD &shard, unordered_map<string, CACHED_FILE>::iterator it);
+
+public:
+    ChunkCache();
+    ChunkCache(size_t max_bytes);
+
+    shared_ptr<const string> get(const string &file, const FILE_VERSION &version, uint64_t index);
+    void put(const string &file, const FILE_VERSION &version, uint64_t index, shared_ptr<const string> data);
+
+    void invalidate(const fs::path &filepath);
+    void invalidate_tree(const fs::path &folderpath);
+};
+
+ChunkCache &get_chunk_cache();
+
+string chunk_cache_key(const fs::path &filepath);
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "chunk_cache.hpp"
+#include "file_utils.hpp"
+
+#define CHUNK_PREFETCH_DEPTH 4      // chunks read ahead of the sender
+
+using namespace std;
+namespace fs = std::filesystem;
+
+
+/*
+Reads the chunks of a file (CHUNK_CACHE_CHUNK_BYTES each) ahead of the thread sending them.
+
+Chunks are first looked up in the chunk cache by the caller's thread. At the first miss a
+prefetch thread is started: it reads the following chunks (cache, or disk with a sequential
+access hint) into a bounded queue that next() drains, so disk reads overlap with the sends.
+A file served entirely from the cache never starts the thread.
+The file is read through the fd the caller stat'ed it with (version must come from that fd),
+never reopened by path, so a file replaced meanwhile can't be cached under the old version.
+Only the chunks overlapping the given data extents are read, the others are holes.
+*/
+class ChunkPrefetcher {
+
+private:
+    int fd;     // the caller's, duplicated by the prefetch thread
+    string key;
+    FILE_VERSION version;
+    vector<FILE_EXTENT> extents;
+    uint64_t chunk_count;
+    uint64_t next_index;
+
+    thread prefetcher;
+    mutex lock;
+    condition_variable not_full;
+    condition_variable not_empty;
+    deque<shared_ptr<const string>> ready;
+    bool stop;
+    string error;
+
+    unsigned long cached_chunks;
+    unsigned long read_chunks;
+
+    uint64_t next_data_chunk(uint64_t index) const;
+    void prefetch(uint64_t first_index, int fd);
+
+public:
+    ChunkPrefetcher(const fs::path &filepath, int fd, const FILE_VERSION &version, const vector<FILE_EXTENT> &extents);
+
+    ~ChunkPrefetcher();
+
+    bool has_next();
+    shared_ptr<const string> next(uint64_t &index);
+
+    unsigned long get_cached_chunks();
+    unsigned long get_read_chunks();
+};
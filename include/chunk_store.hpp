@@ -0,0 +1,78 @@
+#pragma once
+
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "async_writer.hpp"
+#include "cdc.hpp"
+#include "LPTF_Net/LPTF_Structs.hpp"
+
+#define CHUNK_STORE_MANIFEST_EXT ".chunks"
+#define CHUNK_STORE_OWNERS_EXT ".users"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+
+/*
+Content-addressed store of the dedup mode (lpf_server --dedup).
+
+Uploaded files (of at least CDC_MIN_CHUNK_BYTES) are cut in content-defined chunks and kept
+once in meta/store, named after the hash of their chunk list (saved next to them, .chunks).
+The files of the users are hard links to them, so identical files uploaded by several users
+(or twice by one) take the disk space of one. Files are never modified in place (uploads replace
+them, see publish_upload_file()), so sharing an inode between users is safe.
+Disk space is only shared by whole identical files: chunks are not stored apart, so two files
+that differ by a byte are each stored in full.
+
+The chunks of the stored files are indexed, to save transfers: with TRANSFER_OPT_DEDUP a client
+only sends the chunks the server doesn't have, the others are copied from the stored files. A client knowing
+the hash of a chunk gets its content, chunk hashes are never shown to users.
+So that no one learns what the others store, a user is only told about (and given) the chunks of
+the files it stored itself, recorded next to each stored file (.users).
+Stored files no user links to anymore are removed at startup.
+*/
+class ChunkStore {
+
+private:
+    typedef struct {
+        uint32_t object;    // index in objects
+        uint64_t offset;
+        uint32_t length;
+    } CHUNK_LOCATION;
+
+    bool enabled;
+    fs::path folder;
+
+    mutex lock;
+    vector<string> objects;
+    vector<unordered_set<string>> owners;           // users who stored each object
+    unordered_map<string, uint32_t> object_ids;     // name -> index in objects
+    unordered_map<ino_t, uint32_t> object_inodes;
+    unordered_map<string, CHUNK_LOCATION> chunks;
+    unordered_map<string, unordered_set<string>> user_chunks;   // chunks each user has stored
+
+    void write_manifest(const fs::path &manifest, const vector<CONTENT_CHUNK> &list);
+    uint32_t index_object(const string &name, ino_t inode, const vector<CONTENT_CHUNK> &list);
+    void add_owner(uint32_t object, const string &username, const vector<CONTENT_CHUNK> &list);
+
+public:
+    ChunkStore();
+
+    void enable(const fs::path &folder);
+    bool is_enabled();
+
+    vector<bool> find_chunks(const string &username, const vector<CONTENT_CHUNK> &list);
+    uint64_t copy_chunks(const string &username, const vector<CONTENT_CHUNK> &list, const BLOCK_REF_STRUCT &ref, AsyncWriter &writer);
+    bool get_chunk_list(int fd, vector<CONTENT_CHUNK> &list);
+
+    int store_file(const string &username, int fd, const vector<CONTENT_CHUNK> &list);
+};
+
+ChunkStore &get_chunk_store();
@@ -1,22 +1,50 @@
 #pragma once
 
 #include <iostream>
+#include <vector>
 #include "LPTF_Net/LPTF_Socket.hpp"
+#include "LPTF_Net/LPTF_Structs.hpp"
 
 using namespace std;
 
+#define CLIENT_TRANSFER_OPTS (TRANSFER_OPT_SPARSE | TRANSFER_OPT_COMPRESS | TRANSFER_OPT_DELTA | TRANSFER_OPT_DEDUP | TRANSFER_OPT_CHECKSUM)   // transfer options requested to the server
+
 bool download_file(LPTF_Socket *clientSocket, string filename);
 
+bool download_ranges(LPTF_Socket *clientSocket, string filename, string localpath, vector<FILE_RANGE_STRUCT> ranges);
+
+bool download_directory(LPTF_Socket *clientSocket, string folder, string localdir);
+
+bool upload_directory(LPTF_Socket *clientSocket, string localdir, string folder);
+
 bool upload_file(LPTF_Socket *clientSocket, string filename, string targetfile);
 
 bool delete_file(LPTF_Socket *clientSocket, string filename);
 
 bool list_directory(LPTF_Socket *clientSocket, string pathname);
 
+bool list_directory_long(LPTF_Socket *clientSocket, string pathname);
+
 bool create_directory(LPTF_Socket *clientSocket, string folder);
 
 bool remove_directory(LPTF_Socket *clientSocket, string folder);
 
 bool rename_directory(LPTF_Socket *clientSocket, string newname, string path);
 
-bool list_tree(LPTF_Socket *clientSocket);
+bool copy_path(LPTF_Socket *clientSocket, string source, string destination);
+
+bool move_path(LPTF_Socket *clientSocket, string source, string destination);
+
+bool list_tree(LPTF_Socket *clientSocket, string cursor);
+
+bool stat_many(LPTF_Socket *clientSocket, vector<string> paths);
+
+bool show_quota(LPTF_Socket *clientSocket);
+
+bool search_files(LPTF_Socket *clientSocket, string pattern);
+
+bool hash_file(LPTF_Socket *clientSocket, string filename, string localpath);
+
+bool pwrite_file(LPTF_Socket *clientSocket, string filename, uint64_t offset, string localpath);
+
+bool append_file(LPTF_Socket *clientSocket, string filename, istream &lines);
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+CRC32C (Castagnoli), as used by iSCSI, ext4 and SCTP.
+
+Uses the SSE4.2 crc32 instruction where the CPU has it (checked once at runtime),
+a slicing-by-8 table otherwise. crc is the CRC of the data before (0 to start).
+*/
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+// CRC of the data before followed by len zero bytes (holes), in O(log len)
+uint32_t crc32c_zeros(uint32_t crc, uint64_t len);
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "async_writer.hpp"
+#include "LPTF_Net/LPTF_Structs.hpp"
+#include "LPTF_Net/LPTF_Stream.hpp"
+
+#define DELTA_MIN_BLOCK_BYTES 2048
+#define DELTA_MAX_BLOCK_BYTES 131072
+#define DELTA_MAX_SIGNATURE_BYTES (32 * 1024 * 1024)   // a 4Gb file signed with the smallest blocks fits
+
+using namespace std;
+
+
+typedef struct {
+    uint32_t weak;      // rolling checksum
+    uint64_t strong;    // xxh64
+} BLOCK_SIGNATURE;
+
+// signature of the full blocks of a file (a shorter last block is not signed)
+typedef struct {
+    uint32_t block_size;
+    uint64_t file_size;
+    vector<BLOCK_SIGNATURE> blocks;
+} FILE_SIGNATURE;
+
+
+/*
+rsync-style delta transfers (TRANSFER_OPT_DELTA).
+
+The receiver of a file it already has a version of sends the signature of that version,
+the sender then describes its file as literal data (sent in file parts) and references to
+blocks of the receiver's version (block ref parts), found with a rolling checksum so that
+blocks match at any offset. The receiver rebuilds the file from both.
+*/
+uint32_t delta_block_size(uint64_t filesize);
+
+FILE_SIGNATURE compute_signature(int fd, uint64_t filesize);
+
+string serialize_signature(const FILE_SIGNATURE &signature);
+bool parse_signature(const string &data, FILE_SIGNATURE &signature);
+
+void send_signature(LPTF_PartWriter &stream, const FILE_SIGNATURE &signature);
+bool receive_signature(LPTF_PartReader &stream, FILE_SIGNATURE &signature);
+
+bool compute_delta(int fd, uint64_t filesize, const FILE_SIGNATURE &signature,
+                   const function<bool(const char *, size_t)> &literal,
+                   const function<bool(uint64_t, uint64_t)> &copy);
+
+uint64_t copy_blocks(int fd, const FILE_SIGNATURE &signature, const BLOCK_REF_STRUCT &ref, AsyncWriter &writer);
@@ -1,14 +1,27 @@
 #pragma once
 
 #include <filesystem>
+#include <vector>
+
+#include "LPTF_Net/LPTF_Structs.hpp"
 
 using namespace std;
 namespace fs = std::filesystem;
 
+
+// a range of a file holding data (the rest are holes)
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+} FILE_EXTENT;
+
 uint32_t get_file_size(string filepath);
 uint32_t get_file_size(fs::path filepath);
 
 string list_directory_content(fs::path folderpath);
+int stat_list_entry(int dirfd, const char *path, LIST_ENTRY_STRUCT &entry);
+string stat_directory_content(fs::path folderpath);
+string directory_content_to_text(const string &entries, const fs::path &folderpath);
 
 void check_server_root_folder();
 void check_user_root_folder(string username);
@@ -19,6 +32,30 @@ fs::path get_user_root(string username);
 void check_server_logs_folder();
 fs::path get_server_logs_folder();
 
+void check_server_trash_folder();
+fs::path get_server_trash_folder();
+fs::path get_user_trash(string username);
+
+void check_server_meta_folder();
+fs::path get_server_meta_folder(string kind);
+
 bool is_path_in_folder(fs::path contained, fs::path container);
+bool is_path_lexically_in_folder(fs::path contained, fs::path container);
+
+uintmax_t get_tree_size(fs::path dir);
 
 void delete_directory_content(fs::path dir);
+
+vector<FILE_EXTENT> get_data_extents(int fd, uint64_t size);
+uint32_t get_file_crc32c(int fd, uint64_t size);
+string get_file_blake3(int fd, uint64_t size);
+void copy_file_content(int src_fd, int dst_fd, uint64_t size);
+uint64_t clone_file(const fs::path &src, const fs::path &dst);
+
+fs::path get_temp_path(const fs::path &filepath);
+fs::path get_staging_path(const fs::path &filepath);
+size_t clear_staging_folder();
+int open_upload_file(const fs::path &filepath, fs::path &temppath);
+int link_open_file(int fd, const fs::path &linkpath);
+void publish_upload_file(int fd, fs::path &temppath, const fs::path &filepath);
+void discard_upload_file(fs::path &temppath);
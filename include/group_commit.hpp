@@ -0,0 +1,43 @@
+#pragma once
+
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+
+/*
+Group commit for the durable mode (lpf_server --durable).
+
+commit() returns once everything written before the call is on disk. The first caller
+runs a syncfs() of the server filesystem (file data, directory entries, metadata files)
+while the others wait, and the callers that arrived during a round share the next one,
+so concurrent sessions pay for one sync round instead of one fsync each.
+When the durable mode is off, commit() returns right away.
+*/
+class GroupCommitter {
+
+private:
+    bool enabled;
+    int sync_fd;
+
+    mutex lock;
+    condition_variable round_done;
+    unsigned long requested;    // commits requested so far
+    unsigned long completed;    // commits covered by a finished round
+    bool syncing;
+
+public:
+    GroupCommitter();
+
+    ~GroupCommitter();
+
+    void enable(const fs::path &root);
+    bool is_enabled();
+
+    void commit();
+};
+
+GroupCommitter &get_group_committer();
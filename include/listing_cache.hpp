@@ -0,0 +1,77 @@
+#pragma once
+
+#include <filesystem>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define LISTING_CACHE_DEFAULT_MAX_BYTES 16777216    // 16Mb
+#define LISTING_CACHE_ENTRY_OVERHEAD 128            // approx. bookkeeping bytes per cached listing
+
+using namespace std;
+namespace fs = std::filesystem;
+
+
+// a directory listing in both formats, the text one made when the directory was listed
+typedef struct {
+    string entries;     // binary, see stat_directory_content()
+    string text;        // see directory_content_to_text()
+} DIRECTORY_LISTING;
+
+
+/*
+Server-wide cache of directory listings (binary, and as text).
+
+Each cached directory holds an inotify watch, so any change made on disk
+(by the server or by anything else) drops the cached listing.
+The cache is bounded by a memory budget and evicts the least recently used listings.
+*/
+class ListingCache {
+
+private:
+    typedef struct {
+        string key;
+        DIRECTORY_LISTING listing;
+        int wd;
+    } CACHE_ENTRY;
+
+    size_t max_bytes;
+    size_t used_bytes;
+
+    // most recently used entries first
+    list<CACHE_ENTRY> lru;
+    unordered_map<string, list<CACHE_ENTRY>::iterator> entries;
+    // inotify watch descriptor -> cached keys using it
+    unordered_map<int, vector<string>> watches;
+
+    // bumped on every invalidation, used to drop listings that raced with a change
+    unsigned long generation;
+
+    int inotify_fd;
+    int stop_fd;
+    thread watcher;
+    mutex lock;
+
+    void watch_events();
+    void evict(list<CACHE_ENTRY>::iterator it);
+    void drop_watch_key(int wd, const string &key);
+
+public:
+    ListingCache();
+    ListingCache(size_t max_bytes);
+
+    ~ListingCache();
+
+    DIRECTORY_LISTING get(const fs::path &folderpath);
+
+    void invalidate(const fs::path &folderpath);
+    void invalidate_tree(const fs::path &folderpath);
+
+    bool find(const fs::path &folderpath, DIRECTORY_LISTING &listing);
+};
+
+ListingCache &get_listing_cache();
+
+string listing_cache_key(const fs::path &folderpath);
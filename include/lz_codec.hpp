@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12     // entries of the match finder table: 1 << LZ_HASH_BITS
+
+
+/*
+In-tree LZ77 block codec, using the LZ4 block format: a block is a series of sequences
+(a token, literals copied as is, then a back-reference of at least LZ_MIN_MATCH bytes),
+the last sequence has no back-reference. There is no entropy coding, so both ways are fast
+enough to run on every file part.
+
+lz_compress() stops when dst is full: it returns the compressed size and the number of
+source bytes it encoded (consumed), which is what lz_decompress() gives back.
+*/
+size_t lz_compress(const char *src, size_t src_len, char *dst, size_t dst_cap, size_t &consumed);
+
+bool lz_decompress(const char *src, size_t src_len, char *dst, size_t dst_cap, size_t &dst_len);
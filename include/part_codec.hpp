@@ -0,0 +1,62 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+
+#include "LPTF_Net/LPTF_Packet.hpp"
+#include "LPTF_Net/LPTF_Structs.hpp"
+
+#define COMPRESS_BLOCK_BYTES (8 * MAX_BINARY_PART_BYTES)   // most file bytes a compressed part can hold
+#define COMPRESS_BYPASS_PARTS 16                           // parts sent as is after a block that did not shrink
+
+using namespace std;
+
+
+/*
+Cuts file data into BINARY_PART_PACKETs for a transfer, compressed if negotiated
+(TRANSFER_OPT_COMPRESS).
+
+A compressed part holds as much of the data (up to COMPRESS_BLOCK_BYTES) as compresses into
+MAX_BINARY_PART_BYTES, so compressible files also need fewer parts (and acknowledgements).
+Data that doesn't shrink is sent as is, and compression is not tried again for the next
+COMPRESS_BYPASS_PARTS parts, so incompressible files (images, archives...) cost little.
+*/
+class PartEncoder {
+
+private:
+    bool compress;
+    unsigned int bypass;        // parts left to send without trying to compress
+    char buffer[MAX_BINARY_PART_BYTES];
+
+    uint64_t data_bytes;
+    uint64_t sent_bytes;
+    uint64_t compressed_parts;
+    chrono::steady_clock::duration compress_time;
+
+public:
+    PartEncoder(bool compress);
+
+    LPTF_Packet next_part(const char *data, size_t len, size_t &consumed);
+
+    string get_summary();
+};
+
+
+// decodes the BINARY_PART_PACKETs made by PartEncoder
+class PartDecoder {
+
+private:
+    char buffer[COMPRESS_BLOCK_BYTES];
+
+    uint64_t data_bytes;
+    uint64_t received_bytes;
+    uint64_t compressed_parts;
+    chrono::steady_clock::duration decompress_time;
+
+public:
+    PartDecoder();
+
+    BINARY_PART_PACKET_STRUCT decode(LPTF_Packet &packet);
+
+    string get_summary();
+};
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+
+/*
+One mutex per file being changed in place (PWRITE/APPEND) or replaced by a directory upload,
+so that the writes of concurrent sessions to the same file are applied one at a time.
+A lock lives as long as someone holds it, the table only keeps the locks in use.
+*/
+class PathLocks {
+
+private:
+    map<string, weak_ptr<mutex>> locks;
+    mutex table_lock;
+
+public:
+    shared_ptr<mutex> get(const fs::path &filepath);
+};
+
+PathLocks &get_path_locks();
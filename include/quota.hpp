@@ -0,0 +1,103 @@
+#pragma once
+
+#include <condition_variable>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#define USER_QUOTA_DEFAULT_BYTES 10737418240ULL    // 10Gb
+#define QUOTA_JOURNAL_COMPACT_RECORDS 4096          // the journal is rewritten as a single record past this size
+#define QUOTA_RECONCILE_INTERVAL_S 3600
+
+using namespace std;
+namespace fs = std::filesystem;
+
+
+/*
+Per-user disk usage, kept up to date by the server operations so it never needs a tree walk.
+
+The usage of each user is persisted in a small journal (meta/quota/<user>.journal):
+a "=<bytes>" record followed by "+<bytes>"/"-<bytes>" deltas, compacted once it grows.
+A user is only scanned the first time it's seen, and by the background reconciliation
+that corrects any drift (e.g. files changed outside of the server).
+Files waiting in the user's trash are counted until the trash reaper removes them.
+*/
+class QuotaManager {
+
+private:
+    typedef struct {
+        mutex lock;
+        uint64_t used;
+        uint64_t reserved;      // held by the writes in progress, not in used yet
+        int64_t scan_delta;     // deltas applied while a reconciliation scan runs
+        bool scanning;
+        int journal_fd;
+        unsigned int journal_records;
+    } USER_USAGE;
+
+    uint64_t limit;
+
+    map<string, shared_ptr<USER_USAGE>> users;
+    mutex users_lock;
+
+    thread reconciler;
+    condition_variable reconciler_cv;
+    mutex reconciler_lock;
+    bool stop;
+
+    shared_ptr<USER_USAGE> get_user(const string &username);
+    void load(const string &username, USER_USAGE &usage);
+    void write_snapshot(const string &username, USER_USAGE &usage);
+    void apply(const string &username, USER_USAGE &usage, int64_t delta);
+    void reconcile_loop();
+
+public:
+    QuotaManager();
+    QuotaManager(uint64_t limit);
+
+    ~QuotaManager();
+
+    uint64_t get_usage(const string &username);
+    uint64_t get_limit();
+
+
+    bool reserve(const string &username, uint64_t new_bytes, uint64_t replaced_bytes);
+    void commit(const string &username, uint64_t reserved_bytes, int64_t delta);
+    void release(const string &username, uint64_t reserved_bytes);
+
+    void add(const string &username, int64_t delta);
+
+    void reconcile(const string &username);
+    void start_reconciler();
+};
+
+QuotaManager &get_quota_manager();
+
+
+/*
+Bytes reserved in the quota of a user for a write in progress.
+The write accounts its actual change with commit(), whatever wasn't committed is released
+when the reservation goes away (so a failed write gives its bytes back).
+Parts of a reservation can be committed from several threads.
+*/
+class QuotaReservation {
+
+private:
+    mutex lock;
+    string username;
+    uint64_t bytes;
+
+public:
+    QuotaReservation();
+    ~QuotaReservation();
+
+    QuotaReservation(const QuotaReservation &) = delete;
+    QuotaReservation &operator=(const QuotaReservation &) = delete;
+
+    bool reserve(const string &username, uint64_t new_bytes, uint64_t replaced_bytes = 0);
+    void commit(int64_t delta);
+    void commit(uint64_t reserved_bytes, int64_t delta);
+};
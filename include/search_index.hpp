@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define SEARCH_MAX_RESULTS 100000
+#define SEARCH_BATCH_RESULTS 1024   // results copied out of an index at a time, handed over without its lock
+
+using namespace std;
+namespace fs = std::filesystem;
+
+
+typedef struct {
+    string path;
+    bool is_dir;
+} SEARCH_RESULT;
+
+// receives the results of a search by batches, return false to stop the search
+typedef function<bool(const vector<SEARCH_RESULT> &)> SEARCH_VISITOR;
+
+
+/*
+Per-user filename index: every path relative to the user root is split in (lowercase) trigrams,
+and each trigram maps to the sorted list of the paths containing it.
+
+A substring query only verifies the paths containing all of its trigrams,
+a glob query the paths containing all the trigrams of its literal parts.
+The index is built by walking the user tree on a builder thread, then kept up to date by the server
+operations. Until it's built, searches walk the tree instead.
+*/
+class SearchIndex {
+
+private:
+    typedef struct {
+        int kind;
+        string path;
+        string newpath;
+        bool is_dir;
+    } INDEX_OP;
+
+    typedef struct {
+        shared_mutex lock;
+        // id -> entry, removed entries have an empty path
+        vector<SEARCH_RESULT> entries;
+        unordered_map<string, uint32_t> ids;
+        unordered_map<uint32_t, vector<uint32_t>> postings;
+        size_t removed;
+        unsigned long generation;       // bumped when the entry ids change (compaction, rebuild)
+        bool ready;
+        bool building;
+        // changes made while the index is being built, replayed once it's done
+        vector<INDEX_OP> pending;
+    } USER_INDEX;
+
+    map<string, shared_ptr<USER_INDEX>> users;
+    mutex users_lock;
+
+    // users whose index the builder thread has to build
+    deque<string> build_queue;
+    thread builder;
+    condition_variable builder_cv;
+    mutex builder_lock;
+    atomic<bool> stop;
+
+    shared_ptr<USER_INDEX> get_user(const string &username);
+
+    void apply(USER_INDEX &index, const INDEX_OP &op);
+    void insert(USER_INDEX &index, const string &path, bool is_dir);
+    void erase(USER_INDEX &index, const string &path);
+    void erase_tree(USER_INDEX &index, const string &path);
+    void compact(USER_INDEX &index);
+    void record(const string &username, const INDEX_OP &op);
+    void build_loop();
+
+public:
+    SearchIndex();
+    ~SearchIndex();
+
+    void build(const string &username);
+    void request_build(const string &username);
+    void build_all();
+    void start_builder();
+
+    void add(const string &username, const string &path, bool is_dir);
+    void remove(const string &username, const string &path);
+    void remove_tree(const string &username, const string &path);
+    void rename_tree(const string &username, const string &path, const string &newpath);
+
+    size_t search(const string &username, const string &pattern, size_t max_results, const SEARCH_VISITOR &visit);
+};
+
+SearchIndex &get_search_index();
@@ -1,17 +1,33 @@
 #pragma once
 
+#include <vector>
 #include "LPTF_Net/LPTF_Socket.hpp"
+#include "LPTF_Net/LPTF_Structs.hpp"
 #include "logger.hpp"
 
 using namespace std;
 
-bool send_file(LPTF_Socket *serverSocket, int clientSockfd, string filename, string username, Logger *logger);
+#define USER_TREE_PAGE_MAX_ENTRIES 100000
+#define USER_TREE_BATCH_ENTRIES 1024     // tree entries copied out of the catalog at a time (sent without its lock)
+#define STAT_MANY_MAX_PATHS 100000
+#define STAT_MANY_MAX_REQUEST_BYTES (16 * 1024 * 1024)   // paths held until a STAT_MANY request ends
+#define DOWNLOAD_RANGES_MAX_COUNT 4096
+#define WRITE_RECORDS_IDLE_MS (60 * 1000)   // a PWRITE/APPEND session waiting longer for its next records is ended
+#define COPY_THREADS 8      // files of a directory copied at the same time (shared by all the sessions)
+#define ARCHIVE_READ_AHEAD_FILES 64     // small files of a directory download read ahead (on the copy threads)
+#define ARCHIVE_PENDING_FILES 256       // small files of a directory upload waiting to be written (on the copy threads)
 
-bool receive_file(LPTF_Socket *serverSocket, int clientSockfd, string filename, uint32_t filesize, string username, Logger *logger);
+#define SERVER_TRANSFER_OPTS (TRANSFER_OPT_SPARSE | TRANSFER_OPT_COMPRESS | TRANSFER_OPT_DELTA | TRANSFER_OPT_DEDUP | TRANSFER_OPT_CHECKSUM)   // transfer options the server accepts
+
+bool send_file(LPTF_Socket *serverSocket, int clientSockfd, string filename, uint8_t options, string username, Logger *logger);
+
+bool send_file_ranges(LPTF_Socket *serverSocket, int clientSockfd, string filename, uint8_t options, vector<FILE_RANGE_STRUCT> ranges, string username, Logger *logger);
+
+bool receive_file(LPTF_Socket *serverSocket, int clientSockfd, string filename, uint32_t filesize, uint8_t options, string username, Logger *logger);
 
 bool delete_file(LPTF_Socket *serverSocket, int clientSockfd, string filename, string username, Logger *logger);
 
-bool list_directory(LPTF_Socket *serverSocket, int clientSockfd, string path, string username, Logger *logger);
+bool list_directory(LPTF_Socket *serverSocket, int clientSockfd, string path, uint8_t format, string username, Logger *logger);
 
 bool create_directory(LPTF_Socket *serverSocket, int clientSockfd, string folder, string username, Logger *logger);
 
@@ -19,4 +35,22 @@ bool remove_directory(LPTF_Socket *serverSocket, int clientSockfd, string folder
 
 bool rename_directory(LPTF_Socket *serverSocket, int clientSockfd, string newname, string path, string username, Logger *logger);
 
-bool list_user_tree(LPTF_Socket *serverSocket, int clientSockfd, string username, Logger *logger);
+bool list_user_tree(LPTF_Socket *serverSocket, int clientSockfd, string cursor, string username, Logger *logger);
+
+bool stat_many(LPTF_Socket *serverSocket, int clientSockfd, string username, Logger *logger);
+
+bool send_quota(LPTF_Socket *serverSocket, int clientSockfd, string username, Logger *logger);
+
+bool search_files(LPTF_Socket *serverSocket, int clientSockfd, string pattern, string username, Logger *logger);
+
+bool hash_file(LPTF_Socket *serverSocket, int clientSockfd, string filename, string username, Logger *logger);
+
+bool write_file_records(LPTF_Socket *serverSocket, int clientSockfd, string filename, bool append, string username, Logger *logger);
+
+bool send_directory(LPTF_Socket *serverSocket, int clientSockfd, string folder, uint8_t options, string username, Logger *logger);
+
+bool receive_directory(LPTF_Socket *serverSocket, int clientSockfd, string folder, uint8_t options, uint64_t total, string username, Logger *logger);
+
+bool copy_path(LPTF_Socket *serverSocket, int clientSockfd, string source, string destination, string username, Logger *logger);
+
+bool move_path(LPTF_Socket *serverSocket, int clientSockfd, string source, string destination, string username, Logger *logger);
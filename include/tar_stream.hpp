@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+
+#define TAR_BLOCK_BYTES 512
+#define TAR_NAME_MAX_BYTES 4096     // longest path read from an archive (GNU long name records)
+
+using namespace std;
+
+
+typedef struct {
+    string path;        // relative, '/' separated
+    bool is_dir;
+    uint32_t mode;
+    uint64_t size;      // content bytes, 0 for a directory
+    int64_t mtime;
+} TAR_ENTRY;
+
+
+// called by a TarReader as the archive is read
+typedef struct {
+    function<void(const TAR_ENTRY &)> begin;        // a file or directory starts
+    function<void(const char *, size_t)> data;      // content of the current file
+    function<void(uint64_t)> zeros;                 // run of zeros in the content (a hole, if sent as one)
+    function<void()> end;                           // the current entry is complete
+} TAR_VISITOR;
+
+
+/*
+Archives in the tar (ustar) format, written and read as a stream.
+An entry is a header block followed by its content, padded to a whole block. Paths too long
+for the header are preceded by a GNU long name record, sizes too big for it are in base-256.
+The archive ends with two blocks of zeros.
+*/
+string tar_header(const TAR_ENTRY &entry);
+size_t tar_padding(uint64_t size);
+string tar_end();
+
+
+/*
+Reads an archive fed in pieces of any size, calling the visitor as the entries go by.
+Regular files and directories are reported, other entries (links, pax headers...) are skipped.
+Throws a runtime_error on an invalid archive, done() once its end is read.
+*/
+class TarReader {
+
+private:
+    TAR_VISITOR visitor;
+    int state;
+    string header;          // block being collected
+    string long_name;       // path of the next entry, from a GNU long name record
+    uint64_t remaining;     // bytes of content (or long name) left
+    uint64_t padding;       // bytes left up to the next block
+    bool reported;          // the current entry was passed to the visitor
+    bool is_file;
+    int zero_blocks;
+
+    uint64_t consume(const char *data, uint64_t len);
+    void parse_header();
+    void end_content();
+
+public:
+    TarReader(const TAR_VISITOR &visitor);
+
+    void feed(const char *data, size_t len);
+    void feed_zeros(uint64_t len);
+
+    bool done();
+};
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "thread_pool.hpp"
+
+#define TRASH_REAPER_THREADS 2
+#define TRASH_REAPER_BATCH 256          // entries removed between two pauses
+#define TRASH_REAPER_PAUSE_US 5000      // pause between two batches, leaves the disk to the clients
+#define TRASH_REAPER_RETRY_S 300        // between two attempts at removing what could not be removed
+
+using namespace std;
+namespace fs = std::filesystem;
+
+
+/*
+Removes trashed directories in the background.
+
+Directories are first renamed into the user's trash folder (see move_to_trash()),
+which is atomic and instant, then the reaper threads unlink their content in throttled
+batches, with the lowest CPU and I/O priority.
+The removed bytes are released from the user's quota after each batch.
+What could not be removed is tried again by a background retry pass.
+*/
+class TrashReaper {
+
+private:
+    ThreadPool pool;
+    mutex lock;
+    unsigned long counter;
+    vector<fs::path> failed;    // waiting for the next retry pass
+
+    thread retrier;
+    condition_variable retrier_cv;
+    mutex retrier_lock;
+    bool stop;
+
+    void reap(fs::path trashed);
+    void retry_later(const fs::path &trashed, int error);
+    void retry_loop();
+
+public:
+    TrashReaper();
+    ~TrashReaper();
+
+    fs::path new_trash_path(const string &username);
+
+    bool move_to_trash(const fs::path &target, const string &username);
+    bool move_content_to_trash(const fs::path &dir, const string &username);
+
+    void enqueue(const fs::path &trashed);
+    void reap_leftovers();
+    void start_retrier();
+};
+
+TrashReaper &get_trash_reaper();
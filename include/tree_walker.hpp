@@ -0,0 +1,27 @@
+#pragma once
+
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+
+#define TREE_WALKER_THREADS 8
+#define TREE_WALKER_MAX_PREFETCH 64     // max directories read ahead of the walk, per walk
+
+using namespace std;
+namespace fs = std::filesystem;
+
+
+typedef struct {
+    string name;
+    bool is_dir;
+    bool is_symlink;
+} TREE_ENTRY;
+
+// called with the path relative to the walked root, return false to stop the walk
+typedef function<bool(const string &relpath, bool is_dir)> TREE_VISITOR;
+
+
+vector<TREE_ENTRY> read_directory_entries(const fs::path &folderpath);
+
+bool walk_tree(fs::path root, const string &cursor, const TREE_VISITOR &visit);
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// in-tree XXH64 (non-cryptographic 64 bit hash, same results as the reference implementation)
+uint64_t xxh64(const void *data, size_t len, uint64_t seed = 0);
@@ -124,6 +124,17 @@ uint16_t LPTF_Packet::size() {
     return sizeof(header) + header.length;
 }
 
+/*
+Flags of the packet, carried in the reserved byte of the header (see PART_FLAG_HOLE)
+*/
+uint8_t LPTF_Packet::flags() {
+    return header.reserved;
+}
+
+void LPTF_Packet::set_flags(uint8_t flags) {
+    header.reserved = flags;
+}
+
 const PACKET_HEADER LPTF_Packet::get_header() {
     return header;
 }
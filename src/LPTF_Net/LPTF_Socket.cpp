@@ -2,6 +2,7 @@
 #include <stdexcept>
 #include <memory>
 #include <cstring>
+#include <cerrno>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -69,9 +70,27 @@ ssize_t LPTF_Socket::send(int sockfdto, LPTF_Packet &packet, int flags) {
     return -1;
 }
 
-LPTF_Packet LPTF_Socket::recv(int sockfdfrom, int flags) {
+/*
+Reads exactly len bytes (a packet may arrive in several pieces, or with the next one).
+Returns the number of bytes read, less than len only if the connection ended or failed.
+*/
+static ssize_t recv_full(int fd, uint8_t *buffer, size_t len, int flags) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t retval = ::recv(fd, buffer + done, len - done, flags);
+        if (retval < 0 && errno == EINTR)
+            continue;
+        if (retval <= 0)
+            return done > 0 ? (ssize_t)done : retval;
+        done += retval;
+    }
+    return done;
+}
+
+// one packet: the header, then the length it announces
+static LPTF_Packet recv_packet(int fd, int flags) {
     uint8_t buffer[sizeof(PACKET_HEADER)+UINT16_MAX];
-    ssize_t retval = ::recv(sockfdfrom, buffer, sizeof(PACKET_HEADER)+UINT16_MAX, flags);
+    ssize_t retval = recv_full(fd, buffer, sizeof(PACKET_HEADER), flags);
 
     if (retval < 0 /*aka -1*/ || ((size_t) retval) /*-Wsign-compare*/ < sizeof(PACKET_HEADER)) {
         char msg[64];
@@ -79,32 +98,31 @@ LPTF_Packet LPTF_Socket::recv(int sockfdfrom, int flags) {
         throw runtime_error(msg);
     }
 
-    LPTF_Packet packet(buffer, sizeof(PACKET_HEADER)+UINT16_MAX);
-
-    // cout << "Packet Received:" << endl;
-    // packet.print_specs();
-
-    return packet;
-}
+    uint16_t length = (buffer[1] << 8) | buffer[2];
+    retval = recv_full(fd, buffer + sizeof(PACKET_HEADER), length, flags);
 
-LPTF_Packet LPTF_Socket::read() {
-    uint8_t buffer[sizeof(PACKET_HEADER)+UINT16_MAX];
-    ssize_t retval = ::read(sockfd, buffer, sizeof(PACKET_HEADER)+UINT16_MAX);
-
-    if (retval < 0 /*aka -1*/ || ((size_t) retval) /*-Wsign-compare*/ < sizeof(PACKET_HEADER)) {
+    if (retval < 0 || ((size_t) retval) < length) {
         char msg[64];
-        sprintf(msg, "Received too few bytes (expected %ld, got %ld).", sizeof(PACKET_HEADER), retval);
+        sprintf(msg, "Received too few bytes (expected %d, got %ld).", length, retval);
         throw runtime_error(msg);
     }
 
     LPTF_Packet packet(buffer, sizeof(PACKET_HEADER)+UINT16_MAX);
 
-    // cout << "Packet Read:" << endl;
+    // cout << "Packet Received:" << endl;
     // packet.print_specs();
 
     return packet;
 }
 
+LPTF_Packet LPTF_Socket::recv(int sockfdfrom, int flags) {
+    return recv_packet(sockfdfrom, flags);
+}
+
+LPTF_Packet LPTF_Socket::read() {
+    return recv_packet(sockfd, 0);
+}
+
 ssize_t LPTF_Socket::write(LPTF_Packet &packet) {
     void *data = packet.data();
 
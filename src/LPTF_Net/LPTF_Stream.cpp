@@ -0,0 +1,132 @@
+#include <iostream>
+#include <cstring>
+
+#include "../../include/LPTF_Net/LPTF_Stream.hpp"
+#include "../../include/LPTF_Net/LPTF_Utils.hpp"
+
+using namespace std;
+
+
+LPTF_PartWriter::LPTF_PartWriter(LPTF_Socket *socket, int peersockfd): socket{ socket }, peersockfd{ peersockfd } {
+    len = 0;
+    total = 0;
+    closed = false;
+}
+
+
+void LPTF_PartWriter::send_part() {
+    LPTF_Packet pckt = build_binary_part_packet(buffer, len);
+
+    if (peersockfd == -1) socket->write(pckt);
+    else socket->send(peersockfd, pckt, 0);
+
+    // wait for peer reply
+    // this is required to not overflow? the socket
+    if (peersockfd == -1) pckt = socket->read();
+    else pckt = socket->recv(peersockfd, 0);
+
+    // the peer may give up on the stream
+    if (pckt.type() == ERROR_PACKET)
+        throw runtime_error(get_error_content_from_error_packet(pckt));
+
+    if (pckt.type() != REPLY_PACKET)
+        throw runtime_error("Unexpected packet type!");
+
+    total += len;
+    len = 0;
+}
+
+
+void LPTF_PartWriter::write(const void *data, size_t datalen) {
+    if (closed) throw runtime_error("Stream already closed !");
+
+    const char *bytes = (const char *)data;
+
+    while (datalen > 0) {
+        size_t n = min(datalen, (size_t)(MAX_BINARY_PART_BYTES - len));
+        memcpy(buffer + len, bytes, n);
+        len += n;
+        bytes += n;
+        datalen -= n;
+
+        if (len == MAX_BINARY_PART_BYTES)
+            send_part();
+    }
+}
+
+void LPTF_PartWriter::write(const string &data) {
+    write(data.c_str(), data.size());
+}
+
+void LPTF_PartWriter::put(char c) {
+    write(&c, 1);
+}
+
+
+/*
+Sends the remaining data. The last packet is always shorter than MAX_BINARY_PART_BYTES
+(empty if needed), which tells the peer the stream is over.
+*/
+void LPTF_PartWriter::close() {
+    if (closed) return;
+    send_part();
+    closed = true;
+}
+
+
+size_t LPTF_PartWriter::bytes_written() {
+    return total + len;
+}
+
+
+
+LPTF_PartReader::LPTF_PartReader(LPTF_Socket *socket, int peersockfd): socket{ socket }, peersockfd{ peersockfd } {
+    total = 0;
+    ended = false;
+}
+
+
+/*
+Appends the content of the next part of the stream to data.
+Returns false (and leaves data untouched) if the stream already ended.
+*/
+bool LPTF_PartReader::read(string &data) {
+    if (ended) return false;
+
+    LPTF_Packet pckt;
+    if (peersockfd == -1) pckt = socket->read();
+    else pckt = socket->recv(peersockfd, 0);
+
+    if (pckt.type() == ERROR_PACKET)
+        throw runtime_error(get_error_content_from_error_packet(pckt));
+
+    if (pckt.type() != BINARY_PART_PACKET)
+        throw runtime_error("Packet is not a Binary Part Packet !");
+
+    BINARY_PART_PACKET_STRUCT part = get_data_from_binary_part_packet(pckt);
+    data.append((const char *)part.data, part.len);
+    total += part.len;
+
+    // notify peer
+    // this is required to not overflow? the socket
+    char repc = 0;
+    pckt = build_reply_packet(BINARY_PART_PACKET, &repc, 1);
+    if (peersockfd == -1) socket->write(pckt);
+    else socket->send(peersockfd, pckt, 0);
+
+    // a part smaller than MAX_BINARY_PART_BYTES ends the stream
+    if (part.len != MAX_BINARY_PART_BYTES)
+        ended = true;
+
+    return true;
+}
+
+
+bool LPTF_PartReader::done() {
+    return ended;
+}
+
+
+size_t LPTF_PartReader::bytes_read() {
+    return total;
+}
@@ -1,16 +1,19 @@
 #include <iostream>
 #include <cstring>
 
+#include <endian.h>
 #include <netinet/in.h>
 
 #include "../../include/LPTF_Net/LPTF_Packet.hpp"
 #include "../../include/LPTF_Net/LPTF_Utils.hpp"
+#include "../../include/crc32c.hpp"
 
 using namespace std;
 
 
 bool is_command_packet(uint8_t type) {
-    return type >= UPLOAD_FILE_COMMAND && type <= USER_TREE_COMMAND;
+    return (type >= UPLOAD_FILE_COMMAND && type <= USER_TREE_COMMAND)
+           || (type >= STAT_MANY_COMMAND && type <= LAST_COMMAND);
 }
 
 bool is_command_packet(LPTF_Packet &packet) {
@@ -65,8 +68,9 @@ LPTF_Packet build_error_packet(uint8_t errfrom, uint8_t err_code, string &errmsg
 }
 
 
-LPTF_Packet build_file_upload_request_packet(const string filepath, uint32_t filesize) {
-    size_t size = filepath.size()+1 + sizeof(filesize);
+// the options byte is only sent if there are options (older servers don't expect it)
+LPTF_Packet build_file_upload_request_packet(const string filepath, uint32_t filesize, uint8_t options) {
+    size_t size = filepath.size()+1 + sizeof(filesize) + (options != 0 ? sizeof(options) : 0);
     uint8_t *rawcontent = (uint8_t*)malloc(size);
 
     if (!rawcontent)
@@ -76,6 +80,8 @@ LPTF_Packet build_file_upload_request_packet(const string filepath, uint32_t fil
 
     memcpy(rawcontent, filepath.c_str(), filepath.size()+1);
     memcpy(rawcontent + filepath.size()+1, &filesize, sizeof(filesize));
+    if (options != 0)
+        memcpy(rawcontent + filepath.size()+1 + sizeof(filesize), &options, sizeof(options));
 
     LPTF_Packet packet(UPLOAD_FILE_COMMAND, rawcontent, size);
 
@@ -84,8 +90,37 @@ LPTF_Packet build_file_upload_request_packet(const string filepath, uint32_t fil
 }
 
 
-LPTF_Packet build_file_download_request_packet(const string filepath) {
-    return build_command_packet(DOWNLOAD_FILE_COMMAND, filepath);
+// the options byte follows the path (after its null terminator), like the listing format
+LPTF_Packet build_file_download_request_packet(const string filepath, uint8_t options) {
+    if (options == 0)
+        return build_command_packet(DOWNLOAD_FILE_COMMAND, filepath);
+
+    string arg = filepath;
+    arg.push_back('\0');
+    arg.push_back(options);
+    return build_command_packet(DOWNLOAD_FILE_COMMAND, arg);
+}
+
+
+/*
+The options byte follows the path (after its null terminator), then the ranges:
+    varint count, then per range varint (offset << 1 | from end), varint length
+*/
+LPTF_Packet build_file_ranges_request_packet(const string filepath, uint8_t options, const vector<FILE_RANGE_STRUCT> &ranges) {
+    string arg = filepath;
+    arg.push_back('\0');
+    arg.push_back(options);
+
+    append_varint(arg, ranges.size());
+    for (const FILE_RANGE_STRUCT &range : ranges) {
+        append_varint(arg, range.offset << 1 | (range.from_end ? 1 : 0));
+        append_varint(arg, range.length);
+    }
+
+    if (arg.size() > UINT16_MAX)
+        throw runtime_error("Too many ranges !");
+
+    return LPTF_Packet(DOWNLOAD_RANGES_COMMAND, (void *)arg.data(), arg.size());
 }
 
 
@@ -93,8 +128,15 @@ LPTF_Packet build_file_delete_request_packet(const string filepath) {
     return build_command_packet(DELETE_FILE_COMMAND, filepath);
 }
 
-LPTF_Packet build_list_directory_request_packet(const string pathname) {
-    return build_command_packet(LIST_FILES_COMMAND, pathname);
+// the format byte follows the path (after its null terminator), text listings keep the plain path
+LPTF_Packet build_list_directory_request_packet(const string pathname, uint8_t format) {
+    if (format == LIST_FORMAT_TEXT)
+        return build_command_packet(LIST_FILES_COMMAND, pathname);
+
+    string arg = pathname;
+    arg.push_back('\0');
+    arg.push_back(format);
+    return build_command_packet(LIST_FILES_COMMAND, arg);
 }
 
 LPTF_Packet build_create_directory_request_packet(const string folder) {
@@ -123,12 +165,73 @@ LPTF_Packet build_rename_directory_request_packet(const string newname, const st
 }
 
 
+// cursor is the last entry of the previous page, empty to start from the beginning
+LPTF_Packet build_user_tree_request_packet(const string cursor) {
+    return build_command_packet(USER_TREE_COMMAND, cursor);
+}
+
+
+// COPY_COMMAND or MOVE_COMMAND: source, '\0', destination
+LPTF_Packet build_copy_request_packet(uint8_t cmd_type, const string source, const string destination) {
+    return build_command_packet(cmd_type, source + '\0' + destination);
+}
+
+
+// the options byte follows the path (after its null terminator)
+LPTF_Packet build_directory_download_request_packet(const string folder, uint8_t options) {
+    string arg = folder;
+    arg.push_back('\0');
+    arg.push_back(options);
+    return build_command_packet(DOWNLOAD_DIR_COMMAND, arg);
+}
+
+
+// the options byte follows the path (after its null terminator), then the size of the files (varint)
+LPTF_Packet build_directory_upload_request_packet(const string folder, uint8_t options, uint64_t total) {
+    string arg = folder;
+    arg.push_back('\0');
+    arg.push_back(options);
+    append_varint(arg, total);
+    return build_command_packet(UPLOAD_DIR_COMMAND, arg);
+}
+
+
 LPTF_Packet build_binary_part_packet(void *data, uint16_t datalen) {
     LPTF_Packet packet(BINARY_PART_PACKET, data, datalen);
     return packet;
 }
 
 
+// a run of zeros in a sparse transfer (see TRANSFER_OPT_SPARSE)
+LPTF_Packet build_hole_part_packet(uint64_t length) {
+    length = htobe64(length);
+
+    LPTF_Packet packet(BINARY_PART_PACKET, &length, sizeof(length));
+    packet.set_flags(PART_FLAG_HOLE);
+    return packet;
+}
+
+
+// file data compressed in a transfer (see TRANSFER_OPT_COMPRESS)
+LPTF_Packet build_compressed_part_packet(void *data, uint16_t datalen) {
+    LPTF_Packet packet(BINARY_PART_PACKET, data, datalen);
+    packet.set_flags(PART_FLAG_COMPRESSED);
+    return packet;
+}
+
+
+// blocks of the receiver's version in a delta transfer (see TRANSFER_OPT_DELTA)
+LPTF_Packet build_block_ref_part_packet(uint64_t first, uint64_t count) {
+    string content;
+    append_varint(content, first);
+    append_varint(content, count);
+
+    LPTF_Packet packet(BINARY_PART_PACKET, (void *)content.c_str(), content.size());
+    packet.set_flags(PART_FLAG_BLOCK_REF);
+    return packet;
+}
+
+
 string get_message_from_message_packet(LPTF_Packet &packet) {
     string message;
 
@@ -250,7 +353,12 @@ FILE_UPLOAD_REQ_PACKET_STRUCT get_data_from_file_upload_request_packet(LPTF_Pack
     filesize = ntohl(filesize);
     // cout << "filesize ntohl " << filesize << endl;
 
-    return {filepath, filesize};
+    // optional options byte
+    uint8_t options = 0;
+    if (i + 1 + sizeof(uint32_t) < packet.get_header().length)
+        options = (uint8_t)content[i + 1 + sizeof(uint32_t)];
+
+    return {filepath, filesize, options};
 }
 
 
@@ -259,6 +367,57 @@ string get_file_from_file_download_request_packet(LPTF_Packet &packet) {
     return get_arg_from_command_packet(packet);
 }
 
+// the options byte following the path of a command, 0 if none
+static uint8_t get_options_after_path(LPTF_Packet &packet) {
+    if (packet.get_header().length == 0)
+        return 0;
+
+    const char *content = (const char *)packet.get_content();
+    const char *end = (const char *)memchr(content, '\0', packet.get_header().length);
+
+    // no options given
+    if (!end || end + 1 >= content + packet.get_header().length)
+        return 0;
+
+    return (uint8_t)end[1];
+}
+
+uint8_t get_options_from_file_download_request_packet(LPTF_Packet &packet) {
+    if (packet.type() != DOWNLOAD_FILE_COMMAND) throw runtime_error("Invalid packet (type or length)");
+    return get_options_after_path(packet);
+}
+
+FILE_RANGES_REQ_PACKET_STRUCT get_data_from_file_ranges_request_packet(LPTF_Packet &packet) {
+    if (packet.type() != DOWNLOAD_RANGES_COMMAND) throw runtime_error("Invalid packet (type or length)");
+
+    const char *content = (const char *)packet.get_content();
+    const char *end = content + packet.get_header().length;
+    const char *sep = content ? (const char *)memchr(content, '\0', packet.get_header().length) : nullptr;
+
+    if (!sep || sep + 1 >= end)
+        throw runtime_error("Invalid Packet structure ! (could not get the options from file ranges command)");
+
+    FILE_RANGES_REQ_PACKET_STRUCT data;
+    data.filepath = string(content, sep - content);
+    data.options = (uint8_t)sep[1];
+
+    const char *ptr = sep + 2;
+    uint64_t count;
+    if (!read_varint(ptr, end, count) || count > (uint64_t)(end - ptr) / 2)
+        throw runtime_error("Invalid Packet structure ! (could not get the ranges from file ranges command)");
+
+    data.ranges.resize(count);
+    for (FILE_RANGE_STRUCT &range : data.ranges) {
+        uint64_t offset;
+        if (!read_varint(ptr, end, offset) || !read_varint(ptr, end, range.length))
+            throw runtime_error("Invalid Packet structure ! (could not get the ranges from file ranges command)");
+        range.offset = offset >> 1;
+        range.from_end = offset & 1;
+    }
+
+    return data;
+}
+
 string get_file_from_file_delete_request_packet(LPTF_Packet &packet) {
     if (packet.type() != DELETE_FILE_COMMAND) throw runtime_error("Invalid packet (type or length)");
     return get_arg_from_command_packet(packet);
@@ -269,6 +428,22 @@ string get_path_from_list_directory_request_packet(LPTF_Packet &packet) {
     return get_arg_from_command_packet(packet);
 }
 
+uint8_t get_format_from_list_directory_request_packet(LPTF_Packet &packet) {
+    if (packet.type() != LIST_FILES_COMMAND) throw runtime_error("Invalid packet (type or length)");
+
+    if (packet.get_header().length == 0)
+        return LIST_FORMAT_TEXT;
+
+    const char *content = (const char *)packet.get_content();
+    const char *end = (const char *)memchr(content, '\0', packet.get_header().length);
+
+    // no format given
+    if (!end || end + 1 >= content + packet.get_header().length)
+        return LIST_FORMAT_TEXT;
+
+    return (uint8_t)end[1];
+}
+
 string get_path_from_create_directory_request_packet(LPTF_Packet &packet) {
     if (packet.type() != CREATE_FOLDER_COMMAND) throw runtime_error("Invalid packet (type or length)");
     return get_arg_from_command_packet(packet);
@@ -318,8 +493,277 @@ RENAME_DIR_REQ_PACKET_STRUCT get_data_from_rename_directory_request_packet(LPTF_
 }
 
 
+string get_cursor_from_user_tree_request_packet(LPTF_Packet &packet) {
+    if (packet.type() != USER_TREE_COMMAND) throw runtime_error("Invalid packet (type or length)");
+    return get_arg_from_command_packet(packet);
+}
+
+
+COPY_REQ_PACKET_STRUCT get_data_from_copy_request_packet(LPTF_Packet &packet) {
+    if (packet.type() != COPY_COMMAND && packet.type() != MOVE_COMMAND) throw runtime_error("Invalid packet (type or length)");
+
+    string arg((const char *)packet.get_content(), packet.get_header().length);
+    size_t separator = arg.find('\0');
+    if (separator == string::npos) throw runtime_error("Invalid packet (missing destination)");
+
+    return {arg.substr(0, separator), arg.substr(separator + 1)};
+}
+
+
+string get_path_from_directory_download_request_packet(LPTF_Packet &packet) {
+    if (packet.type() != DOWNLOAD_DIR_COMMAND) throw runtime_error("Invalid packet (type or length)");
+    return get_arg_from_command_packet(packet);
+}
+
+uint8_t get_options_from_directory_download_request_packet(LPTF_Packet &packet) {
+    if (packet.type() != DOWNLOAD_DIR_COMMAND) throw runtime_error("Invalid packet (type or length)");
+    return get_options_after_path(packet);
+}
+
+UPLOAD_DIR_REQ_PACKET_STRUCT get_data_from_directory_upload_request_packet(LPTF_Packet &packet) {
+    if (packet.type() != UPLOAD_DIR_COMMAND) throw runtime_error("Invalid packet (type or length)");
+
+    const char *content = (const char *)packet.get_content();
+    const char *end = content + packet.get_header().length;
+    const char *sep = content ? (const char *)memchr(content, '\0', packet.get_header().length) : nullptr;
+
+    UPLOAD_DIR_REQ_PACKET_STRUCT result;
+    if (!sep || sep + 1 >= end) throw runtime_error("Invalid packet (missing options)");
+
+    result.folder = string(content, sep - content);
+    result.options = (uint8_t)sep[1];
+
+    const char *ptr = sep + 2;
+    if (!read_varint(ptr, end, result.total) || ptr != end) throw runtime_error("Invalid packet (size)");
+
+    return result;
+}
+
+
+bool is_digest_part_packet(LPTF_Packet &packet) {
+    return packet.type() == BINARY_PART_PACKET && (packet.flags() & PART_FLAG_DIGEST);
+}
+
+
+uint32_t get_digest_from_digest_part_packet(LPTF_Packet &packet) {
+    if (!is_digest_part_packet(packet) || packet.get_header().length != sizeof(uint32_t))
+        throw runtime_error("Invalid packet (type or length)");
+
+    uint32_t digest;
+    memcpy(&digest, packet.get_content(), sizeof(digest));
+    return be32toh(digest);
+}
+
+
+bool is_resend_part_reply_packet(LPTF_Packet &packet) {
+    return packet.type() == REPLY_PACKET && packet.get_header().length >= 2
+        && ((const uint8_t *)packet.get_content())[0] == BINARY_PART_PACKET
+        && ((const uint8_t *)packet.get_content())[1] == PART_REPLY_RESEND;
+}
+
+
 BINARY_PART_PACKET_STRUCT get_data_from_binary_part_packet(LPTF_Packet &packet) {
     if (packet.type() != BINARY_PART_PACKET) throw runtime_error("Invalid packet (type or length)");
 
     return {(const char *)packet.get_content(), packet.get_header().length};
 }
+
+
+// (see TRANSFER_OPT_CHECKSUM)
+LPTF_Packet build_digest_part_packet(uint32_t digest) {
+    digest = htobe32(digest);
+
+    LPTF_Packet packet(BINARY_PART_PACKET, &digest, sizeof(digest));
+    packet.set_flags(PART_FLAG_DIGEST);
+    return packet;
+}
+
+
+// acknowledges a part (PART_REPLY_OK), or asks for it again (PART_REPLY_RESEND)
+LPTF_Packet build_part_reply_packet(uint8_t status) {
+    return build_reply_packet(BINARY_PART_PACKET, &status, sizeof(status));
+}
+
+
+// appends the CRC32C of the content to a part
+void add_part_checksum(LPTF_Packet &packet) {
+    uint16_t len = packet.get_header().length;
+    if (len > UINT16_MAX - sizeof(uint32_t))
+        throw runtime_error("Packet too big for a checksum !");
+
+    uint32_t crc = htobe32(crc32c(0, packet.get_content(), len));
+
+    string content((const char *)packet.get_content(), len);
+    content.append((const char *)&crc, sizeof(crc));
+
+    LPTF_Packet checked(packet.type(), (void *)content.c_str(), content.size());
+    checked.set_flags(packet.flags() | PART_FLAG_CHECKSUM);
+    packet = checked;
+}
+
+
+// removes the CRC32C of a part, returns false if it's missing or doesn't match the content
+bool check_part_checksum(LPTF_Packet &packet) {
+    uint16_t len = packet.get_header().length;
+    if (!(packet.flags() & PART_FLAG_CHECKSUM) || len < sizeof(uint32_t))
+        return false;
+
+    len -= sizeof(uint32_t);
+    uint32_t crc;
+    memcpy(&crc, (const char *)packet.get_content() + len, sizeof(crc));
+    if (be32toh(crc) != crc32c(0, packet.get_content(), len))
+        return false;
+
+    LPTF_Packet stripped(packet.type(), (void *)packet.get_content(), len);
+    stripped.set_flags(packet.flags() & ~PART_FLAG_CHECKSUM);
+    packet = stripped;
+    return true;
+}
+
+
+bool is_hole_part_packet(LPTF_Packet &packet) {
+    return packet.type() == BINARY_PART_PACKET && (packet.flags() & PART_FLAG_HOLE);
+}
+
+
+bool is_compressed_part_packet(LPTF_Packet &packet) {
+    return packet.type() == BINARY_PART_PACKET && (packet.flags() & PART_FLAG_COMPRESSED);
+}
+
+
+bool is_block_ref_part_packet(LPTF_Packet &packet) {
+    return packet.type() == BINARY_PART_PACKET && (packet.flags() & PART_FLAG_BLOCK_REF);
+}
+
+
+BLOCK_REF_STRUCT get_block_ref_from_block_ref_part_packet(LPTF_Packet &packet) {
+    if (!is_block_ref_part_packet(packet)) throw runtime_error("Invalid packet (type or length)");
+
+    const char *ptr = (const char *)packet.get_content();
+    const char *end = ptr + packet.get_header().length;
+
+    BLOCK_REF_STRUCT ref;
+    if (!read_varint(ptr, end, ref.first) || !read_varint(ptr, end, ref.count) || ptr != end)
+        throw runtime_error("Invalid packet (type or length)");
+
+    return ref;
+}
+
+
+uint64_t get_length_from_hole_part_packet(LPTF_Packet &packet) {
+    if (!is_hole_part_packet(packet) || packet.get_header().length != sizeof(uint64_t)) throw runtime_error("Invalid packet (type or length)");
+
+    uint64_t length;
+    memcpy(&length, packet.get_content(), sizeof(length));
+    return be64toh(length);
+}
+
+
+// LEB128 encoding: 7 bits per byte, the high bit is set on every byte but the last
+void append_varint(string &out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back((char)((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+
+// returns false if the varint is truncated or too long, ptr is moved after the varint
+bool read_varint(const char *&ptr, const char *end, uint64_t &value) {
+    value = 0;
+
+    for (int shift = 0; shift < 64 && ptr < end; shift += 7) {
+        uint8_t byte = (uint8_t)*ptr++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+
+    return false;
+}
+
+
+/*
+Binary listing entry:
+    varint name length, name, type (1 byte), varint size, varint mtime, varint mode
+*/
+void append_list_entry(string &out, const LIST_ENTRY_STRUCT &entry) {
+    append_varint(out, entry.name.size());
+    out.append(entry.name);
+    out.push_back((char)entry.type);
+    append_varint(out, entry.size);
+    append_varint(out, entry.mtime);
+    append_varint(out, entry.mode);
+}
+
+
+// returns false if the entry is incomplete, ptr is only moved if the entry could be read
+bool read_list_entry(const char *&ptr, const char *end, LIST_ENTRY_STRUCT &entry) {
+    const char *cur = ptr;
+    uint64_t namelen, mode;
+
+    if (!read_varint(cur, end, namelen) || (uint64_t)(end - cur) < namelen + 1)
+        return false;
+
+    entry.name = string(cur, namelen);
+    cur += namelen;
+    entry.type = (uint8_t)*cur++;
+
+    if (!read_varint(cur, end, entry.size) || !read_varint(cur, end, entry.mtime) || !read_varint(cur, end, mode))
+        return false;
+
+    entry.mode = (uint32_t)mode;
+    ptr = cur;
+    return true;
+}
+
+
+/*
+STAT_MANY result:
+    status (1 byte), then a binary listing entry if status is STAT_RESULT_OK,
+    otherwise varint path length, path, varint message length, message
+*/
+void append_stat_result(string &out, const STAT_RESULT_STRUCT &result) {
+    out.push_back((char)result.status);
+
+    if (result.status == STAT_RESULT_OK) {
+        append_list_entry(out, result.entry);
+    } else {
+        append_varint(out, result.entry.name.size());
+        out.append(result.entry.name);
+        append_varint(out, result.error.size());
+        out.append(result.error);
+    }
+}
+
+
+// returns false if the result is incomplete, ptr is only moved if the result could be read
+bool read_stat_result(const char *&ptr, const char *end, STAT_RESULT_STRUCT &result) {
+    const char *cur = ptr;
+
+    if (cur >= end)
+        return false;
+
+    result.status = (uint8_t)*cur++;
+
+    if (result.status == STAT_RESULT_OK) {
+        if (!read_list_entry(cur, end, result.entry))
+            return false;
+        result.error.clear();
+    } else {
+        uint64_t len;
+        if (!read_varint(cur, end, len) || (uint64_t)(end - cur) < len)
+            return false;
+        result.entry.name = string(cur, len);
+        cur += len;
+
+        if (!read_varint(cur, end, len) || (uint64_t)(end - cur) < len)
+            return false;
+        result.error = string(cur, len);
+        cur += len;
+    }
+
+    ptr = cur;
+    return true;
+}
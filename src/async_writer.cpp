@@ -0,0 +1,180 @@
+#include "../include/async_writer.hpp"
+#include "../include/crc32c.hpp"
+
+#include <stdexcept>
+#include <cstring>
+
+#include <unistd.h>
+
+using namespace std;
+
+
+AsyncWriter::AsyncWriter(int fd): fd{ fd } {
+    current.offset = 0;
+    current.data.reserve(ASYNC_WRITER_BUFFER_BYTES);
+    queued_bytes = 0;
+    skipped_bytes = 0;
+    digest_enabled = false;
+    digest = 0;
+    busy = false;
+    stop = false;
+
+    writer = thread(&AsyncWriter::write_loop, this);
+}
+
+AsyncWriter::~AsyncWriter() {
+    {
+        lock_guard<mutex> guard(lock);
+        stop = true;
+    }
+    not_empty.notify_all();
+
+    if (writer.joinable())
+        writer.join();
+}
+
+
+void AsyncWriter::write_loop() {
+    while (true) {
+        WRITE_BUFFER buffer;
+        {
+            unique_lock<mutex> guard(lock);
+            not_empty.wait(guard, [this] { return !queue.empty() || stop; });
+            if (queue.empty()) return;
+
+            buffer = move(queue.front());
+            queue.pop_front();
+            busy = true;
+        }
+        not_full.notify_one();
+
+        size_t done = 0;
+        string write_error;
+
+        while (done < buffer.data.size()) {
+            ssize_t len = pwrite(fd, buffer.data.c_str() + done, buffer.data.size() - done, buffer.offset + done);
+            if (len < 0) {
+                if (errno == EINTR) continue;
+                write_error = strerror(errno);
+                break;
+            }
+            done += len;
+        }
+
+        {
+            lock_guard<mutex> guard(lock);
+            busy = false;
+            if (!write_error.empty() && error.empty())
+                error = "Could not write file: " + write_error;
+        }
+        drained.notify_all();
+    }
+}
+
+
+void AsyncWriter::check_error() {
+    lock_guard<mutex> guard(lock);
+    if (!error.empty())
+        throw runtime_error(error);
+}
+
+
+// hands the current buffer to the writer thread, waits if too many are queued
+void AsyncWriter::push_current() {
+    if (current.data.empty())
+        return;
+
+    uint64_t next_offset = current.offset + current.data.size();
+
+    {
+        unique_lock<mutex> guard(lock);
+        not_full.wait(guard, [this] { return queue.size() < ASYNC_WRITER_MAX_BUFFERS || !error.empty(); });
+
+        if (!error.empty())
+            throw runtime_error(error);
+
+        queue.push_back(move(current));
+    }
+    not_empty.notify_one();
+
+    current = WRITE_BUFFER();
+    current.offset = next_offset;
+    current.data.reserve(ASYNC_WRITER_BUFFER_BYTES);
+}
+
+
+void AsyncWriter::write(const void *data, size_t len) {
+    const char *ptr = (const char *)data;
+
+    if (digest_enabled)
+        digest = crc32c(digest, data, len);
+
+    while (len > 0) {
+        size_t size = min(len, (size_t)ASYNC_WRITER_BUFFER_BYTES - current.data.size());
+        current.data.append(ptr, size);
+        ptr += size;
+        len -= size;
+        queued_bytes += size;
+
+        if (current.data.size() == ASYNC_WRITER_BUFFER_BYTES)
+            push_current();
+    }
+
+    check_error();
+}
+
+
+// moves len bytes forward without writing anything: the range stays a hole
+void AsyncWriter::skip(uint64_t len) {
+    push_current();
+
+    current.offset += len;
+    queued_bytes += len;
+    skipped_bytes += len;
+
+    if (digest_enabled)
+        digest = crc32c_zeros(digest, len);
+
+    check_error();
+}
+
+
+// writes what's left and waits until the data is on disk (if sync), throws on any write error
+void AsyncWriter::finish(bool sync) {
+    push_current();
+
+    {
+        unique_lock<mutex> guard(lock);
+        drained.wait(guard, [this] { return (queue.empty() && !busy) || !error.empty(); });
+    }
+    check_error();
+
+    // a trailing hole is not written, the file size is set instead
+    if (skipped_bytes > 0 && ftruncate(fd, queued_bytes) != 0)
+        throw runtime_error(string("Could not resize file: ") + strerror(errno));
+
+    if (sync && fdatasync(fd) != 0)
+        throw runtime_error(string("Could not sync file: ") + strerror(errno));
+}
+
+
+// bytes accepted so far, holes included (not necessarily on disk yet)
+uint64_t AsyncWriter::bytes_written() {
+    return queued_bytes;
+}
+
+uint64_t AsyncWriter::bytes_skipped() {
+    return skipped_bytes;
+}
+
+
+// call before writing anything
+void AsyncWriter::enable_digest() {
+    digest_enabled = true;
+}
+
+
+// CRC32C of what was written (and skipped) so far
+uint32_t AsyncWriter::get_digest() {
+    return digest;
+}
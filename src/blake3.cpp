@@ -0,0 +1,296 @@
+#include "../include/blake3.hpp"
+#include "../include/thread_pool.hpp"
+
+#include <cstring>
+#include <future>
+#include <memory>
+#include <thread>
+#include <endian.h>
+
+#define BLAKE3_CHUNK_START 1
+#define BLAKE3_CHUNK_END 2
+#define BLAKE3_PARENT 4
+#define BLAKE3_ROOT 8
+
+using namespace std;
+
+
+static const uint32_t IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+// message words used by each round (the permutation applied round after round)
+static const uint8_t SCHEDULE[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+
+static inline uint32_t rotr32(uint32_t x, int r) {
+    return (x >> r) | (x << (32 - r));
+}
+
+static inline void g(uint32_t *s, int a, int b, int c, int d, uint32_t mx, uint32_t my) {
+    s[a] = s[a] + s[b] + mx;
+    s[d] = rotr32(s[d] ^ s[a], 16);
+    s[c] = s[c] + s[d];
+    s[b] = rotr32(s[b] ^ s[c], 12);
+    s[a] = s[a] + s[b] + my;
+    s[d] = rotr32(s[d] ^ s[a], 8);
+    s[c] = s[c] + s[d];
+    s[b] = rotr32(s[b] ^ s[c], 7);
+}
+
+// the first 8 words of the output are the chaining value
+static void compress(const uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_BYTES], uint8_t block_len,
+                     uint64_t counter, uint8_t flags, uint32_t out[16]) {
+    uint32_t m[16];
+    for (int i = 0; i < 16; i++) {
+        uint32_t word;
+        memcpy(&word, block + 4 * i, sizeof(word));
+        m[i] = le32toh(word);
+    }
+
+    uint32_t s[16] = {
+        cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+        IV[0], IV[1], IV[2], IV[3], (uint32_t)counter, (uint32_t)(counter >> 32), block_len, flags
+    };
+
+    for (int r = 0; r < 7; r++) {
+        const uint8_t *w = SCHEDULE[r];
+        g(s, 0, 4, 8, 12, m[w[0]], m[w[1]]);
+        g(s, 1, 5, 9, 13, m[w[2]], m[w[3]]);
+        g(s, 2, 6, 10, 14, m[w[4]], m[w[5]]);
+        g(s, 3, 7, 11, 15, m[w[6]], m[w[7]]);
+        g(s, 0, 5, 10, 15, m[w[8]], m[w[9]]);
+        g(s, 1, 6, 11, 12, m[w[10]], m[w[11]]);
+        g(s, 2, 7, 8, 13, m[w[12]], m[w[13]]);
+        g(s, 3, 4, 9, 14, m[w[14]], m[w[15]]);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        out[i] = s[i] ^ s[i + 8];
+        out[i + 8] = s[i + 8] ^ cv[i];
+    }
+}
+
+static array<uint32_t, 8> parent_cv(const array<uint32_t, 8> &left, const array<uint32_t, 8> &right, uint8_t flags) {
+    uint8_t block[BLAKE3_BLOCK_BYTES];
+    for (int i = 0; i < 8; i++) {
+        uint32_t l = htole32(left[i]);
+        uint32_t r = htole32(right[i]);
+        memcpy(block + 4 * i, &l, sizeof(l));
+        memcpy(block + 32 + 4 * i, &r, sizeof(r));
+    }
+
+    uint32_t out[16];
+    compress(IV, block, BLAKE3_BLOCK_BYTES, 0, BLAKE3_PARENT | flags, out);
+
+    array<uint32_t, 8> cv;
+    memcpy(cv.data(), out, sizeof(uint32_t) * 8);
+    return cv;
+}
+
+
+Blake3::Blake3() {
+    reset_chunk(0);
+}
+
+
+/*
+Hasher of a subtree (see finalize_subtree()) starting at chunk first_chunk, which must be
+a multiple of a power of two at least as large as the number of chunks of the subtree.
+*/
+Blake3::Blake3(uint64_t first_chunk) {
+    reset_chunk(first_chunk);
+}
+
+
+void Blake3::reset_chunk(uint64_t counter) {
+    memcpy(chunk_cv, IV, sizeof(chunk_cv));
+    chunk_counter = counter;
+    memset(block, 0, sizeof(block));
+    block_len = 0;
+    blocks_compressed = 0;
+}
+
+
+// merges the completed subtrees as long as their sizes allow it (one per trailing zero bit of total_chunks)
+void Blake3::add_chunk_cv(array<uint32_t, 8> cv, uint64_t total_chunks) {
+    while ((total_chunks & 1) == 0) {
+        cv = parent_cv(cv_stack.back(), cv, 0);
+        cv_stack.pop_back();
+        total_chunks >>= 1;
+    }
+    cv_stack.push_back(cv);
+}
+
+
+void Blake3::update(const void *data, size_t len) {
+    const uint8_t *ptr = (const uint8_t *)data;
+
+    while (len > 0) {
+        // the chunk is complete and more input follows: it is not the root, finish it
+        if (blocks_compressed * BLAKE3_BLOCK_BYTES + block_len == BLAKE3_CHUNK_BYTES) {
+            uint32_t out[16];
+            compress(chunk_cv, block, block_len, chunk_counter, BLAKE3_CHUNK_END | (blocks_compressed == 0 ? BLAKE3_CHUNK_START : 0), out);
+
+            array<uint32_t, 8> cv;
+            memcpy(cv.data(), out, sizeof(uint32_t) * 8);
+            add_chunk_cv(cv, chunk_counter + 1);
+            reset_chunk(chunk_counter + 1);
+        }
+
+        // a full block is only compressed once we know it is not the last one
+        if (block_len == BLAKE3_BLOCK_BYTES) {
+            uint32_t out[16];
+            compress(chunk_cv, block, BLAKE3_BLOCK_BYTES, chunk_counter, blocks_compressed == 0 ? BLAKE3_CHUNK_START : 0, out);
+            memcpy(chunk_cv, out, sizeof(chunk_cv));
+            blocks_compressed++;
+            memset(block, 0, sizeof(block));
+            block_len = 0;
+        }
+
+        size_t n = min(len, (size_t)(BLAKE3_BLOCK_BYTES - block_len));
+        memcpy(block + block_len, ptr, n);
+        block_len += n;
+        ptr += n;
+        len -= n;
+    }
+}
+
+
+void Blake3::finalize(uint8_t out[BLAKE3_OUT_BYTES]) {
+    uint8_t flags = BLAKE3_CHUNK_END | (blocks_compressed == 0 ? BLAKE3_CHUNK_START : 0);
+
+    // a single chunk is the root, otherwise the stack is folded from the right and the last parent is
+    uint32_t words[16];
+    compress(chunk_cv, block, block_len, chunk_counter, flags | (cv_stack.empty() ? BLAKE3_ROOT : 0), words);
+
+    array<uint32_t, 8> cv;
+    memcpy(cv.data(), words, sizeof(uint32_t) * 8);
+
+    for (size_t i = cv_stack.size(); i-- > 0;)
+        cv = parent_cv(cv_stack[i], cv, i == 0 ? BLAKE3_ROOT : 0);
+
+    for (int i = 0; i < 8; i++) {
+        uint32_t word = htole32(cv[i]);
+        memcpy(out + 4 * i, &word, sizeof(word));
+    }
+}
+
+
+// chaining value of the data hashed so far as a subtree, not as the root of the tree
+array<uint32_t, 8> Blake3::finalize_subtree() {
+    uint32_t words[16];
+    compress(chunk_cv, block, block_len, chunk_counter, BLAKE3_CHUNK_END | (blocks_compressed == 0 ? BLAKE3_CHUNK_START : 0), words);
+
+    array<uint32_t, 8> cv;
+    memcpy(cv.data(), words, sizeof(uint32_t) * 8);
+
+    for (size_t i = cv_stack.size(); i-- > 0;)
+        cv = parent_cv(cv_stack[i], cv, 0);
+
+    return cv;
+}
+
+
+// the left subtree holds the largest power of two of chunks that leaves some for the right one
+static size_t left_subtree_bytes(size_t len) {
+    uint64_t chunks = (len - 1) / BLAKE3_CHUNK_BYTES;
+    uint64_t left = 1;
+    while (left * 2 <= chunks)
+        left *= 2;
+    return left * BLAKE3_CHUNK_BYTES;
+}
+
+// shared by every parallel hash, so concurrent ones don't add threads
+static ThreadPool &get_hash_pool() {
+    static ThreadPool pool(max(1u, thread::hardware_concurrency()));
+    return pool;
+}
+
+// queues the subtrees of a subtree (split as long as the depth allows it) to the pool, left to right
+static void queue_subtrees(const uint8_t *data, size_t len, uint64_t first_chunk, unsigned int depth, vector<future<array<uint32_t, 8>>> &leaves) {
+    if (depth == 0 || len < BLAKE3_PARALLEL_MIN_BYTES) {
+        auto task = make_shared<packaged_task<array<uint32_t, 8>()>>([data, len, first_chunk]() {
+            Blake3 hasher(first_chunk);
+            hasher.update(data, len);
+            return hasher.finalize_subtree();
+        });
+        leaves.push_back(task->get_future());
+        get_hash_pool().enqueue([task]() { (*task)(); });
+        return;
+    }
+
+    size_t left_len = left_subtree_bytes(len);
+    queue_subtrees(data, left_len, first_chunk, depth - 1, leaves);
+    queue_subtrees(data + left_len, len - left_len, first_chunk + left_len / BLAKE3_CHUNK_BYTES, depth - 1, leaves);
+}
+
+// the chaining value of a subtree split like queue_subtrees() did, from its hashed subtrees (next is the first one)
+static array<uint32_t, 8> join_subtrees(size_t len, unsigned int depth, vector<future<array<uint32_t, 8>>> &leaves, size_t &next, uint8_t flags) {
+    if (depth == 0 || len < BLAKE3_PARALLEL_MIN_BYTES)
+        return leaves[next++].get();
+
+    size_t left_len = left_subtree_bytes(len);
+    array<uint32_t, 8> left = join_subtrees(left_len, depth - 1, leaves, next, 0);
+    array<uint32_t, 8> right = join_subtrees(len - left_len, depth - 1, leaves, next, 0);
+
+    return parent_cv(left, right, flags);
+}
+
+
+/*
+Same result as blake3(), large inputs are split in up to threads subtrees hashed by a shared pool
+(one thread per core).
+*/
+string blake3_parallel(const void *data, size_t len, unsigned int threads) {
+    if (len < BLAKE3_PARALLEL_MIN_BYTES || threads <= 1)
+        return blake3(data, len);
+
+    unsigned int depth = 0;
+    while ((1u << depth) < threads)
+        depth++;
+
+    vector<future<array<uint32_t, 8>>> leaves;
+    queue_subtrees((const uint8_t *)data, len, 0, depth, leaves);
+
+    size_t next = 0;
+    array<uint32_t, 8> root = join_subtrees(len, depth, leaves, next, BLAKE3_ROOT);
+
+    uint8_t out[BLAKE3_OUT_BYTES];
+    for (int i = 0; i < 8; i++) {
+        uint32_t word = htole32(root[i]);
+        memcpy(out + 4 * i, &word, sizeof(word));
+    }
+    return string((const char *)out, sizeof(out));
+}
+
+
+string blake3(const void *data, size_t len) {
+    Blake3 hasher;
+    hasher.update(data, len);
+
+    uint8_t out[BLAKE3_OUT_BYTES];
+    hasher.finalize(out);
+    return string((const char *)out, sizeof(out));
+}
+
+
+string to_hex(const string &bytes) {
+    static const char digits[] = "0123456789abcdef";
+
+    string hex;
+    hex.reserve(bytes.size() * 2);
+    for (unsigned char c : bytes) {
+        hex.push_back(digits[c >> 4]);
+        hex.push_back(digits[c & 15]);
+    }
+    return hex;
+}
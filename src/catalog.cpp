@@ -0,0 +1,894 @@
+#include "../include/catalog.hpp"
+#include "../include/file_utils.hpp"
+#include "../include/logger.hpp"
+#include "../include/LPTF_Net/LPTF_Packet.hpp"
+#include "../include/LPTF_Net/LPTF_Utils.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+#define CATALOG_MAGIC "LPFCAT01"
+#define CATALOG_LOG_MAGIC "LPFLOG01"
+#define CATALOG_HEADER_SIZE 24      // magic, id, entry count
+#define CATALOG_LOG_HEADER_SIZE 16  // magic, id of the .cat it applies to
+
+// log record types
+#define CATALOG_LOG_PUT 1
+#define CATALOG_LOG_REMOVE_TREE 2
+#define CATALOG_LOG_RENAME_TREE 3
+
+
+fs::path get_catalog_file(const string &username) {
+    return get_server_meta_folder("catalog") / (username + ".cat");
+}
+
+fs::path get_catalog_log(const string &username) {
+    return get_server_meta_folder("catalog") / (username + ".log");
+}
+
+
+int compare_catalog_paths(const char *a, size_t alen, const char *b, size_t blen) {
+    size_t len = min(alen, blen);
+
+    for (size_t i = 0; i < len; i++) {
+        unsigned char ca = a[i] == '/' ? 0 : (unsigned char)a[i];
+        unsigned char cb = b[i] == '/' ? 0 : (unsigned char)b[i];
+        if (ca != cb) return ca < cb ? -1 : 1;
+    }
+
+    return alen == blen ? 0 : (alen < blen ? -1 : 1);
+}
+
+bool CATALOG_PATH_LESS::operator()(const string &a, const string &b) const {
+    return compare_catalog_paths(a.c_str(), a.size(), b.c_str(), b.size()) < 0;
+}
+
+
+// true if header is magic followed by id
+bool check_catalog_header(const char *header, const char *magic, uint64_t id) {
+    uint64_t header_id;
+    memcpy(&header_id, header + 8, sizeof(header_id));
+    return memcmp(header, magic, 8) == 0 && header_id == id;
+}
+
+
+bool is_in_subtree(const string &path, const string &subtree) {
+    return subtree.empty() || path == subtree
+           || (path.size() > subtree.size() && path[subtree.size()] == '/' && path.compare(0, subtree.size(), subtree) == 0);
+}
+
+
+/*
+Catalog record (in the .cat and in the log):
+    binary listing entry (see append_list_entry(), name is the relative path), varint hash length, hash
+*/
+void append_catalog_record(string &out, const LIST_ENTRY_STRUCT &entry, const string &hash) {
+    append_list_entry(out, entry);
+    append_varint(out, hash.size());
+    out.append(hash);
+}
+
+bool read_catalog_record(const char *&ptr, const char *end, LIST_ENTRY_STRUCT &entry, string &hash) {
+    const char *cur = ptr;
+    uint64_t len;
+
+    if (!read_list_entry(cur, end, entry) || !read_varint(cur, end, len) || (uint64_t)(end - cur) < len)
+        return false;
+
+    hash = string(cur, len);
+    ptr = cur + len;
+    return true;
+}
+
+void append_catalog_path(string &out, const string &path) {
+    append_varint(out, path.size());
+    out.append(path);
+}
+
+bool read_catalog_path(const char *&ptr, const char *end, string &path) {
+    uint64_t len;
+    if (!read_varint(ptr, end, len) || (uint64_t)(end - ptr) < len)
+        return false;
+
+    path = string(ptr, len);
+    ptr += len;
+    return true;
+}
+
+
+// id of a new .cat, different from the current one
+uint64_t new_catalog_id(uint64_t current) {
+    uint64_t id = chrono::system_clock::now().time_since_epoch().count();
+    return id == current ? id + 1 : id;
+}
+
+
+Catalog::Catalog() {
+    stop = false;
+}
+
+Catalog::~Catalog() {
+    {
+        lock_guard<mutex> guard(builder_lock);
+        stop = true;
+    }
+    builder_cv.notify_all();
+
+    if (builder.joinable())
+        builder.join();
+
+    for (auto &user : users) {
+        unmap_base(*user.second);
+        if (user.second->log_fd != -1)
+            close(user.second->log_fd);
+    }
+}
+
+
+/*
+Returns the catalog of a user, loaded the first time (or queued for a rebuild if it has no .cat).
+If it could not be loaded, its files are dropped so the next attempt rebuilds it from disk.
+*/
+shared_ptr<Catalog::USER_CATALOG> Catalog::get_user(const string &username) {
+    shared_ptr<USER_CATALOG> catalog;
+    {
+        lock_guard<mutex> guard(users_lock);
+
+        auto it = users.find(username);
+        if (it != users.end()) {
+            catalog = it->second;
+        } else {
+            catalog = make_shared<USER_CATALOG>();
+            catalog->loaded = false;
+            catalog->complete = false;
+            catalog->building = false;
+            catalog->base = nullptr;
+            catalog->base_size = 0;
+            catalog->base_count = 0;
+            catalog->base_id = 0;
+            catalog->log_fd = -1;
+            catalog->log_records = 0;
+            users[username] = catalog;
+        }
+    }
+
+    {
+        shared_lock<shared_mutex> lock(catalog->lock);
+        if (catalog->loaded) return catalog;
+    }
+
+    unique_lock<shared_mutex> lock(catalog->lock);
+
+    if (!catalog->loaded) {
+        try {
+            load(username, *catalog);
+        } catch (const exception &ex) {
+            cerr << "Could not load catalog of " << username << ": " << ex.what() << endl;
+
+            unmap_base(*catalog);
+            catalog->overlay.clear();
+            catalog->loaded = false;
+
+            error_code ec;
+            fs::remove(get_catalog_file(username), ec);
+        }
+    }
+
+    return catalog;
+}
+
+
+// user lock must be held
+void Catalog::load(const string &username, USER_CATALOG &catalog) {
+    catalog.overlay.clear();
+    catalog.log_records = 0;
+
+    // starts empty, the changes are logged while the builder thread walks the user tree
+    if (!map_base(username, catalog)) {
+        catalog.base_id = new_catalog_id(catalog.base_id);
+        open_log(username, catalog);
+        catalog.loaded = true;
+        catalog.complete = false;
+        request_build(username, catalog, true);
+        return;
+    }
+
+    fs::path log = get_catalog_log(username);
+    ifstream file(log, ios::binary);
+    string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    file.close();
+
+    if (data.size() >= CATALOG_LOG_HEADER_SIZE && check_catalog_header(data.c_str(), CATALOG_LOG_MAGIC, catalog.base_id)) {
+
+        const char *ptr = data.c_str() + CATALOG_LOG_HEADER_SIZE;
+        const char *end = data.c_str() + data.size();
+
+        while (ptr < end && apply_log_record(catalog, ptr, end))
+            catalog.log_records++;
+
+        // drop a record torn by a crash
+        if (ptr < end && truncate(log.c_str(), ptr - data.c_str()) != 0)
+            throw runtime_error("Could not truncate catalog log !");
+    }
+
+    // a log written for another .cat (crash during a compaction) is reset here
+    open_log(username, catalog);
+    catalog.loaded = true;
+    catalog.complete = true;
+
+    if (catalog.log_records >= CATALOG_COMPACT_RECORDS)
+        request_build(username, catalog, false);
+}
+
+
+// queues a rebuild (or a compaction) of the catalog for the builder thread, user lock must be held
+void Catalog::request_build(const string &username, USER_CATALOG &catalog, bool from_disk) {
+    if (catalog.building)
+        return;
+    catalog.building = true;
+
+    {
+        lock_guard<mutex> guard(builder_lock);
+        build_queue.push_back({username, from_disk});
+    }
+    builder_cv.notify_one();
+}
+
+
+/*
+Makes a new .cat aside, from the user tree or from the current catalog (compaction), then swaps it in.
+The user lock is only held to read the current catalog (shared) and for the swap, where the records
+logged since the start are carried over to the new log.
+*/
+void Catalog::build(const string &username, bool from_disk) {
+    shared_ptr<USER_CATALOG> catalog = get_user(username);
+    auto start = chrono::steady_clock::now();
+
+    try {
+        uint64_t id;
+        off_t log_offset;
+        vector<CATALOG_RECORD> records;
+        {
+            shared_lock<shared_mutex> lock(catalog->lock);
+
+            struct stat st;
+            if (!catalog->loaded || fstat(catalog->log_fd, &st) != 0)
+                throw runtime_error("Catalog not available !");
+
+            id = new_catalog_id(catalog->base_id);
+            log_offset = st.st_size;
+
+            if (!from_disk) {
+                scan(*catalog, "", true, "", [&](const CATALOG_RECORD &record) {
+                    records.push_back(record);
+                    return true;
+                });
+            }
+        }
+
+        if (from_disk) {
+            fs::path user_root = get_user_root(username);
+
+            walk_tree(user_root, "", [&](const string &relpath, bool) {
+                CATALOG_RECORD record = {false, {relpath, 0, 0, 0, 0}, ""};
+                if (stat_list_entry(AT_FDCWD, (user_root / relpath).c_str(), record.entry) == 0)
+                    records.push_back(record);
+                return !stop;
+            });
+            if (stop)
+                throw runtime_error("server stopping");
+
+            // already in tree order, unless the tree changed during the walk
+            stable_sort(records.begin(), records.end(), [](const CATALOG_RECORD &a, const CATALOG_RECORD &b) {
+                return CATALOG_PATH_LESS()(a.entry.name, b.entry.name);
+            });
+
+            // the hashes of the unchanged files are kept (both sides are in tree order)
+            shared_lock<shared_mutex> lock(catalog->lock);
+            size_t i = 0;
+            scan(*catalog, "", true, "", [&](const CATALOG_RECORD &record) {
+                while (i < records.size() && CATALOG_PATH_LESS()(records[i].entry.name, record.entry.name))
+                    i++;
+                if (i < records.size() && records[i].entry.name == record.entry.name && records[i].entry.type == record.entry.type
+                    && records[i].entry.size == record.entry.size && records[i].entry.mtime == record.entry.mtime)
+                    records[i].hash = record.hash;
+                return true;
+            });
+        }
+
+        fs::path file = write_base(username, id, records);
+
+        unique_lock<shared_mutex> lock(catalog->lock);
+
+        // the changes logged since the start
+        struct stat st;
+        string tail;
+        if (fstat(catalog->log_fd, &st) == 0 && st.st_size > log_offset) {
+            tail.resize(st.st_size - log_offset);
+            if (pread(catalog->log_fd, &tail[0], tail.size(), log_offset) != (ssize_t)tail.size())
+                throw runtime_error("Could not read catalog log !");
+        }
+
+        swap_base(username, *catalog, file);
+
+        const char *ptr = tail.c_str();
+        const char *end = ptr + tail.size();
+        while (ptr < end && apply_log_record(*catalog, ptr, end))
+            catalog->log_records++;
+
+        size_t carried = ptr - tail.c_str();
+        if (write(catalog->log_fd, tail.c_str(), carried) != (ssize_t)carried) {
+            // the .cat lacks these changes, next load rebuilds it
+            error_code ec;
+            fs::remove(get_catalog_file(username), ec);
+            throw runtime_error("Could not write catalog log !");
+        }
+
+        catalog->complete = true;
+        catalog->building = false;
+
+        ostringstream msg;
+        msg << "Catalog of " << username << (from_disk ? " rebuilt: " : " compacted: ") << records.size() << " path(s) in "
+            << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count() << "ms";
+        log_info(msg, nullptr);
+    } catch (const exception &ex) {
+        cerr << "Could not " << (from_disk ? "rebuild" : "compact") << " catalog of " << username << ": " << ex.what() << endl;
+
+        unique_lock<shared_mutex> lock(catalog->lock);
+        catalog->building = false;
+    }
+}
+
+
+// builds the queued catalogs, and rebuilds all of them every CATALOG_RECONCILE_INTERVAL_S
+void Catalog::build_loop() {
+    auto reconcile_at = chrono::steady_clock::now() + chrono::seconds(CATALOG_RECONCILE_INTERVAL_S);
+
+    while (true) {
+        CATALOG_BUILD next = {"", false};
+        {
+            unique_lock<mutex> lock(builder_lock);
+            builder_cv.wait_until(lock, reconcile_at, [this] { return stop || !build_queue.empty(); });
+            if (stop) return;
+
+            if (!build_queue.empty()) {
+                next = build_queue.front();
+                build_queue.pop_front();
+            }
+        }
+
+        if (!next.username.empty()) {
+            build(next.username, next.from_disk);
+            continue;
+        }
+
+        reconcile_at = chrono::steady_clock::now() + chrono::seconds(CATALOG_RECONCILE_INTERVAL_S);
+
+        vector<pair<string, shared_ptr<USER_CATALOG>>> loaded;
+        {
+            lock_guard<mutex> guard(users_lock);
+            for (auto &user : users)
+                loaded.push_back(user);
+        }
+
+        for (auto &user : loaded) {
+            unique_lock<shared_mutex> lock(user.second->lock);
+            if (user.second->loaded)
+                request_build(user.first, *user.second, true);
+        }
+    }
+}
+
+
+void Catalog::start_builder() {
+    if (!builder.joinable())
+        builder = thread(&Catalog::build_loop, this);
+}
+
+
+/*
+Writes records (in tree order) as a new .cat of the user, with the given id, aside from the current one.
+Returns the path of the file, to be swapped in with swap_base().
+*/
+fs::path Catalog::write_base(const string &username, uint64_t id, const vector<CATALOG_RECORD> &records) {
+    uint64_t count = records.size();
+
+    string data;
+    data.append(CATALOG_MAGIC, 8);
+    data.append((const char *)&id, sizeof(id));
+    data.append((const char *)&count, sizeof(count));
+    data.resize(CATALOG_HEADER_SIZE + count * sizeof(uint64_t));
+
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t offset = data.size();
+        memcpy(&data[CATALOG_HEADER_SIZE + i * sizeof(uint64_t)], &offset, sizeof(offset));
+        append_catalog_record(data, records[i].entry, records[i].hash);
+    }
+
+    fs::path tmp = get_catalog_file(username);
+    tmp += ".tmp";
+
+    ofstream out(tmp, ios::binary | ios::trunc);
+    out.write(data.c_str(), data.size());
+    out.close();
+    if (!out)
+        throw runtime_error("Could not write catalog !");
+
+    return tmp;
+}
+
+
+/*
+Renames file (see write_base()) over the .cat of the user, maps it and resets the log and the overlay.
+The rename is atomic, so a crash leaves either the old or the new .cat.
+User lock must be held.
+*/
+void Catalog::swap_base(const string &username, USER_CATALOG &catalog, const fs::path &file) {
+    fs::rename(file, get_catalog_file(username));
+
+    unmap_base(catalog);
+    catalog.overlay.clear();
+
+    if (!map_base(username, catalog)) {
+        catalog.loaded = false;
+        throw runtime_error("Could not map catalog !");
+    }
+
+    open_log(username, catalog);
+}
+
+
+// maps the .cat of the user, false if it's missing or corrupt
+bool Catalog::map_base(const string &username, USER_CATALOG &catalog) {
+    int fd = open(get_catalog_file(username).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < CATALOG_HEADER_SIZE) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    void *addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (addr == MAP_FAILED)
+        return false;
+
+    const char *base = (const char *)addr;
+    uint64_t id, count;
+    memcpy(&id, base + 8, sizeof(id));
+    memcpy(&count, base + 16, sizeof(count));
+
+    bool valid = memcmp(base, CATALOG_MAGIC, 8) == 0 && count <= (size - CATALOG_HEADER_SIZE) / sizeof(uint64_t);
+
+    for (uint64_t i = 0; valid && i < count; i++) {
+        uint64_t offset;
+        memcpy(&offset, base + CATALOG_HEADER_SIZE + i * sizeof(uint64_t), sizeof(offset));
+        valid = offset >= CATALOG_HEADER_SIZE + count * sizeof(uint64_t) && offset < size;
+    }
+
+    if (!valid) {
+        munmap(addr, size);
+        return false;
+    }
+
+    // lookups are binary searches all over the file
+    madvise(addr, size, MADV_WILLNEED);
+
+    catalog.base = base;
+    catalog.base_size = size;
+    catalog.base_count = count;
+    catalog.base_id = id;
+    return true;
+}
+
+
+void Catalog::unmap_base(USER_CATALOG &catalog) {
+    if (catalog.base)
+        munmap((void *)catalog.base, catalog.base_size);
+
+    catalog.base = nullptr;
+    catalog.base_size = 0;
+    catalog.base_count = 0;
+}
+
+
+// opens the log for appending, it's reset if it doesn't belong to the current .cat
+void Catalog::open_log(const string &username, USER_CATALOG &catalog) {
+    if (catalog.log_fd != -1)
+        close(catalog.log_fd);
+
+    catalog.log_fd = open(get_catalog_log(username).c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (catalog.log_fd == -1)
+        throw runtime_error("Could not open catalog log !");
+
+    char header[CATALOG_LOG_HEADER_SIZE];
+    if (pread(catalog.log_fd, header, sizeof(header), 0) == (ssize_t)sizeof(header)
+        && check_catalog_header(header, CATALOG_LOG_MAGIC, catalog.base_id))
+        return;
+
+    memcpy(header, CATALOG_LOG_MAGIC, 8);
+    memcpy(header + 8, &catalog.base_id, sizeof(catalog.base_id));
+
+    if (ftruncate(catalog.log_fd, 0) != 0 || write(catalog.log_fd, header, sizeof(header)) != (ssize_t)sizeof(header))
+        throw runtime_error("Could not reset catalog log !");
+
+    catalog.log_records = 0;
+}
+
+
+bool Catalog::read_base_record(const USER_CATALOG &catalog, uint64_t index, CATALOG_RECORD &record) const {
+    uint64_t offset;
+    memcpy(&offset, catalog.base + CATALOG_HEADER_SIZE + index * sizeof(uint64_t), sizeof(offset));
+
+    const char *ptr = catalog.base + offset;
+    record.removed = false;
+    return read_catalog_record(ptr, catalog.base + catalog.base_size, record.entry, record.hash);
+}
+
+
+// index of the first .cat entry not before path (in tree order)
+uint64_t Catalog::base_lower_bound(const USER_CATALOG &catalog, const string &path) const {
+    const char *end = catalog.base + catalog.base_size;
+    uint64_t low = 0, high = catalog.base_count;
+
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+
+        uint64_t offset, len;
+        memcpy(&offset, catalog.base + CATALOG_HEADER_SIZE + mid * sizeof(uint64_t), sizeof(offset));
+
+        // names are compared in place, without decoding the record
+        const char *name = catalog.base + offset;
+        if (!read_varint(name, end, len) || (uint64_t)(end - name) < len)
+            len = 0;
+
+        if (compare_catalog_paths(name, len, path.c_str(), path.size()) < 0) low = mid + 1;
+        else high = mid;
+    }
+
+    return low;
+}
+
+
+bool Catalog::find(const USER_CATALOG &catalog, const string &path, CATALOG_RECORD &record) const {
+    auto it = catalog.overlay.find(path);
+    if (it != catalog.overlay.end()) {
+        record = it->second;
+        return !record.removed;
+    }
+
+    uint64_t index = base_lower_bound(catalog, path);
+    return index < catalog.base_count && read_base_record(catalog, index, record) && record.entry.name == path;
+}
+
+
+/*
+Visits the entries of the .cat merged with the overlay, in tree order, from start
+(excluded unless inclusive) to the end of subtree (empty for the whole catalog).
+Returns false if visit stopped the scan.
+*/
+bool Catalog::scan(const USER_CATALOG &catalog, const string &start, bool inclusive, const string &subtree,
+                   const function<bool(const CATALOG_RECORD &)> &visit) const {
+    uint64_t index = base_lower_bound(catalog, start);
+    CATALOG_RECORD base_record;
+    bool has_base = index < catalog.base_count && read_base_record(catalog, index, base_record);
+
+    if (has_base && !inclusive && base_record.entry.name == start)
+        has_base = ++index < catalog.base_count && read_base_record(catalog, index, base_record);
+
+    auto it = inclusive ? catalog.overlay.lower_bound(start) : catalog.overlay.upper_bound(start);
+
+    while (has_base || it != catalog.overlay.end()) {
+        int order = !has_base ? 1 : (it == catalog.overlay.end() ? -1
+                    : compare_catalog_paths(base_record.entry.name.c_str(), base_record.entry.name.size(), it->first.c_str(), it->first.size()));
+
+        // the overlay replaces the .cat entry with the same path
+        const CATALOG_RECORD &record = order < 0 ? base_record : it->second;
+
+        if (!is_in_subtree(record.entry.name, subtree))
+            break;
+
+        if (!record.removed && !visit(record))
+            return false;
+
+        if (order >= 0) it++;
+        if (order <= 0)
+            has_base = ++index < catalog.base_count && read_base_record(catalog, index, base_record);
+    }
+
+    return true;
+}
+
+
+// applies a log record to the overlay, false if it's incomplete, user lock must be held
+bool Catalog::apply_log_record(USER_CATALOG &catalog, const char *&ptr, const char *end) {
+    const char *cur = ptr;
+    if (cur >= end)
+        return false;
+
+    uint8_t type = (uint8_t)*cur++;
+
+    switch (type) {
+        case CATALOG_LOG_PUT:
+        {
+            CATALOG_RECORD record;
+            record.removed = false;
+            if (!read_catalog_record(cur, end, record.entry, record.hash))
+                return false;
+
+            catalog.overlay[record.entry.name] = record;
+            break;
+        }
+        case CATALOG_LOG_REMOVE_TREE:
+        {
+            string path;
+            if (!read_catalog_path(cur, end, path))
+                return false;
+
+            erase_tree(catalog, path);
+            break;
+        }
+        case CATALOG_LOG_RENAME_TREE:
+        {
+            string path, newpath;
+            if (!read_catalog_path(cur, end, path) || !read_catalog_path(cur, end, newpath))
+                return false;
+
+            vector<CATALOG_RECORD> moved;
+            scan(catalog, path, true, path, [&](const CATALOG_RECORD &record) {
+                moved.push_back(record);
+                moved.back().entry.name = newpath + record.entry.name.substr(path.size());
+                return true;
+            });
+
+            // a rebuild that already saw the rename (replaying the log written meanwhile) has nothing to move
+            if (moved.empty())
+                break;
+
+            erase_tree(catalog, path);
+            erase_tree(catalog, newpath);
+            for (const CATALOG_RECORD &record : moved)
+                catalog.overlay[record.entry.name] = record;
+            break;
+        }
+        default:
+            return false;
+    }
+
+    ptr = cur;
+    return true;
+}
+
+
+// user lock must be held
+void Catalog::erase_tree(USER_CATALOG &catalog, const string &path) {
+    vector<string> paths;
+    scan(catalog, path, true, path, [&](const CATALOG_RECORD &record) {
+        paths.push_back(record.entry.name);
+        return true;
+    });
+
+    // tombstones hide the .cat entries until the next compaction
+    for (const string &removed : paths)
+        catalog.overlay[removed] = {true, {removed, 0, 0, 0, 0}, ""};
+}
+
+
+/*
+Applies a change to the catalog, then appends it to the log (write-through).
+If the log can't be written the .cat is dropped, so the catalog gets rebuilt on the next load.
+User lock must be held.
+*/
+void Catalog::update(const string &username, USER_CATALOG &catalog, const string &record) {
+    const char *ptr = record.c_str();
+    apply_log_record(catalog, ptr, ptr + record.size());
+
+    if (catalog.log_fd == -1 || write(catalog.log_fd, record.c_str(), record.size()) != (ssize_t)record.size()) {
+        ostringstream msg;
+        msg << "Could not write catalog log of " << username << ", it will be rebuilt";
+        log_error(msg, nullptr);
+
+        error_code ec;
+        fs::remove(get_catalog_file(username), ec);
+        return;
+    }
+
+    if (++catalog.log_records >= CATALOG_COMPACT_RECORDS)
+        request_build(username, catalog, false);
+}
+
+
+// throws if the catalog of the user could not be loaded
+bool Catalog::lookup(const string &username, const string &path, LIST_ENTRY_STRUCT &entry) {
+    shared_ptr<USER_CATALOG> catalog = get_user(username);
+    shared_lock<shared_mutex> lock(catalog->lock);
+
+    if (!catalog->loaded || !catalog->complete)
+        throw runtime_error("Catalog not available !");
+
+    CATALOG_RECORD record;
+    if (!find(*catalog, path, record))
+        return false;
+
+    entry = record.entry;
+    return true;
+}
+
+
+// false if the path is unknown or has no hash yet
+bool Catalog::get_hash(const string &username, const string &path, string &hash) {
+    shared_ptr<USER_CATALOG> catalog = get_user(username);
+    shared_lock<shared_mutex> lock(catalog->lock);
+
+    if (!catalog->loaded || !catalog->complete)
+        throw runtime_error("Catalog not available !");
+
+    CATALOG_RECORD record;
+    if (!find(*catalog, path, record) || record.hash.empty())
+        return false;
+
+    hash = record.hash;
+    return true;
+}
+
+
+/*
+Same as walk_tree() on the user root, served from the catalog.
+The catalog is locked during the walk, visit should not block.
+*/
+bool Catalog::walk(const string &username, const string &cursor, const TREE_VISITOR &visit) {
+    shared_ptr<USER_CATALOG> catalog = get_user(username);
+    shared_lock<shared_mutex> lock(catalog->lock);
+
+    if (!catalog->loaded || !catalog->complete)
+        throw runtime_error("Catalog not available !");
+
+    return scan(*catalog, cursor, cursor.empty(), "", [&](const CATALOG_RECORD &record) {
+        return visit(record.entry.name, record.entry.type == LIST_ENTRY_DIR);
+    });
+}
+
+
+/*
+Counts the files of the directory at path (relative to the user root, empty for the root) and its subtree,
+and their total size. False if the catalog doesn't know path as a directory.
+*/
+bool Catalog::get_tree_totals(const string &username, const string &path, uint64_t &files, uint64_t &bytes) {
+    shared_ptr<USER_CATALOG> catalog = get_user(username);
+    shared_lock<shared_mutex> lock(catalog->lock);
+
+    if (!catalog->loaded || !catalog->complete)
+        throw runtime_error("Catalog not available !");
+
+    CATALOG_RECORD record;
+    if (!path.empty() && (!find(*catalog, path, record) || record.entry.type != LIST_ENTRY_DIR))
+        return false;
+
+    files = 0;
+    bytes = 0;
+    scan(*catalog, path, true, path, [&](const CATALOG_RECORD &record) {
+        if (record.entry.type == LIST_ENTRY_FILE) {
+            files++;
+            bytes += record.entry.size;
+        }
+        return true;
+    });
+    return true;
+}
+
+
+/*
+Updates the entry of path (relative to the user root) from disk, or removes it
+(and its subtree) if it doesn't exist anymore.
+The hash is kept as long as the size and mtime don't change.
+*/
+void Catalog::refresh(const string &username, const string &path) {
+    if (path.empty())
+        return;
+
+    shared_ptr<USER_CATALOG> catalog = get_user(username);
+    unique_lock<shared_mutex> lock(catalog->lock);
+
+    if (!catalog->loaded)
+        return;
+
+    LIST_ENTRY_STRUCT entry = {path, 0, 0, 0, 0};
+    int err = stat_list_entry(AT_FDCWD, (get_user_root(username) / path).c_str(), entry);
+
+    string record;
+
+    if (err == 0) {
+        CATALOG_RECORD old;
+        string hash;
+
+        if (find(*catalog, path, old) && old.entry.type == entry.type && old.entry.size == entry.size && old.entry.mtime == entry.mtime) {
+            if (old.entry.mode == entry.mode)
+                return;     // unchanged
+            hash = old.hash;
+        }
+
+        record.push_back(CATALOG_LOG_PUT);
+        append_catalog_record(record, entry, hash);
+    } else if (err == ENOENT || err == ENOTDIR) {
+        CATALOG_RECORD old;
+        if (!find(*catalog, path, old))
+            return;
+
+        record.push_back(CATALOG_LOG_REMOVE_TREE);
+        append_catalog_path(record, path);
+    } else {
+        return;
+    }
+
+    update(username, *catalog, record);
+}
+
+
+void Catalog::set_hash(const string &username, const string &path, const string &hash) {
+    shared_ptr<USER_CATALOG> catalog = get_user(username);
+    unique_lock<shared_mutex> lock(catalog->lock);
+
+    CATALOG_RECORD record;
+    if (!catalog->loaded || !find(*catalog, path, record) || record.hash == hash)
+        return;
+
+    string log_record;
+    log_record.push_back(CATALOG_LOG_PUT);
+    append_catalog_record(log_record, record.entry, hash);
+
+    update(username, *catalog, log_record);
+}
+
+
+// path can be empty for the whole user root
+void Catalog::remove_tree(const string &username, const string &path) {
+    shared_ptr<USER_CATALOG> catalog = get_user(username);
+    unique_lock<shared_mutex> lock(catalog->lock);
+
+    if (!catalog->loaded)
+        return;
+
+    string record;
+    record.push_back(CATALOG_LOG_REMOVE_TREE);
+    append_catalog_path(record, path);
+
+    update(username, *catalog, record);
+}
+
+
+void Catalog::rename_tree(const string &username, const string &path, const string &newpath) {
+    shared_ptr<USER_CATALOG> catalog = get_user(username);
+    unique_lock<shared_mutex> lock(catalog->lock);
+
+    if (!catalog->loaded)
+        return;
+
+    string record;
+    record.push_back(CATALOG_LOG_RENAME_TREE);
+    append_catalog_path(record, path);
+    append_catalog_path(record, newpath);
+
+    update(username, *catalog, record);
+}
+
+
+Catalog &get_catalog() {
+    static Catalog catalog;
+    return catalog;
+}
@@ -0,0 +1,169 @@
+#include "../include/cdc.hpp"
+#include "../include/blake3.hpp"
+#include "../include/LPTF_Net/LPTF_Utils.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// a cut point needs more zero bits before the average size than after it (normalized chunking)
+#define CDC_MASK_SMALL (~0ULL << (64 - 18))
+#define CDC_MASK_LARGE (~0ULL << (64 - 14))
+
+#define CDC_HASH_CONTEXT "lpf chunk"
+
+using namespace std;
+
+
+// random values for each byte, the same on every build (splitmix64 with a fixed seed)
+static const uint64_t *get_gear_table() {
+    static uint64_t table[256];
+    static bool init = [] {
+        uint64_t state = 0x6C70665F63646321ULL;
+        for (uint64_t &value : table) {
+            uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            value = z ^ (z >> 31);
+        }
+        return true;
+    }();
+    (void)init;
+    return table;
+}
+
+
+// length of the chunk starting at data (len bytes left in the file)
+size_t cdc_chunk_length(const uint8_t *data, size_t len) {
+    if (len <= CDC_MIN_CHUNK_BYTES)
+        return len;
+
+    const uint64_t *gear = get_gear_table();
+    size_t normal = min(len, (size_t)CDC_AVG_CHUNK_BYTES);
+    size_t end = min(len, (size_t)CDC_MAX_CHUNK_BYTES);
+
+    // the hash only depends on the last 64 bytes, the first ones of the chunk can be skipped
+    uint64_t hash = 0;
+    size_t i = CDC_MIN_CHUNK_BYTES;
+
+    for (; i < normal; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if ((hash & CDC_MASK_SMALL) == 0)
+            return i + 1;
+    }
+
+    for (; i < end; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if ((hash & CDC_MASK_LARGE) == 0)
+            return i + 1;
+    }
+
+    return end;
+}
+
+
+// chunk hashes are not plain BLAKE3 hashes, so they can't be learnt from the hash of a whole file
+static string chunk_hash(const uint8_t *data, size_t len) {
+    Blake3 hasher;
+    hasher.update(CDC_HASH_CONTEXT, sizeof(CDC_HASH_CONTEXT) - 1);
+    hasher.update(data, len);
+
+    uint8_t out[BLAKE3_OUT_BYTES];
+    hasher.finalize(out);
+    return string((const char *)out, sizeof(out));
+}
+
+
+// cuts and hashes the first filesize bytes of fd, throws if the file could not be mapped
+vector<CONTENT_CHUNK> compute_chunks(int fd, uint64_t filesize) {
+    vector<CONTENT_CHUNK> chunks;
+    if (filesize == 0)
+        return chunks;
+
+    void *map = mmap(nullptr, filesize, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        throw runtime_error("Could not map file !");
+    madvise(map, filesize, MADV_SEQUENTIAL);
+
+    // unmapped however we leave
+    unique_ptr<void, function<void(void *)>> unmap(map, [filesize](void *addr) { munmap(addr, filesize); });
+
+    const uint8_t *data = (const uint8_t *)map;
+    chunks.reserve(filesize / CDC_AVG_CHUNK_BYTES + 1);
+
+    for (uint64_t pos = 0; pos < filesize;) {
+        size_t len = cdc_chunk_length(data + pos, filesize - pos);
+        chunks.push_back({chunk_hash(data + pos, len), (uint32_t)len});
+        pos += len;
+    }
+
+    return chunks;
+}
+
+
+/*
+Chunk list:
+    varint chunk count, then per chunk: hash (BLAKE3_OUT_BYTES), varint length
+*/
+string serialize_chunk_list(const vector<CONTENT_CHUNK> &chunks) {
+    string out;
+    out.reserve(chunks.size() * (BLAKE3_OUT_BYTES + 3) + 8);
+
+    append_varint(out, chunks.size());
+    for (const CONTENT_CHUNK &chunk : chunks) {
+        out.append(chunk.hash);
+        append_varint(out, chunk.length);
+    }
+
+    return out;
+}
+
+
+bool parse_chunk_list(const string &data, vector<CONTENT_CHUNK> &chunks) {
+    const char *ptr = data.data();
+    const char *end = ptr + data.size();
+    uint64_t count;
+
+    if (!read_varint(ptr, end, count) || count > data.size() / BLAKE3_OUT_BYTES)
+        return false;
+
+    chunks.clear();
+    chunks.reserve(count);
+
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t length;
+        if (end - ptr < BLAKE3_OUT_BYTES)
+            return false;
+
+        string hash(ptr, BLAKE3_OUT_BYTES);
+        ptr += BLAKE3_OUT_BYTES;
+
+        if (!read_varint(ptr, end, length) || length == 0 || length > CDC_MAX_CHUNK_BYTES)
+            return false;
+
+        chunks.push_back({hash, (uint32_t)length});
+    }
+
+    return ptr == end;
+}
+
+
+void send_chunk_list(LPTF_PartWriter &stream, const vector<CONTENT_CHUNK> &chunks) {
+    stream.write(serialize_chunk_list(chunks));
+    stream.close();
+}
+
+
+// reads the whole stream, returns false if the list is invalid or too big
+bool receive_chunk_list(LPTF_PartReader &stream, vector<CONTENT_CHUNK> &chunks) {
+    string data;
+    while (stream.read(data)) {
+        if (data.size() > CDC_MAX_LIST_BYTES)
+            return false;
+    }
+    return parse_chunk_list(data, chunks);
+}
@@ -0,0 +1,209 @@
+#include "../include/chunk_cache.hpp"
+
+#include <functional>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+#define CHUNK_CACHE_SKETCH_ROWS 4
+#define CHUNK_CACHE_SKETCH_SAMPLE (10 * CHUNK_CACHE_SKETCH_WIDTH)  // additions between two agings
+
+
+bool operator==(const FILE_VERSION &a, const FILE_VERSION &b) {
+    return a.dev == b.dev && a.ino == b.ino && a.size == b.size && a.mtime_ns == b.mtime_ns;
+}
+
+
+// the version of a file, stat'ed through the fd its chunks are read from (a path may point to another file by then)
+FILE_VERSION get_file_version(const struct stat &st) {
+    return {st.st_dev, st.st_ino, (uint64_t)st.st_size, st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec};
+}
+
+
+string chunk_cache_key(const fs::path &filepath) {
+    return filepath.lexically_normal().string();
+}
+
+
+uint64_t mix_hash(uint64_t x) {
+    // splitmix64 finalizer
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+
+ChunkCache::ChunkCache(): ChunkCache(CHUNK_CACHE_DEFAULT_MAX_BYTES) {}
+
+ChunkCache::ChunkCache(size_t max_bytes) {
+    shard_max_bytes = max_bytes / CHUNK_CACHE_SHARDS;
+
+    for (SHARD &shard : shards) {
+        shard.used_bytes = 0;
+        shard.sketch.assign(CHUNK_CACHE_SKETCH_ROWS * CHUNK_CACHE_SKETCH_WIDTH, 0);
+        shard.sketch_additions = 0;
+    }
+}
+
+
+// all the chunks of a file are in the same shard
+ChunkCache::SHARD &ChunkCache::get_shard(const string &file) {
+    return shards[hash<string>()(file) % CHUNK_CACHE_SHARDS];
+}
+
+
+// shard lock must be held
+void ChunkCache::record_access(SHARD &shard, const string &file, uint64_t index) {
+    uint64_t h = hash<string>()(file) ^ mix_hash(index);
+
+    for (int row = 0; row < CHUNK_CACHE_SKETCH_ROWS; row++) {
+        uint8_t &counter = shard.sketch[row * CHUNK_CACHE_SKETCH_WIDTH + mix_hash(h + row) % CHUNK_CACHE_SKETCH_WIDTH];
+        if (counter < UINT8_MAX) counter++;
+    }
+
+    // halve every counter once in a while, so old popularity fades
+    if (++shard.sketch_additions >= CHUNK_CACHE_SKETCH_SAMPLE) {
+        for (uint8_t &counter : shard.sketch)
+            counter >>= 1;
+        shard.sketch_additions = 0;
+    }
+}
+
+
+// shard lock must be held
+unsigned int ChunkCache::estimate_frequency(SHARD &shard, const string &file, uint64_t index) {
+    uint64_t h = hash<string>()(file) ^ mix_hash(index);
+    unsigned int frequency = UINT8_MAX;
+
+    for (int row = 0; row < CHUNK_CACHE_SKETCH_ROWS; row++)
+        frequency = min(frequency, (unsigned int)shard.sketch[row * CHUNK_CACHE_SKETCH_WIDTH + mix_hash(h + row) % CHUNK_CACHE_SKETCH_WIDTH]);
+
+    return frequency;
+}
+
+
+// shard lock must be held
+void ChunkCache::evict(SHARD &shard, list<CHUNK_ENTRY>::iterator it) {
+    auto file = shard.files.find(it->file);
+    if (file != shard.files.end()) {
+        file->second.chunks.erase(it->index);
+        if (file->second.chunks.empty())
+            shard.files.erase(file);
+    }
+
+    shard.used_bytes -= it->data->size() + it->file.size();
+    shard.lru.erase(it);
+}
+
+
+// shard lock must be held
+void ChunkCache::drop_file(SHARD &shard, unordered_map<string, CACHED_FILE>::iterator it) {
+    for (auto &chunk : it->second.chunks) {
+        shard.used_bytes -= chunk.second->data->size() + chunk.second->file.size();
+        shard.lru.erase(chunk.second);
+    }
+
+    shard.files.erase(it);
+}
+
+
+/*
+Returns the chunk index of file (see chunk_cache_key()) if cached for this version of the file,
+otherwise nullptr.
+*/
+shared_ptr<const string> ChunkCache::get(const string &file, const FILE_VERSION &version, uint64_t index) {
+    SHARD &shard = get_shard(file);
+    lock_guard<mutex> guard(shard.lock);
+
+    record_access(shard, file, index);
+
+    auto it = shard.files.find(file);
+    if (it == shard.files.end())
+        return nullptr;
+
+    // the file changed since its chunks were cached
+    if (!(it->second.version == version)) {
+        drop_file(shard, it);
+        return nullptr;
+    }
+
+    auto chunk = it->second.chunks.find(index);
+    if (chunk == it->second.chunks.end())
+        return nullptr;
+
+    shard.lru.splice(shard.lru.begin(), shard.lru, chunk->second);
+    return chunk->second->data;
+}
+
+
+// caches a chunk just read from disk, if it's worth it (see the admission policy above)
+void ChunkCache::put(const string &file, const FILE_VERSION &version, uint64_t index, shared_ptr<const string> data) {
+    size_t size = data->size() + file.size();
+
+    if (data->empty() || size > shard_max_bytes)
+        return;
+
+    SHARD &shard = get_shard(file);
+    lock_guard<mutex> guard(shard.lock);
+
+    auto it = shard.files.find(file);
+    if (it != shard.files.end()) {
+        if (!(it->second.version == version)) drop_file(shard, it);
+        else if (it->second.chunks.count(index) != 0) return;
+    }
+
+    unsigned int frequency = estimate_frequency(shard, file, index);
+
+    while (shard.used_bytes + size > shard_max_bytes) {
+        auto victim = prev(shard.lru.end());
+        if (frequency <= estimate_frequency(shard, victim->file, victim->index))
+            return;
+        evict(shard, victim);
+    }
+
+    shard.lru.push_front({file, index, data});
+
+    CACHED_FILE &cached = shard.files[file];
+    cached.version = version;
+    cached.chunks[index] = shard.lru.begin();
+
+    shard.used_bytes += size;
+}
+
+
+void ChunkCache::invalidate(const fs::path &filepath) {
+    string file = chunk_cache_key(filepath);
+
+    SHARD &shard = get_shard(file);
+    lock_guard<mutex> guard(shard.lock);
+
+    auto it = shard.files.find(file);
+    if (it != shard.files.end())
+        drop_file(shard, it);
+}
+
+
+// drops the cached files in folderpath (at any depth)
+void ChunkCache::invalidate_tree(const fs::path &folderpath) {
+    string folder = chunk_cache_key(folderpath);
+    while (folder.size() > 1 && folder.back() == fs::path::preferred_separator)
+        folder.pop_back();
+    string prefix = folder + (char)fs::path::preferred_separator;
+
+    for (SHARD &shard : shards) {
+        lock_guard<mutex> guard(shard.lock);
+
+        for (auto it = shard.files.begin(); it != shard.files.end();) {
+            auto next = std::next(it);
+            if (it->first == folder || it->first.compare(0, prefix.size(), prefix) == 0)
+                drop_file(shard, it);
+            it = next;
+        }
+    }
+}
+
+
+ChunkCache &get_chunk_cache() {
+    static ChunkCache cache;
+    return cache;
+}
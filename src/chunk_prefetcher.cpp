@@ -0,0 +1,167 @@
+#include "../include/chunk_prefetcher.hpp"
+
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+
+/*
+filepath only names the file in the chunk cache, its chunks are read from fd.
+fd must stay open until the last call to next(), the prefetch thread reads from its own duplicate.
+*/
+ChunkPrefetcher::ChunkPrefetcher(const fs::path &filepath, int fd, const FILE_VERSION &version, const vector<FILE_EXTENT> &extents)
+    : fd{ fd }, version{ version }, extents{ extents } {
+    key = chunk_cache_key(filepath);
+    chunk_count = (version.size + CHUNK_CACHE_CHUNK_BYTES - 1) / CHUNK_CACHE_CHUNK_BYTES;
+    next_index = next_data_chunk(0);
+    stop = false;
+    cached_chunks = 0;
+    read_chunks = 0;
+}
+
+ChunkPrefetcher::~ChunkPrefetcher() {
+    {
+        lock_guard<mutex> guard(lock);
+        stop = true;
+    }
+    not_full.notify_all();
+
+    if (prefetcher.joinable())
+        prefetcher.join();
+}
+
+
+// first chunk from index that overlaps a data extent, chunk_count if none
+uint64_t ChunkPrefetcher::next_data_chunk(uint64_t index) const {
+    uint64_t start = index * CHUNK_CACHE_CHUNK_BYTES;
+
+    // first extent ending after the start of the chunk
+    auto it = upper_bound(extents.begin(), extents.end(), start,
+                          [](uint64_t pos, const FILE_EXTENT &extent) { return pos < extent.offset + extent.length; });
+
+    if (it == extents.end())
+        return chunk_count;
+
+    return min(chunk_count, max(index, it->offset / CHUNK_CACHE_CHUNK_BYTES));
+}
+
+
+bool ChunkPrefetcher::has_next() {
+    return next_index < chunk_count;
+}
+
+
+/*
+Returns the next chunk of the file and its index, throws if it could not be read.
+Must not be called more than once per chunk.
+*/
+shared_ptr<const string> ChunkPrefetcher::next(uint64_t &index) {
+    if (next_index >= chunk_count)
+        throw runtime_error("No more chunks to read !");
+
+    index = next_index;
+
+    if (!prefetcher.joinable()) {
+        shared_ptr<const string> chunk = get_chunk_cache().get(key, version, next_index);
+        if (chunk) {
+            next_index = next_data_chunk(next_index + 1);
+            lock_guard<mutex> guard(lock);
+            cached_chunks++;
+            return chunk;
+        }
+
+        int prefetch_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (prefetch_fd == -1)
+            throw runtime_error("Could not read file !");
+
+        prefetcher = thread(&ChunkPrefetcher::prefetch, this, next_index, prefetch_fd);
+    }
+
+    unique_lock<mutex> guard(lock);
+    not_empty.wait(guard, [this] { return !ready.empty() || !error.empty(); });
+
+    if (ready.empty())
+        throw runtime_error(error);
+
+    shared_ptr<const string> chunk = ready.front();
+    ready.pop_front();
+    next_index = next_data_chunk(next_index + 1);
+
+    guard.unlock();
+    not_full.notify_one();
+
+    return chunk;
+}
+
+
+// prefetch thread, reads the data chunks from first_index to the end of the file through read_fd (closed when done)
+void ChunkPrefetcher::prefetch(uint64_t first_index, int read_fd) {
+    bool reading = false;
+
+    for (uint64_t index = first_index; index < chunk_count; index = next_data_chunk(index + 1)) {
+        {
+            unique_lock<mutex> guard(lock);
+            not_full.wait(guard, [this] { return ready.size() < CHUNK_PREFETCH_DEPTH || stop; });
+            if (stop) break;
+        }
+
+        bool cached = true;
+        shared_ptr<const string> chunk = get_chunk_cache().get(key, version, index);
+
+        if (!chunk) {
+            cached = false;
+
+            if (!reading) {
+                reading = true;
+                posix_fadvise(read_fd, index * CHUNK_CACHE_CHUNK_BYTES, 0, POSIX_FADV_SEQUENTIAL);
+            }
+
+            uint64_t chunk_start = index * CHUNK_CACHE_CHUNK_BYTES;
+            string data(min((uint64_t)CHUNK_CACHE_CHUNK_BYTES, version.size - chunk_start), '\0');
+
+            size_t done = 0;
+            while (done < data.size()) {
+                ssize_t len = pread(read_fd, &data[done], data.size() - done, chunk_start + done);
+                if (len <= 0) break;
+                done += len;
+            }
+
+            if (done < data.size()) {
+                lock_guard<mutex> guard(lock);
+                error = "Could not read file !";
+                break;
+            }
+
+            chunk = make_shared<const string>(move(data));
+            get_chunk_cache().put(key, version, index, chunk);
+        }
+
+        {
+            lock_guard<mutex> guard(lock);
+            ready.push_back(chunk);
+            if (cached) cached_chunks++;
+            else read_chunks++;
+        }
+        not_empty.notify_one();
+    }
+
+    close(read_fd);
+
+    // wake up next() if it waits for a chunk that will never come
+    not_empty.notify_one();
+}
+
+
+unsigned long ChunkPrefetcher::get_cached_chunks() {
+    lock_guard<mutex> guard(lock);
+    return cached_chunks;
+}
+
+unsigned long ChunkPrefetcher::get_read_chunks() {
+    lock_guard<mutex> guard(lock);
+    return read_chunks;
+}
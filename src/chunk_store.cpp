@@ -0,0 +1,326 @@
+#include "../include/chunk_store.hpp"
+#include "../include/blake3.hpp"
+#include "../include/file_utils.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+
+ChunkStore::ChunkStore() {
+    enabled = false;
+}
+
+
+/*
+Loads the index of the stored files, removing the ones no user links to anymore
+(and what interrupted uploads left). Throws if the folder could not be created.
+*/
+void ChunkStore::enable(const fs::path &store_folder) {
+    lock_guard<mutex> guard(lock);
+
+    folder = store_folder;
+    if (!fs::is_directory(folder) && !fs::create_directories(folder))
+        throw runtime_error("create_directories() failed!");
+
+    objects.clear();
+    owners.clear();
+    object_ids.clear();
+    object_inodes.clear();
+    chunks.clear();
+    user_chunks.clear();
+
+    size_t removed = 0;
+
+    for (const fs::directory_entry &entry : fs::directory_iterator(folder)) {
+        string name = entry.path().filename().string();
+        fs::path manifest = entry.path();
+        manifest += CHUNK_STORE_MANIFEST_EXT;
+        fs::path owners_file = entry.path();
+        owners_file += CHUNK_STORE_OWNERS_EXT;
+
+        // temporary files, manifests are handled with their file
+        if (name[0] == '.') {
+            unlink(entry.path().c_str());
+            continue;
+        }
+        if (entry.path().extension() == CHUNK_STORE_MANIFEST_EXT || entry.path().extension() == CHUNK_STORE_OWNERS_EXT) {
+            fs::path object = entry.path();
+            object.replace_extension();
+            if (!fs::exists(object))
+                unlink(entry.path().c_str());
+            continue;
+        }
+
+        struct stat st;
+        if (stat(entry.path().c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+
+        if (st.st_nlink <= 1) {
+            unlink(entry.path().c_str());
+            unlink(manifest.c_str());
+            unlink(owners_file.c_str());
+            removed++;
+            continue;
+        }
+
+        try {
+            ifstream in(manifest, ios::binary);
+            ostringstream content;
+            content << in.rdbuf();
+
+            vector<CONTENT_CHUNK> list;
+            if (!in || !parse_chunk_list(content.str(), list)) {
+                // the manifest is rebuilt from the file
+                int fd = open(entry.path().c_str(), O_RDONLY | O_CLOEXEC);
+                if (fd == -1)
+                    throw runtime_error("Could not open stored file !");
+                try {
+                    list = compute_chunks(fd, st.st_size);
+                } catch (...) {
+                    close(fd);
+                    throw;
+                }
+                close(fd);
+                write_manifest(manifest, list);
+            }
+
+            uint32_t object = index_object(name, st.st_ino, list);
+
+            // files stored before owners were recorded get them when stored again
+            ifstream owners_in(owners_file);
+            string username;
+            while (getline(owners_in, username)) {
+                if (username.empty() || !owners[object].insert(username).second)
+                    continue;
+                for (const CONTENT_CHUNK &chunk : list)
+                    user_chunks[username].insert(chunk.hash);
+            }
+        } catch (const exception &ex) {
+            cerr << "Could not index stored file " << name << ": " << ex.what() << endl;
+        }
+    }
+
+    cout << "Chunk store: " << objects.size() << " file(s), " << chunks.size() << " chunk(s), "
+         << removed << " unused file(s) removed" << endl;
+
+    enabled = true;
+}
+
+
+bool ChunkStore::is_enabled() {
+    lock_guard<mutex> guard(lock);
+    return enabled;
+}
+
+
+void ChunkStore::write_manifest(const fs::path &manifest, const vector<CONTENT_CHUNK> &list) {
+    fs::path tmp = get_temp_path(manifest);
+    string data = serialize_chunk_list(list);
+
+    ofstream out(tmp, ios::binary | ios::trunc);
+    out.write(data.c_str(), data.size());
+    out.close();
+    if (!out) {
+        unlink(tmp.c_str());
+        throw runtime_error("Could not write manifest !");
+    }
+
+    fs::rename(tmp, manifest);
+}
+
+
+// returns the index of the object, lock must be held, chunks already indexed keep their location
+uint32_t ChunkStore::index_object(const string &name, ino_t inode, const vector<CONTENT_CHUNK> &list) {
+    uint32_t object = objects.size();
+    objects.push_back(name);
+    owners.emplace_back();
+    object_ids[name] = object;
+    object_inodes[inode] = object;
+
+    uint64_t offset = 0;
+    for (const CONTENT_CHUNK &chunk : list) {
+        chunks.insert({chunk.hash, {object, offset, chunk.length}});
+        offset += chunk.length;
+    }
+
+    return object;
+}
+
+
+/*
+Records that a user stored an object (so it has its content): its chunks are now known to the user.
+Lock must be held, throws if the owner could not be recorded.
+*/
+void ChunkStore::add_owner(uint32_t object, const string &username, const vector<CONTENT_CHUNK> &list) {
+    if (owners[object].count(username) != 0)
+        return;
+
+    fs::path owners_file = folder / objects[object];
+    owners_file += CHUNK_STORE_OWNERS_EXT;
+
+    ofstream out(owners_file, ios::app);
+    out << username << endl;
+    out.close();
+    if (!out)
+        throw runtime_error("Could not record stored file owner !");
+
+    owners[object].insert(username);
+    for (const CONTENT_CHUNK &chunk : list)
+        user_chunks[username].insert(chunk.hash);
+}
+
+
+// which chunks of list the user has stored (the others, even stored by someone else, are reported missing)
+vector<bool> ChunkStore::find_chunks(const string &username, const vector<CONTENT_CHUNK> &list) {
+    lock_guard<mutex> guard(lock);
+
+    vector<bool> found(list.size(), false);
+
+    auto known = user_chunks.find(username);
+    if (known == user_chunks.end())
+        return found;
+
+    for (size_t i = 0; i < list.size(); i++) {
+        auto it = chunks.find(list[i].hash);
+        found[i] = it != chunks.end() && it->second.length == list[i].length && known->second.count(list[i].hash) != 0;
+    }
+    return found;
+}
+
+
+/*
+Writes the chunks ref refers to (indexes in list, the client's chunk list) from the stored files.
+Returns the number of bytes written, throws if a chunk is unknown (or not stored by the user) or could not be read.
+*/
+uint64_t ChunkStore::copy_chunks(const string &username, const vector<CONTENT_CHUNK> &list, const BLOCK_REF_STRUCT &ref, AsyncWriter &writer) {
+    if (ref.count == 0 || ref.first >= list.size() || ref.count > list.size() - ref.first)
+        throw runtime_error("Invalid block reference !");
+
+    vector<char> buffer(CDC_MAX_CHUNK_BYTES);
+    uint64_t total = 0;
+
+    for (uint64_t i = ref.first; i < ref.first + ref.count; i++) {
+        fs::path object;
+        CHUNK_LOCATION location;
+        {
+            lock_guard<mutex> guard(lock);
+            auto it = chunks.find(list[i].hash);
+            auto known = user_chunks.find(username);
+            if (it == chunks.end() || it->second.length != list[i].length
+                || known == user_chunks.end() || known->second.count(list[i].hash) == 0)
+                throw runtime_error("Unknown chunk !");
+            location = it->second;
+            object = folder / objects[location.object];
+        }
+
+        int fd = open(object.c_str(), O_RDONLY | O_CLOEXEC);
+        ssize_t len = fd == -1 ? -1 : pread(fd, buffer.data(), location.length, location.offset);
+        if (fd != -1) close(fd);
+
+        if (len != (ssize_t)location.length)
+            throw runtime_error("Could not read stored chunk !");
+
+        writer.write(buffer.data(), len);
+        total += len;
+    }
+
+    return total;
+}
+
+
+/*
+Reads the chunk list of a stored file (fd, a link to it) from its manifest, so it's not cut again.
+False if fd is not a stored file.
+*/
+bool ChunkStore::get_chunk_list(int fd, vector<CONTENT_CHUNK> &list) {
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return false;
+
+    fs::path manifest;
+    {
+        lock_guard<mutex> guard(lock);
+        auto it = object_inodes.find(st.st_ino);
+        if (it == object_inodes.end())
+            return false;
+        manifest = folder / objects[it->second];
+        manifest += CHUNK_STORE_MANIFEST_EXT;
+    }
+
+    ifstream in(manifest, ios::binary);
+    ostringstream content;
+    content << in.rdbuf();
+
+    return in && parse_chunk_list(content.str(), list);
+}
+
+
+/*
+Stores a file received from a user (fd, cut in list), which is not published yet.
+Returns -1 if the file is now stored (it can be published as is), or an open fd of the
+identical stored file to publish instead. Either way the user is recorded as having it. Throws on error.
+*/
+int ChunkStore::store_file(const string &username, int fd, const vector<CONTENT_CHUNK> &list) {
+    string serialized = serialize_chunk_list(list);
+    string name = to_hex(blake3(serialized.data(), serialized.size()));
+    fs::path object = folder / name;
+    fs::path manifest = object;
+    manifest += CHUNK_STORE_MANIFEST_EXT;
+
+    // the content was checked against list, the user has it
+    auto add_stored_owner = [&]() {
+        lock_guard<mutex> guard(lock);
+        auto it = object_ids.find(name);
+        if (it != object_ids.end())
+            add_owner(it->second, username, list);
+    };
+
+    int stored_fd = open(object.c_str(), O_RDONLY | O_CLOEXEC);
+    if (stored_fd != -1) {
+        try {
+            add_stored_owner();
+        } catch (...) {
+            close(stored_fd);
+            throw;
+        }
+        return stored_fd;
+    }
+
+    // the manifest goes first, a stored file always has one
+    write_manifest(manifest, list);
+
+    if (link_open_file(fd, object) != 0) {
+        // stored by a concurrent upload in the meantime
+        if (errno == EEXIST && (stored_fd = open(object.c_str(), O_RDONLY | O_CLOEXEC)) != -1) {
+            try {
+                add_stored_owner();
+            } catch (...) {
+                close(stored_fd);
+                throw;
+            }
+            return stored_fd;
+        }
+        throw runtime_error("Could not link file into the store !");
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        throw runtime_error("Could not stat stored file !");
+
+    lock_guard<mutex> guard(lock);
+    add_owner(index_object(name, st.st_ino, list), username, list);
+    return -1;
+}
+
+
+ChunkStore &get_chunk_store() {
+    static ChunkStore store;
+    return store;
+}
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <stdexcept>
 #include <cstring>
+#include <limits>
 #include <unistd.h>
 
 #include "../include/LPTF_Net/LPTF_Socket.hpp"
@@ -20,12 +21,52 @@ void print_help() {
     cout << endl << "Available Commands:" << endl;
     cout << "\t-upload <file> <path>" << endl;
     cout << "\t-download <file>" << endl;
+    cout << "\t-range <file> <localfile> <offset>[:<length>] [ranges...]   (offset -n for the last n bytes, to the end without length)" << endl;
+    cout << "\t-downloaddir <folder> [localdir]   (the whole folder, extracted in localdir or here)" << endl;
+    cout << "\t-uploaddir <localdir> [folder]   (the whole directory, extracted in folder or at the root)" << endl;
     cout << "\t-delete <file>" << endl;
     cout << "\t-list <path>" << endl;
+    cout << "\t-ll <path>" << endl;
     cout << "\t-create <folder>" << endl;
     cout << "\t-rm <folder>" << endl;
     cout << "\t-rename <name> <folder>" << endl;
-    cout << "\t-tree" << endl;
+    cout << "\t-copy <path> <newpath>   (file or folder, copied on the server)" << endl;
+    cout << "\t-move <path> <newpath>" << endl;
+    cout << "\t-tree [cursor]" << endl;
+    cout << "\t-stat <path> [paths...]   (- to read the paths from stdin)" << endl;
+    cout << "\t-quota" << endl;
+    cout << "\t-search <pattern>   (substring, or glob with *, ? and [...])" << endl;
+    cout << "\t-hash <file> [localfile]   (compared with the local file, if any)" << endl;
+    cout << "\t-pwrite <file> <offset> <localfile>   (writes the local file at offset)" << endl;
+    cout << "\t-append <file> -   (appends the lines read from stdin, each one at once)" << endl;
+}
+
+
+// <offset>[:<length>], a negative offset counts from the end of the file, without length up to the end
+bool parse_range(const char *arg, FILE_RANGE_STRUCT &range) {
+    range.from_end = arg[0] == '-';
+    if (range.from_end)
+        arg++;
+
+    if (!isdigit(arg[0]))
+        return false;
+
+    char *end;
+    range.offset = strtoull(arg, &end, 10);
+    range.length = 0;
+
+    if (*end == ':' && end[1] != '\0') {
+        const char *length = end + 1;
+        if (!isdigit(length[0]))
+            return false;
+        range.length = strtoull(length, &end, 10);
+        if (range.length == 0)
+            return false;
+    } else if (*end == ':') {
+        end++;
+    }
+
+    return *end == '\0';
 }
 
 
@@ -48,6 +89,17 @@ bool check_command(int argc, char const *argv[]) {
         } else {
             return true;
         }
+    } else if (strcmp(argv[2], "-range") == 0) {
+        if (argc < 6)
+            return false;
+        for (int i = 5; i < argc; i++) {
+            FILE_RANGE_STRUCT range;
+            if (!parse_range(argv[i], range)) {
+                cout << "Invalid range \"" << argv[i] << "\" !" << endl;
+                return false;
+            }
+        }
+        return true;
     } else if (strcmp(argv[2], "-delete") == 0) {
         if (argc < 4)
             return false;
@@ -66,6 +118,15 @@ bool check_command(int argc, char const *argv[]) {
         } else {
             return true;
         }
+    } else if (strcmp(argv[2], "-ll") == 0) {
+        if (argc < 3)
+            return false;
+        if (argc > 4) {
+            cout << "Too much arguments !" << endl;
+            return false;
+        } else {
+            return true;
+        }
     } else if (strcmp(argv[2], "-create") == 0) {
         if (argc < 4)
             return false;
@@ -93,11 +154,75 @@ bool check_command(int argc, char const *argv[]) {
         } else {
             return true;
         }
+    } else if (strcmp(argv[2], "-downloaddir") == 0 || strcmp(argv[2], "-uploaddir") == 0) {
+        if (argc < 4)
+            return false;
+        if (argc > 5) {
+            cout << "Too much arguments !" << endl;
+            return false;
+        } else {
+            return true;
+        }
+    } else if (strcmp(argv[2], "-copy") == 0 || strcmp(argv[2], "-move") == 0) {
+        if (argc <= 4)
+            return false;
+        if (argc > 5) {
+            cout << "Too much arguments !" << endl;
+            return false;
+        } else {
+            return true;
+        }
     } else if (strcmp(argv[2], "-tree") == 0) {
+        if (argc > 4) {
+            cout << "Too much arguments !" << endl;
+            return false;
+        } else return argc >= 3;
+    } else if (strcmp(argv[2], "-stat") == 0) {
+        return argc >= 4;
+    } else if (strcmp(argv[2], "-quota") == 0) {
         if (argc > 3) {
             cout << "Too much arguments !" << endl;
             return false;
         } else return argc == 3;
+    } else if (strcmp(argv[2], "-search") == 0) {
+        if (argc < 4)
+            return false;
+        if (argc > 4) {
+            cout << "Too much arguments !" << endl;
+            return false;
+        } else {
+            return true;
+        }
+    } else if (strcmp(argv[2], "-hash") == 0) {
+        if (argc < 4)
+            return false;
+        if (argc > 5) {
+            cout << "Too much arguments !" << endl;
+            return false;
+        } else {
+            return true;
+        }
+    } else if (strcmp(argv[2], "-pwrite") == 0) {
+        if (argc < 6)
+            return false;
+        if (argc > 6) {
+            cout << "Too much arguments !" << endl;
+            return false;
+        } else if (!isdigit(argv[4][0])) {
+            cout << "Invalid offset \"" << argv[4] << "\" !" << endl;
+            return false;
+        } else {
+            return true;
+        }
+    } else if (strcmp(argv[2], "-append") == 0) {
+        if (argc < 5 || strcmp(argv[4], "-") != 0)
+            return false;
+        if (argc > 5) {
+            cout << "Too much arguments !" << endl;
+            return false;
+        } else {
+            return true;
+        }
     } else {
         cout << "Unknown command !" << endl;
     }
@@ -245,6 +370,20 @@ int main(int argc, char const *argv[]) {
 
             return !download_file(&clientSocket, file);
 
+        } else if (strcmp(argv[2], "-range") == 0) {
+
+            string file = argv[3];
+            string localfile = argv[4];
+            vector<FILE_RANGE_STRUCT> ranges;
+
+            for (int i = 5; i < argc; i++) {
+                FILE_RANGE_STRUCT range;
+                parse_range(argv[i], range);    // checked by check_command()
+                ranges.push_back(range);
+            }
+
+            return !download_ranges(&clientSocket, file, localfile, ranges);
+
         } else if (strcmp(argv[2], "-delete") == 0) {
 
             string file = argv[3];
@@ -260,6 +399,15 @@ int main(int argc, char const *argv[]) {
 
             return !list_directory(&clientSocket, path);
 
+        } else if (strcmp(argv[2], "-ll") == 0) {
+
+            string path = "";
+
+            if (argc == 4)
+                path = argv[3];
+
+            return !list_directory_long(&clientSocket, path);
+
         } else if (strcmp(argv[2], "-create") == 0) {
 
             string folder = argv[3];
@@ -279,9 +427,90 @@ int main(int argc, char const *argv[]) {
             string path = argv[4];
 
             return !rename_directory(&clientSocket, newname, path);
+        } else if (strcmp(argv[2], "-downloaddir") == 0) {
+
+            string folder = argv[3];
+            string localdir = "";
+
+            if (argc == 5)
+                localdir = argv[4];
+
+            return !download_directory(&clientSocket, folder, localdir);
+        } else if (strcmp(argv[2], "-uploaddir") == 0) {
+
+            string localdir = argv[3];
+            string folder = "";
+
+            if (argc == 5)
+                folder = argv[4];
+
+            return !upload_directory(&clientSocket, localdir, folder);
+        } else if (strcmp(argv[2], "-copy") == 0) {
+
+            string source = argv[3];
+            string destination = argv[4];
+
+            return !copy_path(&clientSocket, source, destination);
+        } else if (strcmp(argv[2], "-move") == 0) {
+
+            string source = argv[3];
+            string destination = argv[4];
+
+            return !move_path(&clientSocket, source, destination);
         } else if (strcmp(argv[2], "-tree") == 0) {
 
-            return !list_tree(&clientSocket);
+            string cursor = "";     // start from the beginning
+
+            if (argc == 4)
+                cursor = argv[3];
+
+            return !list_tree(&clientSocket, cursor);
+        } else if (strcmp(argv[2], "-stat") == 0) {
+
+            vector<string> paths;
+
+            if (argc == 4 && strcmp(argv[3], "-") == 0) {
+                string line;
+                while (getline(cin, line))
+                    if (!line.empty()) paths.push_back(line);
+            } else {
+                for (int i = 3; i < argc; i++)
+                    paths.push_back(argv[i]);
+            }
+
+            return !stat_many(&clientSocket, paths);
+        } else if (strcmp(argv[2], "-quota") == 0) {
+
+            return !show_quota(&clientSocket);
+        } else if (strcmp(argv[2], "-search") == 0) {
+
+            string pattern = argv[3];
+
+            return !search_files(&clientSocket, pattern);
+        } else if (strcmp(argv[2], "-hash") == 0) {
+
+            string file = argv[3];
+            string localfile = "";
+
+            if (argc == 5)
+                localfile = argv[4];
+
+            return !hash_file(&clientSocket, file, localfile);
+        } else if (strcmp(argv[2], "-pwrite") == 0) {
+
+            string file = argv[3];
+            uint64_t offset = strtoull(argv[4], nullptr, 10);
+            string localfile = argv[5];
+
+            return !pwrite_file(&clientSocket, file, offset, localfile);
+        } else if (strcmp(argv[2], "-append") == 0) {
+
+            string file = argv[3];
+
+            // the lines follow the password
+            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+
+            return !append_file(&clientSocket, file, cin);
         }
 
     } catch (const exception &ex) {
@@ -1,12 +1,29 @@
 #include "../include/LPTF_Net/LPTF_Socket.hpp"
 #include "../include/LPTF_Net/LPTF_Packet.hpp"
 #include "../include/LPTF_Net/LPTF_Utils.hpp"
+#include "../include/LPTF_Net/LPTF_Stream.hpp"
 #include "../include/file_utils.hpp"
+#include "../include/async_writer.hpp"
+#include "../include/client_actions.hpp"
+#include "../include/part_codec.hpp"
+#include "../include/delta_sync.hpp"
+#include "../include/cdc.hpp"
+#include "../include/crc32c.hpp"
+#include "../include/blake3.hpp"
+#include "../include/tar_stream.hpp"
 
 #include <iostream>
 #include <fstream>
+#include <functional>
+#include <memory>
 
 #include <filesystem>
+#include <ctime>
+#include <vector>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 using namespace std;
 
@@ -35,13 +52,27 @@ bool download_file(LPTF_Socket *clientSocket, string filename) {
 
     cout << "Downloading file \"" << filename << "\"" << endl;
 
-    LPTF_Packet pckt = build_file_download_request_packet(filename);
+    fs::path localpath = fs::path(".") / fs::path(filename).filename();
+
+    // a local version of the file is updated with a delta transfer
+    uint8_t requested = CLIENT_TRANSFER_OPTS & ~TRANSFER_OPT_DELTA;
+    struct stat st;
+    int old_fd = open(localpath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (old_fd != -1 && fstat(old_fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= DELTA_MIN_BLOCK_BYTES) {
+        requested = CLIENT_TRANSFER_OPTS;
+    } else if (old_fd != -1) {
+        close(old_fd);
+        old_fd = -1;
+    }
+
+    LPTF_Packet pckt = build_file_download_request_packet(filename, requested);
     clientSocket->write(pckt);
 
     // check server reply
     LPTF_Packet reply = clientSocket->read();
 
     uint32_t filesize;
+    uint8_t options = 0;
     
     if (reply.type() == REPLY_PACKET && get_refered_packet_type_from_reply_packet(reply) == DOWNLOAD_FILE_COMMAND) {
         
@@ -49,61 +80,146 @@ bool download_file(LPTF_Socket *clientSocket, string filename) {
         memcpy(&filesize, (const char *) reply.get_content() + sizeof(uint8_t), sizeof(filesize));
         cout << "File size: " << filesize << endl;
 
+        // followed by the accepted options (older servers don't send them)
+        if (reply.get_header().length > sizeof(uint8_t) + sizeof(filesize))
+            options = ((const uint8_t *)reply.get_content())[sizeof(uint8_t) + sizeof(filesize)];
+
     } else if (reply.type() == ERROR_PACKET) {
         cout << "Error reply from server (" << get_error_content_from_error_packet(reply) << ")" << endl;
+        if (old_fd != -1) close(old_fd);
         return false;
     } else {
         cout << "Unexpected reply from server (" << reply.type() << ")" << endl;
+        if (old_fd != -1) close(old_fd);
         return false;
     }
 
     cout << "Start receiving file from server" << endl;
 
-    ofstream outfile(fs::path(filename).filename(), ios::binary);
+    // received aside, the local file (if any) is only replaced once the download is complete
+    fs::path temppath;
+    int fd = open_upload_file(localpath, temppath);
 
-    streampos curr_pos = outfile.tellp();
+    int64_t curr_pos = fd == -1 ? -1 : 0;
+    uint64_t copied_bytes = 0;
+    uint64_t corrupted_parts = 0;
 
     try {
 
+        FILE_SIGNATURE signature;
+        if (options & TRANSFER_OPT_DELTA) {
+            if (old_fd == -1)
+                throw runtime_error("Unexpected delta transfer !");
+
+            signature = compute_signature(old_fd, st.st_size);
+
+            LPTF_PartWriter stream(clientSocket, -1);
+            send_signature(stream, signature);
+        }
+
+        if (fd == -1)
+            throw runtime_error("Could not create file !");
+
+        // the disk writes happen behind the acknowledgements
+        AsyncWriter writer(fd);
+        PartDecoder decoder;
+
+        // with checksums, the file is complete once its digest (following the last part) matches
+        bool digest_pending = options & TRANSFER_OPT_CHECKSUM;
+        if (digest_pending)
+            writer.enable_digest();
+
         do {
             pckt = clientSocket->read();
 
             if (pckt.type() != BINARY_PART_PACKET) {
                 cerr << "Packet is not a Binary Part Packet ! (" << pckt.type() << ")" << endl;
+                curr_pos = -1;
                 break;
             }
 
-            BINARY_PART_PACKET_STRUCT data = get_data_from_binary_part_packet(pckt);
+            // a corrupted part is asked again
+            if ((options & TRANSFER_OPT_CHECKSUM) && !check_part_checksum(pckt)) {
+                corrupted_parts++;
+                pckt = build_part_reply_packet(PART_REPLY_RESEND);
+                clientSocket->write(pckt);
+                continue;
+            }
 
-            // cout << "File part Data Len: " << data.len << endl;
+            if (is_digest_part_packet(pckt)) {
+                if (!digest_pending || writer.bytes_written() != filesize)
+                    throw runtime_error("Unexpected digest part !");
+                if (get_digest_from_digest_part_packet(pckt) != writer.get_digest())
+                    throw runtime_error("The received file doesn't match its checksum !");
+                digest_pending = false;
+            } else if (is_hole_part_packet(pckt)) {
+                if (!(options & TRANSFER_OPT_SPARSE))
+                    throw runtime_error("Unexpected hole part !");
+
+                uint64_t length = get_length_from_hole_part_packet(pckt);
+                if (length > filesize - writer.bytes_written())
+                    throw runtime_error("Received more data than the file size !");
+
+                // the file is new: holes are only skipped
+                writer.skip(length);
+            } else if (is_block_ref_part_packet(pckt)) {
+                if (!(options & TRANSFER_OPT_DELTA))
+                    throw runtime_error("Unexpected block reference !");
+
+                BLOCK_REF_STRUCT ref = get_block_ref_from_block_ref_part_packet(pckt);
+                if (ref.count > (filesize - writer.bytes_written()) / signature.block_size)
+                    throw runtime_error("Received more data than the file size !");
+
+                copied_bytes += copy_blocks(old_fd, signature, ref, writer);
+            } else {
+                BINARY_PART_PACKET_STRUCT data = decoder.decode(pckt);
+
+                // cout << "File part Data Len: " << data.len << endl;
 
-            outfile.write((const char*)data.data, data.len);
+                writer.write(data.data, data.len);
+            }
 
-            curr_pos = outfile.tellp();
+            curr_pos = writer.bytes_written();
+            if (curr_pos > filesize)
+                throw runtime_error("Received more data than the file size !");
 
             // notify server
             // this is required to not overflow? the socket
-            char repc = 0;
-            pckt = build_reply_packet(BINARY_PART_PACKET, &repc, 1);
+            pckt = build_part_reply_packet(PART_REPLY_OK);
             clientSocket->write(pckt);
-        } while (static_cast<uint32_t>(curr_pos) < filesize);
-        
-        outfile.close();
+        } while (static_cast<uint32_t>(curr_pos) < filesize || digest_pending);
+
+        writer.finish();
+
+        // the server may have stopped sending midway
+        if (curr_pos == filesize) {
+            publish_upload_file(fd, temppath, localpath);
+
+            if (writer.bytes_skipped() > 0)
+                cout << "Holes skipped: " << writer.bytes_skipped() << " byte(s)" << endl;
+            if (options & TRANSFER_OPT_DELTA)
+                cout << "Taken from the local version: " << copied_bytes << " byte(s), received: " << filesize - copied_bytes << " byte(s)" << endl;
+            if (options & TRANSFER_OPT_COMPRESS)
+                cout << decoder.get_summary() << endl;
+            if (options & TRANSFER_OPT_CHECKSUM)
+                cout << "Checksum: OK, corrupted parts received again: " << corrupted_parts << endl;
+        }
 
     } catch (const exception &ex) {
         string msg = ex.what();
         cout << "Error when downloading file: " << msg << endl;
         pckt = build_error_packet(ERROR_PACKET, ERR_CMD_UNKNOWN, msg);
         clientSocket->write(pckt);
-        outfile.close();
+        curr_pos = -1;
     }
 
+    if (fd != -1) close(fd);
+    if (old_fd != -1) close(old_fd);
+
     if (curr_pos != filesize) {
         cout << "File download encountered an error (file size and intended file size don't match)." << endl;
-        if (fs::exists(filename)) {
-            cout << "Removing file " << filename << ".";
-            fs::remove(filename);
-        }
+        // the local file (if any) is left as it was
+        discard_upload_file(temppath);
         return false;
     } else {
         cout << "File download done. Curr. Pos: " << curr_pos << ", Filesize: " << filesize << endl;
@@ -112,6 +228,163 @@ bool download_file(LPTF_Socket *clientSocket, string filename) {
 }
 
 
+// the ranges of the remote file are written one after the other to localpath
+bool download_ranges(LPTF_Socket *clientSocket, string filename, string localpath, vector<FILE_RANGE_STRUCT> ranges) {
+
+    cout << "Downloading " << ranges.size() << " range(s) of file \"" << filename << "\"" << endl;
+
+    LPTF_Packet pckt = build_file_ranges_request_packet(filename, CLIENT_TRANSFER_OPTS & ~(TRANSFER_OPT_DELTA | TRANSFER_OPT_DEDUP), ranges);
+    clientSocket->write(pckt);
+
+    // check server reply
+    LPTF_Packet reply = clientSocket->read();
+
+    uint64_t filesize;
+    uint8_t options;
+    uint64_t total = 0;
+
+    if (reply.type() == REPLY_PACKET && get_refered_packet_type_from_reply_packet(reply) == DOWNLOAD_RANGES_COMMAND) {
+        const char *ptr = (const char *) reply.get_content() + sizeof(uint8_t);
+        const char *end = (const char *) reply.get_content() + reply.get_header().length;
+        uint64_t count = 0;
+
+        // file size, accepted options, then the ranges as the server clamped them
+        bool valid = end - ptr >= (ptrdiff_t)(sizeof(filesize) + sizeof(options));
+        if (valid) {
+            memcpy(&filesize, ptr, sizeof(filesize));
+            filesize = be64toh(filesize);
+            options = (uint8_t)ptr[sizeof(filesize)];
+            ptr += sizeof(filesize) + sizeof(options);
+            valid = read_varint(ptr, end, count) && count == ranges.size();
+        }
+
+        for (uint64_t i = 0; valid && i < count; i++) {
+            uint64_t offset, length;
+            valid = read_varint(ptr, end, offset) && read_varint(ptr, end, length);
+            if (valid)
+                cout << "Range " << offset << "-" << offset + length << ": " << length << " byte(s)" << endl;
+            total += length;
+        }
+
+        if (!valid) {
+            cout << "Invalid reply from server !" << endl;
+            return false;
+        }
+        cout << "File size: " << filesize << ", receiving " << total << " byte(s)" << endl;
+
+    } else if (reply.type() == ERROR_PACKET) {
+        cout << "Error reply from server (" << get_error_content_from_error_packet(reply) << ")" << endl;
+        return false;
+    } else {
+        cout << "Unexpected reply from server (" << reply.type() << ")" << endl;
+        return false;
+    }
+
+    // received aside, like a download
+    fs::path outpath = fs::path(localpath).has_parent_path() ? fs::path(localpath) : fs::path(".") / localpath;
+    fs::path temppath;
+    int fd = open_upload_file(outpath, temppath);
+
+    int64_t curr_pos = fd == -1 ? -1 : 0;
+    uint64_t corrupted_parts = 0;
+
+    try {
+
+        if (fd == -1)
+            throw runtime_error("Could not create file !");
+
+        AsyncWriter writer(fd);
+        PartDecoder decoder;
+
+        bool digest_pending = options & TRANSFER_OPT_CHECKSUM;
+        if (digest_pending)
+            writer.enable_digest();
+
+        // nothing is sent for empty ranges
+        while (writer.bytes_written() < total || digest_pending) {
+            pckt = clientSocket->read();
+
+            if (pckt.type() != BINARY_PART_PACKET) {
+                cerr << "Packet is not a Binary Part Packet ! (" << pckt.type() << ")" << endl;
+                curr_pos = -1;
+                break;
+            }
+
+            // a corrupted part is asked again
+            if ((options & TRANSFER_OPT_CHECKSUM) && !check_part_checksum(pckt)) {
+                corrupted_parts++;
+                pckt = build_part_reply_packet(PART_REPLY_RESEND);
+                clientSocket->write(pckt);
+                continue;
+            }
+
+            if (is_digest_part_packet(pckt)) {
+                if (!digest_pending || writer.bytes_written() != total)
+                    throw runtime_error("Unexpected digest part !");
+                if (get_digest_from_digest_part_packet(pckt) != writer.get_digest())
+                    throw runtime_error("The received ranges don't match their checksum !");
+                digest_pending = false;
+            } else if (is_hole_part_packet(pckt)) {
+                if (!(options & TRANSFER_OPT_SPARSE))
+                    throw runtime_error("Unexpected hole part !");
+
+                uint64_t length = get_length_from_hole_part_packet(pckt);
+                if (length > total - writer.bytes_written())
+                    throw runtime_error("Received more data than the ranges size !");
+
+                writer.skip(length);
+            } else if (is_block_ref_part_packet(pckt)) {
+                throw runtime_error("Unexpected block reference !");
+            } else {
+                BINARY_PART_PACKET_STRUCT data = decoder.decode(pckt);
+
+                if (data.len > total - writer.bytes_written())
+                    throw runtime_error("Received more data than the ranges size !");
+
+                writer.write(data.data, data.len);
+            }
+
+            curr_pos = writer.bytes_written();
+
+            // notify server
+            pckt = build_part_reply_packet(PART_REPLY_OK);
+            clientSocket->write(pckt);
+        }
+
+        writer.finish();
+
+        if (curr_pos == (int64_t)total) {
+            publish_upload_file(fd, temppath, outpath);
+
+            if (writer.bytes_skipped() > 0)
+                cout << "Holes skipped: " << writer.bytes_skipped() << " byte(s)" << endl;
+            if (options & TRANSFER_OPT_COMPRESS)
+                cout << decoder.get_summary() << endl;
+            if (options & TRANSFER_OPT_CHECKSUM)
+                cout << "Checksum: OK, corrupted parts received again: " << corrupted_parts << endl;
+        }
+
+    } catch (const exception &ex) {
+        string msg = ex.what();
+        cout << "Error when downloading ranges: " << msg << endl;
+        pckt = build_error_packet(ERROR_PACKET, ERR_CMD_UNKNOWN, msg);
+        clientSocket->write(pckt);
+        curr_pos = -1;
+    }
+
+    if (fd != -1) close(fd);
+
+    if (curr_pos != (int64_t)total) {
+        cout << "Ranges download encountered an error." << endl;
+        discard_upload_file(temppath);
+        return false;
+    }
+
+    cout << "Ranges download done: " << total << " byte(s) written to " << localpath << endl;
+    return true;
+}
+
+
 bool upload_file(LPTF_Socket *clientSocket, string filename, string targetfile) {
     
     if (!fs::is_regular_file(targetfile)) {
@@ -122,15 +395,28 @@ bool upload_file(LPTF_Socket *clientSocket, string filename, string targetfile)
     uint32_t filesize = get_file_size(targetfile);
     cout << "File Size: " << filesize << endl;
 
-    LPTF_Packet pckt = build_file_upload_request_packet(filename, filesize);
+    // small files are not worth looking for in the server's chunk store
+    uint8_t requested = CLIENT_TRANSFER_OPTS;
+    if (filesize < CDC_MIN_CHUNK_BYTES)
+        requested &= ~TRANSFER_OPT_DEDUP;
+
+    LPTF_Packet pckt = build_file_upload_request_packet(filename, filesize, requested);
     clientSocket->write(pckt);
 
     // check server reply
     LPTF_Packet reply = clientSocket->read();
+
+    uint8_t options = 0;
     
     if (reply.type() == REPLY_PACKET && get_refered_packet_type_from_reply_packet(reply) == UPLOAD_FILE_COMMAND) {
        string msg = get_reply_content_from_reply_packet(reply);
 
+       // the accepted options follow the OK (after its null terminator)
+       size_t end = msg.find('\0');
+       if (end != string::npos && end + 1 < msg.size())
+            options = (uint8_t)msg[end + 1];
+       msg = msg.substr(0, end);
+
        cout << "Server reply: " << msg << endl;
 
        if (strcmp(msg.c_str(), FILE_TRANSFER_REP_OK) != 0) {
@@ -147,61 +433,205 @@ bool upload_file(LPTF_Socket *clientSocket, string filename, string targetfile)
 
     cout << "Sending file to server..." << endl;
 
-    char buffer[MAX_BINARY_PART_BYTES];
+    // read by blocks, cut into parts by the encoder
+    vector<char> buffer(COMPRESS_BLOCK_BYTES);
 
-    ifstream file(targetfile, ios::binary);
+    int fd = open(targetfile.c_str(), O_RDONLY | O_CLOEXEC);
+    uint64_t hole_bytes = 0;
+    uint64_t copied_bytes = 0;
+    uint64_t resent_parts = 0;
+    uint32_t digest = 0;
+    PartEncoder encoder(options & TRANSFER_OPT_COMPRESS);
 
-    streampos begin = file.tellg();
-    file.seekg (0, ios::end);
-    streampos end = file.tellg();
-    file.seekg(0, ios::beg);
+    // send a part and wait for server reply
+    // this is required to not overflow? the socket
+    auto send_part = [&](LPTF_Packet &part) {
+        if (options & TRANSFER_OPT_CHECKSUM)
+            add_part_checksum(part);
 
-    try {
+        // a corrupted part is sent again
+        for (int attempt = 0;; attempt++) {
+            clientSocket->write(part);
 
-        streampos curr_pos = begin;
-        do {
-            uint16_t read_size;
-            if (MAX_BINARY_PART_BYTES + curr_pos > end) {
-                read_size = end - curr_pos;
-            } else {
-                read_size = MAX_BINARY_PART_BYTES;
-            }
-
-            file.read(buffer, read_size);
-
-            pckt = build_binary_part_packet(buffer, static_cast<uint16_t>(read_size));
-            clientSocket->write(pckt);
-
-            curr_pos = file.tellg();
-
-            // wait for server reply
-            // this is required to not overflow? the socket
             reply = clientSocket->read();
-            
+
             if (reply.type() != REPLY_PACKET && reply.type() != ERROR_PACKET) {
                 cerr << "Unexpected packet type!" << endl;
                 // reply.print_specs();
-                file.close();
                 return false;
             } else if (reply.type() == ERROR_PACKET) {
                 cout << "Error reply from server: " << get_error_content_from_error_packet(reply) << endl;
-                file.close();
                 return false;
             }
 
-        } while (curr_pos < end);
+            if (!is_resend_part_reply_packet(reply))
+                return true;
+            if (attempt == PART_MAX_RESENDS) {
+                cout << "A part was corrupted too many times !" << endl;
+                return false;
+            }
+            resent_parts++;
+        }
+    };
+
+    auto send_hole = [&](uint64_t length) {
+        hole_bytes += length;
+        digest = crc32c_zeros(digest, length);
+        pckt = build_hole_part_packet(length);
+        return send_part(pckt);
+    };
+
+    auto send_data = [&](const char *data, size_t len) {
+        for (size_t done = 0; done < len;) {
+            size_t consumed;
+            pckt = encoder.next_part(data + done, len - done, consumed);
+            if (!send_part(pckt))
+                return false;
+            done += consumed;
+        }
+        return true;
+    };
+
+    // reads and sends a range of the file
+    auto send_range = [&](uint64_t offset, uint64_t length) {
+        for (uint64_t end = offset + length; offset < end;) {
+            size_t read_size = min((uint64_t)buffer.size(), end - offset);
+
+            ssize_t len = pread(fd, buffer.data(), read_size, offset);
+            if (len <= 0)
+                throw runtime_error("Could not read file !");
+
+            digest = crc32c(digest, buffer.data(), len);
+            if (!send_data(buffer.data(), len))
+                return false;
+            offset += len;
+        }
+        return true;
+    };
+
+    try {
+
+        if (fd == -1)
+            throw runtime_error("Could not open file !");
+
+        // in a sparse transfer only the data extents are read and sent, the holes are sent as hole parts
+        // (delta and dedup transfers read the file themselves, see below)
+        vector<FILE_EXTENT> extents = {{0, filesize}};
+        if (options & (TRANSFER_OPT_DELTA | TRANSFER_OPT_DEDUP))
+            extents.clear();
+        else if (options & TRANSFER_OPT_SPARSE)
+            extents = get_data_extents(fd, filesize);
+
+        uint64_t curr_pos = 0;
+        bool sent = true;
+
+        if (options & TRANSFER_OPT_DELTA) {
+            // the server sends the signature of its version, only what it lacks is sent
+            LPTF_PartReader signature_stream(clientSocket, -1);
+            FILE_SIGNATURE signature;
+            if (!receive_signature(signature_stream, signature))
+                throw runtime_error("Invalid file signature !");
+
+            sent = compute_delta(fd, filesize, signature, send_data,
+                [&](uint64_t first, uint64_t count) {
+                    copied_bytes += count * signature.block_size;
+                    pckt = build_block_ref_part_packet(first, count);
+                    return send_part(pckt);
+                });
+
+            curr_pos = filesize;
+        }
+
+        if (options & TRANSFER_OPT_DEDUP) {
+            // the server tells which chunks of the file it already has (one bit each), the others are sent
+            vector<CONTENT_CHUNK> chunks = compute_chunks(fd, filesize);
+
+            LPTF_PartWriter chunk_stream(clientSocket, -1);
+            send_chunk_list(chunk_stream, chunks);
+
+            LPTF_PartReader found_stream(clientSocket, -1);
+            string found;
+            while (found_stream.read(found)) {
+                if (found.size() > (chunks.size() + 7) / 8)
+                    break;
+            }
+            if (found.size() != (chunks.size() + 7) / 8)
+                throw runtime_error("Invalid chunk bitmap !");
+
+            auto is_found = [&](size_t i) { return (found[i / 8] >> (i % 8)) & 1; };
+
+            for (size_t i = 0; i < chunks.size() && sent;) {
+                // a run of chunks, all stored or all missing
+                size_t count = 0;
+                uint64_t length = 0;
+                for (; i + count < chunks.size() && is_found(i + count) == is_found(i); count++)
+                    length += chunks[i + count].length;
+
+                if (is_found(i)) {
+                    pckt = build_block_ref_part_packet(i, count);
+                    sent = send_part(pckt);
+                    copied_bytes += length;
+                } else {
+                    sent = send_range(curr_pos, length);
+                }
+
+                curr_pos += length;
+                i += count;
+            }
+        }
+
+        for (const FILE_EXTENT &extent : extents) {
+            if (extent.offset > curr_pos && !(sent = send_hole(extent.offset - curr_pos)))
+                break;
+
+            if (!(sent = send_range(extent.offset, extent.length)))
+                break;
+            curr_pos = extent.offset + extent.length;
+        }
+
+        if (sent && curr_pos < filesize) {
+            // trailing hole
+            sent = send_hole(filesize - curr_pos);
+        } else if (sent && filesize == 0) {
+            // an empty file is sent as an empty part
+            pckt = build_binary_part_packet(nullptr, 0);
+            sent = send_part(pckt);
+        }
+
+        if (sent && (options & TRANSFER_OPT_CHECKSUM)) {
+            // delta and dedup transfers skip what the server has, the digest covers the whole file
+            if (options & (TRANSFER_OPT_DELTA | TRANSFER_OPT_DEDUP))
+                digest = get_file_crc32c(fd, filesize);
 
-        file.close();
+            pckt = build_digest_part_packet(digest);
+            sent = send_part(pckt);
+        }
+
+        close(fd);
+
+        if (!sent)
+            return false;
 
     } catch (const exception &ex) {
         string msg = ex.what();
         cout << "Error when uploading file: " << msg << endl;
         pckt = build_error_packet(ERROR_PACKET, ERR_CMD_UNKNOWN, msg);
         clientSocket->write(pckt);
-        file.close();
+        if (fd != -1) close(fd);
         return false;
     }
 
+    if (hole_bytes > 0)
+        cout << "Holes skipped: " << hole_bytes << " byte(s)" << endl;
+    if (options & TRANSFER_OPT_DELTA)
+        cout << "Taken from the server's version: " << copied_bytes << " byte(s), sent: " << filesize - copied_bytes << " byte(s)" << endl;
+    if (options & TRANSFER_OPT_DEDUP)
+        cout << "Taken from the server's chunk store: " << copied_bytes << " byte(s), sent: " << filesize - copied_bytes << " byte(s)" << endl;
+    if (options & TRANSFER_OPT_COMPRESS)
+        cout << encoder.get_summary() << endl;
+    if (options & TRANSFER_OPT_CHECKSUM)
+        cout << "Checksum: OK, corrupted parts sent again: " << resent_parts << endl;
+
     cout << "Upload done." << endl;
 
     return true;
@@ -233,6 +663,69 @@ bool list_directory(LPTF_Socket *clientSocket, string pathname) {
 }
 
 
+bool list_directory_long(LPTF_Socket *clientSocket, string pathname) {
+
+    cout << "Listing directory \"" << pathname << "\"" << endl;
+
+    LPTF_Packet pckt = build_list_directory_request_packet(pathname, LIST_FORMAT_BINARY);
+    clientSocket->write(pckt);
+
+    // check server reply
+    if (!wait_for_server_reply(clientSocket))
+        return false;
+
+    const char entry_types[] = {'-', 'd', 'l', '?'};
+
+    try {
+
+        // entries may be split between two packets
+        string pending;
+
+        do {
+            pckt = clientSocket->read();
+
+            if (pckt.type() != BINARY_PART_PACKET) {
+                cerr << "Packet is not a Binary Part Packet ! (" << pckt.type() << ")" << endl;
+                return false;
+            }
+
+            BINARY_PART_PACKET_STRUCT data = get_data_from_binary_part_packet(pckt);
+            pending.append((const char *)data.data, data.len);
+
+            const char *ptr = pending.c_str();
+            const char *end = ptr + pending.size();
+            LIST_ENTRY_STRUCT entry;
+
+            while (read_list_entry(ptr, end, entry)) {
+                char mtime[20];
+                time_t entry_mtime = entry.mtime;
+                strftime(mtime, sizeof(mtime), "%Y-%m-%d %H:%M:%S", localtime(&entry_mtime));
+
+                printf("%c%04o %12lu %s %s%s\n", entry_types[min(entry.type, (uint8_t)LIST_ENTRY_OTHER)], entry.mode,
+                       (unsigned long)entry.size, mtime, entry.name.c_str(), entry.type == LIST_ENTRY_DIR ? "/" : "");
+            }
+
+            pending.erase(0, ptr - pending.c_str());
+
+            // notify server
+            char repc = 0;
+            pckt = build_reply_packet(BINARY_PART_PACKET, &repc, 1);
+            clientSocket->write(pckt);
+
+            // break if len of data is smaller than MAX_BINARY_PART_BYTES
+            if (data.len != MAX_BINARY_PART_BYTES) break;
+
+        } while (true);
+
+    } catch (const exception &ex) {
+        cout << "Error when receiving directory listing: " << ex.what() << endl;
+        return false;
+    }
+
+    return true;
+}
+
+
 bool create_directory(LPTF_Socket *clientSocket, string folder) {
 
     cout << "Creating directory \"" << folder << "\"" << endl;
@@ -269,11 +762,35 @@ bool rename_directory(LPTF_Socket *clientSocket, string newname, string path) {
 }
 
 
-bool list_tree(LPTF_Socket *clientSocket) {
+bool copy_path(LPTF_Socket *clientSocket, string source, string destination) {
+
+    cout << "Copying \"" << source << "\" to \"" << destination << "\"" << endl;
+
+    LPTF_Packet pckt = build_copy_request_packet(COPY_COMMAND, source, destination);
+    clientSocket->write(pckt);
+
+    // check server reply
+    return wait_for_server_reply(clientSocket);
+}
+
+
+bool move_path(LPTF_Socket *clientSocket, string source, string destination) {
+
+    cout << "Moving \"" << source << "\" to \"" << destination << "\"" << endl;
+
+    LPTF_Packet pckt = build_copy_request_packet(MOVE_COMMAND, source, destination);
+    clientSocket->write(pckt);
+
+    // check server reply
+    return wait_for_server_reply(clientSocket);
+}
+
+
+bool list_tree(LPTF_Socket *clientSocket, string cursor) {
 
     cout << "Listing user directory tree" << endl;
 
-    LPTF_Packet pckt = build_command_packet(USER_TREE_COMMAND, "");
+    LPTF_Packet pckt = build_user_tree_request_packet(cursor);
     clientSocket->write(pckt);
 
     cout << "Start receiving directory tree from server" << endl;
@@ -284,6 +801,10 @@ bool list_tree(LPTF_Socket *clientSocket) {
             pckt = clientSocket->read();
 
             if (pckt.type() != BINARY_PART_PACKET) {
+                if (pckt.type() == ERROR_PACKET) {
+                    cout << "Error reply from server (" << get_error_content_from_error_packet(pckt) << ")" << endl;
+                    return false;
+                }
                 cerr << "Packet is not a Binary Part Packet ! (" << pckt.type() << ")" << endl;
                 break;
             }
@@ -304,6 +825,19 @@ bool list_tree(LPTF_Socket *clientSocket) {
 
         } while (true);
 
+        // the server tells if the tree was truncated and where to resume
+        LPTF_Packet reply = clientSocket->read();
+
+        if (reply.type() == REPLY_PACKET && get_refered_packet_type_from_reply_packet(reply) == USER_TREE_COMMAND) {
+            string content = get_reply_content_from_reply_packet(reply);
+            if (content.at(0) != 0) {
+                cout << "More entries available, continue with: -tree \"" << content.substr(1) << "\"" << endl;
+            }
+        } else if (reply.type() == ERROR_PACKET) {
+            cout << "Error reply from server (" << get_error_content_from_error_packet(reply) << ")" << endl;
+            return false;
+        }
+
     } catch (const exception &ex) {
         string msg = ex.what();
         cout << "Error when receiving dir tree: " << msg << endl;
@@ -315,3 +849,729 @@ bool list_tree(LPTF_Socket *clientSocket) {
 
     return true;
 }
+
+
+bool stat_many(LPTF_Socket *clientSocket, vector<string> paths) {
+
+    cout << "Getting info for " << paths.size() << " path(s)" << endl;
+
+    LPTF_Packet pckt = build_command_packet(STAT_MANY_COMMAND, "");
+    clientSocket->write(pckt);
+
+    // check server reply
+    if (!wait_for_server_reply(clientSocket))
+        return false;
+
+    const char entry_types[] = {'-', 'd', 'l', '?'};
+    bool all_ok = true;
+
+    try {
+
+        LPTF_PartWriter request(clientSocket, -1);
+        for (const string &path : paths) {
+            request.write(path.c_str(), path.size() + 1);
+        }
+        request.close();
+
+        LPTF_PartReader results(clientSocket, -1);
+
+        // results may be split between two packets
+        string pending;
+
+        while (results.read(pending)) {
+            const char *ptr = pending.c_str();
+            const char *end = ptr + pending.size();
+            STAT_RESULT_STRUCT result;
+
+            while (read_stat_result(ptr, end, result)) {
+                if (result.status != STAT_RESULT_OK) {
+                    cout << result.entry.name << ": " << result.error << endl;
+                    all_ok = false;
+                    continue;
+                }
+
+                char mtime[20];
+                time_t entry_mtime = result.entry.mtime;
+                strftime(mtime, sizeof(mtime), "%Y-%m-%d %H:%M:%S", localtime(&entry_mtime));
+
+                printf("%c%04o %12lu %s %s\n", entry_types[min(result.entry.type, (uint8_t)LIST_ENTRY_OTHER)], result.entry.mode,
+                       (unsigned long)result.entry.size, mtime, result.entry.name.c_str());
+            }
+
+            pending.erase(0, ptr - pending.c_str());
+        }
+
+    } catch (const exception &ex) {
+        cout << "Error when getting file info: " << ex.what() << endl;
+        return false;
+    }
+
+    return all_ok;
+}
+
+
+bool show_quota(LPTF_Socket *clientSocket) {
+
+    LPTF_Packet pckt = build_command_packet(QUOTA_COMMAND, "");
+    clientSocket->write(pckt);
+
+    LPTF_Packet reply = clientSocket->read();
+
+    if (reply.type() == REPLY_PACKET && get_refered_packet_type_from_reply_packet(reply) == QUOTA_COMMAND
+        && reply.get_header().length == sizeof(uint8_t) + 2*sizeof(uint64_t)) {
+
+        uint64_t usage[2];
+        memcpy(usage, (const char *) reply.get_content() + sizeof(uint8_t), sizeof(usage));
+
+        cout << "Used: " << be64toh(usage[0]) << " / " << be64toh(usage[1]) << " byte(s)" << endl;
+        return true;
+
+    } else if (reply.type() == ERROR_PACKET) {
+        cout << "Error reply from server (" << get_error_content_from_error_packet(reply) << ")" << endl;
+        return false;
+    } else {
+        cout << "Unexpected reply from server (" << reply.type() << ")" << endl;
+        return false;
+    }
+}
+
+
+bool search_files(LPTF_Socket *clientSocket, string pattern) {
+
+    LPTF_Packet pckt = build_command_packet(SEARCH_COMMAND, pattern);
+    clientSocket->write(pckt);
+
+    // check server reply
+    if (!wait_for_server_reply(clientSocket))
+        return false;
+
+    try {
+        LPTF_PartReader results(clientSocket, -1);
+
+        string data;
+        while (results.read(data)) {
+            cout << data;
+            data.clear();
+        }
+        cout.flush();
+
+    } catch (const exception &ex) {
+        cout << "Error when searching: " << ex.what() << endl;
+        return false;
+    }
+
+    return true;
+}
+
+
+// true if the server could hash the file, and it matches localpath (if any)
+bool hash_file(LPTF_Socket *clientSocket, string filename, string localpath) {
+
+    LPTF_Packet pckt = build_command_packet(HASH_COMMAND, filename);
+    clientSocket->write(pckt);
+
+    LPTF_Packet reply = clientSocket->read();
+
+    if (reply.type() == ERROR_PACKET) {
+        cout << "Error reply from server (" << get_error_content_from_error_packet(reply) << ")" << endl;
+        return false;
+    } else if (reply.type() != REPLY_PACKET || get_refered_packet_type_from_reply_packet(reply) != HASH_COMMAND
+               || reply.get_header().length != sizeof(uint8_t) + BLAKE3_OUT_BYTES) {
+        cout << "Unexpected reply from server (" << reply.type() << ")" << endl;
+        return false;
+    }
+
+    string hash((const char *) reply.get_content() + sizeof(uint8_t), BLAKE3_OUT_BYTES);
+    cout << "BLAKE3 " << to_hex(hash) << "  " << filename << endl;
+
+    if (localpath.empty())
+        return true;
+
+    int fd = open(localpath.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        cout << "File \"" << localpath << "\" doesn't exist !" << endl;
+        if (fd != -1) close(fd);
+        return false;
+    }
+
+    string local;
+    try {
+        local = get_file_blake3(fd, st.st_size);
+    } catch (const exception &ex) {
+        cout << "Error when hashing file: " << ex.what() << endl;
+        close(fd);
+        return false;
+    }
+    close(fd);
+
+    cout << "BLAKE3 " << to_hex(local) << "  " << localpath << endl;
+
+    if (local != hash) {
+        cout << "The files differ." << endl;
+        return false;
+    }
+
+    cout << "The files match." << endl;
+    return true;
+}
+
+
+// streams the records built by next_record (false once there is none left) and prints the final size
+static bool write_records(LPTF_Socket *clientSocket, uint8_t command, string filename, const function<bool(string &)> &next_record) {
+
+    LPTF_Packet pckt = build_command_packet(command, filename);
+    clientSocket->write(pckt);
+
+    // check server reply
+    if (!wait_for_server_reply(clientSocket))
+        return false;
+
+    uint64_t records = 0;
+
+    try {
+        LPTF_PartWriter stream(clientSocket, -1);
+        string record;
+        while (next_record(record)) {
+            stream.write(record);
+            records++;
+        }
+        stream.close();
+    } catch (const exception &ex) {
+        cout << "Error when writing file: " << ex.what() << endl;
+        return false;
+    }
+
+    LPTF_Packet reply = clientSocket->read();
+
+    if (reply.type() == ERROR_PACKET) {
+        cout << "Error reply from server (" << get_error_content_from_error_packet(reply) << ")" << endl;
+        return false;
+    } else if (reply.type() != REPLY_PACKET || get_refered_packet_type_from_reply_packet(reply) != command
+               || reply.get_header().length != sizeof(uint8_t) + sizeof(uint64_t)) {
+        cout << "Unexpected reply from server (" << reply.type() << ")" << endl;
+        return false;
+    }
+
+    uint64_t filesize;
+    memcpy(&filesize, (const char *) reply.get_content() + sizeof(uint8_t), sizeof(filesize));
+
+    cout << "Wrote " << records << " record(s), file size: " << be64toh(filesize) << " byte(s)" << endl;
+    return true;
+}
+
+
+// writes the content of the local file at offset, in records of at most WRITE_RECORD_MAX_BYTES
+bool pwrite_file(LPTF_Socket *clientSocket, string filename, uint64_t offset, string localpath) {
+
+    int fd = open(localpath.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        cout << "File \"" << localpath << "\" doesn't exist !" << endl;
+        if (fd != -1) close(fd);
+        return false;
+    }
+
+    uint64_t filesize = st.st_size;
+    uint64_t pos = 0;
+    vector<char> buffer(min(filesize, (uint64_t)WRITE_RECORD_MAX_BYTES));
+
+    bool ok = write_records(clientSocket, PWRITE_COMMAND, filename, [&](string &record) {
+        if (pos >= filesize)
+            return false;
+
+        size_t len = min((uint64_t)buffer.size(), filesize - pos);
+        for (size_t done = 0; done < len;) {
+            ssize_t n = pread(fd, buffer.data() + done, len - done, pos + done);
+            if (n <= 0)
+                throw runtime_error("Could not read local file !");
+            done += n;
+        }
+
+        record.clear();
+        append_varint(record, offset + pos);
+        append_varint(record, len);
+        record.append(buffer.data(), len);
+        pos += len;
+        return true;
+    });
+
+    close(fd);
+    return ok;
+}
+
+
+// appends each line (with its newline) as one record, lines longer than WRITE_RECORD_MAX_BYTES are split
+bool append_file(LPTF_Socket *clientSocket, string filename, istream &lines) {
+
+    string line;
+    size_t pos = 0;
+
+    return write_records(clientSocket, APPEND_COMMAND, filename, [&](string &record) {
+        if (pos >= line.size()) {
+            if (!getline(lines, line))
+                return false;
+            if (!lines.eof())
+                line += '\n';
+            pos = 0;
+        }
+
+        size_t len = min(line.size() - pos, (size_t)WRITE_RECORD_MAX_BYTES);
+
+        record.clear();
+        append_varint(record, len);
+        record.append(line, pos, len);
+        pos += len;
+        return true;
+    });
+}
+
+
+/*
+Downloads a folder of the server as a tar archive and extracts it into localdir as it arrives
+(the archive paths start with the name of the folder). Each file is received aside and only
+shows up once complete, replacing the local file if any.
+*/
+bool download_directory(LPTF_Socket *clientSocket, string folder, string localdir) {
+
+    fs::path root = localdir.empty() ? fs::path(".") : fs::path(localdir);
+    if (!fs::is_directory(root)) {
+        cout << "Directory \"" << root.string() << "\" doesn't exist !" << endl;
+        return false;
+    }
+    fs::path canonical_root = fs::weakly_canonical(root);
+
+    cout << "Downloading directory \"" << folder << "\" to \"" << root.string() << "\"" << endl;
+
+    LPTF_Packet pckt = build_directory_download_request_packet(folder, CLIENT_TRANSFER_OPTS & (TRANSFER_OPT_SPARSE | TRANSFER_OPT_COMPRESS | TRANSFER_OPT_CHECKSUM));
+    clientSocket->write(pckt);
+
+    // check server reply
+    LPTF_Packet reply = clientSocket->read();
+
+    uint8_t options;
+    uint64_t file_count, total;
+
+    if (reply.type() == REPLY_PACKET && get_refered_packet_type_from_reply_packet(reply) == DOWNLOAD_DIR_COMMAND) {
+        const char *ptr = (const char *) reply.get_content() + sizeof(uint8_t);
+        const char *end = (const char *) reply.get_content() + reply.get_header().length;
+
+        // accepted options, number of files and their total size
+        if (ptr == end || (options = *ptr++, !read_varint(ptr, end, file_count) || !read_varint(ptr, end, total))) {
+            cout << "Invalid reply from server !" << endl;
+            return false;
+        }
+        cout << "Receiving " << file_count << " file(s), " << total << " byte(s)" << endl;
+
+    } else if (reply.type() == ERROR_PACKET) {
+        cout << "Error reply from server (" << get_error_content_from_error_packet(reply) << ")" << endl;
+        return false;
+    } else {
+        cout << "Unexpected reply from server (" << reply.type() << ")" << endl;
+        return false;
+    }
+
+    // the file being extracted
+    fs::path filepath;
+    fs::path temppath;
+    int fd = -1;
+    TAR_ENTRY current;
+    unique_ptr<AsyncWriter> writer;     // large files, small ones are written at once
+    string buffer;
+
+    uint64_t files = 0;
+    uint64_t dirs = 0;
+    uint64_t corrupted_parts = 0;
+
+    TAR_VISITOR visitor;
+
+    visitor.begin = [&](const TAR_ENTRY &entry) {
+        fs::path target = root / entry.path;
+
+        // nothing is written outside localdir, even through a symlink
+        if (fs::path(entry.path).is_absolute() || !is_path_lexically_in_folder(target, root)
+            || !is_path_lexically_in_folder(fs::weakly_canonical(target.parent_path()), canonical_root))
+            throw runtime_error("Invalid path in archive: " + entry.path);
+
+        if (entry.is_dir) {
+            fs::create_directories(target);
+            dirs++;
+            return;
+        }
+
+        current = entry;
+        filepath = target;
+        fd = open_upload_file(filepath, temppath);
+        if (fd == -1)
+            throw runtime_error("Could not create file " + filepath.string() + " !");
+
+        buffer.clear();
+        if (entry.size >= ASYNC_WRITER_BUFFER_BYTES)
+            writer = make_unique<AsyncWriter>(fd);
+    };
+
+    visitor.data = [&](const char *data, size_t len) {
+        if (writer)
+            writer->write(data, len);
+        else
+            buffer.append(data, len);
+    };
+
+    visitor.zeros = [&](uint64_t len) {
+        if (writer)
+            writer->skip(len);
+        else
+            buffer.append(len, '\0');
+    };
+
+    visitor.end = [&]() {
+        if (fd == -1)
+            return;     // a directory
+
+        if (writer) {
+            writer->finish(false);
+            writer.reset();
+        } else {
+            for (size_t done = 0; done < buffer.size();) {
+                ssize_t n = pwrite(fd, buffer.data() + done, buffer.size() - done, done);
+                if (n <= 0)
+                    throw runtime_error("Could not write file " + filepath.string() + " !");
+                done += n;
+            }
+        }
+
+        struct timespec times[2] = {{current.mtime, 0}, {current.mtime, 0}};
+        fchmod(fd, current.mode);
+        futimens(fd, times);
+        publish_upload_file(fd, temppath, filepath);
+
+        close(fd);
+        fd = -1;
+        files++;
+    };
+
+    TarReader archive(visitor);
+    PartDecoder decoder;
+    uint32_t digest = 0;
+    bool digest_pending = options & TRANSFER_OPT_CHECKSUM;
+    bool ok = true;
+
+    try {
+
+        do {
+            pckt = clientSocket->read();
+
+            if (pckt.type() == ERROR_PACKET) {
+                throw runtime_error("Error from server (" + get_error_content_from_error_packet(pckt) + ")");
+            } else if (pckt.type() != BINARY_PART_PACKET) {
+                throw runtime_error("Packet is not a Binary Part Packet !");
+            }
+
+            // a corrupted part is asked again
+            if ((options & TRANSFER_OPT_CHECKSUM) && !check_part_checksum(pckt)) {
+                corrupted_parts++;
+                pckt = build_part_reply_packet(PART_REPLY_RESEND);
+                clientSocket->write(pckt);
+                continue;
+            }
+
+            if (is_digest_part_packet(pckt)) {
+                if (!digest_pending || !archive.done())
+                    throw runtime_error("Unexpected digest part !");
+                if (get_digest_from_digest_part_packet(pckt) != digest)
+                    throw runtime_error("The received archive doesn't match its checksum !");
+                digest_pending = false;
+            } else if (archive.done()) {
+                throw runtime_error("Received data after the end of the archive !");
+            } else if (is_hole_part_packet(pckt)) {
+                if (!(options & TRANSFER_OPT_SPARSE))
+                    throw runtime_error("Unexpected hole part !");
+
+                uint64_t length = get_length_from_hole_part_packet(pckt);
+                digest = crc32c_zeros(digest, length);
+                archive.feed_zeros(length);
+            } else {
+                BINARY_PART_PACKET_STRUCT data = decoder.decode(pckt);
+                digest = crc32c(digest, data.data, data.len);
+                archive.feed((const char *)data.data, data.len);
+            }
+
+            // notify server
+            pckt = build_part_reply_packet(PART_REPLY_OK);
+            clientSocket->write(pckt);
+        } while (!archive.done() || digest_pending);
+
+    } catch (const exception &ex) {
+        string msg = ex.what();
+        cout << "Error when downloading directory: " << msg << endl;
+        if (pckt.type() == BINARY_PART_PACKET) {
+            pckt = build_error_packet(ERROR_PACKET, ERR_CMD_UNKNOWN, msg);
+            clientSocket->write(pckt);
+        }
+        ok = false;
+    }
+
+    // the file being received when it failed is dropped
+    writer.reset();
+    if (fd != -1) {
+        close(fd);
+        discard_upload_file(temppath);
+    }
+
+    cout << "Extracted " << files << " file(s) and " << dirs << " directory(ies)" << endl;
+    if (!ok)
+        return false;
+
+    if (options & TRANSFER_OPT_COMPRESS)
+        cout << decoder.get_summary() << endl;
+    if (options & TRANSFER_OPT_CHECKSUM)
+        cout << "Checksum: OK, corrupted parts received again: " << corrupted_parts << endl;
+
+    cout << "Directory download done." << endl;
+    return true;
+}
+
+
+/*
+Uploads a local directory as a tar archive generated on the fly, extracted by the server into folder
+as it arrives (the archive paths start with the name of the directory). Symlinks and special files
+are left out. Small files are gathered in full parts, large ones are sent like a single upload.
+*/
+bool upload_directory(LPTF_Socket *clientSocket, string localdir, string folder) {
+
+    if (!fs::is_directory(localdir)) {
+        cout << "Directory \"" << localdir << "\" doesn't exist !" << endl;
+        return false;
+    }
+
+    // the archive holds the directory itself, under its own name
+    fs::path root = fs::weakly_canonical(fs::absolute(localdir));
+    string root_name = root.filename().string();
+    if (root_name.empty()) {
+        cout << "Cannot upload \"" << localdir << "\" !" << endl;
+        return false;
+    }
+
+    // regular files and directories (symlinks are not followed)
+    vector<pair<TAR_ENTRY, fs::path>> entries;
+    uint64_t total = 0;
+
+    try {
+        auto add_entry = [&](const fs::path &path, const string &name) {
+            struct stat st;
+            if (lstat(path.c_str(), &st) != 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)))
+                return;
+
+            TAR_ENTRY entry = {name, S_ISDIR(st.st_mode), st.st_mode & 07777, S_ISREG(st.st_mode) ? (uint64_t)st.st_size : 0, st.st_mtime};
+            total += entry.size;
+            entries.push_back({entry, path});
+        };
+
+        add_entry(root, root_name);
+        for (const fs::directory_entry &item : fs::recursive_directory_iterator(root))
+            add_entry(item.path(), root_name + "/" + item.path().lexically_relative(root).generic_string());
+    } catch (const exception &ex) {
+        cout << "Could not read directory: " << ex.what() << endl;
+        return false;
+    }
+
+    cout << "Uploading " << entries.size() << " entry(ies), " << total << " byte(s) to \"" << folder << "\"" << endl;
+
+    LPTF_Packet pckt = build_directory_upload_request_packet(folder, CLIENT_TRANSFER_OPTS & (TRANSFER_OPT_SPARSE | TRANSFER_OPT_COMPRESS | TRANSFER_OPT_CHECKSUM), total);
+    clientSocket->write(pckt);
+
+    // check server reply
+    LPTF_Packet reply = clientSocket->read();
+
+    uint8_t options;
+
+    if (reply.type() == REPLY_PACKET && get_refered_packet_type_from_reply_packet(reply) == UPLOAD_DIR_COMMAND && reply.get_header().length > 1) {
+        // accepted options
+        options = ((const uint8_t *) reply.get_content())[1];
+    } else if (reply.type() == ERROR_PACKET) {
+        cout << "Error reply from server (" << get_error_content_from_error_packet(reply) << ")" << endl;
+        return false;
+    } else {
+        cout << "Unexpected reply from server (" << reply.type() << ")" << endl;
+        return false;
+    }
+
+    uint64_t hole_bytes = 0;
+    uint64_t resent_parts = 0;
+    uint32_t digest = 0;
+    PartEncoder encoder(options & TRANSFER_OPT_COMPRESS);
+    int fd = -1;
+
+    // headers and small files, gathered into blocks before being cut into parts
+    string pending;
+    vector<char> buffer(COMPRESS_BLOCK_BYTES);
+
+    // send a part and wait for server reply, throws on error
+    auto send_part = [&](LPTF_Packet &part) {
+        if (options & TRANSFER_OPT_CHECKSUM)
+            add_part_checksum(part);
+
+        // a corrupted part is sent again
+        for (int attempt = 0;; attempt++) {
+            clientSocket->write(part);
+
+            reply = clientSocket->read();
+
+            if (reply.type() == ERROR_PACKET)
+                throw runtime_error("Error from server (" + get_error_content_from_error_packet(reply) + ")");
+            else if (reply.type() != REPLY_PACKET)
+                throw runtime_error("Unexpected packet type!");
+
+            if (!is_resend_part_reply_packet(reply))
+                return;
+            if (attempt == PART_MAX_RESENDS)
+                throw runtime_error("A part was corrupted too many times !");
+            resent_parts++;
+        }
+    };
+
+    auto send_data = [&](const char *data, size_t len) {
+        digest = crc32c(digest, data, len);
+        for (size_t done = 0; done < len;) {
+            size_t consumed;
+            pckt = encoder.next_part(data + done, len - done, consumed);
+            send_part(pckt);
+            done += consumed;
+        }
+    };
+
+    // sends the whole blocks gathered (or everything)
+    auto send_pending = [&](bool all) {
+        size_t done = 0;
+        while (pending.size() - done >= COMPRESS_BLOCK_BYTES || (all && done < pending.size())) {
+            size_t len = min(pending.size() - done, (size_t)COMPRESS_BLOCK_BYTES);
+            send_data(pending.data() + done, len);
+            done += len;
+        }
+        pending.erase(0, done);
+    };
+
+    // reads and sends a range of a large file
+    auto send_range = [&](uint64_t offset, uint64_t length) {
+        for (uint64_t end = offset + length; offset < end;) {
+            ssize_t len = pread(fd, buffer.data(), min((uint64_t)buffer.size(), end - offset), offset);
+            if (len <= 0)
+                throw runtime_error("Could not read file !");
+
+            send_data(buffer.data(), len);
+            offset += len;
+        }
+    };
+
+    try {
+
+        for (auto entry = entries.begin(); entry != entries.end(); entry++) {
+            const TAR_ENTRY &item = entry->first;
+            pending += tar_header(item);
+            if (item.is_dir)
+                continue;
+
+            fd = open(entry->second.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1)
+                throw runtime_error("Could not open " + entry->second.string() + " !");
+
+            if (item.size <= COMPRESS_BLOCK_BYTES) {
+                // appended to the block being gathered
+                size_t start = pending.size();
+                pending.resize(start + item.size);
+                for (size_t done = 0; done < item.size;) {
+                    ssize_t n = pread(fd, &pending[start + done], item.size - done, done);
+                    if (n <= 0)
+                        throw runtime_error("Could not read " + entry->second.string() + " !");
+                    done += n;
+                }
+            } else {
+                // in a sparse transfer only the data extents are read, the holes are sent as hole parts
+                send_pending(true);
+
+                vector<FILE_EXTENT> extents = {{0, item.size}};
+                if (options & TRANSFER_OPT_SPARSE)
+                    extents = get_data_extents(fd, item.size);
+
+                uint64_t curr_pos = 0;
+                for (const FILE_EXTENT &extent : extents) {
+                    if (extent.offset > curr_pos) {
+                        hole_bytes += extent.offset - curr_pos;
+                        digest = crc32c_zeros(digest, extent.offset - curr_pos);
+                        pckt = build_hole_part_packet(extent.offset - curr_pos);
+                        send_part(pckt);
+                    }
+
+                    send_range(extent.offset, extent.length);
+                    curr_pos = extent.offset + extent.length;
+                }
+
+                if (curr_pos < item.size) {
+                    // trailing hole
+                    hole_bytes += item.size - curr_pos;
+                    digest = crc32c_zeros(digest, item.size - curr_pos);
+                    pckt = build_hole_part_packet(item.size - curr_pos);
+                    send_part(pckt);
+                }
+            }
+
+            close(fd);
+            fd = -1;
+
+            pending.append(tar_padding(item.size), '\0');
+            send_pending(false);
+        }
+
+        pending += tar_end();
+        send_pending(true);
+
+        if (options & TRANSFER_OPT_CHECKSUM) {
+            pckt = build_digest_part_packet(digest);
+            send_part(pckt);
+        }
+
+    } catch (const exception &ex) {
+        string msg = ex.what();
+        cout << "Error when uploading directory: " << msg << endl;
+
+        // the server is told, unless it's the one that gave up
+        if (reply.type() != ERROR_PACKET) {
+            pckt = build_error_packet(ERROR_PACKET, ERR_CMD_UNKNOWN, msg);
+            clientSocket->write(pckt);
+        }
+        if (fd != -1) close(fd);
+        return false;
+    }
+
+    // number of files, directories and bytes extracted by the server
+    reply = clientSocket->read();
+
+    uint64_t files, dirs, received;
+
+    if (reply.type() == REPLY_PACKET && get_refered_packet_type_from_reply_packet(reply) == UPLOAD_DIR_COMMAND) {
+        const char *ptr = (const char *) reply.get_content() + sizeof(uint8_t);
+        const char *end = (const char *) reply.get_content() + reply.get_header().length;
+
+        if (!read_varint(ptr, end, files) || !read_varint(ptr, end, dirs) || !read_varint(ptr, end, received)) {
+            cout << "Invalid reply from server !" << endl;
+            return false;
+        }
+    } else if (reply.type() == ERROR_PACKET) {
+        cout << "Error reply from server (" << get_error_content_from_error_packet(reply) << ")" << endl;
+        return false;
+    } else {
+        cout << "Unexpected reply from server (" << reply.type() << ")" << endl;
+        return false;
+    }
+
+    if (hole_bytes > 0)
+        cout << "Holes skipped: " << hole_bytes << " byte(s)" << endl;
+    if (options & TRANSFER_OPT_COMPRESS)
+        cout << encoder.get_summary() << endl;
+    if (options & TRANSFER_OPT_CHECKSUM)
+        cout << "Checksum: OK, corrupted parts sent again: " << resent_parts << endl;
+
+    cout << "Server extracted " << files << " file(s), " << dirs << " new directory(ies), " << received << " byte(s)" << endl;
+    cout << "Directory upload done." << endl;
+    return true;
+}
@@ -0,0 +1,126 @@
+#include "../include/crc32c.hpp"
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78  // reflected
+
+
+// table[k][b]: CRC of byte b followed by k zero bytes (slicing-by-8)
+static const uint32_t (*get_crc32c_table())[256] {
+    static uint32_t table[8][256];
+    static bool init = [] {
+        for (uint32_t b = 0; b < 256; b++) {
+            uint32_t crc = b;
+            for (int i = 0; i < 8; i++)
+                crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+            table[0][b] = crc;
+        }
+        for (uint32_t b = 0; b < 256; b++)
+            for (int k = 1; k < 8; k++)
+                table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xFF];
+        return true;
+    }();
+    (void)init;
+    return table;
+}
+
+
+static uint32_t crc32c_table(uint32_t crc, const uint8_t *ptr, size_t len) {
+    const uint32_t (*table)[256] = get_crc32c_table();
+
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, ptr, sizeof(word));
+        word ^= crc;    // little endian: the CRC is xored into the first 4 bytes
+        crc = table[7][word & 0xFF] ^ table[6][(word >> 8) & 0xFF] ^ table[5][(word >> 16) & 0xFF] ^ table[4][(word >> 24) & 0xFF]
+            ^ table[3][(word >> 32) & 0xFF] ^ table[2][(word >> 40) & 0xFF] ^ table[1][(word >> 48) & 0xFF] ^ table[0][word >> 56];
+        ptr += 8;
+        len -= 8;
+    }
+
+    while (len-- > 0)
+        crc = (crc >> 8) ^ table[0][(crc ^ *ptr++) & 0xFF];
+
+    return crc;
+}
+
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *ptr, size_t len) {
+    uint64_t crc64 = crc;
+
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, ptr, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        ptr += 8;
+        len -= 8;
+    }
+
+    crc = (uint32_t)crc64;
+    while (len-- > 0)
+        crc = _mm_crc32_u8(crc, *ptr++);
+
+    return crc;
+}
+#endif
+
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *ptr = (const uint8_t *)data;
+
+#if defined(__x86_64__)
+    static const bool sse42 = __builtin_cpu_supports("sse4.2");
+    if (sse42)
+        return ~crc32c_sse42(~crc, ptr, len);
+#endif
+
+    return ~crc32c_table(~crc, ptr, len);
+}
+
+
+// a * b modulo the polynomial (reflected bit order)
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1U << 31;
+    uint32_t p = 0;
+
+    while (true) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+
+    return p;
+}
+
+
+uint32_t crc32c_zeros(uint32_t crc, uint64_t len) {
+    // x^(8 * 2^k) modulo the polynomial, for each bit of len
+    static uint32_t powers[64];
+    static bool init = [] {
+        uint32_t p = 1U << 23;   // x^8
+        for (int k = 0; k < 64; k++) {
+            powers[k] = p;
+            p = multmodp(p, p);
+        }
+        return true;
+    }();
+    (void)init;
+
+    // the register (not the CRC) is multiplied by x^(8 * len)
+    uint32_t reg = ~crc;
+    for (int k = 0; len != 0; k++, len >>= 1)
+        if (len & 1)
+            reg = multmodp(powers[k], reg);
+
+    return ~reg;
+}
@@ -0,0 +1,274 @@
+#include "../include/delta_sync.hpp"
+#include "../include/xxh64.hpp"
+#include "../include/LPTF_Net/LPTF_Utils.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+using namespace std;
+
+
+// rsync rolling checksum of a block: a is the sum of the bytes, b the sum of the a's
+static uint32_t weak_checksum(const uint8_t *data, size_t len, uint32_t &a, uint32_t &b) {
+    a = 0;
+    b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += data[i];
+        b += (len - i) * data[i];
+    }
+    return (a & 0xFFFF) | (b << 16);
+}
+
+static uint32_t weak_filter_slot(uint32_t weak) {
+    return (weak ^ (weak >> 16)) & 0xFFFF;
+}
+
+
+// about sqrt(filesize), so that neither the signature nor the unmatched data get too big
+uint32_t delta_block_size(uint64_t filesize) {
+    uint64_t size = (uint64_t)sqrt((double)filesize);
+    size = (size + 1023) / 1024 * 1024;
+    return (uint32_t)min((uint64_t)DELTA_MAX_BLOCK_BYTES, max((uint64_t)DELTA_MIN_BLOCK_BYTES, size));
+}
+
+
+// reads the file, throws if it could not be read
+FILE_SIGNATURE compute_signature(int fd, uint64_t filesize) {
+    FILE_SIGNATURE signature;
+    signature.block_size = delta_block_size(filesize);
+    signature.file_size = filesize;
+    signature.blocks.reserve(filesize / signature.block_size);
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    vector<uint8_t> block(signature.block_size);
+
+    for (uint64_t offset = 0; offset + signature.block_size <= filesize; offset += signature.block_size) {
+        size_t done = 0;
+        while (done < block.size()) {
+            ssize_t len = pread(fd, block.data() + done, block.size() - done, offset + done);
+            if (len <= 0)
+                throw runtime_error("Could not read the previous version !");
+            done += len;
+        }
+
+        uint32_t a, b;
+        signature.blocks.push_back({weak_checksum(block.data(), block.size(), a, b), xxh64(block.data(), block.size())});
+    }
+
+    return signature;
+}
+
+
+/*
+Signature:
+    varint block size, varint file size, varint block count,
+    then per block: weak checksum (uint32), strong hash (uint64), little endian
+*/
+string serialize_signature(const FILE_SIGNATURE &signature) {
+    string out;
+    append_varint(out, signature.block_size);
+    append_varint(out, signature.file_size);
+    append_varint(out, signature.blocks.size());
+
+    out.reserve(out.size() + signature.blocks.size() * (sizeof(uint32_t) + sizeof(uint64_t)));
+
+    for (const BLOCK_SIGNATURE &block : signature.blocks) {
+        uint32_t weak = htole32(block.weak);
+        uint64_t strong = htole64(block.strong);
+        out.append((const char *)&weak, sizeof(weak));
+        out.append((const char *)&strong, sizeof(strong));
+    }
+
+    return out;
+}
+
+
+bool parse_signature(const string &data, FILE_SIGNATURE &signature) {
+    const char *ptr = data.data();
+    const char *end = ptr + data.size();
+    uint64_t block_size, file_size, count;
+
+    if (!read_varint(ptr, end, block_size) || !read_varint(ptr, end, file_size) || !read_varint(ptr, end, count))
+        return false;
+
+    if (block_size < DELTA_MIN_BLOCK_BYTES || block_size > DELTA_MAX_BLOCK_BYTES || count > file_size / block_size
+        || (uint64_t)(end - ptr) != count * (sizeof(uint32_t) + sizeof(uint64_t)))
+        return false;
+
+    signature.block_size = block_size;
+    signature.file_size = file_size;
+    signature.blocks.resize(count);
+
+    for (BLOCK_SIGNATURE &block : signature.blocks) {
+        uint32_t weak;
+        uint64_t strong;
+        memcpy(&weak, ptr, sizeof(weak));
+        memcpy(&strong, ptr + sizeof(weak), sizeof(strong));
+        block.weak = le32toh(weak);
+        block.strong = le64toh(strong);
+        ptr += sizeof(weak) + sizeof(strong);
+    }
+
+    return true;
+}
+
+
+void send_signature(LPTF_PartWriter &stream, const FILE_SIGNATURE &signature) {
+    stream.write(serialize_signature(signature));
+    stream.close();
+}
+
+
+// reads the whole stream, returns false if the signature is invalid or too big
+bool receive_signature(LPTF_PartReader &stream, FILE_SIGNATURE &signature) {
+    string data;
+    while (stream.read(data)) {
+        if (data.size() > DELTA_MAX_SIGNATURE_BYTES)
+            return false;
+    }
+    return parse_signature(data, signature);
+}
+
+
+/*
+Describes the first filesize bytes of fd in order, as literal data and runs of blocks of
+the signed file (first block, count), through the callbacks.
+Returns false as soon as a callback does, throws if the file could not be mapped.
+*/
+bool compute_delta(int fd, uint64_t filesize, const FILE_SIGNATURE &signature,
+                   const function<bool(const char *, size_t)> &literal,
+                   const function<bool(uint64_t, uint64_t)> &copy) {
+
+    if (filesize == 0)
+        return true;
+
+    void *map = mmap(nullptr, filesize, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        throw runtime_error("Could not map file !");
+    madvise(map, filesize, MADV_SEQUENTIAL);
+
+    // unmapped however we leave
+    unique_ptr<void, function<void(void *)>> unmap(map, [filesize](void *addr) { munmap(addr, filesize); });
+
+    const uint8_t *data = (const uint8_t *)map;
+    uint64_t block_size = signature.block_size;
+
+    // blocks sorted by weak checksum, and a bitmap to reject most positions without searching
+    vector<pair<uint32_t, uint32_t>> index;
+    vector<bool> filter(1 << 16, false);
+    index.reserve(signature.blocks.size());
+    for (uint32_t i = 0; i < signature.blocks.size(); i++) {
+        index.push_back({signature.blocks[i].weak, i});
+        filter[weak_filter_slot(signature.blocks[i].weak)] = true;
+    }
+    sort(index.begin(), index.end());
+
+    uint64_t pos = 0;
+    uint64_t literal_start = 0;
+    uint64_t run_first = 0;
+    uint64_t run_count = 0;
+
+    auto flush_run = [&]() {
+        bool ok = run_count == 0 || copy(run_first, run_count);
+        run_count = 0;
+        return ok;
+    };
+
+    if (!index.empty() && filesize >= block_size) {
+        uint32_t a, b;
+        uint32_t weak = weak_checksum(data, block_size, a, b);
+
+        while (true) {
+            int64_t match = -1;
+
+            if (filter[weak_filter_slot(weak)]) {
+                auto range = equal_range(index.begin(), index.end(), make_pair(weak, 0u),
+                                         [](const pair<uint32_t, uint32_t> &x, const pair<uint32_t, uint32_t> &y) { return x.first < y.first; });
+
+                if (range.first != range.second) {
+                    uint64_t strong = xxh64(data + pos, block_size);
+
+                    // the block following the previous match keeps the run going
+                    for (auto it = range.first; it != range.second; it++)
+                        if (signature.blocks[it->second].strong == strong && (match == -1 || it->second == run_first + run_count))
+                            match = it->second;
+                }
+            }
+
+            if (match != -1) {
+                if (pos > literal_start) {
+                    if (!flush_run() || !literal((const char *)data + literal_start, pos - literal_start))
+                        return false;
+                }
+
+                if (run_count > 0 && run_first + run_count == (uint64_t)match) {
+                    run_count++;
+                } else {
+                    if (!flush_run())
+                        return false;
+                    run_first = match;
+                    run_count = 1;
+                }
+
+                pos += block_size;
+                literal_start = pos;
+
+                if (pos + block_size > filesize)
+                    break;
+                weak = weak_checksum(data + pos, block_size, a, b);
+                continue;
+            }
+
+            if (pos + block_size >= filesize)
+                break;
+
+            // roll the window by one byte
+            a = a - data[pos] + data[pos + block_size];
+            b = b - block_size * data[pos] + a;
+            weak = (a & 0xFFFF) | (b << 16);
+            pos++;
+        }
+    }
+
+    if (!flush_run())
+        return false;
+
+    if (filesize > literal_start)
+        return literal((const char *)data + literal_start, filesize - literal_start);
+
+    return true;
+}
+
+
+/*
+Writes the referenced blocks of the previous version (fd, described by signature) to writer.
+Returns the number of bytes written, throws if the reference is invalid.
+*/
+uint64_t copy_blocks(int fd, const FILE_SIGNATURE &signature, const BLOCK_REF_STRUCT &ref, AsyncWriter &writer) {
+    if (ref.count == 0 || ref.first >= signature.blocks.size() || ref.count > signature.blocks.size() - ref.first)
+        throw runtime_error("Invalid block reference !");
+
+    uint64_t offset = ref.first * signature.block_size;
+    uint64_t len = ref.count * signature.block_size;
+
+    vector<char> buffer(min(len, (uint64_t)ASYNC_WRITER_BUFFER_BYTES));
+
+    for (uint64_t done = 0; done < len;) {
+        ssize_t n = pread(fd, buffer.data(), min((uint64_t)buffer.size(), len - done), offset + done);
+        if (n <= 0)
+            throw runtime_error("Could not read the previous version !");
+
+        writer.write(buffer.data(), n);
+        done += n;
+    }
+
+    return len;
+}
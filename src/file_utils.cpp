@@ -1,11 +1,34 @@
 #include "../include/file_utils.hpp"
+#include "../include/LPTF_Net/LPTF_Utils.hpp"
+#include "../include/crc32c.hpp"
+#include "../include/blake3.hpp"
 
 #include <iostream>
 #include <fstream>
 #include <filesystem>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <functional>
+#include <thread>
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 #define SERVER_DIR "server_root"
 #define SERVER_LOGS_DIR "logs"
+#define SERVER_TRASH_DIR "trash"
+#define SERVER_META_DIR "meta"
+
+#define TEMP_NAME_MAX_BYTES 200     // of the original name kept in a temporary name
+#define TEMP_NAME_ATTEMPTS 16
 
 using namespace std;
 namespace fs = std::filesystem;
@@ -39,6 +62,84 @@ string list_directory_content(fs::path folderpath) {
 }
 
 
+/*
+Fills the type, size, mtime and mode of entry with statx() (symlinks are not followed).
+path is relative to dirfd (or AT_FDCWD). Returns 0 on success, otherwise the errno value.
+*/
+int stat_list_entry(int dirfd, const char *path, LIST_ENTRY_STRUCT &entry) {
+    struct statx stx;
+    if (statx(dirfd, path, AT_SYMLINK_NOFOLLOW | AT_STATX_SYNC_AS_STAT,
+              STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME, &stx) != 0)
+        return errno;
+
+    if (S_ISREG(stx.stx_mode)) entry.type = LIST_ENTRY_FILE;
+    else if (S_ISDIR(stx.stx_mode)) entry.type = LIST_ENTRY_DIR;
+    else if (S_ISLNK(stx.stx_mode)) entry.type = LIST_ENTRY_SYMLINK;
+    else entry.type = LIST_ENTRY_OTHER;
+
+    entry.size = stx.stx_size;
+    entry.mtime = stx.stx_mtime.tv_sec > 0 ? stx.stx_mtime.tv_sec : 0;
+    entry.mode = stx.stx_mode & 07777;
+
+    return 0;
+}
+
+
+/*
+Returns the content of a directory as a binary listing (see append_list_entry()).
+Each entry is stat'ed with statx() relative to the open directory, so only the
+requested fields are fetched and no path is resolved again.
+*/
+string stat_directory_content(fs::path folderpath) {
+    string result = "";
+
+    DIR *dir = opendir(folderpath.c_str());
+    if (!dir)
+        throw fs::filesystem_error("Could not open directory", folderpath, error_code(errno, generic_category()));
+
+    int dirfd = ::dirfd(dir);
+    struct dirent *dirent;
+
+    while ((dirent = readdir(dir)) != nullptr) {
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+            continue;
+
+        LIST_ENTRY_STRUCT entry;
+        entry.name = dirent->d_name;
+
+        if (stat_list_entry(dirfd, dirent->d_name, entry) != 0)
+            continue;   // removed meanwhile
+
+        append_list_entry(result, entry);
+    }
+
+    closedir(dir);
+
+    return result;
+}
+
+
+// text listing (same format as list_directory_content()) from a binary listing of folderpath
+string directory_content_to_text(const string &entries, const fs::path &folderpath) {
+    string result = "";
+
+    const char *ptr = entries.c_str();
+    const char *end = ptr + entries.size();
+
+    LIST_ENTRY_STRUCT entry;
+    while (read_list_entry(ptr, end, entry)) {
+        result.append(entry.name);
+        // a symlink to a directory is shown as one
+        error_code ec;
+        if (entry.type == LIST_ENTRY_DIR || (entry.type == LIST_ENTRY_SYMLINK && fs::is_directory(folderpath / entry.name, ec)))
+            result.push_back(fs::path::preferred_separator);
+        result.append("\n");
+    }
+
+    return result;
+}
+
+
 void check_server_root_folder() {
     fs::path sroot(SERVER_DIR);
 
@@ -87,6 +188,56 @@ fs::path get_server_logs_folder() {
 }
 
 
+void check_server_trash_folder() {
+    fs::path troot(SERVER_TRASH_DIR);
+
+    if (!fs::is_directory(troot))
+        if (!fs::create_directories(troot))
+            throw runtime_error("create_directories() failed!");
+}
+
+
+fs::path get_server_trash_folder() {
+    check_server_trash_folder();
+    return fs::path(SERVER_TRASH_DIR);
+}
+
+
+// removed directories wait here for the trash reaper, out of the user root
+fs::path get_user_trash(string username) {
+    fs::path utrash = get_server_trash_folder();
+    utrash /= username;
+
+    if (!fs::is_directory(utrash))
+        if (!fs::create_directories(utrash))
+            throw runtime_error("create_directories() failed!");
+
+    return utrash;
+}
+
+
+void check_server_meta_folder() {
+    fs::path mroot(SERVER_META_DIR);
+
+    if (!fs::is_directory(mroot))
+        if (!fs::create_directories(mroot))
+            throw runtime_error("create_directories() failed!");
+}
+
+
+// server bookkeeping (quotas, indexes...), one subfolder per kind of data
+fs::path get_server_meta_folder(string kind) {
+    check_server_meta_folder();
+    fs::path folder = fs::path(SERVER_META_DIR) / kind;
+
+    if (!fs::is_directory(folder))
+        if (!fs::create_directories(folder))
+            throw runtime_error("create_directories() failed!");
+
+    return folder;
+}
+
+
 bool is_path_in_folder(fs::path contained, fs::path container) {
     // compare the relative path for contained and container
     fs::path relative_path = std::filesystem::relative(contained, container);
@@ -94,7 +245,321 @@ bool is_path_in_folder(fs::path contained, fs::path container) {
 }
 
 
+// same as is_path_in_folder() but without resolving the paths on disk (symlinks are not followed)
+// the container itself is considered in the folder
+bool is_path_lexically_in_folder(fs::path contained, fs::path container) {
+    fs::path relative_path = contained.lexically_normal().lexically_relative(container.lexically_normal());
+    return !relative_path.empty() && (relative_path == "." || *relative_path.begin() != "..");
+}
+
+
+// total size of the regular files under dir (symlinks are not followed)
+uintmax_t get_tree_size(fs::path dir) {
+    uintmax_t size = 0;
+
+    if (!fs::is_directory(dir))
+        return size;
+
+    for (fs::directory_entry const& dir_entry : fs::recursive_directory_iterator(dir)) {
+        error_code ec;
+        if (dir_entry.is_regular_file(ec) && !dir_entry.is_symlink(ec)) {
+            uintmax_t fsize = dir_entry.file_size(ec);
+            if (!ec) size += fsize;
+        }
+    }
+
+    return size;
+}
+
+
 void delete_directory_content(fs::path dir) {
     for (fs::directory_entry const& dir_entry : fs::directory_iterator(dir))
         fs::remove_all(dir_entry);
 }
+
+
+/*
+Returns the data ranges of the first size bytes of the file, in order (SEEK_DATA / SEEK_HOLE).
+Where holes can't be found, the whole file is one data range.
+*/
+vector<FILE_EXTENT> get_data_extents(int fd, uint64_t size) {
+    vector<FILE_EXTENT> extents;
+    uint64_t pos = 0;
+
+    while (pos < size) {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if (data == -1) {
+            // ENXIO: only a hole left
+            if (errno != ENXIO)
+                extents.push_back({pos, size - pos});
+            break;
+        }
+        if ((uint64_t)data >= size)
+            break;
+
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole == -1 || (uint64_t)hole > size)
+            hole = size;
+
+        extents.push_back({(uint64_t)data, (uint64_t)(hole - data)});
+        pos = hole;
+    }
+
+    return extents;
+}
+
+
+// CRC32C of the first size bytes of the file (holes are not read), throws if it could not be read
+uint32_t get_file_crc32c(int fd, uint64_t size) {
+    vector<char> buffer(1 << 20);
+    uint32_t crc = 0;
+    uint64_t pos = 0;
+
+    for (const FILE_EXTENT &extent : get_data_extents(fd, size)) {
+        crc = crc32c_zeros(crc, extent.offset - pos);
+
+        for (pos = extent.offset; pos < extent.offset + extent.length;) {
+            ssize_t len = pread(fd, buffer.data(), min((uint64_t)buffer.size(), extent.offset + extent.length - pos), pos);
+            if (len <= 0)
+                throw runtime_error("Could not read file !");
+
+            crc = crc32c(crc, buffer.data(), len);
+            pos += len;
+        }
+    }
+
+    return crc32c_zeros(crc, size - pos);
+}
+
+
+// BLAKE3 of the first size bytes of the file, hashed on all cores, throws if it could not be mapped
+string get_file_blake3(int fd, uint64_t size) {
+    if (size == 0)
+        return blake3(nullptr, 0);
+
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        throw runtime_error("Could not map file !");
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    // unmapped however we leave
+    unique_ptr<void, function<void(void *)>> unmap(map, [size](void *addr) { munmap(addr, size); });
+
+    return blake3_parallel(map, size, max(1u, thread::hardware_concurrency()));
+}
+
+
+// copies the bytes [offset, offset + len) of src_fd to the same place in dst_fd (in the kernel when possible)
+static void copy_file_data(int src_fd, int dst_fd, uint64_t offset, uint64_t len) {
+    loff_t in_off = offset;
+    loff_t out_off = offset;
+    uint64_t end = offset + len;
+
+    while ((uint64_t)in_off < end) {
+        ssize_t n = copy_file_range(src_fd, &in_off, dst_fd, &out_off, end - in_off, 0);
+        if (n > 0)
+            continue;
+        if (n == 0)
+            throw runtime_error("Could not copy file !");
+
+        // not supported between these files
+        if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)
+            throw runtime_error("Could not copy file !");
+        break;
+    }
+
+    vector<char> buffer(min(end - in_off, (uint64_t)1 << 20));
+
+    while ((uint64_t)in_off < end) {
+        ssize_t n = pread(src_fd, buffer.data(), min((uint64_t)buffer.size(), end - in_off), in_off);
+        if (n <= 0)
+            throw runtime_error("Could not read file !");
+
+        for (ssize_t done = 0; done < n;) {
+            ssize_t written = pwrite(dst_fd, buffer.data() + done, n - done, out_off + done);
+            if (written <= 0)
+                throw runtime_error("Could not write file !");
+            done += written;
+        }
+
+        in_off += n;
+        out_off += n;
+    }
+}
+
+
+/*
+Copies the first size bytes of src_fd to the empty file dst_fd, throws on error.
+The blocks are shared if the filesystem supports reflinks (FICLONE), else only the data extents
+are copied, so the holes of a sparse file stay holes.
+*/
+void copy_file_content(int src_fd, int dst_fd, uint64_t size) {
+    struct stat st;
+    if (fstat(src_fd, &st) == 0 && (uint64_t)st.st_size == size && ioctl(dst_fd, FICLONE, src_fd) == 0)
+        return;
+
+    if (ftruncate(dst_fd, size) != 0)
+        throw runtime_error("Could not write file !");
+
+    for (const FILE_EXTENT &extent : get_data_extents(src_fd, size))
+        copy_file_data(src_fd, dst_fd, extent.offset, extent.length);
+}
+
+
+/*
+Creates dst with the content and permissions of the regular file src, in one step: dst never
+appears partially written. Throws on error, and if dst exists. Returns the size of the copy.
+*/
+uint64_t clone_file(const fs::path &src, const fs::path &dst) {
+    int src_fd = open(src.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat st;
+    if (src_fd == -1 || fstat(src_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (src_fd != -1) close(src_fd);
+        throw runtime_error("Could not open file !");
+    }
+
+    fs::path temppath;
+    int fd = open_upload_file(dst, temppath);
+    if (fd == -1) {
+        close(src_fd);
+        throw runtime_error("Could not create file !");
+    }
+
+    try {
+        copy_file_content(src_fd, fd, st.st_size);
+        fchmod(fd, st.st_mode & 07777);
+
+        // linked rather than renamed, which would replace an existing dst
+        int err = temppath.empty() ? link_open_file(fd, dst) : link(temppath.c_str(), dst.c_str());
+        if (err != 0)
+            throw runtime_error(errno == EEXIST ? "The destination already exists !" : "Could not create file !");
+        discard_upload_file(temppath);
+    } catch (...) {
+        close(fd);
+        close(src_fd);
+        discard_upload_file(temppath);
+        throw;
+    }
+
+    close(fd);
+    close(src_fd);
+    return st.st_size;
+}
+
+
+// hidden name next to filepath, for a file that is not complete yet
+fs::path get_temp_path(const fs::path &filepath) {
+    static atomic<unsigned long> counter(0);
+
+    ostringstream name;
+    name << "." << filepath.filename().string().substr(0, TEMP_NAME_MAX_BYTES) << ".lpf-" << getpid() << "-" << counter++;
+    return filepath.parent_path() / name.str();
+}
+
+
+/*
+Unique path in the server's staging folder (meta/staging), for a file or directory of a user that is
+not complete yet. Clients can't name it, and it's renamed into the user root once complete (so, like
+the trash, the staging folder must be on the filesystem of the user roots).
+*/
+fs::path get_staging_path(const fs::path &filepath) {
+    static atomic<unsigned long> counter(0);
+
+    ostringstream name;
+    name << getpid() << "-" << counter++ << "-" << filepath.filename().string().substr(0, TEMP_NAME_MAX_BYTES);
+    return get_server_meta_folder("staging") / name.str();
+}
+
+
+/*
+Removes what interrupted uploads and directory copies left in the staging folder (see get_staging_path()),
+must not run while some are in progress. Returns the number of entries removed.
+*/
+size_t clear_staging_folder() {
+    size_t removed = 0;
+    error_code ec;
+
+    for (const fs::directory_entry &entry : fs::directory_iterator(get_server_meta_folder("staging"))) {
+        fs::remove_all(entry.path(), ec);
+        removed++;
+    }
+
+    return removed;
+}
+
+
+/*
+Opens a file to receive the content of filepath, without touching filepath itself.
+The file is unnamed (O_TMPFILE) in the directory of filepath: it only shows up once published
+with publish_upload_file(), and vanishes by itself when closed before.
+Where O_TMPFILE is not supported, a file of the staging folder is used instead (temppath is set).
+Returns -1 on error.
+*/
+int open_upload_file(const fs::path &filepath, fs::path &temppath) {
+    temppath.clear();
+
+    // readable too, the file may be read back before it is published (see ChunkStore)
+    int fd = open(filepath.parent_path().c_str(), O_RDWR | O_TMPFILE | O_CLOEXEC, 0666);
+    if (fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR))
+        return fd;
+
+    for (int attempt = 0; attempt < TEMP_NAME_ATTEMPTS; attempt++) {
+        temppath = get_staging_path(filepath);
+        fd = open(temppath.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (fd != -1 || errno != EEXIST) break;
+    }
+
+    if (fd == -1) temppath.clear();
+    return fd;
+}
+
+
+/*
+Gives a name to an open file (which may be unnamed, see open_upload_file()).
+Returns -1 on error (errno is EEXIST if linkpath exists).
+*/
+int link_open_file(int fd, const fs::path &linkpath) {
+    // AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH, /proc works for everyone else
+    if (linkat(fd, "", AT_FDCWD, linkpath.c_str(), AT_EMPTY_PATH) == 0)
+        return 0;
+    if (errno == EEXIST)
+        return -1;
+
+    string fdpath = "/proc/self/fd/" + to_string(fd);
+    return linkat(AT_FDCWD, fdpath.c_str(), AT_FDCWD, linkpath.c_str(), AT_SYMLINK_FOLLOW);
+}
+
+
+/*
+Moves a file opened by open_upload_file() to filepath, atomically replacing the file there if any:
+readers get either the previous content or the new one, never a mix. Throws on error.
+*/
+void publish_upload_file(int fd, fs::path &temppath, const fs::path &filepath) {
+    if (temppath.empty()) {
+        // an unnamed file cannot replace a file, it is linked in the staging folder first
+        for (int attempt = 0; attempt < TEMP_NAME_ATTEMPTS && temppath.empty(); attempt++) {
+            fs::path linkpath = get_staging_path(filepath);
+
+            if (link_open_file(fd, linkpath) == 0)
+                temppath = linkpath;
+            else if (errno != EEXIST)
+                throw runtime_error("Could not link the received file !");
+        }
+
+        if (temppath.empty())
+            throw runtime_error("Could not link the received file !");
+    }
+
+    if (rename(temppath.c_str(), filepath.c_str()) != 0)
+        throw runtime_error("Could not replace the file !");
+
+    temppath.clear();
+}
+
+
+// removes what's left of an upload that was not published (nothing for an unnamed file)
+void discard_upload_file(fs::path &temppath) {
+    if (!temppath.empty())
+        unlink(temppath.c_str());
+    temppath.clear();
+}
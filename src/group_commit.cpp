@@ -0,0 +1,96 @@
+#include "../include/group_commit.hpp"
+#include "../include/logger.hpp"
+
+#include <sstream>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+
+GroupCommitter::GroupCommitter() {
+    enabled = false;
+    sync_fd = -1;
+    requested = 0;
+    completed = 0;
+    syncing = false;
+}
+
+GroupCommitter::~GroupCommitter() {
+    if (sync_fd != -1)
+        close(sync_fd);
+}
+
+
+// turns on the durable mode, root is any path on the filesystem to sync
+void GroupCommitter::enable(const fs::path &root) {
+    lock_guard<mutex> guard(lock);
+
+    if (sync_fd != -1)
+        close(sync_fd);
+
+    sync_fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (sync_fd == -1)
+        throw runtime_error("Could not open the server root for syncing !");
+
+    enabled = true;
+}
+
+
+bool GroupCommitter::is_enabled() {
+    lock_guard<mutex> guard(lock);
+    return enabled;
+}
+
+
+/*
+Waits until everything written before the call is on disk, throws if the sync failed.
+*/
+void GroupCommitter::commit() {
+    unique_lock<mutex> guard(lock);
+
+    if (!enabled)
+        return;
+
+    unsigned long ticket = ++requested;
+
+    while (completed < ticket) {
+        if (syncing) {
+            // a round is running, but it may have started before our changes
+            round_done.wait(guard);
+            continue;
+        }
+
+        // lead a round covering every commit requested so far
+        syncing = true;
+        unsigned long target = requested;
+        guard.unlock();
+
+        bool ok = syncfs(sync_fd) == 0;
+        string err = ok ? "" : strerror(errno);
+
+        guard.lock();
+        syncing = false;
+
+        if (ok) {
+            completed = target;
+        } else {
+            ostringstream msg;
+            msg << "Group commit failed: " << err;
+            log_error(msg, nullptr);
+        }
+        round_done.notify_all();
+
+        if (!ok)
+            throw runtime_error("Could not sync to disk !");
+    }
+}
+
+
+GroupCommitter &get_group_committer() {
+    static GroupCommitter committer;
+    return committer;
+}
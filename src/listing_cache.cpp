@@ -0,0 +1,272 @@
+#include "../include/listing_cache.hpp"
+#include "../include/file_utils.hpp"
+
+#include <iostream>
+#include <cstring>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// listings hold sizes, mtimes and modes, so any write invalidates them. The first event drops the listing
+// and its watch, the writes that follow cost no event until the directory is listed again
+#define LISTING_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB \
+                            | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+
+string listing_cache_key(const fs::path &folderpath) {
+    string key = folderpath.lexically_normal().string();
+    while (key.size() > 1 && key.back() == fs::path::preferred_separator)
+        key.pop_back();
+    return key;
+}
+
+
+ListingCache::ListingCache(): ListingCache(LISTING_CACHE_DEFAULT_MAX_BYTES) {}
+
+ListingCache::ListingCache(size_t max_bytes): max_bytes{ max_bytes } {
+    used_bytes = 0;
+    generation = 0;
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+
+    // without inotify the cache can't know when a listing gets stale, so it stays disabled
+    if (inotify_fd == -1 || stop_fd == -1) {
+        cerr << "Listing cache disabled: " << strerror(errno) << endl;
+        return;
+    }
+
+    watcher = thread(&ListingCache::watch_events, this);
+}
+
+ListingCache::~ListingCache() {
+    if (watcher.joinable()) {
+        uint64_t one = 1;
+        if (::write(stop_fd, &one, sizeof(one)) == sizeof(one))
+            watcher.join();
+        else
+            watcher.detach();
+    }
+
+    if (inotify_fd != -1) close(inotify_fd);
+    if (stop_fd != -1) close(stop_fd);
+}
+
+
+// lists folderpath in both formats
+static DIRECTORY_LISTING list_directory_formats(const fs::path &folderpath) {
+    DIRECTORY_LISTING listing;
+    listing.entries = stat_directory_content(folderpath);
+    listing.text = directory_content_to_text(listing.entries, folderpath);
+    return listing;
+}
+
+
+static size_t listing_cost(const string &key, const DIRECTORY_LISTING &listing) {
+    return key.size() + listing.entries.size() + listing.text.size() + LISTING_CACHE_ENTRY_OVERHEAD;
+}
+
+
+/*
+Returns the listing of folderpath, from the cache if possible.
+On a miss the directory is listed with stat_directory_content() and the result is cached.
+*/
+DIRECTORY_LISTING ListingCache::get(const fs::path &folderpath) {
+    string key = listing_cache_key(folderpath);
+    DIRECTORY_LISTING listing;
+
+    if (find(folderpath, listing))
+        return listing;
+
+    if (!watcher.joinable())
+        return list_directory_formats(folderpath);
+
+    // watch the directory before listing it so no change can slip in between
+    int wd = inotify_add_watch(inotify_fd, key.c_str(), LISTING_WATCH_MASK);
+
+    unsigned long start_generation;
+    {
+        lock_guard<mutex> guard(lock);
+        start_generation = generation;
+        if (wd != -1) watches[wd].push_back(key);
+    }
+
+    listing = list_directory_formats(folderpath);
+
+    lock_guard<mutex> guard(lock);
+
+    size_t cost = listing_cost(key, listing);
+
+    // don't cache if the directory changed while listing it, or if it can't be watched
+    if (wd == -1 || generation != start_generation || cost > max_bytes || entries.count(key) != 0) {
+        if (wd != -1) drop_watch_key(wd, key);
+        return listing;
+    }
+
+    while (used_bytes + cost > max_bytes && !lru.empty())
+        evict(prev(lru.end()));
+
+    lru.push_front({key, listing, wd});
+    entries[key] = lru.begin();
+    used_bytes += cost;
+
+    return listing;
+}
+
+
+/*
+Looks up a cached listing without touching the filesystem.
+Returns false if folderpath is not cached.
+*/
+bool ListingCache::find(const fs::path &folderpath, DIRECTORY_LISTING &listing) {
+    string key = listing_cache_key(folderpath);
+
+    lock_guard<mutex> guard(lock);
+
+    auto it = entries.find(key);
+    if (it == entries.end())
+        return false;
+
+    // move to front
+    lru.splice(lru.begin(), lru, it->second);
+    listing = it->second->listing;
+    return true;
+}
+
+
+void ListingCache::invalidate(const fs::path &folderpath) {
+    string key = listing_cache_key(folderpath);
+
+    lock_guard<mutex> guard(lock);
+    generation++;
+
+    auto it = entries.find(key);
+    if (it != entries.end())
+        evict(it->second);
+}
+
+
+/*
+Drops the cached listings of folderpath and of all its subdirectories.
+*/
+void ListingCache::invalidate_tree(const fs::path &folderpath) {
+    string key = listing_cache_key(folderpath);
+    string prefix = key + (char)fs::path::preferred_separator;
+
+    lock_guard<mutex> guard(lock);
+    generation++;
+
+    for (auto it = lru.begin(); it != lru.end();) {
+        auto next_it = next(it);
+        if (it->key == key || it->key.compare(0, prefix.size(), prefix) == 0)
+            evict(it);
+        it = next_it;
+    }
+}
+
+
+// lock must be held
+void ListingCache::evict(list<CACHE_ENTRY>::iterator it) {
+    used_bytes -= listing_cost(it->key, it->listing);
+    drop_watch_key(it->wd, it->key);
+    entries.erase(it->key);
+    lru.erase(it);
+}
+
+
+// lock must be held
+void ListingCache::drop_watch_key(int wd, const string &key) {
+    auto wit = watches.find(wd);
+    if (wit == watches.end())
+        return;
+
+    vector<string> &keys = wit->second;
+    for (auto kit = keys.begin(); kit != keys.end(); kit++) {
+        if (*kit == key) {
+            keys.erase(kit);
+            break;
+        }
+    }
+
+    if (keys.empty()) {
+        inotify_rm_watch(inotify_fd, wd);
+        watches.erase(wit);
+    }
+}
+
+
+void ListingCache::watch_events() {
+    alignas(struct inotify_event) char buffer[4096];
+
+    struct pollfd fds[2] = {
+        {inotify_fd, POLLIN, 0},
+        {stop_fd, POLLIN, 0}
+    };
+
+    while (true) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            cerr << "Listing cache watcher stopped: " << strerror(errno) << endl;
+            return;
+        }
+
+        if (fds[1].revents & POLLIN)
+            return;
+
+        ssize_t len = ::read(inotify_fd, buffer, sizeof(buffer));
+        if (len <= 0)
+            continue;
+
+        lock_guard<mutex> guard(lock);
+        generation++;
+
+        for (char *ptr = buffer; ptr < buffer + len;) {
+            const struct inotify_event *event = (const struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            // the queue overflowed, some events were lost
+            if (event->mask & IN_Q_OVERFLOW) {
+                while (!lru.empty())
+                    evict(lru.begin());
+                continue;
+            }
+
+            auto wit = watches.find(event->wd);
+            if (wit == watches.end())
+                continue;
+
+            // the watch is gone (directory removed), the kernel already dropped it
+            if (event->mask & IN_IGNORED) {
+                vector<string> keys = wit->second;
+                watches.erase(wit);
+                for (const string &key : keys) {
+                    auto it = entries.find(key);
+                    if (it != entries.end()) {
+                        used_bytes -= listing_cost(it->second->key, it->second->listing);
+                        lru.erase(it->second);
+                        entries.erase(it);
+                    }
+                }
+                continue;
+            }
+
+            vector<string> keys = wit->second;
+            for (const string &key : keys) {
+                auto it = entries.find(key);
+                if (it != entries.end())
+                    evict(it->second);
+            }
+        }
+    }
+}
+
+
+ListingCache &get_listing_cache() {
+    static ListingCache cache;
+    return cache;
+}
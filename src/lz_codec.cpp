@@ -0,0 +1,164 @@
+#include "../include/lz_codec.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+
+static uint32_t read32(const char *ptr) {
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static uint32_t lz_hash(uint32_t value) {
+    return (value * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+
+// bytes taken by a length after its 4 bits in the token (15 means "more bytes follow")
+static size_t extra_length_bytes(size_t length) {
+    return length >= 15 ? (length - 15) / 255 + 1 : 0;
+}
+
+static void put_extra_length(char *dst, size_t &out, size_t length) {
+    length -= 15;
+    while (length >= 255) {
+        dst[out++] = (char)255;
+        length -= 255;
+    }
+    dst[out++] = (char)length;
+}
+
+static bool read_extra_length(const char *src, size_t src_len, size_t &ip, size_t &length) {
+    while (ip < src_len) {
+        uint8_t byte = (uint8_t)src[ip++];
+        length += byte;
+        if (byte != 255)
+            return true;
+    }
+    return false;
+}
+
+
+size_t lz_compress(const char *src, size_t src_len, char *dst, size_t dst_cap, size_t &consumed) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0xFF, sizeof(table));
+
+    size_t out = 0;
+    size_t anchor = 0;     // start of the literals not encoded yet
+    size_t ip = 0;
+
+    while (ip + LZ_MIN_MATCH <= src_len) {
+        uint32_t sequence = read32(src + ip);
+        uint32_t hash = lz_hash(sequence);
+        uint32_t ref = table[hash];
+        table[hash] = ip;
+
+        if (ref == UINT32_MAX || ip - ref > LZ_MAX_OFFSET || read32(src + ref) != sequence) {
+            // the longer nothing matches, the faster we move on (incompressible data)
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        size_t length = LZ_MIN_MATCH;
+        while (ip + length < src_len && src[ref + length] == src[ip + length])
+            length++;
+
+        size_t literals = ip - anchor;
+        size_t cost = 1 + extra_length_bytes(literals) + literals + 2 + extra_length_bytes(length - LZ_MIN_MATCH);
+
+        // keep a byte for the token of the last sequence
+        if (out + cost + 1 > dst_cap)
+            break;
+
+        size_t token = out++;
+        dst[token] = (char)((min(literals, (size_t)15) << 4) | min(length - LZ_MIN_MATCH, (size_t)15));
+
+        if (literals >= 15)
+            put_extra_length(dst, out, literals);
+        memcpy(dst + out, src + anchor, literals);
+        out += literals;
+
+        uint16_t offset = ip - ref;
+        dst[out++] = (char)(offset & 0xFF);
+        dst[out++] = (char)(offset >> 8);
+
+        if (length - LZ_MIN_MATCH >= 15)
+            put_extra_length(dst, out, length - LZ_MIN_MATCH);
+
+        ip += length;
+        anchor = ip;
+    }
+
+    // last sequence: the remaining literals, as many as fit
+    if (out >= dst_cap) {
+        consumed = anchor;
+        return out;
+    }
+
+    size_t space = dst_cap - out;
+    size_t literals = min(src_len - anchor, space - 1);
+    while (1 + extra_length_bytes(literals) + literals > space)
+        literals--;
+
+    dst[out++] = (char)(min(literals, (size_t)15) << 4);
+    if (literals >= 15)
+        put_extra_length(dst, out, literals);
+    memcpy(dst + out, src + anchor, literals);
+    out += literals;
+
+    consumed = anchor + literals;
+    return out;
+}
+
+
+// returns false if src is not a valid block or doesn't fit in dst
+bool lz_decompress(const char *src, size_t src_len, char *dst, size_t dst_cap, size_t &dst_len) {
+    size_t ip = 0;
+    size_t out = 0;
+
+    while (ip < src_len) {
+        uint8_t token = (uint8_t)src[ip++];
+
+        size_t literals = token >> 4;
+        if (literals == 15 && !read_extra_length(src, src_len, ip, literals))
+            return false;
+        if (literals > src_len - ip || literals > dst_cap - out)
+            return false;
+
+        memcpy(dst + out, src + ip, literals);
+        ip += literals;
+        out += literals;
+
+        // the last sequence has no back-reference
+        if (ip == src_len)
+            break;
+
+        if (src_len - ip < 2)
+            return false;
+        size_t offset = (uint8_t)src[ip] | ((size_t)(uint8_t)src[ip + 1] << 8);
+        ip += 2;
+
+        size_t length = token & 15;
+        if (length == 15 && !read_extra_length(src, src_len, ip, length))
+            return false;
+        length += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > out || length > dst_cap - out)
+            return false;
+
+        if (offset >= length) {
+            memcpy(dst + out, dst + out - offset, length);
+        } else {
+            // byte by byte: the reference overlaps what is being written
+            for (size_t i = 0; i < length; i++)
+                dst[out + i] = dst[out - offset + i];
+        }
+        out += length;
+    }
+
+    dst_len = out;
+    return true;
+}
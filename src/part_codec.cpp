@@ -0,0 +1,99 @@
+#include "../include/part_codec.hpp"
+#include "../include/lz_codec.hpp"
+#include "../include/LPTF_Net/LPTF_Utils.hpp"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+using namespace std;
+
+
+static string format_summary(const char *what, uint64_t data_bytes, uint64_t wire_bytes, uint64_t parts, chrono::steady_clock::duration time) {
+    ostringstream summary;
+    summary << fixed << setprecision(2)
+            << what << ": " << parts << " compressed part(s), " << data_bytes << " byte(s) of data as " << wire_bytes << " byte(s)"
+            << " (ratio " << (wire_bytes > 0 ? (double)data_bytes / wire_bytes : 1.0) << "), "
+            << chrono::duration<double, milli>(time).count() << " ms";
+    return summary.str();
+}
+
+
+PartEncoder::PartEncoder(bool compress): compress{ compress } {
+    bypass = 0;
+    data_bytes = 0;
+    sent_bytes = 0;
+    compressed_parts = 0;
+    compress_time = chrono::steady_clock::duration::zero();
+}
+
+
+/*
+Builds the next part from data (len > 0 bytes available).
+consumed is set to the number of bytes of data the part holds.
+*/
+LPTF_Packet PartEncoder::next_part(const char *data, size_t len, size_t &consumed) {
+    if (compress && bypass == 0) {
+        auto start = chrono::steady_clock::now();
+        size_t size = lz_compress(data, min(len, (size_t)COMPRESS_BLOCK_BYTES), buffer, sizeof(buffer), consumed);
+        compress_time += chrono::steady_clock::now() - start;
+
+        if (size < consumed) {
+            data_bytes += consumed;
+            sent_bytes += size;
+            compressed_parts++;
+            return build_compressed_part_packet(buffer, size);
+        }
+
+        bypass = COMPRESS_BYPASS_PARTS;
+    } else if (bypass > 0) {
+        bypass--;
+    }
+
+    consumed = min(len, (size_t)MAX_BINARY_PART_BYTES);
+    data_bytes += consumed;
+    sent_bytes += consumed;
+    return build_binary_part_packet((void *)data, consumed);
+}
+
+
+string PartEncoder::get_summary() {
+    return format_summary("Compression", data_bytes, sent_bytes, compressed_parts, compress_time);
+}
+
+
+PartDecoder::PartDecoder() {
+    data_bytes = 0;
+    received_bytes = 0;
+    compressed_parts = 0;
+    decompress_time = chrono::steady_clock::duration::zero();
+}
+
+
+// the file data of a part (valid until the next call), throws if a compressed part is corrupt
+BINARY_PART_PACKET_STRUCT PartDecoder::decode(LPTF_Packet &packet) {
+    BINARY_PART_PACKET_STRUCT part = get_data_from_binary_part_packet(packet);
+    received_bytes += part.len;
+
+    if (!is_compressed_part_packet(packet)) {
+        data_bytes += part.len;
+        return part;
+    }
+
+    auto start = chrono::steady_clock::now();
+    size_t len;
+    bool ok = lz_decompress((const char *)part.data, part.len, buffer, sizeof(buffer), len);
+    decompress_time += chrono::steady_clock::now() - start;
+
+    if (!ok)
+        throw runtime_error("Corrupt compressed part !");
+
+    data_bytes += len;
+    compressed_parts++;
+    return {buffer, (uint16_t)len};
+}
+
+
+string PartDecoder::get_summary() {
+    return format_summary("Decompression", data_bytes, received_bytes, compressed_parts, decompress_time);
+}
@@ -0,0 +1,32 @@
+#include "../include/path_locks.hpp"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+
+// the lock of filepath, the same for every session while one of them holds it
+shared_ptr<mutex> PathLocks::get(const fs::path &filepath) {
+    string key = filepath.lexically_normal().string();
+
+    lock_guard<mutex> guard(table_lock);
+
+    shared_ptr<mutex> lock = locks[key].lock();
+    if (!lock) {
+        lock = make_shared<mutex>();
+        locks[key] = lock;
+    }
+
+    // forget the locks nobody holds anymore
+    for (auto it = locks.begin(); it != locks.end();) {
+        if (it->second.expired()) it = locks.erase(it);
+        else it++;
+    }
+
+    return lock;
+}
+
+
+PathLocks &get_path_locks() {
+    static PathLocks locks;
+    return locks;
+}
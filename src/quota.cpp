@@ -0,0 +1,329 @@
+#include "../include/quota.hpp"
+#include "../include/file_utils.hpp"
+#include "../include/logger.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+
+fs::path get_quota_journal(const string &username) {
+    return get_server_meta_folder("quota") / (username + ".journal");
+}
+
+
+QuotaManager::QuotaManager(): QuotaManager(USER_QUOTA_DEFAULT_BYTES) {}
+
+QuotaManager::QuotaManager(uint64_t limit): limit{ limit } {
+    stop = false;
+}
+
+QuotaManager::~QuotaManager() {
+    {
+        lock_guard<mutex> guard(reconciler_lock);
+        stop = true;
+    }
+    reconciler_cv.notify_all();
+
+    if (reconciler.joinable())
+        reconciler.join();
+
+    for (auto &user : users)
+        if (user.second->journal_fd != -1)
+            close(user.second->journal_fd);
+}
+
+
+/*
+Returns the usage of a user, loaded from its journal (or scanned) the first time.
+*/
+shared_ptr<QuotaManager::USER_USAGE> QuotaManager::get_user(const string &username) {
+    shared_ptr<USER_USAGE> usage;
+    {
+        lock_guard<mutex> guard(users_lock);
+
+        auto it = users.find(username);
+        if (it != users.end())
+            return it->second;
+
+        usage = make_shared<USER_USAGE>();
+        usage->used = 0;
+        usage->reserved = 0;
+        usage->scan_delta = 0;
+        usage->scanning = false;
+        usage->journal_fd = -1;
+        usage->journal_records = 0;
+        users[username] = usage;
+
+        // loaded while holding the user lock so no one uses it before it's ready
+        usage->lock.lock();
+    }
+
+    try {
+        load(username, *usage);
+    } catch (const exception &ex) {
+        cerr << "Could not load quota journal of " << username << ": " << ex.what() << endl;
+    }
+
+    usage->lock.unlock();
+    return usage;
+}
+
+
+// user lock must be held
+void QuotaManager::load(const string &username, USER_USAGE &usage) {
+    fs::path journal = get_quota_journal(username);
+
+    ifstream file(journal);
+
+    if (file.is_open()) {
+        string line;
+        while (getline(file, line)) {
+            if (line.size() < 2) continue;
+
+            uint64_t value = strtoull(line.c_str() + 1, nullptr, 10);
+            if (line[0] == '=') usage.used = value;
+            else if (line[0] == '+') usage.used += value;
+            else if (line[0] == '-') usage.used = value > usage.used ? 0 : usage.used - value;
+
+            usage.journal_records++;
+        }
+        file.close();
+    } else {
+        // first time this user is seen, the only full scan outside of reconciliation
+        usage.used = get_tree_size(get_user_root(username)) + get_tree_size(get_user_trash(username));
+    }
+
+    write_snapshot(username, usage);
+}
+
+
+/*
+Rewrites the journal as a single record with the current usage (write + rename, so
+a crash leaves either the old or the new journal).
+User lock must be held.
+*/
+void QuotaManager::write_snapshot(const string &username, USER_USAGE &usage) {
+    fs::path journal = get_quota_journal(username);
+    fs::path tmp = journal;
+    tmp += ".tmp";
+
+    ofstream file(tmp, ios::trunc);
+    if (!file.is_open())
+        throw runtime_error("Could not write quota journal !");
+    file << "=" << usage.used << endl;
+    file.close();
+
+    if (usage.journal_fd != -1)
+        close(usage.journal_fd);
+
+    fs::rename(tmp, journal);
+
+    usage.journal_fd = open(journal.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    usage.journal_records = 1;
+}
+
+
+uint64_t QuotaManager::get_usage(const string &username) {
+    shared_ptr<USER_USAGE> usage = get_user(username);
+    lock_guard<mutex> guard(usage->lock);
+    return usage->used;
+}
+
+
+uint64_t QuotaManager::get_limit() {
+    return limit;
+}
+
+
+/*
+Checks and reserves new_bytes in one step, so concurrent writes can't all pass the check
+and together exceed the quota. The reservation ends with commit() or release().
+*/
+bool QuotaManager::reserve(const string &username, uint64_t new_bytes, uint64_t replaced_bytes) {
+    shared_ptr<USER_USAGE> usage = get_user(username);
+    lock_guard<mutex> guard(usage->lock);
+
+    uint64_t after = usage->used > replaced_bytes ? usage->used - replaced_bytes : 0;
+    if (after + usage->reserved + new_bytes > limit)
+        return false;
+
+    usage->reserved += new_bytes;
+    return true;
+}
+
+
+// ends a reservation and accounts the change actually made
+void QuotaManager::commit(const string &username, uint64_t reserved_bytes, int64_t delta) {
+    shared_ptr<USER_USAGE> usage = get_user(username);
+    lock_guard<mutex> guard(usage->lock);
+
+    usage->reserved -= min(reserved_bytes, usage->reserved);
+    apply(username, *usage, delta);
+}
+
+
+void QuotaManager::release(const string &username, uint64_t reserved_bytes) {
+    shared_ptr<USER_USAGE> usage = get_user(username);
+    lock_guard<mutex> guard(usage->lock);
+
+    usage->reserved -= min(reserved_bytes, usage->reserved);
+}
+
+
+void QuotaManager::add(const string &username, int64_t delta) {
+    shared_ptr<USER_USAGE> usage = get_user(username);
+    lock_guard<mutex> guard(usage->lock);
+
+    apply(username, *usage, delta);
+}
+
+
+// user lock must be held
+void QuotaManager::apply(const string &username, USER_USAGE &usage, int64_t delta) {
+    if (delta == 0)
+        return;
+
+    if (delta < 0 && (uint64_t)(-delta) > usage.used) usage.used = 0;
+    else usage.used += delta;
+
+    if (usage.scanning)
+        usage.scan_delta += delta;
+
+    if (usage.journal_records >= QUOTA_JOURNAL_COMPACT_RECORDS || usage.journal_fd == -1) {
+        try {
+            write_snapshot(username, usage);
+        } catch (const exception &ex) {
+            cerr << "Could not compact quota journal of " << username << ": " << ex.what() << endl;
+        }
+        return;
+    }
+
+    string record = (delta < 0 ? "-" + to_string(-delta) : "+" + to_string(delta)) + "\n";
+    if (::write(usage.journal_fd, record.c_str(), record.size()) == (ssize_t)record.size())
+        usage.journal_records++;
+}
+
+
+/*
+Recomputes the usage of a user from disk.
+The scan runs without the user lock, the changes made meanwhile are added to its result.
+*/
+void QuotaManager::reconcile(const string &username) {
+    shared_ptr<USER_USAGE> usage = get_user(username);
+
+    {
+        lock_guard<mutex> guard(usage->lock);
+        if (usage->scanning) return;
+        usage->scanning = true;
+        usage->scan_delta = 0;
+    }
+
+    uint64_t scanned = 0;
+    bool ok = true;
+    try {
+        scanned = get_tree_size(get_user_root(username)) + get_tree_size(get_user_trash(username));
+    } catch (const exception &ex) {
+        cerr << "Quota reconciliation of " << username << " failed: " << ex.what() << endl;
+        ok = false;
+    }
+
+    lock_guard<mutex> guard(usage->lock);
+    usage->scanning = false;
+
+    if (!ok)
+        return;
+
+    uint64_t reconciled = usage->scan_delta < 0 && (uint64_t)(-usage->scan_delta) > scanned ? 0 : scanned + usage->scan_delta;
+
+    if (reconciled != usage->used) {
+        ostringstream msg;
+        msg << "Quota of " << username << " reconciled: " << usage->used << " -> " << reconciled << " byte(s)";
+        log_info(msg, nullptr);
+
+        usage->used = reconciled;
+        try {
+            write_snapshot(username, *usage);
+        } catch (const exception &ex) {
+            cerr << "Could not write quota journal of " << username << ": " << ex.what() << endl;
+        }
+    }
+}
+
+
+void QuotaManager::reconcile_loop() {
+    while (true) {
+        {
+            unique_lock<mutex> lock(reconciler_lock);
+            reconciler_cv.wait_for(lock, chrono::seconds(QUOTA_RECONCILE_INTERVAL_S), [this] { return stop; });
+            if (stop) return;
+        }
+
+        vector<string> usernames;
+        {
+            lock_guard<mutex> guard(users_lock);
+            for (auto &user : users)
+                usernames.push_back(user.first);
+        }
+
+        for (const string &username : usernames)
+            reconcile(username);
+    }
+}
+
+
+void QuotaManager::start_reconciler() {
+    if (!reconciler.joinable())
+        reconciler = thread(&QuotaManager::reconcile_loop, this);
+}
+
+
+QuotaManager &get_quota_manager() {
+    static QuotaManager manager;
+    return manager;
+}
+
+
+
+QuotaReservation::QuotaReservation() {
+    bytes = 0;
+}
+
+QuotaReservation::~QuotaReservation() {
+    if (bytes > 0)
+        get_quota_manager().release(username, bytes);
+}
+
+
+bool QuotaReservation::reserve(const string &username, uint64_t new_bytes, uint64_t replaced_bytes) {
+    lock_guard<mutex> guard(lock);
+    if (!get_quota_manager().reserve(username, new_bytes, replaced_bytes))
+        return false;
+
+    this->username = username;
+    bytes += new_bytes;
+    return true;
+}
+
+
+// accounts delta and ends the whole reservation
+void QuotaReservation::commit(int64_t delta) {
+    commit(UINT64_MAX, delta);
+}
+
+
+// accounts delta and ends part of the reservation (the rest stays reserved)
+void QuotaReservation::commit(uint64_t reserved_bytes, int64_t delta) {
+    lock_guard<mutex> guard(lock);
+    reserved_bytes = min(reserved_bytes, bytes);
+    get_quota_manager().commit(username, reserved_bytes, delta);
+    bytes -= reserved_bytes;
+}
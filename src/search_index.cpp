@@ -0,0 +1,466 @@
+#include "../include/search_index.hpp"
+#include "../include/tree_walker.hpp"
+#include "../include/file_utils.hpp"
+#include "../include/logger.hpp"
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <unordered_set>
+
+#include <fnmatch.h>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+#define INDEX_OP_ADD 0
+#define INDEX_OP_REMOVE 1
+#define INDEX_OP_REMOVE_TREE 2
+#define INDEX_OP_RENAME_TREE 3
+
+#define INDEX_COMPACT_MIN_REMOVED 1024
+
+
+string to_lower(const string &str) {
+    string lower = str;
+    transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return tolower(c); });
+    return lower;
+}
+
+
+// distinct trigrams of a lowercase string, sorted
+vector<uint32_t> get_trigrams(const string &lower) {
+    vector<uint32_t> trigrams;
+
+    for (size_t i = 0; i + 3 <= lower.size(); i++) {
+        trigrams.push_back(((uint32_t)(unsigned char)lower[i] << 16)
+                           | ((uint32_t)(unsigned char)lower[i+1] << 8)
+                           | (uint32_t)(unsigned char)lower[i+2]);
+    }
+
+    sort(trigrams.begin(), trigrams.end());
+    trigrams.erase(unique(trigrams.begin(), trigrams.end()), trigrams.end());
+    return trigrams;
+}
+
+
+// literal parts of a glob pattern (outside of *, ? and [...])
+vector<string> get_glob_literals(const string &pattern) {
+    vector<string> literals;
+    string current;
+
+    for (size_t i = 0; i < pattern.size(); i++) {
+        char c = pattern[i];
+
+        if (c == '*' || c == '?' || c == '[') {
+            if (!current.empty()) literals.push_back(current);
+            current.clear();
+
+            if (c == '[') {
+                size_t end = pattern.find(']', i + 2);
+                if (end == string::npos) break;
+                i = end;
+            }
+        } else if (c == '\\' && i + 1 < pattern.size()) {
+            current.push_back(pattern[++i]);
+        } else {
+            current.push_back(c);
+        }
+    }
+
+    if (!current.empty()) literals.push_back(current);
+    return literals;
+}
+
+
+shared_ptr<SearchIndex::USER_INDEX> SearchIndex::get_user(const string &username) {
+    lock_guard<mutex> guard(users_lock);
+
+    auto it = users.find(username);
+    if (it != users.end())
+        return it->second;
+
+    shared_ptr<USER_INDEX> index = make_shared<USER_INDEX>();
+    index->removed = 0;
+    index->generation = 0;
+    index->ready = false;
+    index->building = false;
+    users[username] = index;
+    return index;
+}
+
+
+// index lock must be held
+void SearchIndex::insert(USER_INDEX &index, const string &path, bool is_dir) {
+    if (path.empty() || index.ids.count(path) != 0)
+        return;
+
+    uint32_t id = index.entries.size();
+    index.entries.push_back({path, is_dir});
+    index.ids[path] = id;
+
+    // ids only grow, so the posting lists stay sorted
+    for (uint32_t trigram : get_trigrams(to_lower(path)))
+        index.postings[trigram].push_back(id);
+}
+
+
+// index lock must be held
+void SearchIndex::erase(USER_INDEX &index, const string &path) {
+    auto it = index.ids.find(path);
+    if (it == index.ids.end())
+        return;
+
+    // the posting lists are only cleaned up by compact()
+    index.entries[it->second].path.clear();
+    index.ids.erase(it);
+    index.removed++;
+}
+
+
+// index lock must be held
+void SearchIndex::erase_tree(USER_INDEX &index, const string &path) {
+    string prefix = path + (char)fs::path::preferred_separator;
+
+    for (auto it = index.ids.begin(); it != index.ids.end();) {
+        if (path.empty() || it->first == path || it->first.compare(0, prefix.size(), prefix) == 0) {
+            index.entries[it->second].path.clear();
+            index.removed++;
+            it = index.ids.erase(it);
+        } else {
+            it++;
+        }
+    }
+}
+
+
+// rebuilds the posting lists without the removed entries, index lock must be held
+void SearchIndex::compact(USER_INDEX &index) {
+    vector<SEARCH_RESULT> entries;
+    entries.swap(index.entries);
+
+    index.ids.clear();
+    index.postings.clear();
+    index.removed = 0;
+    index.generation++;
+
+    for (const SEARCH_RESULT &entry : entries)
+        insert(index, entry.path, entry.is_dir);
+}
+
+
+// index lock must be held
+void SearchIndex::apply(USER_INDEX &index, const INDEX_OP &op) {
+    switch (op.kind) {
+        case INDEX_OP_ADD:
+            insert(index, op.path, op.is_dir);
+            break;
+        case INDEX_OP_REMOVE:
+            erase(index, op.path);
+            break;
+        case INDEX_OP_REMOVE_TREE:
+            erase_tree(index, op.path);
+            break;
+        case INDEX_OP_RENAME_TREE:
+        {
+            string prefix = op.path + (char)fs::path::preferred_separator;
+            vector<SEARCH_RESULT> moved;
+
+            for (const auto &id : index.ids) {
+                if (id.first == op.path || id.first.compare(0, prefix.size(), prefix) == 0)
+                    moved.push_back({op.newpath + id.first.substr(op.path.size()), index.entries[id.second].is_dir});
+            }
+
+            erase_tree(index, op.path);
+            for (const SEARCH_RESULT &entry : moved)
+                insert(index, entry.path, entry.is_dir);
+            break;
+        }
+    }
+
+    if (index.removed > INDEX_COMPACT_MIN_REMOVED && index.removed > index.entries.size() / 2)
+        compact(index);
+}
+
+
+void SearchIndex::record(const string &username, const INDEX_OP &op) {
+    shared_ptr<USER_INDEX> index = get_user(username);
+    unique_lock<shared_mutex> lock(index->lock);
+
+    // an index that was never built will read the change from disk
+    if (index->building) index->pending.push_back(op);
+    if (index->ready) apply(*index, op);
+}
+
+
+void SearchIndex::add(const string &username, const string &path, bool is_dir) {
+    record(username, {INDEX_OP_ADD, path, "", is_dir});
+}
+
+void SearchIndex::remove(const string &username, const string &path) {
+    record(username, {INDEX_OP_REMOVE, path, "", false});
+}
+
+// path can be empty for the whole user root
+void SearchIndex::remove_tree(const string &username, const string &path) {
+    record(username, {INDEX_OP_REMOVE_TREE, path, "", false});
+}
+
+void SearchIndex::rename_tree(const string &username, const string &path, const string &newpath) {
+    record(username, {INDEX_OP_RENAME_TREE, path, newpath, true});
+}
+
+
+SearchIndex::SearchIndex() {
+    stop = false;
+}
+
+SearchIndex::~SearchIndex() {
+    {
+        lock_guard<mutex> guard(builder_lock);
+        stop = true;
+    }
+    builder_cv.notify_all();
+
+    // a build in progress gives up at its next entry
+    if (builder.joinable())
+        builder.join();
+}
+
+
+/*
+(Re)builds the index of a user from its tree. The walk runs without the index lock,
+queries keep using the previous index (or walking the tree) meanwhile.
+*/
+void SearchIndex::build(const string &username) {
+    shared_ptr<USER_INDEX> index = get_user(username);
+
+    {
+        unique_lock<shared_mutex> lock(index->lock);
+        if (index->building) return;
+        index->building = true;
+        index->pending.clear();
+    }
+
+    auto start = chrono::steady_clock::now();
+
+    USER_INDEX built;
+    built.removed = 0;
+
+    try {
+        walk_tree(get_user_root(username), "", [&](const string &relpath, bool is_dir) {
+            insert(built, relpath, is_dir);
+            return !stop;
+        });
+        if (stop)
+            throw runtime_error("server stopping");
+    } catch (const exception &ex) {
+        cerr << "Could not build search index of " << username << ": " << ex.what() << endl;
+        unique_lock<shared_mutex> lock(index->lock);
+        index->building = false;
+        index->pending.clear();
+        return;
+    }
+
+    unique_lock<shared_mutex> lock(index->lock);
+
+    index->entries.swap(built.entries);
+    index->ids.swap(built.ids);
+    index->postings.swap(built.postings);
+    index->removed = 0;
+    index->generation++;
+
+    for (const INDEX_OP &op : index->pending)
+        apply(*index, op);
+    index->pending.clear();
+
+    index->building = false;
+    index->ready = true;
+
+    ostringstream msg;
+    msg << "Search index of " << username << " built: " << index->ids.size() << " path(s) in "
+        << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count() << "ms";
+    log_info(msg, nullptr);
+}
+
+
+// queues the build of a user's index for the builder thread
+void SearchIndex::request_build(const string &username) {
+    {
+        lock_guard<mutex> guard(builder_lock);
+        if (find(build_queue.begin(), build_queue.end(), username) != build_queue.end())
+            return;
+        build_queue.push_back(username);
+    }
+    builder_cv.notify_one();
+}
+
+
+// queues the build of the index of every user in the server root
+void SearchIndex::build_all() {
+    for (fs::directory_entry const& user_root : fs::directory_iterator(get_server_root())) {
+        if (user_root.is_directory())
+            request_build(user_root.path().filename().string());
+    }
+}
+
+
+void SearchIndex::build_loop() {
+    while (true) {
+        string username;
+        {
+            unique_lock<mutex> lock(builder_lock);
+            builder_cv.wait(lock, [this] { return stop || !build_queue.empty(); });
+            if (stop) return;
+
+            username = build_queue.front();
+            build_queue.pop_front();
+        }
+
+        build(username);
+    }
+}
+
+
+void SearchIndex::start_builder() {
+    if (!builder.joinable())
+        builder = thread(&SearchIndex::build_loop, this);
+}
+
+
+/*
+Hands the paths matching pattern (case insensitive) to visit by batches, at most max_results of them.
+pattern is a glob if it contains *, ? or [, otherwise a substring of the path.
+A batch is copied out of the index and handed over without its lock, so a slow reader doesn't
+hold back the changes. If the entries get renumbered meanwhile, the candidates are looked up again
+and the search goes on from the start, skipping the paths already handed over. Until the index is built, the tree is walked instead (and the build requested).
+Returns the number of results.
+*/
+size_t SearchIndex::search(const string &username, const string &pattern, size_t max_results, const SEARCH_VISITOR &visit) {
+    shared_ptr<USER_INDEX> index = get_user(username);
+
+    bool glob = pattern.find_first_of("*?[") != string::npos;
+    string lower = to_lower(pattern);
+
+    auto matches = [&](const string &path) {
+        if (glob) return fnmatch(pattern.c_str(), path.c_str(), FNM_CASEFOLD) == 0;
+        return to_lower(path).find(lower) != string::npos;
+    };
+
+    vector<SEARCH_RESULT> batch;
+    size_t count = 0;
+    bool ready;
+    bool building;
+    {
+        shared_lock<shared_mutex> lock(index->lock);
+        ready = index->ready;
+        building = index->building;
+    }
+
+    if (!ready) {
+        if (!building)
+            request_build(username);
+
+        bool more = true;
+        walk_tree(get_user_root(username), "", [&](const string &relpath, bool is_dir) {
+            if (matches(relpath)) {
+                batch.push_back({relpath, is_dir});
+                count++;
+                if (batch.size() == SEARCH_BATCH_RESULTS) {
+                    more = visit(batch);
+                    batch.clear();
+                }
+            }
+            return more && count < max_results;
+        });
+
+        if (more && !batch.empty())
+            visit(batch);
+        return count;
+    }
+
+    vector<uint32_t> trigrams;
+    for (const string &literal : glob ? get_glob_literals(lower) : vector<string>{lower}) {
+        vector<uint32_t> literal_trigrams = get_trigrams(literal);
+        trigrams.insert(trigrams.end(), literal_trigrams.begin(), literal_trigrams.end());
+    }
+    sort(trigrams.begin(), trigrams.end());
+    trigrams.erase(unique(trigrams.begin(), trigrams.end()), trigrams.end());
+
+    // ids of the candidate entries (all of them if there's no trigram to filter with, for a short query)
+    vector<uint32_t> candidates;
+    bool all_entries = trigrams.empty();
+    unsigned long generation;
+
+    // looks the candidates up for the current ids, false if there's none. index lock must be held
+    auto find_candidates = [&]() {
+        generation = index->generation;
+        candidates.clear();
+
+        // intersect the posting lists, smallest first
+        vector<const vector<uint32_t> *> lists;
+        for (uint32_t trigram : trigrams) {
+            auto it = index->postings.find(trigram);
+            if (it == index->postings.end())
+                return false;
+            lists.push_back(&it->second);
+        }
+        sort(lists.begin(), lists.end(), [](const vector<uint32_t> *a, const vector<uint32_t> *b) { return a->size() < b->size(); });
+
+        if (!lists.empty())
+            candidates = *lists[0];
+        for (size_t i = 1; i < lists.size() && !candidates.empty(); i++) {
+            vector<uint32_t> intersection;
+            set_intersection(candidates.begin(), candidates.end(), lists[i]->begin(), lists[i]->end(), back_inserter(intersection));
+            candidates.swap(intersection);
+        }
+        return true;
+    };
+
+    {
+        shared_lock<shared_mutex> lock(index->lock);
+        if (!find_candidates())
+            return 0;
+    }
+
+    // the paths handed over (at most max_results), so a restart doesn't hand them over twice
+    unordered_set<string> emitted;
+
+    for (size_t next = 0; count < max_results;) {
+        {
+            shared_lock<shared_mutex> lock(index->lock);
+
+            // the ids were renumbered meanwhile, start over with the new ones
+            if (index->generation != generation) {
+                if (!find_candidates())
+                    break;
+                next = 0;
+            }
+
+            size_t end = all_entries ? index->entries.size() : candidates.size();
+            for (; next < end && batch.size() < SEARCH_BATCH_RESULTS && count < max_results; next++) {
+                const SEARCH_RESULT &entry = index->entries[all_entries ? next : candidates[next]];
+                if (!entry.path.empty() && matches(entry.path) && emitted.insert(entry.path).second) {
+                    batch.push_back(entry);
+                    count++;
+                }
+            }
+
+            if (batch.empty())
+                break;
+        }
+
+        if (!visit(batch))
+            break;
+        batch.clear();
+    }
+
+    return count;
+}
+
+
+SearchIndex &get_search_index() {
+    static SearchIndex index;
+    return index;
+}
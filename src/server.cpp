@@ -11,98 +11,25 @@
 #include <sstream>
 
 #include <utility>
+#include <csignal>
 
 #include "../include/LPTF_Net/LPTF_Socket.hpp"
 #include "../include/LPTF_Net/LPTF_Utils.hpp"
 #include "../include/server_actions.hpp"
 #include "../include/file_utils.hpp"
 #include "../include/logger.hpp"
+#include "../include/thread_pool.hpp"
+#include "../include/trash_reaper.hpp"
+#include "../include/catalog.hpp"
+#include "../include/quota.hpp"
+#include "../include/search_index.hpp"
+#include "../include/group_commit.hpp"
+#include "../include/chunk_store.hpp"
 
 using namespace std;
 
 #define PASSWORD_FILE "very_safe_trust_me_bro.txt"
 
-// borrowed from https://www.geeksforgeeks.org/thread-pool-in-cpp/
-class ThreadPool { 
-public: 
-    ThreadPool(size_t num_threads = thread::hardware_concurrency()) {
-        // Creating worker threads
-        for (size_t i = 0; i < num_threads; ++i) { 
-            threads_.emplace_back([this] { 
-                while (true) { 
-                    function<void()> task; 
-                    { 
-                        // Lock queue so that data 
-                        // can be shared safely
-                        unique_lock<mutex> lock( 
-                            queue_mutex_); 
-  
-                        // Waiting until there is a task to 
-                        // execute or the pool is stopped
-                        cv_.wait(lock, [this] { 
-                            return !tasks_.empty() || stop_; 
-                        }); 
-  
-                        // exit the thread in case the pool 
-                        // is stopped and there are no tasks 
-                        if (stop_ && tasks_.empty()) { 
-                            return; 
-                        } 
-  
-                        // Get the next task from the queue 
-                        task = std::move(tasks_.front()); 
-                        tasks_.pop(); 
-                    } 
-  
-                    task(); 
-                } 
-            }); 
-        } 
-    } 
-  
-    ~ThreadPool() 
-    { 
-        {
-            // Lock the queue to update the stop flag safely 
-            unique_lock<mutex> lock(queue_mutex_); 
-            stop_ = true; 
-        }
-
-        cv_.notify_all(); 
-  
-        // Joining all worker threads to ensure they have 
-        // completed their tasks
-        for (auto& thread : threads_) { 
-            thread.join(); 
-        } 
-    } 
-  
-    // Enqueue task for execution by the thread pool 
-    void enqueue(function<void()> task) 
-    { 
-        { 
-            unique_lock<mutex> lock(queue_mutex_); 
-            tasks_.emplace(std::move(task)); 
-        } 
-        cv_.notify_one(); 
-    } 
-  
-private: 
-    // Vector to store worker threads 
-    vector<thread> threads_;
-    // Queue of tasks 
-    queue<function<void()> > tasks_;
-    // Mutex to synchronize access to shared data 
-    mutex queue_mutex_;
-    // Condition variable to signal changes in the state of 
-    // the tasks queue 
-    condition_variable cv_;
-    // Flag to indicate whether the thread pool should stop 
-    // or not 
-    bool stop_ = false;
-};
-
-
 std::map<std::string, std::string> read_passwords() {
     std::ifstream file(PASSWORD_FILE);
     std::map<std::string, std::string> passwords;
@@ -194,21 +121,90 @@ void execute_command(LPTF_Socket *serverSocket, int clientSockfd, LPTF_Packet &r
             FILE_UPLOAD_REQ_PACKET_STRUCT transfer_args = get_data_from_file_upload_request_packet(req);
 
             ostringstream msg;
-            msg << "UPLOAD_FILE_COMMAND: \"" << transfer_args.filepath << "\", " << transfer_args.filesize;
+            msg << "UPLOAD_FILE_COMMAND: \"" << transfer_args.filepath << "\", " << transfer_args.filesize << ", options " << (int)transfer_args.options;
             log_info(msg, logger);
 
-            receive_file(serverSocket, clientSockfd, transfer_args.filepath, transfer_args.filesize, username, logger);
+            receive_file(serverSocket, clientSockfd, transfer_args.filepath, transfer_args.filesize, transfer_args.options, username, logger);
             break;
         }
         case DOWNLOAD_FILE_COMMAND:
         {
             string filepath = get_file_from_file_download_request_packet(req);
+            uint8_t options = get_options_from_file_download_request_packet(req);
+
+            ostringstream msg;
+            msg << "DOWNLOAD_FILE_COMMAND: \"" << filepath << "\", options " << (int)options;
+            log_info(msg, logger);
+
+            send_file(serverSocket, clientSockfd, filepath, options, username, logger);
+            break;
+        }
+
+        case DOWNLOAD_DIR_COMMAND:
+        {
+            string folder = get_path_from_directory_download_request_packet(req);
+            uint8_t options = get_options_from_directory_download_request_packet(req);
+
+            ostringstream msg;
+            msg << "DOWNLOAD_DIR_COMMAND: \"" << folder << "\", options " << (int)options;
+            log_info(msg, logger);
+
+            send_directory(serverSocket, clientSockfd, folder, options, username, logger);
+            break;
+        }
+
+        case UPLOAD_DIR_COMMAND:
+        {
+            UPLOAD_DIR_REQ_PACKET_STRUCT args = get_data_from_directory_upload_request_packet(req);
+
+            ostringstream msg;
+            msg << "UPLOAD_DIR_COMMAND: \"" << args.folder << "\", options " << (int)args.options << ", " << args.total << " byte(s)";
+            log_info(msg, logger);
+
+            receive_directory(serverSocket, clientSockfd, args.folder, args.options, args.total, username, logger);
+            break;
+        }
+
+        case COPY_COMMAND:
+        case MOVE_COMMAND:
+        {
+            COPY_REQ_PACKET_STRUCT args = get_data_from_copy_request_packet(req);
+            bool move = req.type() == MOVE_COMMAND;
+
+            ostringstream msg;
+            msg << (move ? "MOVE_COMMAND" : "COPY_COMMAND") << ": \"" << args.source << "\", \"" << args.destination << "\"";
+            log_info(msg, logger);
+
+            if (move)
+                move_path(serverSocket, clientSockfd, args.source, args.destination, username, logger);
+            else
+                copy_path(serverSocket, clientSockfd, args.source, args.destination, username, logger);
+            break;
+        }
+
+        case PWRITE_COMMAND:
+        case APPEND_COMMAND:
+        {
+            string filepath = get_arg_from_command_packet(req);
+            bool append = req.type() == APPEND_COMMAND;
 
             ostringstream msg;
-            msg << "DOWNLOAD_FILE_COMMAND: \"" << filepath << "\"";
+            msg << (append ? "APPEND_COMMAND" : "PWRITE_COMMAND") << ": \"" << filepath << "\"";
             log_info(msg, logger);
 
-            send_file(serverSocket, clientSockfd, filepath, username, logger);
+            write_file_records(serverSocket, clientSockfd, filepath, append, username, logger);
+            break;
+        }
+
+        case DOWNLOAD_RANGES_COMMAND:
+        {
+            FILE_RANGES_REQ_PACKET_STRUCT data = get_data_from_file_ranges_request_packet(req);
+
+            ostringstream msg;
+            msg << "DOWNLOAD_RANGES_COMMAND: \"" << data.filepath << "\", " << data.ranges.size() << " range(s), options " << (int)data.options;
+            log_info(msg, logger);
+
+            send_file_ranges(serverSocket, clientSockfd, data.filepath, data.options, data.ranges, username, logger);
             break;
         }
         
@@ -227,12 +223,13 @@ void execute_command(LPTF_Socket *serverSocket, int clientSockfd, LPTF_Packet &r
         case LIST_FILES_COMMAND:
         {
             string path = get_path_from_list_directory_request_packet(req);
+            uint8_t format = get_format_from_list_directory_request_packet(req);
 
             ostringstream msg;
-            msg << "LIST_FILES_COMMAND: \"" << path << "\"";
+            msg << "LIST_FILES_COMMAND: \"" << path << "\", format " << (int)format;
             log_info(msg, logger);
 
-            list_directory(serverSocket, clientSockfd, path, username, logger);
+            list_directory(serverSocket, clientSockfd, path, format, username, logger);
             break;
         }
         
@@ -274,12 +271,56 @@ void execute_command(LPTF_Socket *serverSocket, int clientSockfd, LPTF_Packet &r
         
         case USER_TREE_COMMAND:
         {
-            log_info("USER_TREE_COMMAND", logger);
+            string cursor = get_cursor_from_user_tree_request_packet(req);
+
+            ostringstream msg;
+            msg << "USER_TREE_COMMAND: \"" << cursor << "\"";
+            log_info(msg, logger);
 
-            list_user_tree(serverSocket, clientSockfd, username, logger);
+            list_user_tree(serverSocket, clientSockfd, cursor, username, logger);
             break;
         }
         
+        case STAT_MANY_COMMAND:
+        {
+            log_info("STAT_MANY_COMMAND", logger);
+
+            stat_many(serverSocket, clientSockfd, username, logger);
+            break;
+        }
+
+        case QUOTA_COMMAND:
+        {
+            log_info("QUOTA_COMMAND", logger);
+
+            send_quota(serverSocket, clientSockfd, username, logger);
+            break;
+        }
+
+        case SEARCH_COMMAND:
+        {
+            string pattern = get_arg_from_command_packet(req);
+
+            ostringstream msg;
+            msg << "SEARCH_COMMAND: \"" << pattern << "\"";
+            log_info(msg, logger);
+
+            search_files(serverSocket, clientSockfd, pattern, username, logger);
+            break;
+        }
+
+        case HASH_COMMAND:
+        {
+            string filename = get_arg_from_command_packet(req);
+
+            ostringstream msg;
+            msg << "HASH_COMMAND: \"" << filename << "\"";
+            log_info(msg, logger);
+
+            hash_file(serverSocket, clientSockfd, filename, username, logger);
+            break;
+        }
+
         default:
         {
             log_error("Got unexpected command from client", logger);
@@ -352,13 +393,61 @@ void handle_client(LPTF_Socket *serverSocket, int clientSockfd, struct sockaddr_
     close(clientSockfd);
 }
 
-int main() {
+int main(int argc, char const *argv[]) {
     int port = 12345;
     int max_clients = 10;
 
+    bool durable = false;
+    bool dedup = false;
+    for (int i = 1; i < argc; i++) {
+        if (string(argv[i]) == "--durable") {
+            durable = true;
+        } else if (string(argv[i]) == "--dedup") {
+            dedup = true;
+        } else {
+            cerr << "Usage: " << argv[0] << " [--durable] [--dedup]" << endl
+                 << "\t--durable   (uploads and changes are acknowledged once synced to disk)" << endl
+                 << "\t--dedup     (identical files are stored once, across users too: whole files only, not chunks." << endl
+                 << "\t             Uploads only send the chunks missing from the files the user stored)" << endl;
+            return 1;
+        }
+    }
+
+    // a client leaving mid-transfer makes the sends fail, it must not stop the server
+    signal(SIGPIPE, SIG_IGN);
+
     try {
         ThreadPool clientPool(max_clients);
 
+        // uploads and metadata changes are acknowledged once synced to disk, in shared rounds
+        if (durable) {
+            check_server_root_folder();
+            get_group_committer().enable(get_server_root());
+            cout << "Durable mode: on" << endl;
+        }
+
+        // uploaded files are stored once, the users' files link to them
+        if (dedup)
+            get_chunk_store().enable(get_server_meta_folder("store"));
+
+        // finish removing what a previous run left in the trash
+        get_trash_reaper().reap_leftovers();
+        get_trash_reaper().start_retrier();
+
+        // and the staging files and directories of its interrupted uploads and copies
+        size_t leftovers = clear_staging_folder();
+        if (leftovers > 0)
+            cout << "Removed " << leftovers << " staging file(s) or folder(s) of interrupted transfers" << endl;
+
+        get_quota_manager().start_reconciler();
+
+        // the first searches of a user fall back to walking its tree until its index is built
+        get_search_index().build_all();
+        get_search_index().start_builder();
+
+        // catalogs are built, compacted and reconciled in the background, readers fall back to the disk meanwhile
+        get_catalog().start_builder();
+
         LPTF_Socket serverSocket = LPTF_Socket();
 
         struct sockaddr_in serverAddr;
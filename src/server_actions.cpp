@@ -1,8 +1,28 @@
 #include "../include/LPTF_Net/LPTF_Socket.hpp"
 #include "../include/LPTF_Net/LPTF_Packet.hpp"
 #include "../include/LPTF_Net/LPTF_Utils.hpp"
+#include "../include/LPTF_Net/LPTF_Stream.hpp"
 #include "../include/file_utils.hpp"
 #include "../include/logger.hpp"
+#include "../include/server_actions.hpp"
+#include "../include/listing_cache.hpp"
+#include "../include/tree_walker.hpp"
+#include "../include/trash_reaper.hpp"
+#include "../include/quota.hpp"
+#include "../include/search_index.hpp"
+#include "../include/catalog.hpp"
+#include "../include/chunk_cache.hpp"
+#include "../include/chunk_prefetcher.hpp"
+#include "../include/async_writer.hpp"
+#include "../include/group_commit.hpp"
+#include "../include/part_codec.hpp"
+#include "../include/delta_sync.hpp"
+#include "../include/chunk_store.hpp"
+#include "../include/crc32c.hpp"
+#include "../include/blake3.hpp"
+#include "../include/path_locks.hpp"
+#include "../include/thread_pool.hpp"
+#include "../include/tar_stream.hpp"
 
 #include <iostream>
 #include <fstream>
@@ -11,6 +31,19 @@
 
 #include <sstream>
 
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <map>
+#include <endian.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
 using namespace std;
 
 namespace fs = std::filesystem;
@@ -31,7 +64,137 @@ void send_ok_reply(LPTF_Socket *serverSocket, int clientSockfd, uint8_t repfrom)
 }
 
 
-bool send_file(LPTF_Socket *serverSocket, int clientSockfd, string filename, string username, Logger *logger) {
+// in durable mode, a change is only acknowledged once it's on disk
+bool send_committed_reply(LPTF_Socket *serverSocket, int clientSockfd, uint8_t repfrom, Logger *logger) {
+    try {
+        get_group_committer().commit();
+    } catch (const exception &ex) {
+        send_error_message(serverSocket, clientSockfd, repfrom, ex.what(), logger);
+        return false;
+    }
+
+    send_ok_reply(serverSocket, clientSockfd, repfrom);
+    return true;
+}
+
+
+// keep the server caches in sync with the changes made by the server itself
+void on_directory_changed(fs::path folderpath) {
+    get_listing_cache().invalidate(folderpath);
+    // the directory size and mtime are listed in its parent
+    get_listing_cache().invalidate(fs::path(listing_cache_key(folderpath)).parent_path());
+}
+
+void on_tree_changed(fs::path folderpath) {
+    get_listing_cache().invalidate_tree(folderpath);
+    get_listing_cache().invalidate(fs::path(listing_cache_key(folderpath)).parent_path());
+    get_chunk_cache().invalidate_tree(folderpath);
+}
+
+void on_file_changed(fs::path filepath) {
+    get_chunk_cache().invalidate(filepath);
+    on_directory_changed(filepath.parent_path());
+}
+
+
+// path relative to the user root, as stored in the search index
+string get_index_path(fs::path path, const fs::path &user_root) {
+    path = path.lexically_normal();
+    if (!path.has_filename()) path = path.parent_path();
+    return path.lexically_relative(user_root.lexically_normal()).string();
+}
+
+
+// refreshes the catalog entries of path and of its parent directory (whose mtime changed too)
+void update_catalog(const string &username, const fs::path &user_root, const fs::path &path) {
+    string relpath = get_index_path(path, user_root);
+    get_catalog().refresh(username, relpath);
+    get_catalog().refresh(username, fs::path(relpath).parent_path().string());
+}
+
+
+/*
+Sends a part (with its checksum if asked) and waits for the client reply, this is required to not
+overflow the socket. A part the client got corrupted is sent again, counted in resent_parts.
+*/
+static void send_part_and_wait(LPTF_Socket *serverSocket, int clientSockfd, LPTF_Packet &part, bool checksum, uint64_t &resent_parts) {
+    if (checksum)
+        add_part_checksum(part);
+
+    for (int attempt = 0;; attempt++) {
+        serverSocket->send(clientSockfd, part, 0);
+
+        LPTF_Packet reply = serverSocket->recv(clientSockfd, 0);
+
+        if (reply.type() != REPLY_PACKET)
+            throw runtime_error("Unexpected packet type!");
+        if (!is_resend_part_reply_packet(reply))
+            return;
+        if (attempt == PART_MAX_RESENDS)
+            throw runtime_error("A part was corrupted too many times !");
+        resent_parts++;
+    }
+}
+
+
+/*
+Sends the bytes [start, end) of a file as parts, read through chunks (the prefetcher of the data
+extents of that range): file parts for the data, hole parts for the rest.
+The CRC32C of the range is added to digest if it is not null. Returns the hole bytes.
+*/
+static uint64_t send_file_range(ChunkPrefetcher &chunks, uint64_t start, uint64_t end, PartEncoder &encoder, uint32_t *digest,
+                                const function<void(LPTF_Packet &)> &send_part) {
+    uint64_t curr_pos = start;
+    uint64_t hole_bytes = 0;
+    LPTF_Packet pckt;
+
+    auto send_hole = [&](uint64_t length) {
+        pckt = build_hole_part_packet(length);
+        send_part(pckt);
+        hole_bytes += length;
+        if (digest)
+            *digest = crc32c_zeros(*digest, length);
+        curr_pos += length;
+    };
+
+    while (chunks.has_next()) {
+        uint64_t index;
+        shared_ptr<const string> chunk = chunks.next(index);
+        uint64_t chunk_start = index * CHUNK_CACHE_CHUNK_BYTES;
+
+        // the chunks may overlap the range
+        uint64_t data_start = max(chunk_start, curr_pos);
+        uint64_t data_end = min(chunk_start + chunk->size(), end);
+        if (data_start >= data_end)
+            continue;
+
+        // skipped chunks
+        if (data_start > curr_pos)
+            send_hole(data_start - curr_pos);
+
+        if (digest)
+            *digest = crc32c(*digest, chunk->data() + (data_start - chunk_start), data_end - data_start);
+
+        // send the chunk as file parts
+        do {
+            size_t consumed;
+
+            pckt = encoder.next_part(chunk->data() + (curr_pos - chunk_start), data_end - curr_pos, consumed);
+            send_part(pckt);
+
+            curr_pos += consumed;
+        } while (curr_pos < data_end);
+    }
+
+    // trailing hole
+    if (curr_pos < end)
+        send_hole(end - curr_pos);
+
+    return hole_bytes;
+}
+
+
+bool send_file(LPTF_Socket *serverSocket, int clientSockfd, string filename, uint8_t options, string username, Logger *logger) {
 
     fs::path user_root = get_user_root(username);
     fs::path filepath = user_root;
@@ -41,74 +204,282 @@ bool send_file(LPTF_Socket *serverSocket, int clientSockfd, string filename, str
     fp_msg << "Filepath: " << filepath;
     log_debug(fp_msg, logger);
 
-    if (!is_path_in_folder(filepath, user_root) || !fs::is_regular_file(filepath)) {
+    // everything is read through this fd, whatever replaces the file meanwhile
+    struct stat st;
+    int fd = -1;
+    if (!is_path_in_folder(filepath, user_root) || (fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC)) == -1
+        || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (fd != -1) close(fd);
         send_error_message(serverSocket, clientSockfd, DOWNLOAD_FILE_COMMAND, "The file doesn't exist.", logger);
         return false;
     }
 
-    uint32_t filesize = get_file_size(filepath);
+    FILE_VERSION version = get_file_version(st);
+    uint32_t filesize = st.st_size;
 
     cout << filesize << endl;
 
-    LPTF_Packet pckt = build_reply_packet(DOWNLOAD_FILE_COMMAND, (void *)&filesize, sizeof(filesize));
+    options &= SERVER_TRANSFER_OPTS;
+
+    // in a sparse transfer only the chunks holding data are read and sent, the rest are hole parts
+    // (a delta transfer reads the file itself, see below)
+    vector<FILE_EXTENT> extents = {{0, filesize}};
+    if (options & TRANSFER_OPT_DELTA)
+        extents.clear();
+    else if (options & TRANSFER_OPT_SPARSE)
+        extents = get_data_extents(fd, filesize);
+
+    // the accepted options follow the file size
+    char reply[sizeof(filesize) + sizeof(options)];
+    memcpy(reply, &filesize, sizeof(filesize));
+    memcpy(reply + sizeof(filesize), &options, sizeof(options));
+
+    LPTF_Packet pckt = build_reply_packet(DOWNLOAD_FILE_COMMAND, reply, sizeof(reply));
     serverSocket->send(clientSockfd, pckt, 0);
 
     ostringstream msg;
     msg << "Start sending file " << filepath << " (" << filesize << " byte(s)) to client";
     log_info(msg, logger);
 
-    char buffer[MAX_BINARY_PART_BYTES];
-
-    ifstream file(filepath, ios::binary);
+    // chunks are read ahead (or taken from the chunk cache) while the previous ones are sent
+    ChunkPrefetcher chunks(filepath, fd, version, extents);
 
-    streampos begin = file.tellg();
-    file.seekg (0, ios::end);
-    streampos end = file.tellg();
-    file.seekg(0, ios::beg);
+    uint64_t hole_bytes = 0;
+    uint64_t copied_bytes = 0;
+    uint64_t resent_parts = 0;
+    uint32_t digest = 0;
+    PartEncoder encoder(options & TRANSFER_OPT_COMPRESS);
 
     try {
 
-        streampos curr_pos = begin;
-        do {
-            uint16_t read_size;
-            if (MAX_BINARY_PART_BYTES + curr_pos > end) {
-                read_size = end - curr_pos;
-            } else {
-                read_size = MAX_BINARY_PART_BYTES;
-            }
+        auto send_part = [&](LPTF_Packet &part) {
+            send_part_and_wait(serverSocket, clientSockfd, part, options & TRANSFER_OPT_CHECKSUM, resent_parts);
+        };
+
+        uint64_t curr_pos = 0;
+
+        if (options & TRANSFER_OPT_DELTA) {
+            // the client sends the signature of its version, only what it lacks is sent
+            LPTF_PartReader request(serverSocket, clientSockfd);
+            FILE_SIGNATURE signature;
+            if (!receive_signature(request, signature))
+                throw runtime_error("Invalid file signature !");
+
+            if (fstat(fd, &st) != 0 || (uint64_t)st.st_size != filesize)
+                throw runtime_error("The file changed during the transfer !");
+
+            compute_delta(fd, filesize, signature,
+                [&](const char *data, size_t len) {
+                    for (size_t done = 0; done < len;) {
+                        size_t consumed;
+                        pckt = encoder.next_part(data + done, len - done, consumed);
+                        send_part(pckt);
+                        done += consumed;
+                    }
+                    return true;
+                },
+                [&](uint64_t first, uint64_t count) {
+                    pckt = build_block_ref_part_packet(first, count);
+                    send_part(pckt);
+                    copied_bytes += count * signature.block_size;
+                    return true;
+                });
+
+            if (options & TRANSFER_OPT_CHECKSUM)
+                digest = get_file_crc32c(fd, filesize);
+            curr_pos = filesize;
+        }
+
+        if (curr_pos < filesize) {
+            hole_bytes = send_file_range(chunks, curr_pos, filesize, encoder, (options & TRANSFER_OPT_CHECKSUM) ? &digest : nullptr, send_part);
+        } else if (filesize == 0) {
+            // an empty file is sent as an empty part
+            pckt = build_binary_part_packet(nullptr, 0);
+            send_part(pckt);
+        }
 
-            file.read(buffer, read_size);
+        // the client checks the whole file before keeping it
+        if (options & TRANSFER_OPT_CHECKSUM) {
+            pckt = build_digest_part_packet(digest);
+            send_part(pckt);
+        }
 
-            pckt = build_binary_part_packet(buffer, static_cast<uint16_t>(read_size));
-            serverSocket->send(clientSockfd, pckt, 0);
+    } catch (const exception &ex) {
+        send_error_message(serverSocket, clientSockfd, DOWNLOAD_FILE_COMMAND, ex.what(), logger);
+        close(fd);
+        return false;
+    }
 
-            curr_pos = file.tellg();
+    close(fd);
 
-            // wait for client reply
-            // this is required to not overflow? the socket
-            pckt = serverSocket->recv(clientSockfd, 0);
-            
-            if (pckt.type() != REPLY_PACKET) {
-                log_error("Unexpected packet type!", logger);
-                // pckt.print_specs();
-                break;
+    ostringstream status_msg;
+    if (options & TRANSFER_OPT_DELTA) {
+        status_msg << "File sent: " << copied_bytes << " byte(s) taken from the client's version, "
+                   << filesize - copied_bytes << " sent";
+    } else {
+        status_msg << "File sent: " << chunks.get_cached_chunks() << " chunk(s) from cache, " << chunks.get_read_chunks() << " read from disk, "
+                   << hole_bytes << " byte(s) of holes skipped";
+    }
+    log_info(status_msg, logger);
+
+    if (options & TRANSFER_OPT_COMPRESS)
+        log_info(encoder.get_summary(), logger);
+
+    if (resent_parts > 0) {
+        ostringstream resent_msg;
+        resent_msg << "Corrupted parts sent again: " << resent_parts;
+        log_warn(resent_msg, logger);
+    }
+
+    return true;
+}
+
+
+/*
+Sends ranges of a file, in the order requested, with the same parts as send_file() (but no delta).
+The reply holds the file size (uint64), the accepted options and the ranges once clamped to the file
+(varint count, then varint offset, varint length each), the client receives their concatenation.
+*/
+bool send_file_ranges(LPTF_Socket *serverSocket, int clientSockfd, string filename, uint8_t options, vector<FILE_RANGE_STRUCT> ranges, string username, Logger *logger) {
+
+    fs::path user_root = get_user_root(username);
+    fs::path filepath = user_root;
+    filepath /= filename;
+
+    if (ranges.empty() || ranges.size() > DOWNLOAD_RANGES_MAX_COUNT) {
+        send_error_message(serverSocket, clientSockfd, DOWNLOAD_RANGES_COMMAND, "Invalid number of ranges.", logger);
+        return false;
+    }
+
+    // everything is read through this fd, whatever replaces the file meanwhile
+    struct stat st;
+    int fd = -1;
+    if (!is_path_in_folder(filepath, user_root) || (fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC)) == -1
+        || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (fd != -1) close(fd);
+        send_error_message(serverSocket, clientSockfd, DOWNLOAD_RANGES_COMMAND, "The file doesn't exist.", logger);
+        return false;
+    }
+
+    FILE_VERSION version = get_file_version(st);
+    uint64_t filesize = st.st_size;
+
+    options &= SERVER_TRANSFER_OPTS & ~(TRANSFER_OPT_DELTA | TRANSFER_OPT_DEDUP);
+
+    // ranges past the end of the file are cut (possibly to nothing)
+    vector<FILE_EXTENT> resolved;
+    uint64_t total = 0;
+    for (const FILE_RANGE_STRUCT &range : ranges) {
+        uint64_t offset = range.from_end ? filesize - min(range.offset, filesize) : min(range.offset, filesize);
+        uint64_t length = range.length == 0 ? filesize - offset : min(range.length, filesize - offset);
+        resolved.push_back({offset, length});
+        total += length;
+    }
+
+    vector<FILE_EXTENT> data_extents = {{0, filesize}};
+    if (options & TRANSFER_OPT_SPARSE)
+        data_extents = get_data_extents(fd, filesize);
+
+    string reply(sizeof(uint64_t), '\0');
+    uint64_t be_filesize = htobe64(filesize);
+    memcpy(&reply[0], &be_filesize, sizeof(be_filesize));
+    reply.push_back(options);
+    append_varint(reply, resolved.size());
+    for (const FILE_EXTENT &range : resolved) {
+        append_varint(reply, range.offset);
+        append_varint(reply, range.length);
+    }
+
+    LPTF_Packet pckt = build_reply_packet(DOWNLOAD_RANGES_COMMAND, (void *)reply.data(), reply.size());
+    serverSocket->send(clientSockfd, pckt, 0);
+
+    ostringstream msg;
+    msg << "Start sending " << resolved.size() << " range(s) of file " << filepath << " (" << total << " byte(s)) to client";
+    log_info(msg, logger);
+
+    uint64_t hole_bytes = 0;
+    uint64_t resent_parts = 0;
+    unsigned long cached_chunks = 0;
+    unsigned long read_chunks = 0;
+    uint32_t digest = 0;
+    PartEncoder encoder(options & TRANSFER_OPT_COMPRESS);
+
+    try {
+
+        auto send_part = [&](LPTF_Packet &part) {
+            send_part_and_wait(serverSocket, clientSockfd, part, options & TRANSFER_OPT_CHECKSUM, resent_parts);
+        };
+
+        for (const FILE_EXTENT &range : resolved) {
+            if (range.length == 0)
+                continue;
+
+            // the data extents of the range, read ahead through the chunk cache
+            vector<FILE_EXTENT> extents;
+            for (const FILE_EXTENT &extent : data_extents) {
+                uint64_t start = max(extent.offset, range.offset);
+                uint64_t end = min(extent.offset + extent.length, range.offset + range.length);
+                if (start < end)
+                    extents.push_back({start, end - start});
             }
 
-        } while (curr_pos < end);
+            ChunkPrefetcher chunks(filepath, fd, version, extents);
+            hole_bytes += send_file_range(chunks, range.offset, range.offset + range.length, encoder,
+                                          (options & TRANSFER_OPT_CHECKSUM) ? &digest : nullptr, send_part);
+
+            cached_chunks += chunks.get_cached_chunks();
+            read_chunks += chunks.get_read_chunks();
+        }
 
-        file.close();
+        // the client checks the concatenated ranges before keeping them
+        if (options & TRANSFER_OPT_CHECKSUM) {
+            pckt = build_digest_part_packet(digest);
+            send_part(pckt);
+        }
 
     } catch (const exception &ex) {
-        send_error_message(serverSocket, clientSockfd, DOWNLOAD_FILE_COMMAND, ex.what(), logger);
-        file.close();
+        send_error_message(serverSocket, clientSockfd, DOWNLOAD_RANGES_COMMAND, ex.what(), logger);
+        close(fd);
         return false;
     }
 
+    close(fd);
+
+    ostringstream status_msg;
+    status_msg << "Ranges sent: " << cached_chunks << " chunk(s) from cache, " << read_chunks << " read from disk, "
+               << hole_bytes << " byte(s) of holes skipped";
+    log_info(status_msg, logger);
+
+    if (options & TRANSFER_OPT_COMPRESS)
+        log_info(encoder.get_summary(), logger);
+
+    if (resent_parts > 0) {
+        ostringstream resent_msg;
+        resent_msg << "Corrupted parts sent again: " << resent_parts;
+        log_warn(resent_msg, logger);
+    }
+
+    return true;
+}
+
+
+// whether fd and other_fd have the same length bytes from offset
+static bool same_file_range(int fd, int other_fd, uint64_t offset, uint64_t length) {
+    char buffer[4096], other[4096];
+
+    for (uint64_t done = 0; done < length;) {
+        size_t len = min((uint64_t)sizeof(buffer), length - done);
+        if (pread(fd, buffer, len, offset + done) != (ssize_t)len || pread(other_fd, other, len, offset + done) != (ssize_t)len)
+            return false;
+        if (memcmp(buffer, other, len) != 0)
+            return false;
+        done += len;
+    }
     return true;
 }
 
 
-bool receive_file(LPTF_Socket *serverSocket, int clientSockfd, string filename, uint32_t filesize, string username, Logger *logger) {
+bool receive_file(LPTF_Socket *serverSocket, int clientSockfd, string filename, uint32_t filesize, uint8_t options, string username, Logger *logger) {
 
     fs::path user_root = get_user_root(username);
     fs::path filepath = user_root;
@@ -123,29 +494,122 @@ bool receive_file(LPTF_Socket *serverSocket, int clientSockfd, string filename,
         return false;
     }
 
-    ofstream outfile;
-    outfile.open(filepath, ios::binary | ios::out);
+    // the quota is checked before the client sends any data, the file's bytes stay reserved until it's published
+    uint64_t replaced_size = fs::is_regular_file(filepath) ? fs::file_size(filepath) : 0;
+    QuotaReservation reservation;
 
-    streampos curr_pos = outfile.tellp();
+    if (!reservation.reserve(username, filesize, replaced_size)) {
+        send_error_message(serverSocket, clientSockfd, UPLOAD_FILE_COMMAND, "Quota exceeded !", logger);
+        return false;
+    }
+
+    // the file is received aside and replaces filepath once complete,
+    // so downloads never see a partial file and a failed upload leaves the previous one
+    fs::path temppath;
+    int fd = -1;
+    if (filepath.has_filename() && !fs::is_directory(filepath))
+        fd = open_upload_file(filepath, temppath);
 
     LPTF_Packet pckt;
 
     // cannot open file for output
-    if (curr_pos == -1) {
+    if (fd == -1) {
         send_error_message(serverSocket, clientSockfd, UPLOAD_FILE_COMMAND, "Could not create file !", logger);
-        outfile.close();
         return false;
     }
 
-    pckt = build_reply_packet(UPLOAD_FILE_COMMAND, (void *)FILE_TRANSFER_REP_OK, strlen(FILE_TRANSFER_REP_OK));
+    options &= SERVER_TRANSFER_OPTS;
+
+    // a delta transfer needs a previous version worth signing
+    int old_fd = -1;
+    FILE_SIGNATURE signature;
+    if (options & TRANSFER_OPT_DELTA) {
+        struct stat st;
+        old_fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+
+        try {
+            if (old_fd != -1 && fstat(old_fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= DELTA_MIN_BLOCK_BYTES) {
+                signature = compute_signature(old_fd, st.st_size);
+            } else if (old_fd != -1) {
+                close(old_fd);
+                old_fd = -1;
+            }
+        } catch (const exception &ex) {
+            log_warn(ex.what(), logger);
+            close(old_fd);
+            old_fd = -1;
+        }
+
+        if (old_fd == -1)
+            options &= ~TRANSFER_OPT_DELTA;
+    }
+
+    // otherwise the chunks of the file may already be stored (dedup mode)
+    if ((options & TRANSFER_OPT_DEDUP) && ((options & TRANSFER_OPT_DELTA) || !get_chunk_store().is_enabled() || filesize < CDC_MIN_CHUNK_BYTES))
+        options &= ~TRANSFER_OPT_DEDUP;
+
+    // the accepted options follow the OK (after its null terminator), if any were requested
+    string reply = FILE_TRANSFER_REP_OK;
+    if (options != 0) {
+        reply.push_back('\0');
+        reply.push_back(options);
+    }
+
+    pckt = build_reply_packet(UPLOAD_FILE_COMMAND, (void *)reply.c_str(), reply.size());
     serverSocket->send(clientSockfd, pckt, 0);
 
     ostringstream msg;
     msg << "Start receiving file " << filename;
     log_info(msg, logger);
 
+    int64_t curr_pos = 0;
+    uint64_t hole_bytes = 0;
+    uint64_t copied_bytes = 0;
+    uint64_t corrupted_parts = 0;
+    string store_status;
+    PartDecoder decoder;
+
+    // a delta upload copying every block of the previous version in place (and the same tail)
+    // rebuilds it unchanged: its chunks are known if it's stored
+    bool unchanged = (options & TRANSFER_OPT_DELTA) && signature.file_size == filesize;
+
     try {
 
+        if (options & TRANSFER_OPT_DELTA) {
+            LPTF_PartWriter stream(serverSocket, clientSockfd);
+            send_signature(stream, signature);
+        }
+
+        // the client sends its chunk list, it is told which chunks are stored (one bit each)
+        vector<CONTENT_CHUNK> client_chunks;
+        if (options & TRANSFER_OPT_DEDUP) {
+            LPTF_PartReader request(serverSocket, clientSockfd);
+            uint64_t total = 0;
+
+            bool valid = receive_chunk_list(request, client_chunks);
+            for (const CONTENT_CHUNK &chunk : client_chunks)
+                total += chunk.length;
+            if (!valid || total != filesize)
+                throw runtime_error("Invalid chunk list !");
+
+            vector<bool> found = get_chunk_store().find_chunks(username, client_chunks);
+            string bitmap((found.size() + 7) / 8, '\0');
+            for (size_t i = 0; i < found.size(); i++)
+                if (found[i]) bitmap[i / 8] |= 1 << (i % 8);
+
+            LPTF_PartWriter stream(serverSocket, clientSockfd);
+            stream.write(bitmap);
+            stream.close();
+        }
+
+        // parts are acknowledged once queued, the disk writes happen behind
+        AsyncWriter writer(fd);
+
+        // with checksums, the file is complete once its digest (following the last part) matches
+        bool digest_pending = options & TRANSFER_OPT_CHECKSUM;
+        if (digest_pending)
+            writer.enable_digest();
+
         do {
             pckt = serverSocket->recv(clientSockfd, 0);
 
@@ -153,50 +617,153 @@ bool receive_file(LPTF_Socket *serverSocket, int clientSockfd, string filename,
                 ostringstream err_msg;
                 err_msg << "Packet is not a File Part Packet ! (" << pckt.type() << ")";
                 log_error(err_msg, logger);
+                curr_pos = -1;
                 break;
             }
 
-            BINARY_PART_PACKET_STRUCT data = get_data_from_binary_part_packet(pckt);
+            // a corrupted part is asked again
+            if ((options & TRANSFER_OPT_CHECKSUM) && !check_part_checksum(pckt)) {
+                corrupted_parts++;
+                pckt = build_part_reply_packet(PART_REPLY_RESEND);
+                serverSocket->send(clientSockfd, pckt, 0);
+                continue;
+            }
+
+            if (is_digest_part_packet(pckt)) {
+                if (!digest_pending || writer.bytes_written() != filesize)
+                    throw runtime_error("Unexpected digest part !");
+                if (get_digest_from_digest_part_packet(pckt) != writer.get_digest())
+                    throw runtime_error("The received file doesn't match its checksum !");
+                digest_pending = false;
+            } else if (is_hole_part_packet(pckt)) {
+                uint64_t length = get_length_from_hole_part_packet(pckt);
+                if (length > filesize - writer.bytes_written())
+                    throw runtime_error("Received more data than the file size !");
+
+                // the file is new: holes are only skipped
+                unchanged = unchanged && writer.bytes_written() >= signature.blocks.size() * signature.block_size;
+                writer.skip(length);
+                hole_bytes += length;
+            } else if (is_block_ref_part_packet(pckt)) {
+                BLOCK_REF_STRUCT ref = get_block_ref_from_block_ref_part_packet(pckt);
+
+                if (options & TRANSFER_OPT_DELTA) {
+                    if (ref.count > (filesize - writer.bytes_written()) / signature.block_size)
+                        throw runtime_error("Received more data than the file size !");
+                    unchanged = unchanged && (uint64_t)ref.first * signature.block_size == writer.bytes_written();
+                    copied_bytes += copy_blocks(old_fd, signature, ref, writer);
+                } else if (options & TRANSFER_OPT_DEDUP) {
+                    // the chunk list adds up to the file size
+                    copied_bytes += get_chunk_store().copy_chunks(username, client_chunks, ref, writer);
+                } else {
+                    throw runtime_error("Unexpected block reference !");
+                }
+            } else {
+                BINARY_PART_PACKET_STRUCT data = decoder.decode(pckt);
+
+                // cout << "File part Data Len: " << data.len << endl;
+
+                unchanged = unchanged && writer.bytes_written() >= signature.blocks.size() * signature.block_size;
+                writer.write(data.data, data.len);
+            }
+
+            curr_pos = writer.bytes_written();
+            if (curr_pos > filesize)
+                throw runtime_error("Received more data than the file size !");
+
+            // the last part is only acknowledged once the whole file is on disk and published
+            // (in durable mode by a group commit, which also covers its directory entry)
+            if (curr_pos == filesize && !digest_pending) {
+                writer.finish(!get_group_committer().is_enabled());
+
+                // in dedup mode the file is stored, or an identical stored file is published instead
+                int stored_fd = -1;
+                if (get_chunk_store().is_enabled() && filesize >= CDC_MIN_CHUNK_BYTES) {
+                    uint64_t blocks_bytes = signature.blocks.size() * signature.block_size;
+                    unchanged = unchanged && copied_bytes == blocks_bytes
+                                && same_file_range(fd, old_fd, blocks_bytes, filesize - blocks_bytes);
+
+                    vector<CONTENT_CHUNK> chunks;
+                    if (!unchanged || !get_chunk_store().get_chunk_list(old_fd, chunks))
+                        chunks = compute_chunks(fd, filesize);
+
+                    // what was copied from the store must be what the client has
+                    bool same = chunks.size() == client_chunks.size();
+                    for (size_t i = 0; same && i < chunks.size(); i++)
+                        same = chunks[i].hash == client_chunks[i].hash && chunks[i].length == client_chunks[i].length;
+                    if ((options & TRANSFER_OPT_DEDUP) && !same)
+                        throw runtime_error("The received file doesn't match its chunk list !");
+
+                    try {
+                        stored_fd = get_chunk_store().store_file(username, fd, chunks);
+                        store_status = stored_fd == -1 ? "stored" : "identical to a stored file";
+                    } catch (const exception &ex) {
+                        log_warn(ex.what(), logger);
+                    }
+                }
 
-            // cout << "File part Data Len: " << data.len << endl;
+                struct stat st;
+                replaced_size = (stat(filepath.c_str(), &st) == 0 && S_ISREG(st.st_mode)) ? st.st_size : 0;
+
+                if (stored_fd != -1) {
+                    fs::path stored_temppath;
+                    try {
+                        publish_upload_file(stored_fd, stored_temppath, filepath);
+                    } catch (...) {
+                        close(stored_fd);
+                        throw;
+                    }
+                    close(stored_fd);
+                    discard_upload_file(temppath);
+                } else {
+                    publish_upload_file(fd, temppath, filepath);
+                }
 
-            outfile.write((const char*)data.data, data.len);
+                reservation.commit((int64_t)filesize - (int64_t)replaced_size);
+                on_file_changed(filepath);
+                get_search_index().add(username, get_index_path(filepath, user_root), false);
+                update_catalog(username, user_root, filepath);
 
-            curr_pos = outfile.tellp();
-            
-            // bad file
-            if (curr_pos == -1) { throw runtime_error("File stream pos invalid!"); }
+                get_group_committer().commit();
+            }
 
             // send reply to client
             // this is required to not overflow? the socket
-            char repc = 0;
-            pckt = build_reply_packet(BINARY_PART_PACKET, &repc, 1);
+            pckt = build_part_reply_packet(PART_REPLY_OK);
             serverSocket->send(clientSockfd, pckt, 0);
-        } while (static_cast<uint32_t>(curr_pos) < filesize);
-        
-        outfile.close();
+        } while (static_cast<uint32_t>(curr_pos) < filesize || digest_pending);
 
     } catch (const exception &ex) {
         send_error_message(serverSocket, clientSockfd, UPLOAD_FILE_COMMAND, ex.what(), logger);
-        outfile.close();
+        curr_pos = -1;
     }
 
+    close(fd);
+    if (old_fd != -1) close(old_fd);
+
     if (curr_pos == -1 || curr_pos != filesize) {
         ostringstream err_msg;
         err_msg << "File transfer encountered an error: file size and intended file size don't match (Curr. Pos: " << curr_pos << ", FSize: " << filesize << ").";
         log_error(err_msg, logger);
 
-        if (fs::exists(filepath)) {
-            ostringstream warn_msg;
-            warn_msg << "Removing file " << filepath;
-            log_warn(warn_msg, logger);
-            fs::remove(filepath);
-        }
+        // the previous file (if any) is still in place
+        discard_upload_file(temppath);
         return false;
     } else {
         ostringstream status_msg;
-        status_msg << "File transfer done. Curr. Pos: " << curr_pos << ", Filesize: " << filesize;
+        status_msg << "File transfer done. Curr. Pos: " << curr_pos << ", Filesize: " << filesize << ", Holes: " << hole_bytes;
+        if (options & TRANSFER_OPT_DELTA)
+            status_msg << ", Taken from the previous version: " << copied_bytes;
+        if (options & TRANSFER_OPT_DEDUP)
+            status_msg << ", Taken from the chunk store: " << copied_bytes;
+        if (!store_status.empty())
+            status_msg << ", Chunk store: " << store_status;
+        if (options & TRANSFER_OPT_CHECKSUM)
+            status_msg << ", Checksum: OK, Corrupted parts received again: " << corrupted_parts;
         log_info(status_msg, logger);
+
+        if (options & TRANSFER_OPT_COMPRESS)
+            log_info(decoder.get_summary(), logger);
         return true;
     }
 }
@@ -222,11 +789,18 @@ bool delete_file(LPTF_Socket *serverSocket, int clientSockfd, string filename, s
     status_msg << "Deleting file " << filepath;
     log_info(status_msg, logger);
 
+    uintmax_t size = fs::file_size(filepath);
+
     if (fs::remove(filepath)) {
         log_info("File deleted", logger);
 
-        send_ok_reply(serverSocket, clientSockfd, DELETE_FILE_COMMAND);
-        return true;
+        get_quota_manager().add(username, -(int64_t)size);
+
+        on_file_changed(filepath);
+        get_search_index().remove(username, get_index_path(filepath, user_root));
+        update_catalog(username, user_root, filepath);
+
+        return send_committed_reply(serverSocket, clientSockfd, DELETE_FILE_COMMAND, logger);
     } else {
         send_error_message(serverSocket, clientSockfd, DELETE_FILE_COMMAND, "The file could not be removed.", logger);
         return false;
@@ -234,7 +808,7 @@ bool delete_file(LPTF_Socket *serverSocket, int clientSockfd, string filename, s
 }
 
 
-bool list_directory(LPTF_Socket *serverSocket, int clientSockfd, string path, string username, Logger *logger) {
+bool list_directory(LPTF_Socket *serverSocket, int clientSockfd, string path, uint8_t format, string username, Logger *logger) {
     fs::path user_root = get_user_root(username);
     fs::path folderpath = user_root;
     if (!path.empty())
@@ -244,19 +818,52 @@ bool list_directory(LPTF_Socket *serverSocket, int clientSockfd, string path, st
     fp_msg << "Folderpath: " << folderpath;
     log_debug(fp_msg, logger);
 
-    if (!fs::equivalent(user_root, folderpath) && (!is_path_in_folder(folderpath, user_root) || !fs::is_directory(folderpath)
-        || (path.size() > 0 && (path.at(0) == '/' || path.at(0) == '\\')))) {
-        send_error_message(serverSocket, clientSockfd, LIST_FILES_COMMAND, "The folder doesn't exist.", logger);
+    if (format != LIST_FORMAT_TEXT && format != LIST_FORMAT_BINARY) {
+        send_error_message(serverSocket, clientSockfd, LIST_FILES_COMMAND, "Unknown listing format.", logger);
         return false;
     }
 
+    DIRECTORY_LISTING listing;
+
+    // a listing only gets cached after its path passed the checks below,
+    // so a hot listing is served without touching the filesystem again
+    bool cached = !(path.size() > 0 && (path.at(0) == '/' || path.at(0) == '\\'))
+                  && is_path_lexically_in_folder(folderpath, user_root)
+                  && get_listing_cache().find(folderpath, listing);
+
+    if (!cached) {
+        if (!fs::equivalent(user_root, folderpath) && (!is_path_in_folder(folderpath, user_root) || !fs::is_directory(folderpath)
+            || (path.size() > 0 && (path.at(0) == '/' || path.at(0) == '\\')))) {
+            send_error_message(serverSocket, clientSockfd, LIST_FILES_COMMAND, "The folder doesn't exist.", logger);
+            return false;
+        }
+
+        listing = get_listing_cache().get(folderpath);
+    }
+
     // list directory content
 
     ostringstream msg;
-    msg << "Listing directory content of " << folderpath;
+    msg << "Listing directory content of " << folderpath << (cached ? " (cached)" : "");
     log_info(msg, logger);
 
-    string result = list_directory_content(folderpath);
+    if (format == LIST_FORMAT_BINARY) {
+        // the listing may not fit in a reply, it is streamed after an empty OK reply
+        send_ok_reply(serverSocket, clientSockfd, LIST_FILES_COMMAND);
+
+        try {
+            LPTF_PartWriter stream(serverSocket, clientSockfd);
+            stream.write(listing.entries);
+            stream.close();
+        } catch (const exception &ex) {
+            send_error_message(serverSocket, clientSockfd, LIST_FILES_COMMAND, ex.what(), logger);
+            return false;
+        }
+
+        return true;
+    }
+
+    string result = listing.text;
 
     if (result.size() == 0) result.append("(empty)");
 
@@ -302,8 +909,11 @@ bool create_directory(LPTF_Socket *serverSocket, int clientSockfd, string folder
     } else {
         log_info("Directory created", logger);
 
-        send_ok_reply(serverSocket, clientSockfd, CREATE_FOLDER_COMMAND);
-        return true;
+        on_directory_changed(folderpath.parent_path());
+        get_search_index().add(username, get_index_path(folderpath, user_root), true);
+        update_catalog(username, user_root, folderpath);
+
+        return send_committed_reply(serverSocket, clientSockfd, CREATE_FOLDER_COMMAND, logger);
     }
 }
 
@@ -315,10 +925,19 @@ bool remove_directory(LPTF_Socket *serverSocket, int clientSockfd, string folder
     // if folder is user root, remove all contents
     if (fs::equivalent(user_root, folderpath)) {
 
-        delete_directory_content(user_root);
+        log_info("Removing user root content", logger);
 
-        send_ok_reply(serverSocket, clientSockfd, DELETE_FOLDER_COMMAND);
-        return true;
+        // the content is moved to the trash and removed in the background,
+        // what could not be moved (e.g. trash on another filesystem) is removed right away
+        if (!get_trash_reaper().move_content_to_trash(user_root, username)) {
+            get_quota_manager().add(username, -(int64_t)get_tree_size(user_root));
+            delete_directory_content(user_root);
+        }
+        on_tree_changed(user_root);
+        get_search_index().remove_tree(username, "");
+        get_catalog().remove_tree(username, "");
+
+        return send_committed_reply(serverSocket, clientSockfd, DELETE_FOLDER_COMMAND, logger);
 
     }
 
@@ -340,12 +959,23 @@ bool remove_directory(LPTF_Socket *serverSocket, int clientSockfd, string folder
     msg << "Removing directory " << folderpath;
     log_info(msg, logger);
 
-    if (fs::remove_all(folderpath) == 0 /* if nothing removed */) {
+    // the directory is moved to the trash and removed in the background
+    // (its size is released from the quota as the reaper removes it)
+    bool removed = get_trash_reaper().move_to_trash(folderpath, username);
+    if (!removed) {
+        uintmax_t size = get_tree_size(folderpath);
+        removed = fs::remove_all(folderpath) != 0;
+        if (removed) get_quota_manager().add(username, -(int64_t)size);
+    }
+    on_tree_changed(folderpath);
+    if (removed) get_search_index().remove_tree(username, get_index_path(folderpath, user_root));
+    update_catalog(username, user_root, folderpath);
+
+    if (!removed) {
         send_error_message(serverSocket, clientSockfd, DELETE_FOLDER_COMMAND, "The directory could not be removed !", logger);
         return false;
     } else {
-        send_ok_reply(serverSocket, clientSockfd, DELETE_FOLDER_COMMAND);
-        return true;
+        return send_committed_reply(serverSocket, clientSockfd, DELETE_FOLDER_COMMAND, logger);
     }
 }
 
@@ -383,11 +1013,14 @@ bool rename_directory(LPTF_Socket *serverSocket, int clientSockfd, string newnam
 
     try {
         fs::rename(folderpath, newfolderpath);
+        on_tree_changed(folderpath);
+        get_search_index().rename_tree(username, get_index_path(folderpath, user_root), get_index_path(newfolderpath, user_root));
+        get_catalog().rename_tree(username, get_index_path(folderpath, user_root), get_index_path(newfolderpath, user_root));
+        update_catalog(username, user_root, newfolderpath);
 
         log_info("Directory renamed", logger);
 
-        send_ok_reply(serverSocket, clientSockfd, RENAME_FOLDER_COMMAND);
-        return true;
+        return send_committed_reply(serverSocket, clientSockfd, RENAME_FOLDER_COMMAND, logger);
     } catch(const fs::filesystem_error &ex) {
         send_error_message(serverSocket, clientSockfd, RENAME_FOLDER_COMMAND, ex.what(), logger);
         return false;
@@ -395,92 +1028,1277 @@ bool rename_directory(LPTF_Socket *serverSocket, int clientSockfd, string newnam
 }
 
 
-bool list_user_tree(LPTF_Socket *serverSocket, int clientSockfd, string username, Logger *logger) {
+bool list_user_tree(LPTF_Socket *serverSocket, int clientSockfd, string cursor, string username, Logger *logger) {
     fs::path user_root = get_user_root(username);
 
-    log_info("Start sending directory tree to client", logger);
+    ostringstream msg;
+    msg << "Start sending directory tree to client";
+    if (!cursor.empty()) msg << " (resuming after \"" << cursor << "\")";
+    log_info(msg, logger);
 
     try {
 
-        size_t urlen = user_root.string().size();
-        string content;
-        LPTF_Packet pckt;
-
-        for (fs::directory_entry const& dir_entry : fs::recursive_directory_iterator(user_root)) {
-            content.append((const char *)(dir_entry.path().string().c_str() + urlen+1));
-            if (fs::is_directory(dir_entry)) content.push_back(dir_entry.path().preferred_separator);
-            content.push_back('\n');
+        LPTF_PartWriter stream(serverSocket, clientSockfd);
 
-            if (content.size() > MAX_BINARY_PART_BYTES) {
-                pckt = build_binary_part_packet((void *)content.c_str(), MAX_BINARY_PART_BYTES);
-                serverSocket->send(clientSockfd, pckt, 0);
+        size_t count = 0;
+        string last_entry;
 
-                // wait for client reply
-                pckt = serverSocket->recv(clientSockfd, 0);
+        // entries are written to the stream as they're visited
+        auto visit = [&](const string &relpath, bool is_dir) {
+            if (count == USER_TREE_PAGE_MAX_ENTRIES)
+                return false;
 
-                if (pckt.type() != REPLY_PACKET) {
-                    log_error("Unexpected packet type!", logger);
-                    return false;
-                }
+            stream.write(relpath);
+            if (is_dir) stream.put(fs::path::preferred_separator);
+            stream.put('\n');
 
-                content.erase(0, MAX_BINARY_PART_BYTES);
-            }
+            count++;
+            last_entry = relpath;
+            return true;
+        };
+
+        // the page is served from the catalog, walked by batches so that it's never locked while sending,
+        // or read from disk (from where the catalog stopped) if the catalog is not available
+        bool done = false;
+        try {
+            vector<pair<string, bool>> batch;
+            do {
+                batch.clear();
+                done = get_catalog().walk(username, count == 0 ? cursor : last_entry, [&](const string &relpath, bool is_dir) {
+                    if (count + batch.size() == USER_TREE_PAGE_MAX_ENTRIES || batch.size() == USER_TREE_BATCH_ENTRIES)
+                        return false;
+                    batch.push_back({relpath, is_dir});
+                    return true;
+                });
+
+                for (const pair<string, bool> &entry : batch)
+                    visit(entry.first, entry.second);
+            } while (!done && count < USER_TREE_PAGE_MAX_ENTRIES);
+        } catch (const exception &ex) {
+            log_warn(ex.what(), logger);
+            done = walk_tree(user_root, count == 0 ? cursor : last_entry, visit);
         }
 
-        // if no entries
-        if (content.size() == 0) {
-            pckt = build_binary_part_packet(nullptr, 0);
-            serverSocket->send(clientSockfd, pckt, 0);
+        stream.close();
 
-            // wait for client reply
-            pckt = serverSocket->recv(clientSockfd, 0);
+        // tell the client if (and where) it can resume the listing
+        string reply_content;
+        reply_content.push_back(done ? 0 : 1);
+        if (!done) reply_content.append(last_entry);
 
-            if (pckt.type() != REPLY_PACKET) {
-                log_error("Unexpected packet type!", logger);
-                return false;
+        LPTF_Packet reply = build_reply_packet(USER_TREE_COMMAND, (void *)reply_content.c_str(), reply_content.size());
+        serverSocket->send(clientSockfd, reply, 0);
+
+        ostringstream status_msg;
+        status_msg << "Sent " << count << " tree entries (" << stream.bytes_written() << " byte(s))" << (done ? "" : ", more to come");
+        log_info(status_msg, logger);
+
+    } catch (const exception &ex) {
+        send_error_message(serverSocket, clientSockfd, USER_TREE_COMMAND, ex.what(), logger);
+        return false;
+    }
+
+    return true;
+}
+
+
+STAT_RESULT_STRUCT stat_user_path(const fs::path &user_root, const string &username, const string &path) {
+    STAT_RESULT_STRUCT result;
+    result.status = STAT_RESULT_ERROR;
+    result.entry.name = path;
+
+    fs::path filepath = user_root / path;
+
+    if (path.empty() || path.at(0) == '/' || path.at(0) == '\\' || !is_path_lexically_in_folder(filepath, user_root)) {
+        result.error = "Invalid path.";
+        return result;
+    }
+
+    // the catalog never follows symlinks, so a lexically valid path is enough to look it up there.
+    // A path it doesn't know (e.g. through a symlinked directory) is resolved and stat'ed on disk
+    int err = ENOENT;
+    try {
+        if (get_catalog().lookup(username, get_index_path(filepath, user_root), result.entry))
+            err = 0;
+    } catch (const exception &) {
+        // catalog not available, stat'ed on disk below
+    }
+    if (err != 0)
+        err = is_path_in_folder(filepath, user_root) ? stat_list_entry(AT_FDCWD, filepath.c_str(), result.entry) : ENOENT;
+
+    result.entry.name = path;
+    if (err != 0) {
+        result.error = strerror(err);
+        return result;
+    }
+
+    result.status = STAT_RESULT_OK;
+    return result;
+}
+
+
+/*
+Stats a batch of paths (relative to the user root) in one request.
+The client streams the null terminated paths, then the results are streamed back in the same order.
+*/
+bool stat_many(LPTF_Socket *serverSocket, int clientSockfd, string username, Logger *logger) {
+    fs::path user_root = get_user_root(username);
+
+    send_ok_reply(serverSocket, clientSockfd, STAT_MANY_COMMAND);
+
+    try {
+
+        LPTF_PartReader request(serverSocket, clientSockfd);
+
+        // the results can only be sent once the request ended, its paths are kept until then (within bounds)
+        vector<string> paths;
+        string pending;
+
+        while (request.read(pending)) {
+            if (request.bytes_read() > STAT_MANY_MAX_REQUEST_BYTES)
+                throw runtime_error("Request too large.");
+
+            size_t start = 0;
+            size_t end;
+
+            // the last path may be split with the next part
+            while ((end = pending.find('\0', start)) != string::npos) {
+                if (end - start > PATH_MAX)
+                    throw runtime_error("Path too long.");
+                if (paths.size() == STAT_MANY_MAX_PATHS)
+                    throw runtime_error("Too many paths in one batch.");
+
+                paths.push_back(pending.substr(start, end - start));
+                start = end + 1;
             }
 
-            return true;
+            pending.erase(0, start);
+            if (pending.size() > PATH_MAX)
+                throw runtime_error("Path too long.");
+        }
+
+        ostringstream msg;
+        msg << "Sending stat results for " << paths.size() << " path(s)";
+        log_info(msg, logger);
+
+        // each result goes out as the stream fills a part
+        LPTF_PartWriter stream(serverSocket, clientSockfd);
+        string result;
+        for (const string &path : paths) {
+            result.clear();
+            append_stat_result(result, stat_user_path(user_root, username, path));
+            stream.write(result);
         }
+        stream.close();
 
-        // build packets with the remaining content
-        while (content.size() != 0) {
-            uint16_t datalen;
-            if (content.size() > MAX_BINARY_PART_BYTES) datalen = MAX_BINARY_PART_BYTES;
-            else datalen = static_cast<uint16_t>(content.size());
+    } catch (const exception &ex) {
+        send_error_message(serverSocket, clientSockfd, STAT_MANY_COMMAND, ex.what(), logger);
+        return false;
+    }
 
-            pckt = build_binary_part_packet((void *)content.c_str(), datalen);
-            serverSocket->send(clientSockfd, pckt, 0);
+    return true;
+}
 
-            // wait for client reply
-            pckt = serverSocket->recv(clientSockfd, 0);
 
-            if (pckt.type() != REPLY_PACKET) {
-                log_error("Unexpected packet type!", logger);
-                return false;
-            }
+bool send_quota(LPTF_Socket *serverSocket, int clientSockfd, string username, Logger *logger) {
+    uint64_t usage[2] = {
+        htobe64(get_quota_manager().get_usage(username)),
+        htobe64(get_quota_manager().get_limit())
+    };
 
-            content.erase(0, datalen);
+    ostringstream msg;
+    msg << "Quota usage: " << be64toh(usage[0]) << " / " << be64toh(usage[1]) << " byte(s)";
+    log_info(msg, logger);
 
-            // send empty bin part packet to tell the client to stop waiting for data
-            if (datalen == MAX_BINARY_PART_BYTES && content.size() == 0) {
-                pckt = build_binary_part_packet(nullptr, 0);
-                serverSocket->send(clientSockfd, pckt, 0);
+    LPTF_Packet reply = build_reply_packet(QUOTA_COMMAND, usage, sizeof(usage));
+    serverSocket->send(clientSockfd, reply, 0);
+    return true;
+}
 
-                // wait for client reply
-                pckt = serverSocket->recv(clientSockfd, 0);
 
-                if (pckt.type() != REPLY_PACKET) {
-                    log_error("Unexpected packet type!", logger);
-                    return false;
-                }
+/*
+Sends the paths of the user matching pattern (a glob, or a substring),
+streamed after an OK reply as lines, directories ending with a '/'.
+*/
+bool search_files(LPTF_Socket *serverSocket, int clientSockfd, string pattern, string username, Logger *logger) {
+    if (pattern.empty()) {
+        send_error_message(serverSocket, clientSockfd, SEARCH_COMMAND, "Empty search pattern.", logger);
+        return false;
+    }
+
+    try {
+        send_ok_reply(serverSocket, clientSockfd, SEARCH_COMMAND);
+
+        // the results are sent as the search finds them
+        LPTF_PartWriter stream(serverSocket, clientSockfd);
+        size_t count = get_search_index().search(username, pattern, SEARCH_MAX_RESULTS, [&](const vector<SEARCH_RESULT> &results) {
+            for (const SEARCH_RESULT &result : results) {
+                stream.write(result.path);
+                if (result.is_dir) stream.put('/');
+                stream.put('\n');
             }
-        }
-        
+            return true;
+        });
+        stream.close();
+
+        ostringstream msg;
+        msg << "Search \"" << pattern << "\": " << count << " result(s)";
+        log_info(msg, logger);
+
     } catch (const exception &ex) {
-        send_error_message(serverSocket, clientSockfd, USER_TREE_COMMAND, ex.what(), logger);
+        send_error_message(serverSocket, clientSockfd, SEARCH_COMMAND, ex.what(), logger);
         return false;
     }
 
     return true;
 }
+
+
+// the file a cached hash was computed for, the catalog itself only compares sizes and mtimes in seconds
+static string get_hash_cache_key(const struct stat &st) {
+    string key;
+    append_varint(key, st.st_ino);
+    append_varint(key, st.st_size);
+    append_varint(key, st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec);
+    return key;
+}
+
+
+/*
+Replies with the BLAKE3 of a file of the user (BLAKE3_OUT_BYTES bytes), hashed on all cores.
+The hash is kept in the catalog entry of the file, after the key of the version it is valid for.
+*/
+bool hash_file(LPTF_Socket *serverSocket, int clientSockfd, string filename, string username, Logger *logger) {
+
+    fs::path user_root = get_user_root(username);
+    fs::path filepath = user_root;
+    filepath /= filename;
+
+    struct stat st;
+    int fd = -1;
+    if (!is_path_in_folder(filepath, user_root) || stat(filepath.c_str(), &st) != 0 || !S_ISREG(st.st_mode)
+        || (fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC)) == -1 || fstat(fd, &st) != 0) {
+        if (fd != -1) close(fd);
+        send_error_message(serverSocket, clientSockfd, HASH_COMMAND, "The file doesn't exist.", logger);
+        return false;
+    }
+
+    string relpath = get_index_path(filepath, user_root);
+    string key = get_hash_cache_key(st);
+    string hash;
+    bool cached = false;
+
+    try {
+        string value;
+        if (get_catalog().get_hash(username, relpath, value) && value.size() == key.size() + BLAKE3_OUT_BYTES
+            && value.compare(0, key.size(), key) == 0) {
+            hash = value.substr(key.size());
+            cached = true;
+        }
+    } catch (const exception &ex) {
+        log_warn(ex.what(), logger);
+    }
+
+    if (!cached) {
+        try {
+            hash = get_file_blake3(fd, st.st_size);
+        } catch (const exception &ex) {
+            close(fd);
+            send_error_message(serverSocket, clientSockfd, HASH_COMMAND, ex.what(), logger);
+            return false;
+        }
+
+        // only cached if the file didn't change while it was hashed
+        struct stat after;
+        if (fstat(fd, &after) == 0 && get_hash_cache_key(after) == key) {
+            try {
+                get_catalog().refresh(username, relpath);
+                get_catalog().set_hash(username, relpath, key + hash);
+            } catch (const exception &ex) {
+                log_warn(ex.what(), logger);
+            }
+        }
+    }
+
+    close(fd);
+
+    ostringstream msg;
+    msg << "BLAKE3 of " << filepath << ": " << to_hex(hash) << (cached ? " (cached)" : "");
+    log_info(msg, logger);
+
+    LPTF_Packet reply = build_reply_packet(HASH_COMMAND, (void *)hash.data(), hash.size());
+    serverSocket->send(clientSockfd, reply, 0);
+    return true;
+}
+
+
+/*
+Changes a file of the user in place with the records the client streams after the OK reply:
+    PWRITE_COMMAND  varint offset, varint length, data
+    APPEND_COMMAND  varint length, data (written at the end of the file)
+Each record is written at once under the lock of the file, so the records of concurrent
+sessions never mix, and is visible in listings once its part is handled. The file is created
+if needed, and can't grow past 4Gb (the most a download can announce). The final reply holds its size (uint64).
+A session idle for WRITE_RECORDS_IDLE_MS is ended, so it doesn't keep a worker forever.
+*/
+bool write_file_records(LPTF_Socket *serverSocket, int clientSockfd, string filename, bool append, string username, Logger *logger) {
+    uint8_t command = append ? APPEND_COMMAND : PWRITE_COMMAND;
+
+    fs::path user_root = get_user_root(username);
+    fs::path filepath = user_root;
+    filepath /= filename;
+
+    ostringstream fp_msg;
+    fp_msg << "Filepath: " << filepath;
+    log_debug(fp_msg, logger);
+
+    struct stat st;
+    bool created = stat(filepath.c_str(), &st) != 0;
+    if (!is_path_in_folder(filepath, user_root) || !filepath.has_filename() || !fs::is_directory(fs::path(filepath).remove_filename())
+        || (!created && !S_ISREG(st.st_mode))) {
+        send_error_message(serverSocket, clientSockfd, command, "Target file is invalid !", logger);
+        return false;
+    }
+
+    shared_ptr<mutex> lock = get_path_locks().get(filepath);
+    int fd = -1;
+
+    // opens the file again if another session replaced it, and copies it if it is shared with the chunk store
+    // (called with the lock held), returns its size
+    auto prepare_file = [&]() {
+        struct stat path_st, fd_st;
+        if (fd != -1 && (stat(filepath.c_str(), &path_st) != 0 || fstat(fd, &fd_st) != 0
+                         || path_st.st_dev != fd_st.st_dev || path_st.st_ino != fd_st.st_ino)) {
+            close(fd);
+            fd = -1;
+        }
+
+        if (fd == -1 && (fd = open(filepath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666)) == -1)
+            throw runtime_error("Could not open file !");
+        if (fstat(fd, &fd_st) != 0 || !S_ISREG(fd_st.st_mode))
+            throw runtime_error("Target file is invalid !");
+
+        if (fd_st.st_nlink > 1) {
+            fs::path temppath;
+            int copy_fd = open_upload_file(filepath, temppath);
+            if (copy_fd == -1)
+                throw runtime_error("Could not copy file !");
+
+            try {
+                copy_file_content(fd, copy_fd, fd_st.st_size);
+                fchmod(copy_fd, fd_st.st_mode & 07777);
+                publish_upload_file(copy_fd, temppath, filepath);
+            } catch (...) {
+                close(copy_fd);
+                discard_upload_file(temppath);
+                throw;
+            }
+
+            close(fd);
+            fd = copy_fd;
+        }
+
+        return (uint64_t)fd_st.st_size;
+    };
+
+    // written since the listings and the catalog were last told
+    bool changed = false;
+    auto publish_changes = [&]() {
+        on_file_changed(filepath);
+        update_catalog(username, user_root, filepath);
+        if (created)
+            get_search_index().add(username, get_index_path(filepath, user_root), false);
+        created = false;
+        changed = false;
+    };
+
+    send_ok_reply(serverSocket, clientSockfd, command);
+
+    uint64_t records = 0;
+    uint64_t written = 0;
+    uint64_t filesize = 0;
+    bool ok = true;
+
+    try {
+        LPTF_PartReader stream(serverSocket, clientSockfd);
+        string data;
+
+        while (!stream.done()) {
+            struct pollfd pfd = {clientSockfd, POLLIN, 0};
+            int ready = poll(&pfd, 1, WRITE_RECORDS_IDLE_MS);
+            if (ready == -1 && errno == EINTR)
+                continue;
+            if (ready == 0)
+                throw runtime_error("Session idle for too long !");
+
+            stream.read(data);
+
+            const char *ptr = data.data();
+            const char *end = ptr + data.size();
+
+            // the complete records, the rest waits for the next part
+            while (true) {
+                const char *cur = ptr;
+                uint64_t offset = 0;
+                uint64_t length;
+                if ((!append && !read_varint(cur, end, offset)) || !read_varint(cur, end, length))
+                    break;
+                // downloads announce the file size on 32 bits, a record can't grow a file past 4Gb
+                if (length > WRITE_RECORD_MAX_BYTES || offset > UINT32_MAX - length)
+                    throw runtime_error("Invalid record !");
+                if ((uint64_t)(end - cur) < length)
+                    break;
+
+                {
+                    lock_guard<mutex> guard(*lock);
+                    uint64_t size = prepare_file();
+                    if (append)
+                        offset = size;
+                    if (offset > UINT32_MAX - length)
+                        throw runtime_error("The file can't grow past 4Gb !");
+
+                    uint64_t growth = offset + length > size ? offset + length - size : 0;
+                    QuotaReservation reservation;
+                    if (growth > 0 && !reservation.reserve(username, growth))
+                        throw runtime_error("Quota exceeded !");
+
+                    for (uint64_t done = 0; done < length;) {
+                        ssize_t n = pwrite(fd, cur + done, length - done, offset + done);
+                        if (n <= 0)
+                            throw runtime_error("Could not write file !");
+                        done += n;
+                    }
+
+                    if (growth > 0)
+                        reservation.commit((int64_t)growth);
+                    filesize = size + growth;
+                    changed = true;
+                }
+
+                records++;
+                written += length;
+                ptr = cur + length;
+            }
+
+            data.erase(0, ptr - data.data());
+
+            if (changed)
+                publish_changes();
+        }
+
+        if (!data.empty())
+            throw runtime_error("Incomplete record !");
+
+        // an empty stream still creates the file
+        if (fd == -1) {
+            lock_guard<mutex> guard(*lock);
+            filesize = prepare_file();
+            changed = true;
+        }
+
+    } catch (const exception &ex) {
+        send_error_message(serverSocket, clientSockfd, command, ex.what(), logger);
+        ok = false;
+    }
+
+    if (fd != -1) {
+        close(fd);
+        if (changed)
+            publish_changes();
+    }
+
+    ostringstream msg;
+    msg << "Wrote " << records << " record(s), " << written << " byte(s) to " << filepath << ", file size: " << filesize;
+    log_info(msg, logger);
+
+    if (!ok)
+        return false;
+
+    // in durable mode, acknowledged once on disk
+    try {
+        get_group_committer().commit();
+    } catch (const exception &ex) {
+        send_error_message(serverSocket, clientSockfd, command, ex.what(), logger);
+        return false;
+    }
+
+    uint64_t be_filesize = htobe64(filesize);
+    LPTF_Packet reply = build_reply_packet(command, &be_filesize, sizeof(be_filesize));
+    serverSocket->send(clientSockfd, reply, 0);
+    return true;
+}
+
+
+ThreadPool &get_copy_pool() {
+    static ThreadPool pool(COPY_THREADS);
+    return pool;
+}
+
+
+// checks the source and destination of a copy or a move, returns the error message if any
+static string check_copy_paths(const fs::path &user_root, const fs::path &srcpath, const fs::path &dstpath, bool &is_dir) {
+    struct stat st;
+    if (!is_path_in_folder(srcpath, user_root) || lstat(srcpath.c_str(), &st) != 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)))
+        return "The source doesn't exist.";
+    is_dir = S_ISDIR(st.st_mode);
+
+    if (!dstpath.has_filename() || !is_path_in_folder(dstpath, user_root) || !fs::is_directory(dstpath.parent_path()))
+        return "Invalid destination.";
+    if (lstat(dstpath.c_str(), &st) == 0)
+        return "The destination already exists.";
+    if (is_dir && is_path_in_folder(dstpath, srcpath))
+        return "A directory cannot be copied or moved into itself.";
+
+    return "";
+}
+
+
+/*
+Copies a file or a directory of the user to a new path, on the server.
+The data is shared with the source where the filesystem supports reflinks, else copied in the kernel.
+A directory is copied in the staging folder (out of reach of the clients, and cleared at startup
+if left by a crash), its files in parallel, then renamed to the destination once complete.
+Symlinks and special files are not copied.
+*/
+bool copy_path(LPTF_Socket *serverSocket, int clientSockfd, string source, string destination, string username, Logger *logger) {
+    fs::path user_root = get_user_root(username);
+    fs::path srcpath = user_root / source;
+    fs::path dstpath = user_root / destination;
+
+    bool is_dir = false;
+    string error = check_copy_paths(user_root, srcpath, dstpath, is_dir);
+    if (!error.empty()) {
+        send_error_message(serverSocket, clientSockfd, COPY_COMMAND, error, logger);
+        return false;
+    }
+
+    ostringstream msg;
+    msg << "Copying " << srcpath << " to " << dstpath;
+    log_info(msg, logger);
+
+    // paths relative to the source, directories in tree order (parents first)
+    vector<string> dirs;
+    vector<string> files;
+    uint64_t total = 0;
+    struct stat st;
+
+    try {
+        if (is_dir) {
+            walk_tree(srcpath, "", [&](const string &relpath, bool) {
+                if (lstat((srcpath / relpath).c_str(), &st) != 0)
+                    return true;    // removed since
+
+                if (S_ISDIR(st.st_mode)) {
+                    dirs.push_back(relpath);
+                } else if (S_ISREG(st.st_mode)) {
+                    files.push_back(relpath);
+                    total += st.st_size;
+                }
+                return true;
+            });
+        } else if (lstat(srcpath.c_str(), &st) == 0) {
+            total = st.st_size;
+        }
+    } catch (const exception &ex) {
+        send_error_message(serverSocket, clientSockfd, COPY_COMMAND, ex.what(), logger);
+        return false;
+    }
+
+    QuotaReservation reservation;
+    if (!reservation.reserve(username, total)) {
+        send_error_message(serverSocket, clientSockfd, COPY_COMMAND, "Quota exceeded !", logger);
+        return false;
+    }
+
+    atomic<uint64_t> copied(0);
+    fs::path target = is_dir ? get_staging_path(dstpath) : dstpath;
+
+    try {
+        if (!is_dir) {
+            copied = clone_file(srcpath, dstpath);
+        } else {
+            if (lstat(srcpath.c_str(), &st) != 0 || mkdir(target.c_str(), st.st_mode & 07777) != 0)
+                throw runtime_error("Could not create directory !");
+
+            for (const string &relpath : dirs) {
+                if (lstat((srcpath / relpath).c_str(), &st) != 0 || mkdir((target / relpath).c_str(), st.st_mode & 07777) != 0)
+                    throw runtime_error("Could not create directory !");
+            }
+
+            vector<future<void>> results;
+            results.reserve(files.size());
+
+            for (const string &relpath : files) {
+                auto task = make_shared<packaged_task<void()>>([&srcpath, &target, &copied, relpath]() {
+                    copied += clone_file(srcpath / relpath, target / relpath);
+                });
+                results.push_back(task->get_future());
+                get_copy_pool().enqueue([task]() { (*task)(); });
+            }
+
+            // every copy is waited for before target is removed on error
+            exception_ptr failure;
+            for (future<void> &result : results) {
+                try {
+                    result.get();
+                } catch (...) {
+                    if (!failure) failure = current_exception();
+                }
+            }
+            if (failure)
+                rethrow_exception(failure);
+
+            if (renameat2(AT_FDCWD, target.c_str(), AT_FDCWD, dstpath.c_str(), RENAME_NOREPLACE) != 0)
+                throw runtime_error(errno == EEXIST ? "The destination already exists." : "Could not create the copy !");
+        }
+    } catch (const exception &ex) {
+        if (is_dir) {
+            error_code ec;
+            fs::remove_all(target, ec);
+        }
+        send_error_message(serverSocket, clientSockfd, COPY_COMMAND, ex.what(), logger);
+        return false;
+    }
+
+    reservation.commit((int64_t)copied);
+
+    on_directory_changed(dstpath.parent_path());
+    get_search_index().add(username, get_index_path(dstpath, user_root), is_dir);
+    update_catalog(username, user_root, dstpath);
+
+    for (const vector<string> *entries : {&dirs, &files}) {
+        for (const string &relpath : *entries) {
+            string index_path = get_index_path(dstpath / relpath, user_root);
+            get_search_index().add(username, index_path, entries == &dirs);
+            get_catalog().refresh(username, index_path);
+        }
+    }
+
+    ostringstream done_msg;
+    done_msg << "Copied " << (is_dir ? files.size() : 1) << " file(s), " << copied << " byte(s)";
+    log_info(done_msg, logger);
+
+    return send_committed_reply(serverSocket, clientSockfd, COPY_COMMAND, logger);
+}
+
+
+// renames a file or a directory of the user (anywhere in its tree), never replacing an existing path
+bool move_path(LPTF_Socket *serverSocket, int clientSockfd, string source, string destination, string username, Logger *logger) {
+    fs::path user_root = get_user_root(username);
+    fs::path srcpath = user_root / source;
+    fs::path dstpath = user_root / destination;
+
+    bool is_dir = false;
+    string error = check_copy_paths(user_root, srcpath, dstpath, is_dir);
+    if (!error.empty()) {
+        send_error_message(serverSocket, clientSockfd, MOVE_COMMAND, error, logger);
+        return false;
+    }
+
+    ostringstream msg;
+    msg << "Moving " << srcpath << " to " << dstpath;
+    log_info(msg, logger);
+
+    if (renameat2(AT_FDCWD, srcpath.c_str(), AT_FDCWD, dstpath.c_str(), RENAME_NOREPLACE) != 0) {
+        send_error_message(serverSocket, clientSockfd, MOVE_COMMAND, errno == EEXIST ? "The destination already exists." : "Could not move the path !", logger);
+        return false;
+    }
+
+    if (is_dir)
+        on_tree_changed(srcpath);
+    else
+        on_file_changed(srcpath);
+    on_directory_changed(dstpath.parent_path());
+
+    get_search_index().rename_tree(username, get_index_path(srcpath, user_root), get_index_path(dstpath, user_root));
+    get_catalog().rename_tree(username, get_index_path(srcpath, user_root), get_index_path(dstpath, user_root));
+    update_catalog(username, user_root, srcpath);
+    update_catalog(username, user_root, dstpath);
+
+    log_info("Path moved", logger);
+
+    return send_committed_reply(serverSocket, clientSockfd, MOVE_COMMAND, logger);
+}
+
+
+typedef struct {
+    TAR_ENTRY entry;
+    fs::path path;
+    future<string> data;    // content of a small file, read ahead
+} ARCHIVE_MEMBER;
+
+
+// reads up to size bytes of a small file (less if it shrank or was removed since), for a directory download
+static string read_small_file(const fs::path &filepath, uint64_t size) {
+    string data(size, '\0');
+    uint64_t done = 0;
+
+    int fd = open(filepath.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+        return "";
+
+    while (done < size) {
+        ssize_t n = pread(fd, &data[done], size - done, done);
+        if (n < 0) {
+            close(fd);
+            throw runtime_error("Could not read file !");
+        }
+        if (n == 0)
+            break;
+        done += n;
+    }
+
+    close(fd);
+    data.resize(done);
+    return data;
+}
+
+
+/*
+Sends a directory of the user as a tar archive generated on the fly, in the same parts as send_file()
+(no delta): the client extracts it as it arrives. The paths start with the name of the directory
+(the user root has none). Symlinks and special files are left out.
+The reply holds the accepted options, then the number of files and their total size (varints, from the
+catalog, or counted by a first walk). The members are sent as the tree is walked: the next small files
+are read ahead in parallel on the copy threads, the others go through the chunk cache and a prefetcher,
+like a single download. A file that changed size meanwhile aborts the download.
+The archive ends with two zero blocks (and its digest).
+*/
+bool send_directory(LPTF_Socket *serverSocket, int clientSockfd, string folder, uint8_t options, string username, Logger *logger) {
+    fs::path user_root = get_user_root(username);
+    fs::path folderpath = user_root;
+    if (!folder.empty())
+        folderpath /= folder;
+
+    bool is_root = fs::equivalent(user_root, folderpath);
+    if (!is_root && (!is_path_in_folder(folderpath, user_root) || !fs::is_directory(folderpath)
+        || (folder.size() > 0 && (folder.at(0) == '/' || folder.at(0) == '\\')))) {
+        send_error_message(serverSocket, clientSockfd, DOWNLOAD_DIR_COMMAND, "The folder doesn't exist.", logger);
+        return false;
+    }
+
+    options &= TRANSFER_OPT_SPARSE | TRANSFER_OPT_COMPRESS | TRANSFER_OPT_CHECKSUM;
+
+    string base = is_root ? "" : fs::path(get_index_path(folderpath, user_root)).filename().string();
+    uint64_t file_count = 0;
+    uint64_t total = 0;
+
+    // the totals announced come from the catalog, or from a first walk if it doesn't know the folder
+    try {
+        bool counted = false;
+        try {
+            counted = get_catalog().get_tree_totals(username, is_root ? "" : get_index_path(folderpath, user_root), file_count, total);
+        } catch (const exception &ex) {
+            log_warn(ex.what(), logger);
+        }
+
+        if (!counted) {
+            walk_tree(folderpath, "", [&](const string &relpath, bool) {
+                struct stat st;
+                if (lstat((folderpath / relpath).c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+                    file_count++;
+                    total += st.st_size;
+                }
+                return true;
+            });
+        }
+    } catch (const exception &ex) {
+        send_error_message(serverSocket, clientSockfd, DOWNLOAD_DIR_COMMAND, ex.what(), logger);
+        return false;
+    }
+
+    string reply(1, (char)options);
+    append_varint(reply, file_count);
+    append_varint(reply, total);
+
+    LPTF_Packet pckt = build_reply_packet(DOWNLOAD_DIR_COMMAND, (void *)reply.data(), reply.size());
+    serverSocket->send(clientSockfd, pckt, 0);
+
+    ostringstream msg;
+    msg << "Start sending directory " << folderpath << " (" << file_count << " file(s), " << total << " byte(s)) to client";
+    log_info(msg, logger);
+
+    uint64_t sent_entries = 0;
+    uint64_t sent_files = 0;
+    uint64_t hole_bytes = 0;
+    uint64_t resent_parts = 0;
+    unsigned long read_ahead_files = 0;
+    unsigned long cached_chunks = 0;
+    unsigned long read_chunks = 0;
+    uint32_t digest = 0;
+    PartEncoder encoder(options & TRANSFER_OPT_COMPRESS);
+
+    // the members walked but not sent yet, while their small files are read ahead
+    deque<ARCHIVE_MEMBER> window;
+
+    try {
+
+        auto send_part = [&](LPTF_Packet &part) {
+            send_part_and_wait(serverSocket, clientSockfd, part, options & TRANSFER_OPT_CHECKSUM, resent_parts);
+        };
+
+        // headers and small files are gathered in full parts (each part costs a round trip)
+        string pending;
+
+        auto flush = [&](bool all) {
+            size_t pos = 0;
+            while (pending.size() - pos >= COMPRESS_BLOCK_BYTES || (all && pos < pending.size())) {
+                size_t consumed;
+                pckt = encoder.next_part(pending.data() + pos, pending.size() - pos, consumed);
+                send_part(pckt);
+                pos += consumed;
+            }
+            pending.erase(0, pos);
+        };
+
+        auto emit = [&](const string &data) {
+            if (options & TRANSFER_OPT_CHECKSUM)
+                digest = crc32c(digest, data.data(), data.size());
+            pending.append(data);
+            flush(false);
+        };
+
+        auto send_member = [&](ARCHIVE_MEMBER &member) {
+            emit(tar_header(member.entry));
+            sent_entries++;
+            if (member.entry.is_dir)
+                return;
+
+            uint64_t size = member.entry.size;
+
+            if (member.data.valid()) {
+                string data = member.data.get();
+                read_ahead_files++;
+
+                // the header is sent, a file that shrank since cannot be completed
+                if (data.size() < size)
+                    throw runtime_error("The file " + member.entry.path + " changed during the download !");
+                emit(data);
+            } else {
+                // large files are sent like a single download, read through one fd
+                struct stat st;
+                int fd = open(member.path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+                if (fd == -1 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size < size) {
+                    if (fd != -1) close(fd);
+                    throw runtime_error("The file " + member.entry.path + " changed during the download !");
+                }
+
+                vector<FILE_EXTENT> extents = {{0, size}};
+                if (options & TRANSFER_OPT_SPARSE)
+                    extents = get_data_extents(fd, size);
+
+                flush(true);
+
+                try {
+                    ChunkPrefetcher chunks(member.path, fd, get_file_version(st), extents);
+                    hole_bytes += send_file_range(chunks, 0, size, encoder, (options & TRANSFER_OPT_CHECKSUM) ? &digest : nullptr, send_part);
+
+                    cached_chunks += chunks.get_cached_chunks();
+                    read_chunks += chunks.get_read_chunks();
+                } catch (const exception &) {
+                    close(fd);
+                    throw;
+                }
+                close(fd);
+            }
+
+            emit(string(tar_padding(size), '\0'));
+            sent_files++;
+        };
+
+        // a walked member starts reading if it's a small file, and is sent once ARCHIVE_READ_AHEAD_FILES follow it
+        auto add_member = [&](const fs::path &path, const string &archive_path) {
+            struct stat st;
+            if (lstat(path.c_str(), &st) != 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)))
+                return;
+
+            bool is_dir = S_ISDIR(st.st_mode);
+            uint64_t size = is_dir ? 0 : st.st_size;
+            ARCHIVE_MEMBER member = {{archive_path, is_dir, st.st_mode & 07777, size, st.st_mtim.tv_sec},
+                                     path, {}};
+
+            if (!is_dir && size <= CHUNK_CACHE_CHUNK_BYTES) {
+                auto task = make_shared<packaged_task<string()>>([path, size]() { return read_small_file(path, size); });
+                member.data = task->get_future();
+                get_copy_pool().enqueue([task]() { (*task)(); });
+            }
+
+            window.push_back(std::move(member));
+            if (window.size() > ARCHIVE_READ_AHEAD_FILES) {
+                send_member(window.front());
+                window.pop_front();
+            }
+        };
+
+        if (!is_root)
+            add_member(folderpath, base);
+
+        walk_tree(folderpath, "", [&](const string &relpath, bool) {
+            add_member(folderpath / relpath, base.empty() ? relpath : base + "/" + relpath);
+            return true;
+        });
+
+        for (; !window.empty(); window.pop_front())
+            send_member(window.front());
+
+        emit(tar_end());
+        flush(true);
+
+        // the client checks the whole archive
+        if (options & TRANSFER_OPT_CHECKSUM) {
+            pckt = build_digest_part_packet(digest);
+            send_part(pckt);
+        }
+
+    } catch (const exception &ex) {
+        // the files still being read ahead are waited for
+        for (ARCHIVE_MEMBER &member : window)
+            if (member.data.valid()) member.data.wait();
+
+        send_error_message(serverSocket, clientSockfd, DOWNLOAD_DIR_COMMAND, ex.what(), logger);
+        return false;
+    }
+
+    ostringstream status_msg;
+    status_msg << "Directory sent: " << sent_entries << " entries, " << sent_files << " file(s), " << read_ahead_files << " small file(s) read ahead, "
+               << cached_chunks << " chunk(s) from cache, " << read_chunks << " read from disk, "
+               << hole_bytes << " byte(s) of holes skipped";
+    log_info(status_msg, logger);
+
+    if (options & TRANSFER_OPT_COMPRESS)
+        log_info(encoder.get_summary(), logger);
+
+    if (resent_parts > 0) {
+        ostringstream resent_msg;
+        resent_msg << "Corrupted parts sent again: " << resent_parts;
+        log_warn(resent_msg, logger);
+    }
+
+    return true;
+}
+
+
+/*
+The umask of the server, read once from /proc (umask() only reads it by changing it,
+which the other threads would see), 022 if it can't be read.
+*/
+static mode_t get_server_umask() {
+    static mode_t mask = []() {
+        ifstream status("/proc/self/status");
+        string line;
+        while (getline(status, line))
+            if (line.compare(0, 6, "Umask:") == 0)
+                return (mode_t)(stoul(line.substr(6), nullptr, 8) & 0777);
+        return (mode_t)022;
+    }();
+    return mask;
+}
+
+
+/*
+Gives a received file of a directory upload its mode and mtime, then publishes it at filepath.
+Only the permission bits of the mode sent are kept (never setuid, setgid or sticky), minus the umask.
+*/
+static void publish_archive_file(int fd, fs::path &temppath, const fs::path &filepath, const TAR_ENTRY &entry,
+                                 QuotaReservation &reservation, const string &username, const fs::path &user_root) {
+    struct timespec times[2] = {{entry.mtime, 0}, {entry.mtime, 0}};
+    fchmod(fd, entry.mode & 0777 & ~get_server_umask());
+    futimens(fd, times);
+
+    {
+        // not while a PWRITE/APPEND session is changing the file it replaces
+        shared_ptr<mutex> lock = get_path_locks().get(filepath);
+        lock_guard<mutex> guard(*lock);
+
+        struct stat st;
+        uint64_t replaced_size = (stat(filepath.c_str(), &st) == 0 && S_ISREG(st.st_mode)) ? st.st_size : 0;
+
+        publish_upload_file(fd, temppath, filepath);
+        reservation.commit(entry.size, (int64_t)entry.size - (int64_t)replaced_size);
+    }
+
+    on_file_changed(filepath);
+    get_search_index().add(username, get_index_path(filepath, user_root), false);
+    update_catalog(username, user_root, filepath);
+}
+
+
+// writes a small file of a directory upload (on the copy threads), throws on error
+static void write_archive_file(const fs::path &filepath, const TAR_ENTRY &entry, const string &data,
+                               QuotaReservation &reservation, const string &username, const fs::path &user_root) {
+    fs::path temppath;
+    int fd = open_upload_file(filepath, temppath);
+    if (fd == -1)
+        throw runtime_error("Could not create file " + get_index_path(filepath, user_root) + " !");
+
+    try {
+        for (size_t done = 0; done < data.size();) {
+            ssize_t n = pwrite(fd, data.data() + done, data.size() - done, done);
+            if (n <= 0)
+                throw runtime_error("Could not write file !");
+            done += n;
+        }
+
+        // in durable mode, synced with the others by a group commit
+        if (!get_group_committer().is_enabled() && fdatasync(fd) != 0)
+            throw runtime_error("Could not sync file " + get_index_path(filepath, user_root) + " !");
+
+        publish_archive_file(fd, temppath, filepath, entry, reservation, username, user_root);
+    } catch (...) {
+        close(fd);
+        discard_upload_file(temppath);
+        throw;
+    }
+
+    close(fd);
+}
+
+
+/*
+Receives a tar archive (see send_directory()) and extracts it into a folder of the user as it arrives.
+The request holds the size of its files, reserved in the quota first. Every path is checked to
+stay in the folder. Directories are created in order, large files written behind the receiving
+thread, small files handed to the copy threads (at most ARCHIVE_PENDING_FILES at once) so their
+creation overlaps with the transfer. Each file is synced before it replaces the previous one
+(in durable mode, they are all synced by one group commit at the end).
+The final reply holds the number of files, directories and bytes extracted (varints).
+*/
+bool receive_directory(LPTF_Socket *serverSocket, int clientSockfd, string folder, uint8_t options, uint64_t total, string username, Logger *logger) {
+    fs::path user_root = get_user_root(username);
+    fs::path folderpath = user_root;
+    if (!folder.empty())
+        folderpath /= folder;
+
+    if (!fs::equivalent(user_root, folderpath) && (!is_path_in_folder(folderpath, user_root) || !fs::is_directory(folderpath)
+        || (folder.size() > 0 && (folder.at(0) == '/' || folder.at(0) == '\\')))) {
+        send_error_message(serverSocket, clientSockfd, UPLOAD_DIR_COMMAND, "Target directory doesn't exist !", logger);
+        return false;
+    }
+
+    // the quota is reserved before the client sends any data, each file accounts its part
+    QuotaReservation reservation;
+    if (!reservation.reserve(username, total)) {
+        send_error_message(serverSocket, clientSockfd, UPLOAD_DIR_COMMAND, "Quota exceeded !", logger);
+        return false;
+    }
+
+    options &= TRANSFER_OPT_SPARSE | TRANSFER_OPT_COMPRESS | TRANSFER_OPT_CHECKSUM;
+
+    LPTF_Packet pckt = build_reply_packet(UPLOAD_DIR_COMMAND, &options, sizeof(options));
+    serverSocket->send(clientSockfd, pckt, 0);
+
+    ostringstream msg;
+    msg << "Start receiving directory archive in " << folderpath << " (" << total << " byte(s))";
+    log_info(msg, logger);
+
+    uint64_t files = 0;
+    uint64_t dirs = 0;
+    uint64_t received = 0;
+    uint64_t corrupted_parts = 0;
+
+    // the large file being received
+    fs::path filepath;
+    fs::path temppath;
+    int fd = -1;
+    TAR_ENTRY current;
+    unique_ptr<AsyncWriter> writer;
+    shared_ptr<string> buffer;
+
+    // small files being written, oldest first
+    deque<future<void>> writes;
+
+    // creates a directory and its missing parents (within the folder)
+    auto make_directory = [&](const fs::path &dirpath) {
+        vector<fs::path> missing;
+        for (fs::path path = dirpath; !fs::exists(path); path = path.parent_path())
+            missing.push_back(path);
+
+        for (auto path = missing.rbegin(); path != missing.rend(); path++) {
+            fs::create_directory(*path);
+            on_directory_changed(path->parent_path());
+            get_search_index().add(username, get_index_path(*path, user_root), true);
+            update_catalog(username, user_root, *path);
+            dirs++;
+        }
+
+        if (!fs::is_directory(dirpath))
+            throw runtime_error("Not a directory: " + get_index_path(dirpath, user_root));
+    };
+
+    TAR_VISITOR visitor;
+
+    visitor.begin = [&](const TAR_ENTRY &entry) {
+        fs::path target = (folderpath / entry.path).lexically_normal();
+
+        if (fs::path(entry.path).is_absolute() || !is_path_lexically_in_folder(target, folderpath) || !is_path_in_folder(target, user_root))
+            throw runtime_error("Invalid path in archive: " + entry.path);
+
+        if (entry.is_dir) {
+            make_directory(target);
+            return;
+        }
+
+        make_directory(target.parent_path());
+
+        received += entry.size;
+        if (received > total)
+            throw runtime_error("Received more data than announced !");
+
+        current = entry;
+        filepath = target;
+
+        if (entry.size <= CHUNK_CACHE_CHUNK_BYTES) {
+            buffer = make_shared<string>();
+            buffer->reserve(entry.size);
+            return;
+        }
+
+        fd = open_upload_file(filepath, temppath);
+        if (fd == -1)
+            throw runtime_error("Could not create file " + get_index_path(filepath, user_root) + " !");
+        writer = make_unique<AsyncWriter>(fd);
+    };
+
+    visitor.data = [&](const char *data, size_t len) {
+        if (writer)
+            writer->write(data, len);
+        else
+            buffer->append(data, len);
+    };
+
+    visitor.zeros = [&](uint64_t len) {
+        if (writer)
+            writer->skip(len);
+        else
+            buffer->append(len, '\0');
+    };
+
+    visitor.end = [&]() {
+        if (writer) {
+            writer->finish(!get_group_committer().is_enabled());
+            writer.reset();
+
+            publish_archive_file(fd, temppath, filepath, current, reservation, username, user_root);
+            close(fd);
+            fd = -1;
+        } else if (buffer) {
+            // the oldest write is waited for (and its error reported) once too many are pending
+            if (writes.size() >= ARCHIVE_PENDING_FILES) {
+                writes.front().get();
+                writes.pop_front();
+            }
+
+            auto task = make_shared<packaged_task<void()>>([path = filepath, entry = current, data = buffer, &reservation, username, user_root]() {
+                write_archive_file(path, entry, *data, reservation, username, user_root);
+            });
+            writes.push_back(task->get_future());
+            get_copy_pool().enqueue([task]() { (*task)(); });
+            buffer.reset();
+        } else {
+            return;     // a directory
+        }
+
+        files++;
+    };
+
+    TarReader archive(visitor);
+    PartDecoder decoder;
+    uint32_t digest = 0;
+    bool digest_pending = options & TRANSFER_OPT_CHECKSUM;
+    bool ok = true;
+
+    try {
+
+        do {
+            pckt = serverSocket->recv(clientSockfd, 0);
+
+            // the client gave up (its error is not answered)
+            if (pckt.type() != BINARY_PART_PACKET) {
+                ostringstream err_msg;
+                err_msg << "Packet is not a File Part Packet ! (" << pckt.type() << ")";
+                log_error(err_msg, logger);
+                ok = false;
+                break;
+            }
+
+            // a corrupted part is asked again
+            if ((options & TRANSFER_OPT_CHECKSUM) && !check_part_checksum(pckt)) {
+                corrupted_parts++;
+                pckt = build_part_reply_packet(PART_REPLY_RESEND);
+                serverSocket->send(clientSockfd, pckt, 0);
+                continue;
+            }
+
+            if (is_digest_part_packet(pckt)) {
+                if (!digest_pending || !archive.done())
+                    throw runtime_error("Unexpected digest part !");
+                if (get_digest_from_digest_part_packet(pckt) != digest)
+                    throw runtime_error("The received archive doesn't match its checksum !");
+                digest_pending = false;
+            } else if (archive.done()) {
+                throw runtime_error("Received data after the end of the archive !");
+            } else if (is_hole_part_packet(pckt)) {
+                if (!(options & TRANSFER_OPT_SPARSE))
+                    throw runtime_error("Unexpected hole part !");
+
+                uint64_t length = get_length_from_hole_part_packet(pckt);
+                digest = crc32c_zeros(digest, length);
+                archive.feed_zeros(length);
+            } else {
+                BINARY_PART_PACKET_STRUCT data = decoder.decode(pckt);
+                digest = crc32c(digest, data.data, data.len);
+                archive.feed((const char *)data.data, data.len);
+            }
+
+            pckt = build_part_reply_packet(PART_REPLY_OK);
+            serverSocket->send(clientSockfd, pckt, 0);
+        } while (!archive.done() || digest_pending);
+
+        if (ok) {
+            while (!writes.empty()) {
+                writes.front().get();
+                writes.pop_front();
+            }
+
+            get_group_committer().commit();
+        }
+
+    } catch (const exception &ex) {
+        send_error_message(serverSocket, clientSockfd, UPLOAD_DIR_COMMAND, ex.what(), logger);
+        ok = false;
+    }
+
+    // what was extracted stays, the file being received when it failed is dropped
+    for (future<void> &write : writes)
+        write.wait();
+    writer.reset();
+    if (fd != -1) {
+        close(fd);
+        discard_upload_file(temppath);
+    }
+
+    if (!ok) {
+        ostringstream err_msg;
+        err_msg << "Directory transfer encountered an error, " << dirs << " directory(ies) created";
+        log_error(err_msg, logger);
+        return false;
+    }
+
+    ostringstream status_msg;
+    status_msg << "Directory transfer done: " << files << " file(s), " << dirs << " directory(ies), " << received << " byte(s)";
+    if (options & TRANSFER_OPT_CHECKSUM)
+        status_msg << ", Checksum: OK, Corrupted parts received again: " << corrupted_parts;
+    log_info(status_msg, logger);
+
+    if (options & TRANSFER_OPT_COMPRESS)
+        log_info(decoder.get_summary(), logger);
+
+    string reply;
+    append_varint(reply, files);
+    append_varint(reply, dirs);
+    append_varint(reply, received);
+
+    pckt = build_reply_packet(UPLOAD_DIR_COMMAND, (void *)reply.data(), reply.size());
+    serverSocket->send(clientSockfd, pckt, 0);
+    return true;
+}
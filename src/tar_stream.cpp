@@ -0,0 +1,311 @@
+#include "../include/tar_stream.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+// TarReader states
+#define TAR_STATE_HEADER 0
+#define TAR_STATE_LONG_NAME 1
+#define TAR_STATE_CONTENT 2
+#define TAR_STATE_PADDING 3
+#define TAR_STATE_END 4
+
+// ustar header fields (offset, length)
+#define TAR_NAME 0, 100
+#define TAR_MODE 100, 8
+#define TAR_UID 108, 8
+#define TAR_GID 116, 8
+#define TAR_SIZE 124, 12
+#define TAR_MTIME 136, 12
+#define TAR_CHKSUM 148, 8
+#define TAR_TYPEFLAG 156
+#define TAR_MAGIC 257, 8
+#define TAR_PREFIX 345, 155
+
+#define TAR_TYPE_FILE '0'
+#define TAR_TYPE_DIR '5'
+#define TAR_TYPE_GNU_LONG_NAME 'L'
+
+#define TAR_LONG_LINK_NAME "././@LongLink"
+
+using namespace std;
+
+
+static void put_string(string &block, size_t offset, size_t len, const string &value) {
+    memcpy(&block[offset], value.data(), min(len, value.size()));
+}
+
+
+// octal (NUL terminated) if it fits, else base-256 (GNU): the first byte has its high bit set
+static void put_number(string &block, size_t offset, size_t len, uint64_t value) {
+    if (value < (1ULL << (3 * (len - 1)))) {
+        for (size_t i = len - 1; i-- > 0;) {
+            block[offset + i] = '0' + (value & 7);
+            value >>= 3;
+        }
+        block[offset + len - 1] = '\0';
+        return;
+    }
+
+    for (size_t i = len; i-- > 1;) {
+        block[offset + i] = (char)(value & 0xFF);
+        value >>= 8;
+    }
+    block[offset] = (char)0x80;
+}
+
+
+static bool get_number(const string &block, size_t offset, size_t len, uint64_t &value) {
+    value = 0;
+
+    if ((uint8_t)block[offset] & 0x80) {
+        if ((uint8_t)block[offset] != 0x80)
+            return false;   // negative, or too big
+        for (size_t i = 1; i < len; i++) {
+            if (value >> 56)
+                return false;
+            value = value << 8 | (uint8_t)block[offset + i];
+        }
+        return true;
+    }
+
+    size_t i = 0;
+    while (i < len && block[offset + i] == ' ') i++;
+    for (; i < len && block[offset + i] >= '0' && block[offset + i] <= '7'; i++) {
+        if (value >> 61)
+            return false;
+        value = value << 3 | (block[offset + i] - '0');
+    }
+    // followed by spaces or NULs only
+    for (; i < len; i++)
+        if (block[offset + i] != ' ' && block[offset + i] != '\0')
+            return false;
+    return true;
+}
+
+
+static string get_string(const string &block, size_t offset, size_t len) {
+    const char *start = block.data() + offset;
+    return string(start, strnlen(start, len));
+}
+
+
+// sum of the header bytes, the checksum field counted as spaces
+static uint64_t header_checksum(const string &block) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK_BYTES; i++)
+        sum += (i >= 148 && i < 156) ? ' ' : (uint8_t)block[i];
+    return sum;
+}
+
+
+static string make_block(const string &name, char type, uint32_t mode, uint64_t size, int64_t mtime, const string &prefix) {
+    string block(TAR_BLOCK_BYTES, '\0');
+
+    put_string(block, TAR_NAME, name);
+    put_number(block, TAR_MODE, mode & 07777);
+    put_number(block, TAR_UID, 0);
+    put_number(block, TAR_GID, 0);
+    put_number(block, TAR_SIZE, size);
+    put_number(block, TAR_MTIME, max(mtime, (int64_t)0));
+    block[TAR_TYPEFLAG] = type;
+    put_string(block, TAR_MAGIC, string("ustar\0" "00", 8));
+    put_string(block, TAR_PREFIX, prefix);
+
+    // 6 octal digits, NUL, space
+    uint64_t sum = header_checksum(block);
+    put_number(block, 148, 7, sum);
+    block[155] = ' ';
+
+    return block;
+}
+
+
+size_t tar_padding(uint64_t size) {
+    return (TAR_BLOCK_BYTES - size % TAR_BLOCK_BYTES) % TAR_BLOCK_BYTES;
+}
+
+
+string tar_header(const TAR_ENTRY &entry) {
+    string path = entry.path;
+    if (entry.is_dir) path.push_back('/');
+
+    char type = entry.is_dir ? TAR_TYPE_DIR : TAR_TYPE_FILE;
+    uint64_t size = entry.is_dir ? 0 : entry.size;
+
+    if (path.size() <= 100)
+        return make_block(path, type, entry.mode, size, entry.mtime, "");
+
+    // split between the prefix and name fields at a separator, the longest prefix leaving the shortest name
+    size_t split = path.rfind('/', min(path.size() - 2, (size_t)155));
+    if (split != string::npos && split > 0 && path.size() - split - 1 <= 100)
+        return make_block(path.substr(split + 1), type, entry.mode, size, entry.mtime, path.substr(0, split));
+
+    // GNU long name record, then the header with the name cut
+    string record = make_block(TAR_LONG_LINK_NAME, TAR_TYPE_GNU_LONG_NAME, 0644, path.size() + 1, 0, "");
+    record.append(path);
+    record.append(1 + tar_padding(path.size() + 1), '\0');
+    record.append(make_block(path.substr(0, 100), type, entry.mode, size, entry.mtime, ""));
+    return record;
+}
+
+
+string tar_end() {
+    return string(2 * TAR_BLOCK_BYTES, '\0');
+}
+
+
+TarReader::TarReader(const TAR_VISITOR &visitor) : visitor(visitor), state(TAR_STATE_HEADER), remaining(0), padding(0),
+                                                  reported(false), is_file(false), zero_blocks(0) {
+    header.reserve(TAR_BLOCK_BYTES);
+}
+
+
+void TarReader::parse_header() {
+    if (header.find_first_not_of('\0') == string::npos) {
+        // two zero blocks end the archive
+        if (++zero_blocks == 2)
+            state = TAR_STATE_END;
+        return;
+    }
+    zero_blocks = 0;
+
+    uint64_t checksum, size, mode, mtime;
+    if (!get_number(header, TAR_CHKSUM, checksum) || checksum != header_checksum(header))
+        throw runtime_error("Invalid archive header (checksum) !");
+    if (header.compare(257, 5, "ustar") != 0)
+        throw runtime_error("Invalid archive header (not ustar) !");
+    if (!get_number(header, TAR_SIZE, size) || !get_number(header, TAR_MODE, mode) || !get_number(header, TAR_MTIME, mtime))
+        throw runtime_error("Invalid archive header !");
+
+    char type = header[TAR_TYPEFLAG];
+    remaining = size;
+    padding = tar_padding(size);
+
+    if (type == TAR_TYPE_GNU_LONG_NAME) {
+        if (size == 0 || size > TAR_NAME_MAX_BYTES)
+            throw runtime_error("Invalid archive header (name too long) !");
+        long_name.clear();
+        state = TAR_STATE_LONG_NAME;
+        return;
+    }
+
+    TAR_ENTRY entry;
+    if (!long_name.empty()) {
+        entry.path = long_name;
+        long_name.clear();
+    } else {
+        string prefix = get_string(header, TAR_PREFIX);
+        entry.path = get_string(header, TAR_NAME);
+        if (!prefix.empty())
+            entry.path = prefix + "/" + entry.path;
+    }
+
+    entry.is_dir = type == TAR_TYPE_DIR;
+    is_file = type == TAR_TYPE_FILE || type == '\0' || type == '7';    // '7': contiguous file, a regular file
+    reported = (is_file || entry.is_dir) && !entry.path.empty();
+
+    while (entry.path.size() > 1 && entry.path.back() == '/')
+        entry.path.pop_back();
+    entry.mode = mode & 07777;
+    entry.size = is_file ? size : 0;
+    entry.mtime = mtime;
+
+    if (reported)
+        visitor.begin(entry);
+
+    state = TAR_STATE_CONTENT;
+    if (remaining == 0)
+        end_content();
+}
+
+
+void TarReader::end_content() {
+    if (state == TAR_STATE_LONG_NAME) {
+        // NUL terminated
+        long_name.resize(strnlen(long_name.c_str(), long_name.size()));
+        if (long_name.empty())
+            throw runtime_error("Invalid archive header (empty name) !");
+    } else if (reported) {
+        reported = false;
+        visitor.end();
+    }
+
+    state = padding > 0 ? TAR_STATE_PADDING : TAR_STATE_HEADER;
+}
+
+
+// processes the next bytes (zeros if data is null) of the current state, returns how many were used
+uint64_t TarReader::consume(const char *data, uint64_t len) {
+    uint64_t n = 0;
+
+    switch (state) {
+        case TAR_STATE_HEADER:
+            n = min(len, (uint64_t)(TAR_BLOCK_BYTES - header.size()));
+            if (data)
+                header.append(data, n);
+            else
+                header.append(n, '\0');
+
+            if (header.size() == TAR_BLOCK_BYTES) {
+                parse_header();
+                header.clear();
+            }
+            break;
+
+        case TAR_STATE_LONG_NAME:
+        case TAR_STATE_CONTENT:
+            n = min(len, remaining);
+            if (state == TAR_STATE_LONG_NAME) {
+                if (data)
+                    long_name.append(data, n);
+                else
+                    long_name.append(n, '\0');
+            } else if (reported && is_file) {
+                if (data)
+                    visitor.data(data, n);
+                else
+                    visitor.zeros(n);
+            }
+
+            remaining -= n;
+            if (remaining == 0)
+                end_content();
+            break;
+
+        case TAR_STATE_PADDING:
+            n = min(len, padding);
+            padding -= n;
+            if (padding == 0)
+                state = TAR_STATE_HEADER;
+            break;
+
+        case TAR_STATE_END:
+            // what follows the end (padding to a record size) is ignored
+            n = len;
+            break;
+    }
+
+    return n;
+}
+
+
+void TarReader::feed(const char *data, size_t len) {
+    while (len > 0) {
+        uint64_t n = consume(data, len);
+        data += n;
+        len -= n;
+    }
+}
+
+
+void TarReader::feed_zeros(uint64_t len) {
+    while (len > 0)
+        len -= consume(nullptr, len);
+}
+
+
+bool TarReader::done() {
+    return state == TAR_STATE_END;
+}
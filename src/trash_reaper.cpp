@@ -0,0 +1,345 @@
+#include "../include/trash_reaper.hpp"
+#include "../include/file_utils.hpp"
+#include "../include/logger.hpp"
+#include "../include/quota.hpp"
+
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <cstring>
+#include <set>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// from linux/ioprio.h
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+
+typedef struct {
+    string username;
+    unsigned long entries;
+    uint64_t bytes;
+    uint64_t unreleased;    // bytes removed but still counted in the user's quota
+    unsigned int batch;
+} REAP_STATS;
+
+
+void release_quota(REAP_STATS &stats) {
+    get_quota_manager().add(stats.username, -(int64_t)stats.unreleased);
+    stats.unreleased = 0;
+}
+
+
+// lowest CPU and I/O priority for the calling thread
+void set_idle_priority() {
+    pid_t tid = syscall(SYS_gettid);
+    setpriority(PRIO_PROCESS, tid, 19);
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+}
+
+
+void throttle(REAP_STATS &stats) {
+    stats.entries++;
+    if (++stats.batch >= TRASH_REAPER_BATCH) {
+        stats.batch = 0;
+        release_quota(stats);
+        usleep(TRASH_REAPER_PAUSE_US);
+    }
+}
+
+
+// a directory entered by remove_directory_content_at()
+typedef struct {
+    string name;
+    dev_t parent_dev;
+    ino_t parent_ino;
+} REAP_LEVEL;
+
+
+/*
+Unlinks everything but the subdirectories in dirfd.
+Returns the name of a subdirectory left to empty (one not in skipped), or "" if there's none.
+*/
+string remove_files_at(int dirfd, const string &relpath, const set<string> &skipped, REAP_STATS &stats) {
+    int scanfd = dup(dirfd);
+    DIR *dir = scanfd == -1 ? nullptr : fdopendir(scanfd);
+    if (!dir) {
+        if (scanfd != -1) close(scanfd);
+        return "";
+    }
+
+    string subdir;
+
+    // entries removed while reading may make readdir() skip some, so read again until nothing is removed
+    bool removed;
+    do {
+        removed = false;
+        rewinddir(dir);
+
+        struct dirent *dirent;
+        while ((dirent = readdir(dir)) != nullptr) {
+            const char *name = dirent->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+                continue;
+
+            struct stat st;
+            if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                continue;
+
+            if (S_ISDIR(st.st_mode)) {
+                if (subdir.empty() && skipped.count(relpath + name) == 0)
+                    subdir = name;
+                continue;
+            }
+
+            if (unlinkat(dirfd, name, 0) == 0) {
+                stats.bytes += st.st_size;
+                if (S_ISREG(st.st_mode)) stats.unreleased += st.st_size;
+                removed = true;
+            }
+
+            throttle(stats);
+        }
+    } while (removed && subdir.empty());
+
+    closedir(dir);
+    return subdir;
+}
+
+
+/*
+Removes the content of the directory dirfd with unlinkat(), then closes dirfd.
+Symlinks are removed, never followed.
+
+The tree is walked depth first without recursion, with one directory open at a time:
+the walk goes back up through "..", checked against the directory it came from.
+What can't be removed is left in place (and skipped for the rest of the walk).
+*/
+void remove_directory_content_at(int dirfd, REAP_STATS &stats) {
+    vector<REAP_LEVEL> levels;
+    set<string> skipped;    // directories that could not be entered or removed, relative to the first one
+    string relpath;         // of dirfd, "" or ending with a '/'
+
+    while (true) {
+        string subdir = remove_files_at(dirfd, relpath, skipped, stats);
+
+        if (!subdir.empty()) {
+            struct stat st;
+            int subfd = openat(dirfd, subdir.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (subfd == -1 || fstat(dirfd, &st) != 0) {
+                if (subfd != -1) close(subfd);
+                skipped.insert(relpath + subdir);
+                continue;
+            }
+
+            levels.push_back({subdir, st.st_dev, st.st_ino});
+            relpath += subdir + "/";
+            close(dirfd);
+            dirfd = subfd;
+            continue;
+        }
+
+        // dirfd is empty (or only holds what was skipped), go back up and remove it
+        if (levels.empty())
+            break;
+
+        REAP_LEVEL level = levels.back();
+        levels.pop_back();
+        relpath.resize(relpath.size() - level.name.size() - 1);
+
+        int parentfd = openat(dirfd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        close(dirfd);
+        dirfd = parentfd;
+
+        // the tree moved under the walk, leave the rest for the next pass
+        struct stat st;
+        if (dirfd == -1 || fstat(dirfd, &st) != 0 || st.st_dev != level.parent_dev || st.st_ino != level.parent_ino)
+            break;
+
+        if (unlinkat(dirfd, level.name.c_str(), AT_REMOVEDIR) != 0)
+            skipped.insert(relpath + level.name);
+
+        throttle(stats);
+    }
+
+    if (dirfd != -1)
+        close(dirfd);
+}
+
+
+TrashReaper::TrashReaper(): pool(TRASH_REAPER_THREADS) {
+    counter = 0;
+    stop = false;
+}
+
+TrashReaper::~TrashReaper() {
+    {
+        lock_guard<mutex> guard(retrier_lock);
+        stop = true;
+    }
+    retrier_cv.notify_all();
+
+    if (retrier.joinable())
+        retrier.join();
+}
+
+
+// unique path in the user's trash folder
+fs::path TrashReaper::new_trash_path(const string &username) {
+    unsigned long n;
+    {
+        lock_guard<mutex> guard(lock);
+        n = counter++;
+    }
+
+    ostringstream name;
+    name << chrono::system_clock::now().time_since_epoch().count() << "-" << n;
+
+    return get_user_trash(username) / name.str();
+}
+
+
+/*
+Moves target into the user's trash and schedules its removal.
+Returns false if it could not be moved (e.g. trash on another filesystem).
+*/
+bool TrashReaper::move_to_trash(const fs::path &target, const string &username) {
+    fs::path trashed = new_trash_path(username);
+
+    if (rename(target.c_str(), trashed.c_str()) != 0)
+        return false;
+
+    enqueue(trashed);
+    return true;
+}
+
+
+/*
+Moves the content of dir into the user's trash and schedules its removal, dir itself is kept.
+Returns false if some entries could not be moved (these are left in place).
+*/
+bool TrashReaper::move_content_to_trash(const fs::path &dir, const string &username) {
+    fs::path trashed = new_trash_path(username);
+    fs::create_directory(trashed);
+
+    bool moved_all = true;
+
+    for (fs::directory_entry const& dir_entry : fs::directory_iterator(dir)) {
+        fs::path target = trashed / dir_entry.path().filename();
+        if (rename(dir_entry.path().c_str(), target.c_str()) != 0)
+            moved_all = false;
+    }
+
+    enqueue(trashed);
+    return moved_all;
+}
+
+
+void TrashReaper::enqueue(const fs::path &trashed) {
+    pool.enqueue([this, trashed] { reap(trashed); });
+}
+
+
+void TrashReaper::reap(fs::path trashed) {
+    set_idle_priority();
+
+    // trashed paths are trash/<user>/<name>
+    REAP_STATS stats = {trashed.parent_path().filename().string(), 0, 0, 0, 0};
+
+    struct stat st;
+    if (lstat(trashed.c_str(), &st) != 0)
+        return;
+
+    if (S_ISDIR(st.st_mode)) {
+        int dirfd = open(trashed.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dirfd != -1)
+            remove_directory_content_at(dirfd, stats);
+
+        release_quota(stats);
+
+        if (rmdir(trashed.c_str()) != 0) {
+            retry_later(trashed, errno);
+            return;
+        }
+    } else if (unlink(trashed.c_str()) == 0) {
+        stats.bytes += st.st_size;
+        if (S_ISREG(st.st_mode)) stats.unreleased += st.st_size;
+        release_quota(stats);
+    } else {
+        retry_later(trashed, errno);
+        return;
+    }
+
+    stats.entries++;
+
+    ostringstream msg;
+    msg << "Trash reaper removed " << trashed << " (" << stats.entries << " entries, " << stats.bytes << " byte(s))";
+    log_info(msg, nullptr);
+}
+
+
+// what's left of trashed is removed again on the next retry pass (its size stays in the quota until then)
+void TrashReaper::retry_later(const fs::path &trashed, int error) {
+    ostringstream msg;
+    msg << "Trash reaper could not remove " << trashed << ": " << strerror(error) << ", retrying in "
+        << TRASH_REAPER_RETRY_S << "s";
+    log_error(msg, nullptr);
+
+    lock_guard<mutex> guard(lock);
+    failed.push_back(trashed);
+}
+
+
+void TrashReaper::retry_loop() {
+    while (true) {
+        {
+            unique_lock<mutex> lock(retrier_lock);
+            retrier_cv.wait_for(lock, chrono::seconds(TRASH_REAPER_RETRY_S), [this] { return stop; });
+            if (stop) return;
+        }
+
+        vector<fs::path> retried;
+        {
+            lock_guard<mutex> guard(lock);
+            retried.swap(failed);
+        }
+
+        for (const fs::path &trashed : retried)
+            enqueue(trashed);
+    }
+}
+
+
+void TrashReaper::start_retrier() {
+    if (!retrier.joinable())
+        retrier = thread(&TrashReaper::retry_loop, this);
+}
+
+
+// schedules the removal of what a previous run left in the trash
+void TrashReaper::reap_leftovers() {
+    for (fs::directory_entry const& user_trash : fs::directory_iterator(get_server_trash_folder())) {
+        if (!user_trash.is_directory())
+            continue;
+
+        for (fs::directory_entry const& trashed : fs::directory_iterator(user_trash.path()))
+            enqueue(trashed.path());
+    }
+}
+
+
+TrashReaper &get_trash_reaper() {
+    static TrashReaper reaper;
+    return reaper;
+}
@@ -0,0 +1,220 @@
+#include "../include/tree_walker.hpp"
+#include "../include/thread_pool.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+
+// layout of the records returned by getdents64(2)
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+
+/*
+Reads the entries of a directory with getdents64(2), sorted by name.
+Entry types come from d_type, a stat is only needed on filesystems that don't fill it.
+Symlinks are never followed (like in the catalog): a symlink to a directory is not a directory.
+*/
+vector<TREE_ENTRY> read_directory_entries(const fs::path &folderpath) {
+    vector<TREE_ENTRY> entries;
+
+    int fd = open(folderpath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        throw fs::filesystem_error("Could not open directory", folderpath, error_code(errno, generic_category()));
+
+    alignas(struct linux_dirent64) char buffer[65536];
+
+    while (true) {
+        long nread = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+
+        if (nread == -1) {
+            int err = errno;
+            close(fd);
+            throw fs::filesystem_error("Could not read directory", folderpath, error_code(err, generic_category()));
+        }
+
+        if (nread == 0)
+            break;
+
+        for (long pos = 0; pos < nread;) {
+            struct linux_dirent64 *dirent = (struct linux_dirent64 *)(buffer + pos);
+            pos += dirent->d_reclen;
+
+            const char *name = dirent->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+                continue;
+
+            unsigned char type = dirent->d_type;
+            bool is_symlink = type == DT_LNK;
+            bool is_dir = type == DT_DIR;
+
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                    is_symlink = S_ISLNK(st.st_mode);
+                    is_dir = S_ISDIR(st.st_mode);
+                }
+            }
+
+            entries.push_back({name, is_dir, is_symlink});
+        }
+    }
+
+    close(fd);
+
+    sort(entries.begin(), entries.end(), [](const TREE_ENTRY &a, const TREE_ENTRY &b) { return a.name < b.name; });
+
+    return entries;
+}
+
+
+ThreadPool &get_walker_pool() {
+    static ThreadPool pool(TREE_WALKER_THREADS);
+    return pool;
+}
+
+
+typedef struct {
+    string relpath;
+    vector<TREE_ENTRY> entries;
+    size_t index;
+    size_t prefetched;  // entries before this index were considered for prefetching
+    bool on_cursor;     // the directory is an ancestor of the cursor
+} WALK_FRAME;
+
+
+/*
+Walks the tree under root depth-first, the entries of each directory in name order,
+and calls visit() with the path of each entry relative to root.
+Symlinks are reported as such (not as directories) and not followed.
+
+The subdirectories coming next in the walk are read ahead by the walker threads
+(up to TREE_WALKER_MAX_PREFETCH of them), while the entries are visited in a deterministic
+order on the calling thread.
+
+If cursor (a path relative to root) is not empty, the walk resumes right after that entry,
+so a walk stopped after an entry can be continued later. The cursor entry doesn't have to exist anymore.
+Only the directories on the current path (and the ones read ahead) are held in memory, each with
+all its entries (they are sorted): memory grows with the widest of them, not with the whole tree.
+
+Returns false if visit() stopped the walk, true if the whole tree was walked.
+*/
+bool walk_tree(fs::path root, const string &cursor, const TREE_VISITOR &visit) {
+    vector<string> resume;
+    for (const fs::path &part : fs::path(cursor).relative_path())
+        if (!part.empty()) resume.push_back(part.string());
+
+    vector<WALK_FRAME> frames;
+    unordered_map<string, future<vector<TREE_ENTRY>>> prefetched;
+
+    // read ahead tasks left over by a stopped walk are skipped
+    shared_ptr<atomic<bool>> cancelled = make_shared<atomic<bool>>(false);
+
+    // request the next subdirectories of the walk, innermost directories first
+    auto prefetch = [&]() {
+        for (auto frame = frames.rbegin(); frame != frames.rend(); frame++) {
+            frame->prefetched = max(frame->prefetched, frame->index);
+
+            while (frame->prefetched < frame->entries.size()) {
+                if (prefetched.size() >= TREE_WALKER_MAX_PREFETCH)
+                    return;
+
+                const TREE_ENTRY &entry = frame->entries[frame->prefetched++];
+                if (!entry.is_dir || entry.is_symlink)
+                    continue;
+
+                string relpath = frame->relpath;
+                if (!relpath.empty()) relpath.push_back(fs::path::preferred_separator);
+                relpath.append(entry.name);
+
+                auto task = make_shared<packaged_task<vector<TREE_ENTRY>()>>([root, relpath, cancelled]() {
+                    if (*cancelled) return vector<TREE_ENTRY>();
+                    return read_directory_entries(root / relpath);
+                });
+
+                prefetched[relpath] = task->get_future();
+                get_walker_pool().enqueue([task]() { (*task)(); });
+            }
+        }
+    };
+
+    auto open_frame = [&](const string &relpath, bool on_cursor) {
+        WALK_FRAME frame = {relpath, {}, 0, 0, on_cursor};
+
+        auto it = prefetched.find(relpath);
+        if (it != prefetched.end()) {
+            frame.entries = it->second.get();
+            prefetched.erase(it);
+        } else {
+            frame.entries = read_directory_entries(relpath.empty() ? root : root / relpath);
+        }
+
+        // skip the entries before the cursor
+        if (on_cursor) {
+            const string &resume_name = resume[frames.size()];
+            frame.index = lower_bound(frame.entries.begin(), frame.entries.end(), resume_name,
+                                      [](const TREE_ENTRY &e, const string &name) { return e.name < name; })
+                          - frame.entries.begin();
+        }
+
+        frames.push_back(std::move(frame));
+        prefetch();
+    };
+
+    try {
+
+        open_frame("", !resume.empty());
+
+        while (!frames.empty()) {
+            WALK_FRAME &frame = frames.back();
+
+            if (frame.index == frame.entries.size()) {
+                frames.pop_back();
+                continue;
+            }
+
+            TREE_ENTRY entry = frame.entries[frame.index++];
+            size_t depth = frames.size() - 1;
+
+            string relpath = frame.relpath;
+            if (!relpath.empty()) relpath.push_back(fs::path::preferred_separator);
+            relpath.append(entry.name);
+
+            // the cursor and its ancestors were already visited by a previous walk
+            bool visited = frame.on_cursor && entry.name == resume[depth];
+
+            if (!visited && !visit(relpath, entry.is_dir)) {
+                *cancelled = true;
+                return false;
+            }
+
+            if (entry.is_dir && !entry.is_symlink)
+                open_frame(relpath, visited && depth + 1 < resume.size());
+        }
+
+    } catch (...) {
+        *cancelled = true;
+        throw;
+    }
+
+    return true;
+}